@@ -0,0 +1,412 @@
+#include <cradle/caching/immutable.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <cppcoro/sync_wait.hpp>
+
+#include <cradle/utilities/testing.h>
+#include <cradle/utilities/text.h>
+
+using namespace cradle;
+
+namespace {
+
+cppcoro::task<int>
+test_task(int the_answer)
+{
+    co_return the_answer;
+}
+
+// Have :thread_count threads concurrently acquire, copy and release
+// pointers to keys drawn from a pool of :key_count keys.
+void
+hammer_cache(
+    immutable_cache& cache,
+    int thread_count,
+    int operations_per_thread,
+    int key_count)
+{
+    std::vector<std::thread> threads;
+    threads.reserve(thread_count);
+    for (int t = 0; t != thread_count; ++t)
+    {
+        threads.emplace_back([&, t] {
+            std::minstd_rand generator(t);
+            std::uniform_int_distribution<int> distribution(0, key_count - 1);
+            for (int i = 0; i != operations_per_thread; ++i)
+            {
+                int key = distribution(generator);
+                immutable_cache_ptr<int> p(
+                    cache, make_id(key), [&] { return test_task(key); });
+                immutable_cache_ptr<int> q = p;
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+}
+
+} // namespace
+
+TEST_CASE("immutable cache lock contention", "[immutable_cache]")
+{
+    // The total amount of work is held constant across thread counts, so
+    // (ideally) the times should decrease as threads are added.
+    int const total_operations = 1 << 18;
+    int const key_count = 4096;
+
+    // A single shard is equivalent to the original design, where every cache
+    // operation takes the same global mutex.
+    for (int shard_count : {1, 16})
+    {
+        for (int thread_count : {1, 4, 16, 64})
+        {
+            immutable_cache cache(immutable_cache_config(
+                1 << 20, shard_count, none, none, none));
+            BENCHMARK(
+                std::to_string(shard_count) + " shard(s), "
+                + std::to_string(thread_count) + " thread(s)")
+            {
+                hammer_cache(
+                    cache,
+                    thread_count,
+                    total_operations / thread_count,
+                    key_count);
+            };
+        }
+    }
+}
+
+namespace {
+
+typedef std::vector<std::string> key_trace;
+
+// Generate a trace where requests for a set of popular keys (following a
+// Zipf distribution) are periodically interrupted by scans over keys that are
+// only ever requested once. This mimics our mix of metadata/type lookups with
+// occasional large tree traversals.
+key_trace
+generate_zipf_scan_trace(
+    int request_count, int hot_key_count, int scan_interval, int scan_length)
+{
+    std::vector<double> cdf(hot_key_count);
+    double total = 0;
+    for (int i = 0; i != hot_key_count; ++i)
+    {
+        total += 1. / (i + 1);
+        cdf[i] = total;
+    }
+
+    std::minstd_rand generator(1);
+    std::uniform_real_distribution<double> distribution(0, total);
+    key_trace trace;
+    trace.reserve(request_count);
+    int scan_counter = 0;
+    while (int(trace.size()) < request_count)
+    {
+        if (trace.size() % scan_interval == 0)
+        {
+            for (int i = 0; i != scan_length; ++i)
+                trace.push_back("scan/" + std::to_string(scan_counter++));
+        }
+        auto hot_key = std::lower_bound(
+                           cdf.begin(), cdf.end(), distribution(generator))
+                       - cdf.begin();
+        trace.push_back("hot/" + std::to_string(hot_key));
+    }
+    trace.resize(request_count);
+    return trace;
+}
+
+// Read a recorded trace (one key per line).
+key_trace
+read_trace_file(char const* path)
+{
+    key_trace trace;
+    std::ifstream input(path);
+    std::string key;
+    while (std::getline(input, key))
+        trace.push_back(key);
+    return trace;
+}
+
+cppcoro::task<std::string>
+one_kb_string_task()
+{
+    co_return std::string(1024, 'x');
+}
+
+// Replay :trace against a cache with room for :capacity unused 1kB values
+// and return the hit ratio.
+double
+replay_trace(
+    key_trace const& trace,
+    int capacity,
+    immutable_cache_eviction_policy policy)
+{
+    auto const entry_size = sizeof(std::string) + 1024;
+    immutable_cache cache(immutable_cache_config(
+        capacity * entry_size, none, policy, none, none));
+    std::size_t misses = 0;
+    for (auto const& key : trace)
+    {
+        immutable_cache_ptr<std::string> p(cache, make_id(key), [&] {
+            ++misses;
+            return one_kb_string_task();
+        });
+        cppcoro::sync_wait(p.task());
+    }
+    return 1 - double(misses) / double(trace.size());
+}
+
+} // namespace
+
+TEST_CASE("immutable cache eviction policy hit ratios", "[immutable_cache]")
+{
+    std::vector<std::pair<std::string, key_trace>> traces;
+    traces.emplace_back(
+        "zipf+scans", generate_zipf_scan_trace(200'000, 2'000, 5'000, 2'000));
+    traces.emplace_back(
+        "zipf", generate_zipf_scan_trace(200'000, 2'000, 200'000, 0));
+    // A recorded trace can also be supplied via the environment.
+    if (char const* path = std::getenv("CRADLE_CACHE_TRACE"))
+        traces.emplace_back(path, read_trace_file(path));
+
+    int const capacity = 200;
+    for (auto const& named_trace : traces)
+    {
+        auto const& trace = named_trace.second;
+        for (auto policy :
+             {immutable_cache_eviction_policy::LRU,
+              immutable_cache_eviction_policy::TINY_LFU})
+        {
+            auto const label
+                = named_trace.first + ", " + lexical_cast<string>(policy);
+            std::cout << label << ": hit ratio = "
+                      << replay_trace(trace, capacity, policy) << std::endl;
+            BENCHMARK(std::string(label))
+            {
+                return replay_trace(trace, capacity, policy);
+            };
+        }
+    }
+}
+
+// Count heap allocations so that the benchmarks below can report how many
+// allocations each cache operation requires. (This replaces the global
+// operator new for the whole benchmark runner, but the overhead is
+// negligible.)
+
+namespace {
+
+std::atomic<std::size_t> allocation_count = 0;
+
+} // namespace
+
+void*
+operator new(std::size_t size)
+{
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void
+operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void
+operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+namespace {
+
+// Get the average number of allocations performed by each invocation of
+// :operation.
+template<class Operation>
+double
+allocations_per_operation(int operation_count, Operation&& operation)
+{
+    auto const before = allocation_count.load(std::memory_order_relaxed);
+    for (int i = 0; i != operation_count; ++i)
+        operation(i);
+    auto const after = allocation_count.load(std::memory_order_relaxed);
+    return double(after - before) / operation_count;
+}
+
+} // namespace
+
+TEST_CASE("immutable cache allocations", "[immutable_cache]")
+{
+    immutable_cache cache(
+        immutable_cache_config(1 << 20, none, none, none, none));
+
+    // Hits are measured against an entry that's already loaded (and kept
+    // alive).
+    immutable_cache_ptr<int> hot(
+        cache, make_id(-1), [] { return test_task(0); });
+    cppcoro::sync_wait(hot.task());
+    auto hit = [&](int) {
+        immutable_cache_ptr<int> p(
+            cache, make_id(-1), [] { return test_task(0); });
+        return cppcoro::sync_wait(p.task());
+    };
+
+    // Each miss uses a new key and loads its value. The size limit is large
+    // enough that nothing is evicted during the measurements.
+    int next_key = 0;
+    auto miss = [&](int) {
+        int key = next_key++;
+        immutable_cache_ptr<int> p(
+            cache, make_id(key), [&] { return test_task(key); });
+        return cppcoro::sync_wait(p.task());
+    };
+
+    std::cout << "allocations per hit: "
+              << allocations_per_operation(1000, hit) << std::endl;
+    std::cout << "allocations per miss: "
+              << allocations_per_operation(1000, miss) << std::endl;
+
+    BENCHMARK("hit")
+    {
+        return hit(0);
+    };
+    BENCHMARK("miss")
+    {
+        return miss(0);
+    };
+}
+
+namespace {
+
+// Get the average number of allocations per hit and per miss when the cache
+// is keyed by the IDs that :make_key produces (from integers).
+template<class MakeKey>
+std::pair<double, double>
+count_key_allocations(MakeKey&& make_key)
+{
+    immutable_cache cache(
+        immutable_cache_config(1 << 20, none, none, none, none));
+    immutable_cache_ptr<int> hot(
+        cache, make_key(-1), [] { return test_task(0); });
+    cppcoro::sync_wait(hot.task());
+    auto hits = allocations_per_operation(1000, [&](int) {
+        immutable_cache_ptr<int> p(
+            cache, make_key(-1), [] { return test_task(0); });
+        return cppcoro::sync_wait(p.task());
+    });
+    auto misses = allocations_per_operation(1000, [&](int key) {
+        immutable_cache_ptr<int> p(
+            cache, make_key(key), [&] { return test_task(key); });
+        return cppcoro::sync_wait(p.task());
+    });
+    return {hits, misses};
+}
+
+} // namespace
+
+TEST_CASE("immutable cache key allocations", "[immutable_cache]")
+{
+    // Capturing a key used to always allocate, so these show how much of
+    // each operation's allocation count is due to the key itself.
+    auto report = [](char const* label, std::pair<double, double> counts) {
+        std::cout << label << " keys: allocations per hit: " << counts.first
+                  << ", per miss: " << counts.second << std::endl;
+    };
+    report("integer", count_key_allocations([](int i) {
+               return make_id(i);
+           }));
+    report("string", count_key_allocations([](int i) {
+               return make_id("key/" + std::to_string(i));
+           }));
+    report("paired", count_key_allocations([](int i) {
+               return combine_ids(
+                   make_id(std::string("context")),
+                   make_id("key/" + std::to_string(i)));
+           }));
+}
+
+namespace {
+
+typedef decltype(make_id(0)) int_id;
+
+std::vector<int_id>
+make_fan_out_keys(int key_count)
+{
+    std::vector<int_id> keys;
+    keys.reserve(key_count);
+    for (int i = 0; i != key_count; ++i)
+        keys.push_back(make_id(i));
+    return keys;
+}
+
+// Acquire pointers to all of :keys one at a time.
+std::vector<immutable_cache_ptr<int>>
+acquire_individually(immutable_cache& cache, std::vector<int_id> const& keys)
+{
+    std::vector<immutable_cache_ptr<int>> ptrs;
+    ptrs.reserve(keys.size());
+    for (std::size_t i = 0; i != keys.size(); ++i)
+    {
+        ptrs.emplace_back(
+            cache, keys[i], [&] { return test_task(int(i)); });
+    }
+    return ptrs;
+}
+
+// Acquire pointers to all of :keys with a single batch call.
+std::vector<immutable_cache_ptr<int>>
+acquire_as_batch(immutable_cache& cache, std::vector<int_id> const& keys)
+{
+    return acquire_cache_ptrs<int>(
+        cache, keys, [](std::size_t i) { return test_task(int(i)); });
+}
+
+} // namespace
+
+TEST_CASE("immutable cache fan-out acquisition", "[immutable_cache]")
+{
+    // This mimics a request that fans out to thousands of subrequests (e.g.,
+    // visiting all the references in a large object).
+    auto const keys = make_fan_out_keys(10'000);
+
+    // Cold acquisitions all miss, so each one creates a new entry.
+    BENCHMARK("10k keys, cold, individually")
+    {
+        immutable_cache cache(
+            immutable_cache_config(1 << 20, none, none, none, none));
+        return acquire_individually(cache, keys).size();
+    };
+    BENCHMARK("10k keys, cold, batch")
+    {
+        immutable_cache cache(
+            immutable_cache_config(1 << 20, none, none, none, none));
+        return acquire_as_batch(cache, keys).size();
+    };
+
+    // Warm acquisitions all hit entries that are already loaded.
+    immutable_cache cache(
+        immutable_cache_config(1 << 20, none, none, none, none));
+    auto const loaded = acquire_individually(cache, keys);
+    BENCHMARK("10k keys, warm, individually")
+    {
+        return acquire_individually(cache, keys).size();
+    };
+    BENCHMARK("10k keys, warm, batch")
+    {
+        return acquire_as_batch(cache, keys).size();
+    };
+}
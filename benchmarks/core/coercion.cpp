@@ -0,0 +1,127 @@
+#include <cradle/core/coercion.h>
+
+#include <cppcoro/sync_wait.hpp>
+
+#include <cradle/core.h>
+#include <cradle/utilities/testing.h>
+
+using namespace cradle;
+
+namespace {
+
+api_structure_field_info
+make_field(api_type_info schema)
+{
+    return make_api_structure_field_info("", std::move(schema), none);
+}
+
+// Generate the schema of a control point (as a named type) and the
+// dictionary that it's defined in.
+std::map<api_named_type_reference, api_type_info>
+generate_control_point_types()
+{
+    auto const float_type
+        = make_api_type_info_with_float_type(api_float_type());
+    auto const integer_type
+        = make_api_type_info_with_integer_type(api_integer_type());
+    return {
+        {make_api_named_type_reference("rt", "control_point"),
+         make_api_type_info_with_structure_type(api_structure_info(
+             {{"meterset_weight", make_field(float_type)},
+              {"gantry_angle", make_field(float_type)},
+              {"jaw_positions",
+               make_field(make_api_type_info_with_array_type(
+                   make_api_array_info(none, float_type)))},
+              {"dose_rate", make_field(integer_type)},
+              {"energy",
+               make_field(make_api_type_info_with_named_type(
+                   make_api_named_type_reference("rt", "energy")))}}))},
+        {make_api_named_type_reference("rt", "energy"), float_type}};
+}
+
+// Generate an array of :count control points. If :with_integers is true,
+// the floats are all written as integers, so they all require coercion.
+dynamic_array
+generate_control_points(int count, bool with_integers)
+{
+    auto number = [&](int n) {
+        return with_integers ? dynamic(integer(n)) : dynamic(double(n));
+    };
+    dynamic_array points;
+    for (int i = 0; i != count; ++i)
+    {
+        points.push_back(dynamic(
+            {{"meterset_weight", number(i % 10)},
+             {"gantry_angle", number(i % 360)},
+             {"jaw_positions",
+              dynamic_array{number(-5), number(5), number(-7), number(7)}},
+             {"dose_rate", integer(600)},
+             {"energy", number(6)}}));
+    }
+    return points;
+}
+
+} // namespace
+
+TEST_CASE("coercion plans", "[core][coercion]")
+{
+    auto const types = generate_control_point_types();
+    std::function<cppcoro::task<api_type_info>(
+        api_named_type_reference const& ref)>
+        look_up_named_type = [&](api_named_type_reference const& ref)
+        -> cppcoro::task<api_type_info> { co_return types.at(ref); };
+    auto const point_type = make_api_type_info_with_named_type(
+        make_api_named_type_reference("rt", "control_point"));
+    auto const array_type = make_api_type_info_with_array_type(
+        make_api_array_info(none, point_type));
+
+    auto const array_plan = cppcoro::sync_wait(
+        compile_coercion_plan(look_up_named_type, array_type));
+    auto const point_plan = cppcoro::sync_wait(
+        compile_coercion_plan(look_up_named_type, point_type));
+
+    BENCHMARK("compiling a plan")
+    {
+        return cppcoro::sync_wait(
+            compile_coercion_plan(look_up_named_type, array_type));
+    };
+
+    for (bool with_integers : {false, true})
+    {
+        auto const points = generate_control_points(10000, with_integers);
+        auto const array = dynamic(points);
+        string const label
+            = with_integers ? "10k points (integers)" : "10k points";
+
+        BENCHMARK(label + ", coerce_value")
+        {
+            return cppcoro::sync_wait(
+                coerce_value(look_up_named_type, array_type, array));
+        };
+        BENCHMARK(label + ", compiled plan")
+        {
+            return apply_coercion_plan(array_plan, array);
+        };
+
+        // This is how array calculations coerce their items.
+        BENCHMARK(label + ", coerce_value per item")
+        {
+            dynamic_array coerced;
+            coerced.reserve(points.size());
+            for (auto const& point : points)
+            {
+                coerced.push_back(cppcoro::sync_wait(
+                    coerce_value(look_up_named_type, point_type, point)));
+            }
+            return coerced;
+        };
+        BENCHMARK(label + ", compiled plan per item")
+        {
+            dynamic_array coerced;
+            coerced.reserve(points.size());
+            for (auto const& point : points)
+                coerced.push_back(apply_coercion_plan(point_plan, point));
+            return coerced;
+        };
+    }
+}
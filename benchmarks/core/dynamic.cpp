@@ -0,0 +1,400 @@
+#include <cradle/core/dynamic.h>
+
+#include <iostream>
+#include <map>
+#include <memory_resource>
+
+#include <cradle/core.h>
+#include <cradle/encodings/json.h>
+#include <cradle/encodings/msgpack.h>
+#include <cradle/encodings/native.h>
+#include <cradle/utilities/testing.h>
+
+using namespace cradle;
+
+namespace {
+
+// Generate a value that resembles a typical Thinknode object: an array of
+// records (beams) with nested records (control points, the machine) and
+// arrays of numbers.
+dynamic
+generate_beams(int beam_count)
+{
+    dynamic_array beams;
+    for (int i = 0; i != beam_count; ++i)
+    {
+        dynamic_array control_points;
+        for (int j = 0; j != 10; ++j)
+        {
+            control_points.push_back(dynamic(
+                {{"meterset_weight", j / 10.},
+                 {"gantry_angle", double(j * 36)},
+                 {"jaw_positions", dynamic_array{-5., 5., -7.5, 7.5}},
+                 {"dose_rate", integer(600)}}));
+        }
+        beams.push_back(dynamic(
+            {{"beam_id", "beam_" + std::to_string(i)},
+             {"description", "treatment beam"},
+             {"couch_angle", 0.},
+             {"collimator_angle", 90.},
+             {"isocenter", dynamic_array{12.5, -3.25, 40.}},
+             {"machine",
+              dynamic(
+                  {{"name", "linac_" + std::to_string(i % 3)},
+                   {"sad", 1000.},
+                   {"energy", integer(6)}})},
+             {"control_points", control_points},
+             {"meterset", 100. + i}}));
+    }
+    return beams;
+}
+
+// Estimate what :v would occupy if maps were still std::maps: each entry
+// would live in its own tree node (with a header of three pointers and a
+// color).
+size_t
+std_map_deep_sizeof(dynamic const& v)
+{
+    size_t const node_overhead = 4 * sizeof(void*);
+    switch (v.type())
+    {
+        case value_type::ARRAY: {
+            // (This is only used on values that have never been compacted.)
+            size_t size = sizeof(dynamic) + sizeof(dynamic_array);
+            for (auto const& item : *get_dynamic_array(v))
+                size += std_map_deep_sizeof(item);
+            return size;
+        }
+        case value_type::MAP: {
+            size_t size
+                = sizeof(dynamic) + sizeof(std::map<dynamic, dynamic>);
+            for (auto const& [key, value] : cast<dynamic_map>(v))
+            {
+                size += node_overhead + std_map_deep_sizeof(key)
+                        + std_map_deep_sizeof(value);
+            }
+            return size;
+        }
+        default:
+            return deep_sizeof(v);
+    }
+}
+
+// Get the number of bytes that the map key :key allocates on the heap.
+// (Interned keys don't allocate, and neither do short strings, since they're
+// stored inline.)
+size_t
+string_key_heap_size(dynamic const& key)
+{
+    if (key.type() != value_type::STRING || get_string_symbol(key))
+        return 0;
+    auto const& s = cast<string>(key);
+    return s.capacity() > string().capacity() ? s.capacity() + 1 : 0;
+}
+
+// Get the number of bytes that the uninterned map keys within :v allocate on
+// the heap.
+size_t
+key_heap_size(dynamic const& v)
+{
+    size_t size = 0;
+    switch (v.type())
+    {
+        case value_type::ARRAY:
+            // Tables store their keys once, and packed arrays don't have any.
+            if (auto const* table = get_record_table(v))
+            {
+                for (auto const& key : table->keys)
+                    size += string_key_heap_size(key);
+                for (auto const& column : table->columns)
+                    size += key_heap_size(column);
+            }
+            else if (auto const* array = get_dynamic_array(v))
+            {
+                for (auto const& item : *array)
+                    size += key_heap_size(item);
+            }
+            break;
+        case value_type::MAP:
+            for (auto const& [key, value] : cast<dynamic_map>(v))
+                size += string_key_heap_size(key) + key_heap_size(value);
+            break;
+        default:
+            break;
+    }
+    return size;
+}
+
+// A memory_resource that counts the allocations that it passes on to the
+// heap.
+struct counting_resource : std::pmr::memory_resource
+{
+    size_t allocation_count = 0;
+
+ private:
+    void*
+    do_allocate(size_t bytes, size_t alignment) override
+    {
+        ++allocation_count;
+        return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    }
+
+    void
+    do_deallocate(void* p, size_t bytes, size_t alignment) override
+    {
+        std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+    }
+
+    bool
+    do_is_equal(std::pmr::memory_resource const& other) const noexcept override
+    {
+        return this == &other;
+    }
+};
+
+} // namespace
+
+TEST_CASE("dynamic decoding", "[core][dynamic]")
+{
+    auto const beams = generate_beams(100);
+    auto const json = value_to_json(beams);
+    auto const msgpack = value_to_msgpack_string(beams);
+    auto const native = write_natively_encoded_value(beams);
+
+    std::cout << "100 beams: " << deep_sizeof(beams)
+              << " bytes (with std::map: ~" << std_map_deep_sizeof(beams)
+              << " bytes)" << std::endl;
+
+    // Decoded map keys are interned (and the beams are stored as a table).
+    auto const decoded = parse_msgpack_value(msgpack);
+    std::cout << "100 beams, decoded: " << deep_sizeof(decoded)
+              << " bytes (uninterned: " << deep_sizeof(beams)
+              << " bytes); keys allocate " << key_heap_size(decoded)
+              << " heap bytes (uninterned: " << key_heap_size(beams)
+              << " bytes)" << std::endl;
+
+    BENCHMARK("100 beams, JSON")
+    {
+        return parse_json_value(json);
+    };
+    BENCHMARK("100 beams, MessagePack")
+    {
+        return parse_msgpack_value(msgpack);
+    };
+    BENCHMARK("100 beams, native")
+    {
+        return read_natively_encoded_value(native.data(), native.size());
+    };
+
+    // Compare how often decoding allocates dynamic storage from the heap on
+    // its own vs within an arena (which only goes to the heap for chunks).
+    {
+        counting_resource heap;
+        {
+            dynamic_memory_scope scope(&heap);
+            parse_msgpack_value(msgpack);
+        }
+        counting_resource upstream;
+        {
+            std::pmr::monotonic_buffer_resource arena(&upstream);
+            dynamic_memory_scope scope(&arena);
+            parse_msgpack_value(msgpack);
+        }
+        std::cout << "100 beams, decoding: " << heap.allocation_count
+                  << " node allocations (in an arena: "
+                  << upstream.allocation_count << " chunk allocations)"
+                  << std::endl;
+    }
+
+    // These include releasing the decoded value (and the arena), since
+    // that's where arenas save the most.
+    BENCHMARK("100 beams, MessagePack (heap)")
+    {
+        auto value = parse_msgpack_value(msgpack);
+        return value.type();
+    };
+    BENCHMARK("100 beams, MessagePack (arena)")
+    {
+        dynamic_arena arena;
+        dynamic_memory_scope scope(arena.resource());
+        auto value = parse_msgpack_value(msgpack);
+        return value.type();
+    };
+    BENCHMARK("100 beams, native (arena)")
+    {
+        dynamic_arena arena;
+        dynamic_memory_scope scope(arena.resource());
+        auto value = read_natively_encoded_value(native.data(), native.size());
+        return value.type();
+    };
+}
+
+TEST_CASE("dynamic field access", "[core][dynamic]")
+{
+    auto const beams = generate_beams(100);
+    auto const& records = *get_dynamic_array(beams);
+
+    // Also make std::map copies of the records (for comparison).
+    std::vector<std::map<dynamic, dynamic>> std_maps;
+    for (auto const& record : records)
+    {
+        auto const& map = cast<dynamic_map>(record);
+        std_maps.emplace_back(map.begin(), map.end());
+    }
+
+    char const* const field_names[]
+        = {"beam_id", "couch_angle", "machine", "control_points", "meterset"};
+
+    BENCHMARK("100 beams, 5 fields, get_field")
+    {
+        size_t total = 0;
+        for (auto const& record : records)
+        {
+            for (auto const* name : field_names)
+            {
+                total += size_t(
+                    get_field(cast<dynamic_map>(record), name).type());
+            }
+        }
+        return total;
+    };
+    BENCHMARK("100 beams, 5 fields, dynamic keys")
+    {
+        size_t total = 0;
+        for (auto const& record : records)
+        {
+            for (auto const* name : field_names)
+            {
+                total += size_t(
+                    cast<dynamic_map>(record).at(dynamic(name)).type());
+            }
+        }
+        return total;
+    };
+    // Decoded records have interned keys, so they can be queried by symbol.
+    // (The beams are decoded as a table, so they're expanded into records
+    // first.)
+    dynamic_array const decoded = cast<dynamic_array>(
+        parse_msgpack_value(value_to_msgpack_string(beams)));
+    std::vector<string_symbol const*> field_symbols;
+    for (auto const* name : field_names)
+        field_symbols.push_back(&intern_string(name));
+    BENCHMARK("100 beams, 5 fields, interned get_field")
+    {
+        size_t total = 0;
+        for (auto const& record : decoded)
+        {
+            for (auto const* symbol : field_symbols)
+            {
+                total += size_t(
+                    get_field(cast<dynamic_map>(record), *symbol).type());
+            }
+        }
+        return total;
+    };
+    BENCHMARK("100 beams, 5 fields, std::map with dynamic keys")
+    {
+        size_t total = 0;
+        for (auto const& map : std_maps)
+        {
+            for (auto const* name : field_names)
+                total += size_t(map.at(dynamic(name)).type());
+        }
+        return total;
+    };
+}
+
+TEST_CASE("packed arrays", "[core][dynamic]")
+{
+    // This resembles a dose grid (100x100x100 voxels).
+    std::vector<double> voxels(1'000'000);
+    for (size_t i = 0; i != voxels.size(); ++i)
+        voxels[i] = double(i % 997) * 0.25;
+    auto const packed = to_dynamic(voxels);
+    auto const unpacked = dynamic(get_packed_array<double>(packed)->unpack());
+    auto const msgpack = value_to_msgpack_string(packed);
+    auto const native = write_natively_encoded_value(packed);
+
+    std::cout << "1M voxels: " << deep_sizeof(packed) << " bytes packed, "
+              << deep_sizeof(unpacked) << " bytes unpacked" << std::endl;
+
+    BENCHMARK("1M voxels, MessagePack")
+    {
+        return parse_msgpack_value(msgpack);
+    };
+    BENCHMARK("1M voxels, native")
+    {
+        return read_natively_encoded_value(native.data(), native.size());
+    };
+    BENCHMARK("1M voxels, from_dynamic (packed)")
+    {
+        return from_dynamic<std::vector<double>>(packed);
+    };
+    BENCHMARK("1M voxels, from_dynamic (unpacked)")
+    {
+        return from_dynamic<std::vector<double>>(unpacked);
+    };
+    BENCHMARK("1M voxels, hashing (packed)")
+    {
+        return invoke_hash(packed);
+    };
+    BENCHMARK("1M voxels, hashing (unpacked)")
+    {
+        return invoke_hash(unpacked);
+    };
+}
+
+TEST_CASE("record tables", "[core][dynamic]")
+{
+    // This resembles the points of a structure set: lots of small records
+    // that all have the same fields.
+    dynamic_array points;
+    for (int i = 0; i != 10'000; ++i)
+    {
+        points.push_back(dynamic(
+            {{"x", i * 0.5},
+             {"y", i * -0.25},
+             {"z", 12.5},
+             {"contour", integer(i / 100)}}));
+    }
+    auto const records = dynamic(points);
+    auto const table = compact_array(points);
+    auto const msgpack = value_to_msgpack_string(records);
+    auto const native = write_natively_encoded_value(records);
+
+    std::cout << "10k points: " << deep_sizeof(table) << " bytes as a table, "
+              << deep_sizeof(records) << " bytes as records" << std::endl;
+
+    BENCHMARK("10k points, MessagePack")
+    {
+        return parse_msgpack_value(msgpack);
+    };
+    BENCHMARK("10k points, native")
+    {
+        return read_natively_encoded_value(native.data(), native.size());
+    };
+    BENCHMARK("10k points, hashing (table)")
+    {
+        return invoke_hash(table);
+    };
+    BENCHMARK("10k points, hashing (records)")
+    {
+        return invoke_hash(records);
+    };
+    BENCHMARK("10k points, summing x (table)")
+    {
+        auto const& x = *get_packed_array<double>(
+            *get_record_table(table)->find_column("x"));
+        double total = 0;
+        for (size_t i = 0; i != x.size(); ++i)
+            total += x[i];
+        return total;
+    };
+    BENCHMARK("10k points, summing x (records)")
+    {
+        double total = 0;
+        for (auto const& point : *get_dynamic_array(records))
+            total += cast<double>(get_field(cast<dynamic_map>(point), "x"));
+        return total;
+    };
+}
@@ -0,0 +1,155 @@
+#include <cradle/core/hash.h>
+
+#include <algorithm>
+#include <iostream>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <cradle/core.h>
+#include <cradle/utilities/testing.h>
+
+using namespace cradle;
+
+namespace {
+
+// Generate requests that resemble real calculation requests: their structure
+// is the same, and their contents vary in small ways.
+std::vector<dynamic>
+generate_calc_requests(int count)
+{
+    std::vector<dynamic> requests;
+    requests.reserve(count);
+    for (int i = 0; i != count; ++i)
+    {
+        requests.push_back(dynamic(
+            {{"function",
+              dynamic(
+                  {{"account", "mgh"},
+                   {"app", "dosimetry"},
+                   {"name", "compute_dose"},
+                   {"args",
+                    dynamic_array{
+                        dynamic({{"value", integer(i % 100)}}),
+                        dynamic({{"value", integer(i / 100)}}),
+                        dynamic(
+                            {{"reference",
+                              "plan_" + std::to_string(i % 7)}}),
+                    }}})}}));
+    }
+    return requests;
+}
+
+// Make the cache keys for :requests (in the same form that they take when
+// they're posted).
+std::vector<captured_id>
+make_calc_request_keys(std::vector<dynamic> const& requests)
+{
+    std::vector<captured_id> keys;
+    keys.reserve(requests.size());
+    for (auto const& request : requests)
+    {
+        keys.push_back(captured_id(combine_ids(
+            make_id(string("post_calculation")),
+            make_id(string("context_id")),
+            make_id(request))));
+    }
+    return keys;
+}
+
+// This is how dynamic values used to be hashed (via boost::hash, which
+// hashes integers as themselves and combines hashes with hash_combine).
+size_t
+legacy_hash(dynamic const& x)
+{
+    size_t seed = 0;
+    switch (x.type())
+    {
+        case value_type::ARRAY:
+            visit_unpacked_array(x, [&](dynamic_array const& array) {
+                for (auto const& item : array)
+                    boost::hash_combine(seed, legacy_hash(item));
+            });
+            return seed;
+        case value_type::MAP:
+            for (auto const& [key, value] : cast<dynamic_map>(x))
+            {
+                size_t pair_seed = 0;
+                boost::hash_combine(pair_seed, legacy_hash(key));
+                boost::hash_combine(pair_seed, legacy_hash(value));
+                boost::hash_combine(seed, pair_seed);
+            }
+            return seed;
+        case value_type::STRING:
+            return boost::hash<string>()(cast<string>(x));
+        case value_type::INTEGER:
+            return boost::hash<integer>()(cast<integer>(x));
+        default:
+            return invoke_hash(x);
+    }
+}
+
+// Report how well :hashes are distributed.
+void
+report_hash_quality(
+    std::string const& label, std::vector<size_t> const& hashes)
+{
+    std::unordered_set<size_t> distinct_hashes(hashes.begin(), hashes.end());
+    size_t const bucket_count = hashes.size();
+    std::unordered_map<size_t, int> buckets;
+    for (auto h : hashes)
+        ++buckets[h % bucket_count];
+    int longest_chain = 0;
+    for (auto const& [bucket, size] : buckets)
+        longest_chain = std::max(longest_chain, size);
+    std::cout << label << ": " << hashes.size() - distinct_hashes.size()
+              << " collisions, " << buckets.size() << " of " << bucket_count
+              << " buckets used, longest chain = " << longest_chain
+              << std::endl;
+}
+
+} // namespace
+
+TEST_CASE("ID hashing", "[core][hash]")
+{
+    auto const requests = generate_calc_requests(100'000);
+    auto const keys = make_calc_request_keys(requests);
+
+    std::vector<size_t> hashes;
+    for (auto const& key : keys)
+        hashes.push_back(key->hash());
+    report_hash_quality("current", hashes);
+
+    // For comparison, ID pairs used to be combined with XOR.
+    hashes.clear();
+    size_t const string_hashes
+        = boost::hash<string>()("post_calculation")
+          ^ boost::hash<string>()("context_id");
+    for (auto const& request : requests)
+        hashes.push_back(string_hashes ^ legacy_hash(request));
+    report_hash_quality("legacy", hashes);
+
+    std::unordered_map<
+        id_interface const*,
+        int,
+        id_interface_pointer_hash,
+        id_interface_pointer_equality_test>
+        map;
+    for (auto const& key : keys)
+        map[&*key] = 0;
+
+    BENCHMARK("100k calc request keys, hashing")
+    {
+        size_t total = 0;
+        for (auto const& key : keys)
+            total += key->hash();
+        return total;
+    };
+    BENCHMARK("100k calc request keys, lookups")
+    {
+        int found = 0;
+        for (auto const& key : keys)
+            found += map.count(&*key) ? 1 : 0;
+        return found;
+    };
+}
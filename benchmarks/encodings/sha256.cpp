@@ -0,0 +1,83 @@
+#include <cradle/encodings/sha256.h>
+
+#include <iostream>
+
+#include <picosha2.h>
+
+#include <cradle/utilities/testing.h>
+
+using namespace cradle;
+
+namespace {
+
+char const*
+get_implementation_name(sha256_implementation implementation)
+{
+    switch (implementation)
+    {
+        case sha256_implementation::PORTABLE:
+            return "portable";
+        case sha256_implementation::SHA_NI:
+            return "SHA-NI";
+        case sha256_implementation::AVX2:
+            return "AVX2";
+    }
+    return "unknown";
+}
+
+std::vector<sha256_implementation> const all_implementations
+    = {sha256_implementation::PORTABLE,
+       sha256_implementation::SHA_NI,
+       sha256_implementation::AVX2};
+
+} // namespace
+
+TEST_CASE("SHA-256 throughput", "[encodings][sha256]")
+{
+    std::cout << "SHA-256 implementation: "
+              << get_implementation_name(get_sha256_implementation())
+              << " (batches: "
+              << get_implementation_name(get_batch_sha256_implementation())
+              << ")" << std::endl;
+
+    // Hash 1 MB in messages of various sizes. (The total amount of data is
+    // held constant, so the times are directly comparable.)
+    size_t const total_size = 1 << 20;
+    string const data(total_size, 'x');
+    for (size_t message_size : {size_t(64), size_t(1024), total_size})
+    {
+        size_t const message_count = total_size / message_size;
+        auto const size_label
+            = std::to_string(message_size) + "-byte messages";
+
+        BENCHMARK("picosha2, " + size_label)
+        {
+            picosha2::byte_t digest[32];
+            for (size_t i = 0; i != message_count; ++i)
+            {
+                auto const* message = data.data() + i * message_size;
+                picosha2::hash256(
+                    message, message + message_size, digest, digest + 32);
+            }
+            return digest[0];
+        };
+
+        std::vector<blob> messages(message_count);
+        for (size_t i = 0; i != message_count; ++i)
+        {
+            messages[i].data = data.data() + i * message_size;
+            messages[i].size = message_size;
+        }
+        for (auto implementation : all_implementations)
+        {
+            if (!is_sha256_implementation_supported(implementation))
+                continue;
+            BENCHMARK(
+                std::string(get_implementation_name(implementation)) + ", "
+                + size_label)
+            {
+                return compute_sha256_digests(messages, implementation);
+            };
+        }
+    }
+}
@@ -0,0 +1,94 @@
+#include <cradle/encodings/typed_encoding.h>
+
+#include <iostream>
+
+#include <cradle/core.h>
+#include <cradle/encodings/msgpack_internals.h>
+#include <cradle/encodings/native.h>
+#include <cradle/utilities/testing.h>
+
+using namespace cradle;
+
+namespace {
+
+// Generate a type description that resembles the schema of a large record
+// type: a structure with many fields, some of which are arrays of nested
+// structures (down to :depth levels).
+api_type_info
+generate_schema(int field_count, int depth)
+{
+    std::map<string, api_structure_field_info> fields;
+    for (int i = 0; i != field_count; ++i)
+    {
+        auto schema
+            = depth > 0 && i % 4 == 0
+                  ? make_api_type_info_with_array_type(make_api_array_info(
+                      none, generate_schema(field_count, depth - 1)))
+                  : make_api_type_info_with_float_type(api_float_type());
+        fields["field_" + std::to_string(i)] = make_api_structure_field_info(
+            "field " + std::to_string(i),
+            std::move(schema),
+            i % 3 == 0 ? omissible<bool>(true) : omissible<bool>());
+    }
+    return make_api_type_info_with_structure_type(
+        make_api_structure_info(std::move(fields)));
+}
+
+} // namespace
+
+TEST_CASE("direct encoding of API types", "[encodings][typed]")
+{
+    auto const schema = generate_schema(20, 3);
+    auto const msgpack = value_to_msgpack_string(schema);
+    auto const native = write_natively_encoded_value(schema);
+
+    std::cout << "API schema: " << deep_sizeof(schema) << " bytes, "
+              << msgpack.size() << " bytes of MessagePack, " << native.size()
+              << " bytes natively encoded" << std::endl;
+
+    // Both of the "via dynamic" decoding paths include this.
+    auto const dynamic_schema = to_dynamic(schema);
+    BENCHMARK("API schema, from_dynamic")
+    {
+        return from_dynamic<api_type_info>(dynamic_schema);
+    };
+
+    BENCHMARK("API schema, MessagePack encoding (via dynamic)")
+    {
+        return value_to_msgpack_string(to_dynamic(schema));
+    };
+    BENCHMARK("API schema, MessagePack encoding (direct)")
+    {
+        return value_to_msgpack_string(schema);
+    };
+    BENCHMARK("API schema, MessagePack decoding (via dynamic)")
+    {
+        return from_dynamic<api_type_info>(parse_msgpack_value(msgpack));
+    };
+    BENCHMARK("API schema, MessagePack decoding (direct)")
+    {
+        api_type_info decoded;
+        parse_msgpack_value(&decoded, msgpack);
+        return decoded;
+    };
+
+    BENCHMARK("API schema, native encoding (via dynamic)")
+    {
+        return write_natively_encoded_value(to_dynamic(schema));
+    };
+    BENCHMARK("API schema, native encoding (direct)")
+    {
+        return write_natively_encoded_value(schema);
+    };
+    BENCHMARK("API schema, native decoding (via dynamic)")
+    {
+        return from_dynamic<api_type_info>(
+            read_natively_encoded_value(native.data(), native.size()));
+    };
+    BENCHMARK("API schema, native decoding (direct)")
+    {
+        api_type_info decoded;
+        read_natively_encoded_value(&decoded, native.data(), native.size());
+        return decoded;
+    };
+}
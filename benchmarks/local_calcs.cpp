@@ -0,0 +1,141 @@
+#include <cradle/websocket/local_calcs.h>
+
+#include <iostream>
+#include <unordered_set>
+
+#include <cppcoro/sync_wait.hpp>
+
+#include <cradle/utilities/testing.h>
+
+using namespace cradle;
+
+namespace {
+
+// Generate a value that's roughly the size of a large ISS object: an array of
+// records, each of which contains a large array of numbers.
+dynamic
+generate_large_object(int record_count)
+{
+    dynamic_array records;
+    for (int i = 0; i != record_count; ++i)
+    {
+        dynamic_array samples;
+        for (int j = 0; j != 1000; ++j)
+            samples.push_back(double(i * j));
+        records.push_back(dynamic(
+            {{"name", "record_" + std::to_string(i)},
+             {"machine", dynamic({{"name", "linac"}, {"sad", 1000.}})},
+             {"samples", samples}}));
+    }
+    return records;
+}
+
+// Get the number of bytes that :v actually occupies, counting storage that's
+// shared by different parts of :v only once.
+size_t
+unique_deep_sizeof(dynamic const& v, std::unordered_set<void const*>& seen)
+{
+    switch (v.type())
+    {
+        case value_type::ARRAY: {
+            // (Packed arrays and tables are counted as they are.)
+            auto const* array_ptr = get_dynamic_array(v);
+            if (!array_ptr)
+                return deep_sizeof(v);
+            auto const& array = *array_ptr;
+            if (!seen.insert(&array).second)
+                return sizeof(dynamic);
+            size_t size = sizeof(dynamic) + sizeof(dynamic_array);
+            for (auto const& item : array)
+                size += unique_deep_sizeof(item, seen);
+            return size;
+        }
+        case value_type::MAP: {
+            auto const& map = cast<dynamic_map>(v);
+            if (!seen.insert(&map).second)
+                return sizeof(dynamic);
+            size_t size = sizeof(dynamic) + sizeof(dynamic_map);
+            for (auto const& [key, value] : map)
+            {
+                size += unique_deep_sizeof(key, seen)
+                        + unique_deep_sizeof(value, seen);
+            }
+            return size;
+        }
+        default:
+            return deep_sizeof(v);
+    }
+}
+
+thinknode_type_info
+dynamic_schema()
+{
+    return make_thinknode_type_info_with_dynamic_type(
+        make_thinknode_dynamic_type());
+}
+
+} // namespace
+
+TEST_CASE("local calcs with large values", "[local_calcs][ws]")
+{
+    service_core core;
+    init_test_service(core);
+    thinknode_session session;
+
+    // This binds a large object to a variable and then uses it in several
+    // ways, each of which used to require copying it.
+    auto object = generate_large_object(100);
+    auto variable = [] {
+        return make_calculation_request_with_variable("object");
+    };
+    auto request = make_calculation_request_with_let(
+        make_let_calculation_request(
+            {{"object", make_calculation_request_with_value(object)}},
+            make_calculation_request_with_object(
+                make_calculation_object_request(
+                    {{"all", variable()},
+                     {"cast",
+                      make_calculation_request_with_cast(
+                          make_calculation_cast_request(
+                              dynamic_schema(), variable()))},
+                     {"first",
+                      make_calculation_request_with_item(
+                          make_calculation_item_request(
+                              variable(),
+                              make_calculation_request_with_value(
+                                  dynamic(integer(0))),
+                              dynamic_schema()))},
+                     {"machine",
+                      make_calculation_request_with_property(
+                          make_calculation_property_request(
+                              make_calculation_request_with_item(
+                                  make_calculation_item_request(
+                                      variable(),
+                                      make_calculation_request_with_value(
+                                          dynamic(integer(1))),
+                                      dynamic_schema())),
+                              make_calculation_request_with_value(
+                                  dynamic("machine")),
+                              dynamic_schema()))}},
+                    dynamic_schema()))));
+
+    auto eval = [&] {
+        return cppcoro::sync_wait(
+            perform_local_calc(core, session, "context", request));
+    };
+
+    auto const result = eval();
+    std::unordered_set<void const*> seen;
+    std::cout << "local calc result: " << deep_sizeof(result)
+              << " bytes (logically), " << unique_deep_sizeof(result, seen)
+              << " bytes (actually)" << std::endl;
+
+    BENCHMARK("let/variable/item/property/cast on a large object")
+    {
+        return eval();
+    };
+    BENCHMARK("copying a large object")
+    {
+        return dynamic(object);
+    };
+}
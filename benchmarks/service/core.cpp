@@ -0,0 +1,68 @@
+#include <cradle/service/core.h>
+
+#include <vector>
+
+#include <cppcoro/sync_wait.hpp>
+
+#include <cradle/encodings/sha256_hash_id.h>
+#include <cradle/service/internals.h>
+#include <cradle/thinknode/types.hpp>
+#include <cradle/utilities/concurrency_testing.h>
+#include <cradle/utilities/testing.h>
+
+using namespace cradle;
+
+namespace {
+
+// Make a calculation request that's roughly the size of a real-world request
+// for a large array of values.
+calculation_request
+make_large_calculation_request(int item_count)
+{
+    std::vector<calculation_request> items;
+    items.reserve(item_count);
+    for (int i = 0; i != item_count; ++i)
+    {
+        items.push_back(make_calculation_request_with_value(
+            dynamic({{"index", integer(i)}, {"label", "item"}})));
+    }
+    return make_calculation_request_with_array(make_calculation_array_request(
+        std::move(items),
+        make_thinknode_type_info_with_dynamic_type(
+            make_thinknode_dynamic_type())));
+}
+
+} // namespace
+
+TEST_CASE("disk-cached lookups with large keys", "[service][core]")
+{
+    service_core core;
+    init_test_service(core);
+
+    auto request = make_large_calculation_request(10000);
+    auto task_creator = []() -> cppcoro::task<dynamic> {
+        co_return dynamic(integer(0));
+    };
+
+    // Populate the cache.
+    {
+        auto key = make_sha256_hashed_id("post_calculation", request);
+        cppcoro::sync_wait(disk_cached(core, key, task_creator));
+        REQUIRE(occurs_soon([&] {
+            return core.internals().disk_write_pool.get_tasks_total() == 0;
+        }));
+    }
+
+    // The first lookup with a given key has to hash the whole request, but
+    // repeated lookups with the same key (or copies of it) reuse the digest.
+    BENCHMARK("10k-item request, new key")
+    {
+        auto key = make_sha256_hashed_id("post_calculation", request);
+        return cppcoro::sync_wait(disk_cached(core, key, task_creator));
+    };
+    auto key = make_sha256_hashed_id("post_calculation", request);
+    BENCHMARK("10k-item request, reused key")
+    {
+        return cppcoro::sync_wait(disk_cached(core, key, task_creator));
+    };
+}
@@ -226,7 +226,7 @@ let enum_hash_declaration namespace e =
       "inline size_t";
       "hash_value(" ^ e.enum_id ^ " const& x)";
       "{";
-      "    return size_t(x);";
+      "    return size_t(cradle::hash_integer(uint64_t(x)));";
       "}";
     ]
 
@@ -549,6 +549,72 @@ let structure_request_declaration s =
          structure_request_declaration_instance label assignments s)
        instantiations)
 
+(* Generate the C++ declaration of a static variable (named 'name') that holds
+   the interned name of a field. *)
+let interned_field_name_declaration f =
+  "static cradle::string_symbol const& name = cradle::intern_string(\""
+  ^ f.field_id ^ "\"); "
+
+(* Generate the C++ code to read a structure's fields from a record in a
+   single pass over the record's entries. (See cradle/core/field_dispatch.h.)
+   Each entry's key is looked up in a perfect hash table of the structure's
+   own field names, and keys that aren't found there are passed on to the
+   supertype. *)
+let structure_record_reading_implementation s =
+  let field_count = List.length s.structure_fields in
+  let indexed_fields = List.mapi (fun i f -> (i, f)) s.structure_fields in
+  (* A structure with no fields and no supertype doesn't use its arguments. *)
+  let uses_arguments = field_count > 0 || structure_has_super s in
+  let argument name = if uses_arguments then " " ^ name else "" in
+  template_parameters_declaration s.structure_parameters
+  ^ "bool read_record_field(" ^ full_structure_type s ^ "&" ^ argument "x"
+  ^ ", std::string_view" ^ argument "name" ^ ", cradle::dynamic const&"
+  ^ argument "key" ^ ", cradle::dynamic const&" ^ argument "value"
+  ^ ", cradle::record_field_set&" ^ argument "fields_read" ^ ", unsigned"
+  ^ argument "offset" ^ ") " ^ "{ "
+  ^ ( if field_count > 0 then
+      "using cradle::read_record_field_value; "
+      ^ "static constexpr cradle::field_name_table<"
+      ^ string_of_int field_count ^ "> field_names({"
+      ^ String.concat ", "
+          (List.map (fun f -> "\"" ^ f.field_id ^ "\"") s.structure_fields)
+      ^ "}); " ^ "switch (field_names.find(name)) " ^ "{ "
+      ^ String.concat ""
+          (List.map
+             (fun (i, f) ->
+               "case " ^ string_of_int i ^ ": "
+               ^ "read_record_field_value(&x." ^ f.field_id
+               ^ ", key, value); " ^ "fields_read.mark(offset + "
+               ^ string_of_int i ^ "); " ^ "return true; ")
+             indexed_fields)
+      ^ "} "
+    else "" )
+  ^ ( match s.structure_super with
+    | Some super ->
+        "return read_record_field(as_" ^ super
+        ^ "(x), name, key, value, fields_read, offset + "
+        ^ string_of_int field_count ^ "); "
+    | None -> "return false; " )
+  ^ "} "
+  ^ template_parameters_declaration s.structure_parameters
+  ^ "void finish_record_fields(" ^ full_structure_type s ^ "&" ^ argument "x"
+  ^ ", cradle::record_field_set const&" ^ argument "fields_read"
+  ^ ", unsigned" ^ argument "offset" ^ ") " ^ "{ "
+  ^ "using cradle::finish_record_field; "
+  ^ ( match s.structure_super with
+    | Some super ->
+        "finish_record_fields(as_" ^ super ^ "(x), fields_read, offset + "
+        ^ string_of_int field_count ^ "); "
+    | None -> "" )
+  ^ String.concat ""
+      (List.map
+         (fun (i, f) ->
+           "finish_record_field(&x." ^ f.field_id
+           ^ ", fields_read.contains(offset + " ^ string_of_int i ^ "), \""
+           ^ f.field_id ^ "\"); ")
+         indexed_fields)
+  ^ "} "
+
 (* Generate the C++ code to convert a structure to and from a dynamic value. *)
 let structure_value_conversion_implementation s =
   template_parameters_declaration s.structure_parameters
@@ -561,33 +627,19 @@ let structure_value_conversion_implementation s =
   ^ String.concat ""
       (List.map
          (fun f ->
-           "write_field_to_record(record, \"" ^ f.field_id ^ "\", x."
-           ^ f.field_id ^ "); ")
+           "{ " ^ interned_field_name_declaration f
+           ^ "write_field_to_record(record, name, x." ^ f.field_id ^ "); } ")
          s.structure_fields)
   ^ "} "
   ^ template_parameters_declaration s.structure_parameters
   ^ "void to_dynamic(cradle::dynamic* v, " ^ full_structure_type s
   ^ " const& x) " ^ "{ " ^ "cradle::dynamic_map r; "
   ^ "write_fields_to_record(r, x); " ^ "*v = std::move(r); " ^ "} "
-  ^ template_parameters_declaration s.structure_parameters
-  ^ "void read_fields_from_record(" ^ full_structure_type s
-  ^ "& x, cradle::dynamic_map const& record) " ^ "{ "
-  ^ "using cradle::read_field_from_record; "
-  ^ ( match s.structure_super with
-    | Some super -> "read_fields_from_record(as_" ^ super ^ "(x), record); "
-    | None -> "" )
-  ^ String.concat ""
-      (List.map
-         (fun f ->
-           "read_field_from_record(&x." ^ f.field_id ^ ", record, \""
-           ^ f.field_id ^ "\"); ")
-         s.structure_fields)
-  ^ "} "
+  ^ structure_record_reading_implementation s
   ^ template_parameters_declaration s.structure_parameters
   ^ "void from_dynamic(" ^ full_structure_type s ^ "* x,"
-  ^ " cradle::dynamic const& v) " ^ "{ " ^ "cradle::dynamic_map const& r = "
-  ^ "cradle::cast<cradle::dynamic_map>(v); "
-  ^ "read_fields_from_record(*x, r); " ^ "} "
+  ^ " cradle::dynamic const& v) " ^ "{ " ^ "cradle::read_record_fields(*x, "
+  ^ "cradle::cast<cradle::dynamic_map>(v)); " ^ "} "
 
 (* ^ template_parameters_declaration s.structure_parameters
    ^ "void read_fields_from_immutable_map(" ^ full_structure_type s ^ "& x, "
@@ -616,8 +668,12 @@ let structure_value_conversion_declarations s =
   if not (has_parameters s) then
     "void write_fields_to_record(cradle::dynamic_map& record, " ^ s.structure_id
     ^ " const& x); " ^ "void to_dynamic(cradle::dynamic* v, " ^ s.structure_id
-    ^ " const& x); " ^ "void read_fields_from_record(" ^ s.structure_id
-    ^ "& x, cradle::dynamic_map const& record); " ^ "void from_dynamic("
+    ^ " const& x); " ^ "bool read_record_field(" ^ s.structure_id
+    ^ "& x, std::string_view name, cradle::dynamic const& key, "
+    ^ "cradle::dynamic const& value, cradle::record_field_set& fields_read, "
+    ^ "unsigned offset); " ^ "void finish_record_fields(" ^ s.structure_id
+    ^ "& x, cradle::record_field_set const& fields_read, unsigned offset); "
+    ^ "void from_dynamic("
     ^ s.structure_id ^ "* x," ^ " cradle::dynamic const& v); "
     (* ^ "void read_fields_from_immutable_map(" ^ full_structure_type s ^ "& x, "
        ^ "std::map<std::string,cradle::untyped_immutable> const& fields); " *)
@@ -882,8 +938,8 @@ let structure_hash_declaration namespace s =
         String.concat ""
           (List.map
              (fun f ->
-               "boost::hash_combine(h, cradle::invoke_hash(x." ^ f.field_id
-               ^ ")); ")
+               "h = cradle::combine_hashes(h, cradle::invoke_hash(x."
+               ^ f.field_id ^ ")); ")
              s.structure_fields);
         "    return h;";
         "}";
@@ -902,14 +958,78 @@ let structure_hash_definition namespace s =
         String.concat ""
           (List.map
              (fun f ->
-               "boost::hash_combine(h, cradle::invoke_hash(x." ^ f.field_id
-               ^ ")); ")
+               "h = cradle::combine_hashes(h, cradle::invoke_hash(x."
+               ^ f.field_id ^ ")); ")
              s.structure_fields);
         "return h;";
         "}";
       ]
   else ""
 
+(* Generate the visit_fields functions for a structure, which let typed
+   encodings (see cradle/encodings/typed_encoding.h) work directly with its
+   fields. The fields are visited in key order, after those of the supertype.
+*)
+let structure_field_visitors s =
+  let sorted_fields =
+    List.sort (fun a b -> compare a.field_id b.field_id) s.structure_fields
+  in
+  let visitor constness =
+    template_parameters_declaration
+      (s.structure_parameters @ [ (Pclass, "Visitor") ])
+    ^ "void visit_fields(" ^ full_structure_type s ^ constness
+    ^ "& x, Visitor&& visitor) " ^ "{ "
+    ^ ( match s.structure_super with
+      | Some super -> "visit_fields(as_" ^ super ^ "(x), visitor); "
+      | None -> "" )
+    ^ String.concat ""
+        (List.map
+           (fun f -> "visitor(\"" ^ f.field_id ^ "\", x." ^ f.field_id ^ "); ")
+           sorted_fields)
+    ^ "} "
+  in
+  visitor " const" ^ visitor ""
+
+(* Generate the read_field function for a structure, which lets typed
+   encodings find the field that an incoming key names. The key is looked up
+   in a perfect hash table of the structure's own field names (see
+   cradle/core/field_dispatch.h), and keys that aren't found there are passed
+   on to the supertype. read(index, field) is called for the field that's
+   found, where the structure's own fields are numbered from :offset (in the
+   order that they're declared) and its supertype's fields follow them. *)
+let structure_field_reader s =
+  let field_count = List.length s.structure_fields in
+  let indexed_fields = List.mapi (fun i f -> (i, f)) s.structure_fields in
+  (* A structure with no fields and no supertype doesn't use its arguments. *)
+  let uses_arguments = field_count > 0 || structure_has_super s in
+  let argument name = if uses_arguments then " " ^ name else "" in
+  template_parameters_declaration
+    (s.structure_parameters @ [ (Pclass, "Read") ])
+  ^ "bool read_field(" ^ full_structure_type s ^ "&" ^ argument "x"
+  ^ ", std::string_view" ^ argument "name" ^ ", Read&&" ^ argument "read"
+  ^ ", unsigned" ^ argument "offset" ^ ") " ^ "{ "
+  ^ ( if field_count > 0 then
+      "static constexpr cradle::field_name_table<"
+      ^ string_of_int field_count ^ "> field_names({"
+      ^ String.concat ", "
+          (List.map (fun f -> "\"" ^ f.field_id ^ "\"") s.structure_fields)
+      ^ "}); " ^ "switch (field_names.find(name)) " ^ "{ "
+      ^ String.concat ""
+          (List.map
+             (fun (i, f) ->
+               "case " ^ string_of_int i ^ ": " ^ "read(offset + "
+               ^ string_of_int i ^ ", x." ^ f.field_id ^ "); "
+               ^ "return true; ")
+             indexed_fields)
+      ^ "} "
+    else "" )
+  ^ ( match s.structure_super with
+    | Some super ->
+        "return read_field(as_" ^ super ^ "(x), name, read, offset + "
+        ^ string_of_int field_count ^ "); "
+    | None -> "return false; " )
+  ^ "} "
+
 (* Generate all the C++ code that needs to appear in the header file for a
    structure. *)
 let hpp_string_of_structure app_id app_namespace env s =
@@ -929,6 +1049,8 @@ let hpp_string_of_structure app_id app_namespace env s =
   ^ ( if structure_component_is_preexisting s "iostream" then ""
     else structure_iostream_declarations s )
   ^ structure_hash_declaration namespace s
+  ^ structure_field_visitors s
+  ^ structure_field_reader s
   ^ "} namespace " ^ app_namespace ^ " { "
 
 (* Generate all the C++ code that needs to appear in the .cpp file for a
@@ -192,7 +192,7 @@ let union_auto_upgrade_value_definition app_id u =
     ^ String.concat ""
         (List.map
            (fun m ->
-             "{ auto i = fields.find(dynamic(\"" ^ m.um_id ^ "\")); "
+             "{ auto i = fields.find(\"" ^ m.um_id ^ "\"); "
              ^ "if (i != fields.end()) " ^ "{ "
              ^ cpp_code_for_type m.um_type
              ^ " ut;" ^ "upgrade_value(&ut, i->second);" ^ u.union_id
@@ -386,8 +386,11 @@ let union_conversion_definitions u =
          (fun m ->
            "case "
            ^ cpp_enum_value_of_union_member u m
-           ^ ": " ^ "to_dynamic(&s[dynamic(\"" ^ m.um_id ^ "\")], as_" ^ m.um_id
-           ^ "(x)); " ^ "break; ")
+           ^ ": " ^ "{ "
+           ^ "static cradle::string_symbol const& name = "
+           ^ "cradle::intern_string(\"" ^ m.um_id ^ "\"); "
+           ^ "to_dynamic(&s[dynamic(name)], as_" ^ m.um_id ^ "(x)); "
+           ^ "break; } ")
          u.union_members)
   ^ "} " ^ "*v = std::move(s); " ^ "} " ^ "void from_dynamic(" ^ u.union_id
   ^ "* x, cradle::dynamic const& v) " ^ "{ " ^ "cradle::dynamic_map const& s = "
@@ -406,6 +409,31 @@ let union_conversion_definitions u =
   ^ "} " ^ "} " ^ "std::ostream& operator<<(std::ostream& s, " ^ u.union_id
   ^ " const& x) " ^ "{ return s << to_dynamic(x); } "
 
+(* Generate the member visitors for a union, which let typed encodings (see
+   cradle/encodings/typed_encoding.h) work directly with its members. *)
+let union_member_visitors u =
+  "template<class Visitor> void visit_union_member(" ^ u.union_id
+  ^ " const& x, Visitor&& visitor) " ^ "{ " ^ "switch (x.type) " ^ "{ "
+  ^ String.concat ""
+      (List.map
+         (fun m ->
+           "case "
+           ^ cpp_enum_value_of_union_member u m
+           ^ ": " ^ "visitor(\"" ^ m.um_id ^ "\", as_" ^ m.um_id ^ "(x)); "
+           ^ "break; ")
+         u.union_members)
+  ^ "} " ^ "} " ^ "template<class Read> bool read_union_member(" ^ u.union_id
+  ^ "& x, std::string_view name, Read&& read) " ^ "{ "
+  ^ String.concat ""
+      (List.map
+         (fun m ->
+           "if (name == \"" ^ m.um_id ^ "\") " ^ "{ "
+           ^ cpp_code_for_type m.um_type
+           ^ " tmp; " ^ "read(tmp); " ^ "set_to_" ^ m.um_id
+           ^ "(x, std::move(tmp)); " ^ "return true; " ^ "} ")
+         u.union_members)
+  ^ "return false; " ^ "} "
+
 let union_swap_declaration u =
   "void swap(" ^ u.union_id ^ "& a, " ^ u.union_id ^ "& b); "
 
@@ -460,7 +488,9 @@ let union_hash_definitions namespace u =
            (fun m ->
              "case "
              ^ cpp_enum_value_of_union_member u m
-             ^ ": " ^ "return cradle::invoke_hash(as_" ^ m.um_id ^ "(x)); ")
+             ^ ": "
+             ^ "return cradle::combine_hashes(cradle::invoke_hash(x.type), "
+             ^ "cradle::invoke_hash(as_" ^ m.um_id ^ "(x))); ")
            u.union_members);
       "    }";
       "assert(0);";
@@ -484,6 +514,7 @@ let hpp_string_of_union account_id app_id namespace u =
   ^ union_hash_declarations namespace u
   ^ union_swap_declaration u
   ^ union_conversion_declarations u
+  ^ union_member_visitors u
   ^ union_deep_sizeof_declaration u
 
 (* ^ union_upgrade_type_info_declaration u
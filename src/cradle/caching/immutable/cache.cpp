@@ -1,5 +1,10 @@
 #include <cradle/caching/immutable/cache.hpp>
 
+#include <algorithm>
+#include <iterator>
+#include <limits>
+#include <tuple>
+
 #include <cradle/caching/immutable/internals.h>
 #include <cradle/utilities/text.h>
 
@@ -17,8 +22,7 @@ immutable_cache::immutable_cache(immutable_cache_config config)
 void
 immutable_cache::reset(immutable_cache_config config)
 {
-    this->impl = std::make_unique<detail::immutable_cache>();
-    this->impl->config = std::move(config);
+    this->impl = std::make_unique<detail::immutable_cache>(std::move(config));
 }
 
 void
@@ -33,24 +37,140 @@ clear_unused_entries(immutable_cache& cache)
     detail::reduce_memory_cache_size(*cache.impl, 0);
 }
 
+void
+set_unused_size_limit(immutable_cache& cache, uint64_t limit)
+{
+    cache.impl->unused_size_limit.store(limit, std::memory_order_relaxed);
+    detail::reduce_memory_cache_size(*cache.impl, limit);
+}
+
+uint64_t
+get_unused_size_limit(immutable_cache& cache)
+{
+    return cache.impl->unused_size_limit.load(std::memory_order_relaxed);
+}
+
+void
+set_eviction_hook(immutable_cache& cache, immutable_cache_eviction_hook hook)
+{
+    cache.impl->eviction_hook = std::move(hook);
+}
+
+immutable_cache_usage
+get_cache_usage(immutable_cache& cache_object)
+{
+    auto& cache = *cache_object.impl;
+    return immutable_cache_usage{
+        integer(cache.total_size.load(std::memory_order_relaxed)),
+        integer(cache.unused_size.load(std::memory_order_relaxed)),
+        integer(cache.spill_count.load(std::memory_order_relaxed))};
+}
+
+immutable_cache_retry_stats
+get_cache_retry_stats(immutable_cache& cache_object)
+{
+    auto& cache = *cache_object.impl;
+    return immutable_cache_retry_stats{
+        integer(cache.failure_count.load(std::memory_order_relaxed)),
+        integer(cache.failures_served_count.load(std::memory_order_relaxed)),
+        integer(cache.retry_count.load(std::memory_order_relaxed))};
+}
+
+immutable_cache_stats
+get_cache_stats(immutable_cache& cache_object)
+{
+    auto& cache = *cache_object.impl;
+    auto load = [](std::atomic<uint64_t> const& counter) {
+        return integer(counter.load(std::memory_order_relaxed));
+    };
+    immutable_cache_stats stats;
+    stats.entry_count = load(cache.entry_count);
+    stats.hits = load(cache.hit_count);
+    stats.misses = load(cache.miss_count);
+    stats.loads_in_progress = load(cache.loads_in_progress);
+    stats.evictions = load(cache.eviction_count);
+    stats.bytes_pending_eviction = load(cache.unused_size);
+    // Since the counters are read independently, they might be momentarily
+    // inconsistent with each other.
+    stats.bytes_in_use = std::max(
+        load(cache.total_size) - stats.bytes_pending_eviction, integer(0));
+    stats.load_latency_histogram.reserve(
+        detail::immutable_cache_load_latency_bucket_count);
+    for (auto const& bucket : cache.load_latency_histogram)
+        stats.load_latency_histogram.push_back(load(bucket));
+    return stats;
+}
+
+namespace {
+
+// the information that's collected about an entry while its shard is locked
+struct raw_entry_snapshot
+{
+    captured_id key;
+    immutable_cache_entry_state state;
+    std::size_t size;
+    bool pending_eviction;
+};
+
+} // namespace
+
 immutable_cache_snapshot
-get_cache_snapshot(immutable_cache& cache_object)
+get_cache_snapshot(
+    immutable_cache& cache_object,
+    std::size_t offset,
+    std::size_t max_entries,
+    std::size_t stride)
 {
     auto& cache = *cache_object.impl;
-    std::scoped_lock<std::mutex> lock(cache.mutex);
+    stride = std::max<std::size_t>(stride, 1);
+
+    // Collect the selected entries, one shard at a time. Positions are
+    // counted across the whole cache, so :shard_start is the position of the
+    // first entry in the current shard, and :next is the position of the next
+    // entry to collect.
+    std::vector<raw_entry_snapshot> raw_entries;
+    std::size_t shard_start = 0;
+    std::size_t next = offset;
+    for (std::size_t s = 0;
+         s != cache.shard_count && raw_entries.size() < max_entries;
+         ++s)
+    {
+        auto& shard = cache.shards[s];
+        std::scoped_lock<std::mutex> lock(shard.mutex);
+        std::size_t const shard_end = shard_start + shard.records.size();
+        if (next < shard_end)
+        {
+            auto i = shard.records.begin();
+            std::advance(i, next - shard_start);
+            while (true)
+            {
+                auto const& record = *i->second;
+                raw_entries.push_back(raw_entry_snapshot{
+                    record.key,
+                    record.state.load(std::memory_order_relaxed),
+                    record.size,
+                    record.eviction_list != nullptr});
+                next += stride;
+                if (raw_entries.size() == max_entries || next >= shard_end)
+                    break;
+                std::advance(i, stride);
+            }
+        }
+        shard_start = shard_end;
+    }
+
+    // Now that no locks are held, format the keys and put each entry into
+    // the appropriate list, depending on whether or not it's pending
+    // eviction.
     immutable_cache_snapshot snapshot;
-    snapshot.in_use.reserve(cache.records.size());
-    for (auto const& [key, record] : cache.records)
+    for (auto const& raw : raw_entries)
     {
         immutable_cache_entry_snapshot entry{
-            lexical_cast<string>(*record->key),
-            record->state.load(std::memory_order_relaxed),
+            lexical_cast<string>(*raw.key),
+            raw.state,
             // is_initialized(data) ? some(data.ptr->type_info()) : none,
-            record->size};
-        // Put the entry's info the appropriate list depending on whether
-        // or not its in the eviction list.
-        if (record->eviction_list_iterator
-            != cache.eviction_list.records.end())
+            raw.size};
+        if (raw.pending_eviction)
         {
             snapshot.pending_eviction.push_back(std::move(entry));
         }
@@ -62,4 +182,94 @@ get_cache_snapshot(immutable_cache& cache_object)
     return snapshot;
 }
 
+immutable_cache_snapshot
+get_cache_snapshot(immutable_cache& cache)
+{
+    return get_cache_snapshot(
+        cache, 0, std::numeric_limits<std::size_t>::max());
+}
+
+namespace {
+
+// the information that's used to rank entries by how hot they are
+struct hot_entry
+{
+    unsigned access_count;
+    // Is the entry currently in use? (If so, it's more recently used than
+    // any entry that's pending eviction.)
+    bool in_use;
+    uint64_t release_time;
+    captured_id key;
+};
+
+bool
+is_hotter(hot_entry const& a, hot_entry const& b)
+{
+    return std::tie(a.access_count, a.in_use, a.release_time)
+           > std::tie(b.access_count, b.in_use, b.release_time);
+}
+
+} // namespace
+
+std::vector<std::string>
+get_hottest_cache_keys(immutable_cache& cache_object, std::size_t max_count)
+{
+    auto& cache = *cache_object.impl;
+    if (max_count == 0)
+        return {};
+
+    // Collect the hottest entries from each shard. While a shard is locked,
+    // only pointers to its records are ranked, so that keys only have to be
+    // copied for the entries that are actually selected.
+    std::vector<hot_entry> candidates;
+    std::vector<detail::immutable_cache_record const*> shard_candidates;
+    for (std::size_t s = 0; s != cache.shard_count; ++s)
+    {
+        auto& shard = cache.shards[s];
+        std::scoped_lock<std::mutex> lock(shard.mutex);
+        shard_candidates.clear();
+        for (auto const& [key, record] : shard.records)
+        {
+            if (record->state.load(std::memory_order_relaxed)
+                == immutable_cache_entry_state::READY)
+            {
+                shard_candidates.push_back(record);
+            }
+        }
+        auto rank = [](detail::immutable_cache_record const* record) {
+            return hot_entry{
+                record->access_count,
+                record->eviction_list == nullptr,
+                record->release_time,
+                captured_id()};
+        };
+        auto const selected = std::min(max_count, shard_candidates.size());
+        std::partial_sort(
+            shard_candidates.begin(),
+            shard_candidates.begin() + selected,
+            shard_candidates.end(),
+            [&](auto* a, auto* b) { return is_hotter(rank(a), rank(b)); });
+        for (std::size_t i = 0; i != selected; ++i)
+        {
+            auto entry = rank(shard_candidates[i]);
+            entry.key = shard_candidates[i]->key;
+            candidates.push_back(std::move(entry));
+        }
+    }
+
+    // Merge the shards' candidates and format the winners' keys (now that no
+    // locks are held).
+    auto const count = std::min(max_count, candidates.size());
+    std::partial_sort(
+        candidates.begin(),
+        candidates.begin() + count,
+        candidates.end(),
+        is_hotter);
+    std::vector<std::string> keys;
+    keys.reserve(count);
+    for (std::size_t i = 0; i != count; ++i)
+        keys.push_back(lexical_cast<string>(*candidates[i].key));
+    return keys;
+}
+
 } // namespace cradle
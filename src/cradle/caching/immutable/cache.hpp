@@ -1,7 +1,9 @@
 #ifndef CRADLE_CACHING_IMMUTABLE_CACHE_HPP
 #define CRADLE_CACHING_IMMUTABLE_CACHE_HPP
 
+#include <functional>
 #include <memory>
+#include <type_traits>
 
 #include <cradle/core.h>
 
@@ -17,12 +19,76 @@ struct immutable_cache;
 
 } // namespace detail
 
+api(enum)
+enum class immutable_cache_eviction_policy
+{
+    // Unused entries are evicted in the order in which they were released.
+    LRU,
+
+    // Unused entries are evicted according to a W-TinyLFU-style policy,
+    // which considers how frequently each entry's key has been requested
+    // (recently). This protects frequently used entries from being flushed
+    // out by bursts of entries that are only used once.
+    TINY_LFU
+};
+
+api(struct)
+struct immutable_cache_retry_policy
+{
+    // how long (in milliseconds) a failure is remembered before the entry
+    // can be retried - This is the backoff after the first failure.
+    // Until then, anyone who requests the entry simply gets the failure.
+    integer initial_backoff;
+
+    // the factor by which the backoff grows with each consecutive failure of
+    // the same entry - This defaults to 2.
+    omissible<double> backoff_multiplier;
+
+    // the longest that the backoff can grow to, in milliseconds - This
+    // defaults to one minute.
+    omissible<integer> max_backoff;
+
+    // the fraction of each backoff that's randomized, so that entries that
+    // failed together aren't all retried together - This defaults to 0.1.
+    omissible<double> jitter;
+
+    // the maximum number of failed entries that can be retrying at once,
+    // across the whole cache - Entries that are due for a retry while this
+    // many retries are in progress continue to report their failures.
+    // By default, there's no limit.
+    omissible<integer> max_concurrent_retries;
+};
+
 api(struct)
 struct immutable_cache_config
 {
     // The maximum amount of memory to use for caching results that are no
     // longer in use, in bytes.
     integer unused_size_limit;
+
+    // the number of independently locked shards that the cache is
+    // partitioned into (by key hash) - This defaults to 16. A value of 1
+    // serializes all cache operations on a single lock.
+    omissible<integer> shard_count;
+
+    // the policy for deciding which unused entries to evict when the cache
+    // exceeds its size limit - This defaults to LRU.
+    omissible<immutable_cache_eviction_policy> eviction_policy;
+
+    // the maximum amount of memory to use for all cached results (whether
+    // they're in use or not), in bytes - Whenever this is exceeded, unused
+    // entries are evicted (regardless of :unused_size_limit). If it's still
+    // exceeded when a result finishes loading, that result is spilled: it
+    // remains available to the parties that are currently using it, but it's
+    // dropped as soon as it's released rather than being retained. Note that
+    // results only count against this limit once they finish loading, so
+    // usage can still exceed it by the size of spilled results that are in
+    // use and results that are in flight. By default, there's no limit.
+    omissible<integer> total_size_limit;
+
+    // the policy for retrying entries that have failed - If this is omitted,
+    // a failed entry is retried every time that it's requested.
+    omissible<immutable_cache_retry_policy> retry_policy;
 };
 
 struct immutable_cache
@@ -98,10 +164,153 @@ struct immutable_cache_snapshot
     std::vector<immutable_cache_entry_snapshot> pending_eviction;
 };
 
+api(struct)
+struct immutable_cache_usage
+{
+    // the total size of all results in the cache, in bytes
+    integer total_size;
+
+    // the portion of :total_size that's occupied by results that are no
+    // longer in use
+    integer unused_size;
+
+    // the number of results that have been spilled because the cache was
+    // over its total size limit - (Results that are no longer in use by the
+    // time they would be spilled are simply evicted, so they're counted in
+    // immutable_cache_stats::evictions instead.)
+    integer spill_count;
+};
+
+// Get the current memory usage of an immutable memory cache.
+// Unlike get_cache_snapshot(), this doesn't have to lock or visit any
+// entries, so it's cheap enough to call frequently.
+immutable_cache_usage
+get_cache_usage(immutable_cache& cache);
+
+api(struct)
+struct immutable_cache_retry_stats
+{
+    // the number of times that an entry has failed
+    integer failures;
+
+    // the number of times that a failed entry was requested and the failure
+    // was reported rather than retrying the entry (because of the retry
+    // policy)
+    integer failures_served;
+
+    // the number of times that a failed entry has been retried
+    integer retries;
+};
+
+// Get the counts of failures and retries for an immutable memory cache.
+immutable_cache_retry_stats
+get_cache_retry_stats(immutable_cache& cache);
+
+api(struct)
+struct immutable_cache_stats
+{
+    // the number of entries in the cache
+    integer entry_count;
+
+    // the number of requests that found an existing entry
+    integer hits;
+
+    // the number of requests that had to (re)create an entry's task
+    integer misses;
+
+    // the number of tasks that are currently running
+    integer loads_in_progress;
+
+    // the number of entries that have been evicted
+    integer evictions;
+
+    // the total size of the entries that are in use, in bytes
+    integer bytes_in_use;
+
+    // the total size of the entries that are pending eviction, in bytes
+    integer bytes_pending_eviction;
+
+    // a histogram of how long tasks took to run - Entry i is the number of
+    // tasks that took less than 2^i microseconds (but at least 2^(i-1)).
+    // The last entry also includes any tasks that took longer.
+    std::vector<integer> load_latency_histogram;
+};
+
+// Get the statistics for an immutable memory cache.
+// These are maintained with atomic counters, so this doesn't have to lock or
+// visit any entries.
+immutable_cache_stats
+get_cache_stats(immutable_cache& cache);
+
 // Get a snapshot of the contents of an immutable memory cache.
 immutable_cache_snapshot
 get_cache_snapshot(immutable_cache& cache);
 
+// Get a partial snapshot of the contents of an immutable memory cache.
+//
+// The entries are visited in the cache's internal order, which is arbitrary
+// but stays stable while the cache isn't modified. The snapshot starts at the
+// entry at position :offset in that order and then includes every
+// :stride'th entry until it has :max_entries of them. (Thus, a :stride of 1
+// gives consecutive pages, while larger strides give evenly spaced samples of
+// large caches.)
+//
+// Only a single shard of the cache is locked at a time, and keys are
+// formatted after the locks are released, so this is safe to call
+// periodically on a busy cache.
+//
+immutable_cache_snapshot
+get_cache_snapshot(
+    immutable_cache& cache,
+    std::size_t offset,
+    std::size_t max_entries,
+    std::size_t stride = 1);
+
+// Get the keys of (up to) :max_count of the ready entries in an immutable
+// memory cache, hottest first. Entries are ranked by how many times they've
+// been looked up while in the cache, with ties going to the entry that was
+// used most recently. (The keys are formatted the same way as in snapshots,
+// which is also how they're identified in the disk cache.)
+std::vector<std::string>
+get_hottest_cache_keys(immutable_cache& cache, std::size_t max_count);
+
+// Set the limit on the total size of unused entries in an immutable memory
+// cache (in bytes). This overrides :unused_size_limit in the cache's config
+// and allows the cache's budget to be adjusted at run time. If the new limit
+// is lower, unused entries are evicted immediately to meet it.
+void
+set_unused_size_limit(immutable_cache& cache, uint64_t limit);
+
+// Get the limit that's currently enforced on the total size of unused
+// entries in an immutable memory cache.
+uint64_t
+get_unused_size_limit(immutable_cache& cache);
+
+// By default, when an entry is evicted from an immutable memory cache, its
+// value is simply discarded. For value types where this is specialized to be
+// true, evicted values are instead offered to the cache's eviction hook (if
+// it has one), which can save them elsewhere (e.g., on disk). Such types
+// must support to_dynamic() (and from_dynamic(), so that the service can
+// recover them; see cradle/service/core.h).
+template<class Value>
+struct immutable_cache_spills_on_eviction : std::false_type
+{
+};
+
+// An eviction hook receives the key of an evicted entry along with a
+// function that produces the entry's value (in dynamic form). The hook is
+// called outside of the cache's locks but on whatever thread performed the
+// eviction, so it should defer any expensive work (including calling
+// :get_value) to another thread.
+typedef std::function<void(
+    id_interface const& key, std::function<dynamic()> get_value)>
+    immutable_cache_eviction_hook;
+
+// Set the eviction hook for an immutable memory cache.
+// This must be done before the cache is used concurrently.
+void
+set_eviction_hook(immutable_cache& cache, immutable_cache_eviction_hook hook);
+
 // Clear unused entries from the cache.
 void
 clear_unused_entries(immutable_cache& cache);
@@ -0,0 +1,324 @@
+#include <cradle/caching/immutable/eviction.h>
+
+#include <algorithm>
+
+#include <cradle/caching/immutable/internals.h>
+
+namespace cradle {
+namespace detail {
+
+void
+push_eviction_list_entry(
+    cache_record_eviction_list& list, immutable_cache_record* record)
+{
+    assert(!record->eviction_list);
+    record->eviction_list = &list;
+    record->eviction_list_prev = list.tail;
+    record->eviction_list_next = nullptr;
+    if (list.tail)
+        list.tail->eviction_list_next = record;
+    else
+        list.head = record;
+    list.tail = record;
+}
+
+void
+erase_eviction_list_entry(immutable_cache_record* record)
+{
+    assert(record->eviction_list);
+    auto& list = *record->eviction_list;
+    auto* prev = record->eviction_list_prev;
+    auto* next = record->eviction_list_next;
+    if (prev)
+        prev->eviction_list_next = next;
+    else
+        list.head = next;
+    if (next)
+        next->eviction_list_prev = prev;
+    else
+        list.tail = prev;
+    record->eviction_list = nullptr;
+    record->eviction_list_prev = nullptr;
+    record->eviction_list_next = nullptr;
+}
+
+// FREQUENCY SKETCH
+
+frequency_sketch::frequency_sketch(unsigned width_log2)
+    : width_log2_(width_log2),
+      width_(std::size_t(1) << width_log2),
+      counters_(new std::atomic<uint8_t>[row_count * width_]),
+      // This follows the TinyLFU paper's recommendation of aging after a
+      // number of samples that's a small multiple of the table width.
+      sample_size_(10 * width_)
+{
+    for (std::size_t i = 0; i != row_count * width_; ++i)
+        counters_[i].store(0, std::memory_order_relaxed);
+}
+
+std::size_t
+frequency_sketch::counter_index(unsigned row, std::size_t key_hash) const
+{
+    // Each row uses a different seed, and the high bits of the product are
+    // used since they depend on all bits of the hash.
+    static uint64_t const seeds[row_count]
+        = {0x9e37'79b9'7f4a'7c15,
+           0xc2b2'ae3d'27d4'eb4f,
+           0x1656'67b1'9e37'79f9,
+           0x27d4'eb2f'1656'67c5};
+    uint64_t h = (uint64_t(key_hash) + row) * seeds[row];
+    h ^= h >> 29;
+    return row * width_ + std::size_t(h >> (64 - width_log2_));
+}
+
+void
+frequency_sketch::increment(std::size_t key_hash)
+{
+    // This uses the "conservative update" rule: Only the counters that are
+    // currently at the minimum are incremented, which reduces the
+    // overestimation caused by collisions.
+    std::size_t indices[row_count];
+    unsigned minimum = 15;
+    for (unsigned row = 0; row != row_count; ++row)
+    {
+        indices[row] = counter_index(row, key_hash);
+        minimum = std::min<unsigned>(
+            minimum, counters_[indices[row]].load(std::memory_order_relaxed));
+    }
+    if (minimum == 15)
+        return;
+    for (unsigned row = 0; row != row_count; ++row)
+    {
+        // Concurrent updates may race here, but since the sketch is only an
+        // estimate, losing the occasional increment is fine.
+        uint8_t expected = uint8_t(minimum);
+        counters_[indices[row]].compare_exchange_strong(
+            expected, uint8_t(minimum + 1), std::memory_order_relaxed);
+    }
+    if (additions_.fetch_add(1, std::memory_order_relaxed) + 1
+        == sample_size_)
+    {
+        age();
+    }
+}
+
+unsigned
+frequency_sketch::estimate(std::size_t key_hash) const
+{
+    unsigned minimum = 15;
+    for (unsigned row = 0; row != row_count; ++row)
+    {
+        minimum = std::min<unsigned>(
+            minimum,
+            counters_[counter_index(row, key_hash)].load(
+                std::memory_order_relaxed));
+    }
+    return minimum;
+}
+
+void
+frequency_sketch::age()
+{
+    for (std::size_t i = 0; i != row_count * width_; ++i)
+    {
+        counters_[i].store(
+            uint8_t(counters_[i].load(std::memory_order_relaxed) >> 1),
+            std::memory_order_relaxed);
+    }
+    additions_.fetch_sub(sample_size_ / 2, std::memory_order_relaxed);
+}
+
+namespace {
+
+// LRU POLICY
+
+// This evicts records strictly in the order in which they were released.
+struct lru_eviction_policy : eviction_policy_interface
+{
+    void
+    add(immutable_cache_record* record) override
+    {
+        push_eviction_list_entry(records_, record);
+    }
+
+    void
+    remove(immutable_cache_record* record) override
+    {
+        erase_eviction_list_entry(record);
+    }
+
+    immutable_cache_record*
+    select_victim() override
+    {
+        return records_.empty() ? nullptr : records_.front();
+    }
+
+    eviction_rank
+    rank(immutable_cache_record const& record) const override
+    {
+        return eviction_rank{0, record.release_time};
+    }
+
+    optional<eviction_rank>
+    peek_victim_rank() const override
+    {
+        if (records_.empty())
+            return none;
+        return rank(*records_.front());
+    }
+
+ private:
+    cache_record_eviction_list records_;
+};
+
+// W-TINYLFU POLICY
+
+// This is an adaptation of W-TinyLFU (Einziger et al., "TinyLFU: A Highly
+// Efficient Cache Admission Policy") to the unused portion of the cache.
+//
+// Newly released records enter a small LRU window. Once the window exceeds
+// its share of the budget, its oldest record must compete with the oldest
+// record of the main region for admission: whichever has the lower estimated
+// access frequency is the one that's evicted. (Unlike the original
+// algorithm, ties go to the candidate. See select_victim().) This lets the
+// cache absorb bursts of one-off entries (e.g., scans) without flushing out
+// entries that are used repeatedly over time.
+//
+struct tiny_lfu_eviction_policy : eviction_policy_interface
+{
+    tiny_lfu_eviction_policy(
+        frequency_sketch& sketch, uint64_t window_size_limit)
+        : sketch_(sketch), window_size_limit_(window_size_limit)
+    {
+    }
+
+    void
+    add(immutable_cache_record* record) override
+    {
+        push_eviction_list_entry(window_, record);
+        window_size_ += record->size;
+    }
+
+    void
+    remove(immutable_cache_record* record) override
+    {
+        if (record->eviction_list == &window_)
+            window_size_ -= record->size;
+        erase_eviction_list_entry(record);
+    }
+
+    immutable_cache_record*
+    select_victim() override
+    {
+        // The main region doesn't have a fixed capacity of its own (the size
+        // limit applies to the cache as a whole), so admitting a record never
+        // requires an eviction by itself. Thus, candidates that are at least
+        // as frequently used as the oldest record in the main region are
+        // admitted, and the first one that isn't is the victim. (Evicting a
+        // tied candidate instead, as in the original algorithm, can evict a
+        // frequently used record while rarely used ones are still queued up
+        // behind it in the window.)
+        while (window_size_ > window_size_limit_ && !window_.empty())
+        {
+            auto* candidate = window_.front();
+            if (!main_.empty()
+                && frequency(*candidate) < frequency(*main_.front()))
+            {
+                return candidate;
+            }
+            admit(candidate);
+        }
+        if (!main_.empty())
+            return main_.front();
+        if (!window_.empty())
+            return window_.front();
+        return nullptr;
+    }
+
+    eviction_rank
+    rank(immutable_cache_record const& record) const override
+    {
+        return eviction_rank{frequency(record), record.release_time};
+    }
+
+    optional<eviction_rank>
+    peek_victim_rank() const override
+    {
+        // This follows select_victim(), but it only simulates admissions.
+        // Admitted records go to the back of the main region, so they only
+        // affect its front if it was empty.
+        immutable_cache_record const* main_front = main_.front();
+        immutable_cache_record const* candidate = window_.front();
+        uint64_t window_size = window_size_;
+        while (window_size > window_size_limit_ && candidate)
+        {
+            if (main_front && frequency(*candidate) < frequency(*main_front))
+                return rank(*candidate);
+            if (!main_front)
+                main_front = candidate;
+            window_size -= candidate->size;
+            candidate = candidate->eviction_list_next;
+        }
+        if (main_front)
+            return rank(*main_front);
+        if (candidate)
+            return rank(*candidate);
+        return none;
+    }
+
+ private:
+    unsigned
+    frequency(immutable_cache_record const& record) const
+    {
+        return sketch_.estimate(record.key_hash);
+    }
+
+    // Move :record from the window to the main region.
+    void
+    admit(immutable_cache_record* record)
+    {
+        window_size_ -= record->size;
+        erase_eviction_list_entry(record);
+        push_eviction_list_entry(main_, record);
+    }
+
+    frequency_sketch& sketch_;
+    cache_record_eviction_list window_;
+    uint64_t window_size_ = 0;
+    uint64_t window_size_limit_;
+    cache_record_eviction_list main_;
+};
+
+// the fraction of the unused size limit that's devoted to the TinyLFU window
+double const tiny_lfu_window_fraction = 0.01;
+
+} // namespace
+
+bool
+eviction_policy_uses_frequency(immutable_cache_config const& config)
+{
+    return config.eviction_policy
+           && *config.eviction_policy
+                  == immutable_cache_eviction_policy::TINY_LFU;
+}
+
+std::unique_ptr<eviction_policy_interface>
+create_eviction_policy(
+    immutable_cache_config const& config,
+    std::size_t shard_count,
+    frequency_sketch* sketch)
+{
+    if (eviction_policy_uses_frequency(config))
+    {
+        assert(sketch);
+        return std::make_unique<tiny_lfu_eviction_policy>(
+            *sketch,
+            uint64_t(
+                double(config.unused_size_limit) * tiny_lfu_window_fraction
+                / double(shard_count)));
+    }
+    return std::make_unique<lru_eviction_policy>();
+}
+
+} // namespace detail
+} // namespace cradle
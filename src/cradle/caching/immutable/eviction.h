@@ -0,0 +1,177 @@
+#ifndef CRADLE_CACHING_IMMUTABLE_EVICTION_H
+#define CRADLE_CACHING_IMMUTABLE_EVICTION_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#include <cradle/caching/immutable/cache.hpp>
+
+// This file defines the eviction policies that decide which unused entries
+// are evicted from an immutable cache when it exceeds its size limit.
+
+namespace cradle {
+namespace detail {
+
+struct immutable_cache_record;
+
+// An eviction list holds unused records in the order in which they were
+// added (oldest first). It's intrusive: the links are stored in the records
+// themselves, so adding and removing records never allocates.
+struct cache_record_eviction_list
+{
+    immutable_cache_record* head = nullptr;
+    immutable_cache_record* tail = nullptr;
+
+    bool
+    empty() const
+    {
+        return head == nullptr;
+    }
+
+    immutable_cache_record*
+    front() const
+    {
+        return head;
+    }
+};
+
+// Add :record to the back of :list, updating the record's bookkeeping to
+// reflect its position.
+void
+push_eviction_list_entry(
+    cache_record_eviction_list& list, immutable_cache_record* record);
+
+// Remove :record from whatever eviction list it's in.
+void
+erase_eviction_list_entry(immutable_cache_record* record);
+
+// frequency_sketch is a count-min sketch that estimates how often individual
+// keys are requested from the cache. It's shared by all shards of a cache and
+// can be updated without any locks.
+//
+// The counters saturate at 15 and are periodically halved so that the sketch
+// reflects recent popularity rather than all-time popularity.
+//
+struct frequency_sketch : noncopyable
+{
+    // :width_log2 is the log2 of the number of counters in each row.
+    frequency_sketch(unsigned width_log2);
+
+    // Record an access to the key with the given hash.
+    void
+    increment(std::size_t key_hash);
+
+    // Estimate how many times the key with the given hash has been accessed
+    // (recently).
+    unsigned
+    estimate(std::size_t key_hash) const;
+
+ private:
+    static constexpr unsigned row_count = 4;
+
+    std::size_t
+    counter_index(unsigned row, std::size_t key_hash) const;
+
+    void
+    age();
+
+    unsigned width_log2_;
+    std::size_t width_;
+    std::unique_ptr<std::atomic<uint8_t>[]> counters_;
+    // the number of increments since the counters were last aged
+    std::atomic<std::size_t> additions_ = 0;
+    // the number of increments that triggers aging
+    std::size_t sample_size_;
+};
+
+// eviction_rank is used to compare eviction candidates from different shards.
+// The candidate with the lowest rank is evicted first.
+struct eviction_rank
+{
+    // the estimated access frequency of the record (always 0 for policies
+    // that don't consider frequency)
+    unsigned frequency;
+    // the time that the record was released (see
+    // immutable_cache_record::release_time)
+    uint64_t release_time;
+};
+
+inline bool
+operator<(eviction_rank const& a, eviction_rank const& b)
+{
+    return a.frequency < b.frequency
+           || (a.frequency == b.frequency
+               && a.release_time < b.release_time);
+}
+
+// Encode :rank as a single integer that sorts in the same order, so that it
+// can be stored atomically. (Frequencies never exceed 15 (see
+// frequency_sketch), so they fit in the top four bits.)
+inline uint64_t
+encode_eviction_rank(eviction_rank const& rank)
+{
+    uint64_t const max_release_time = (uint64_t(1) << 60) - 2;
+    return (uint64_t(std::min(rank.frequency, 15u)) << 60)
+           | std::min(rank.release_time, max_release_time);
+}
+
+// This is never the encoding of an actual rank, and it sorts after all of
+// them, so it represents the absence of an eviction candidate.
+inline constexpr uint64_t no_eviction_candidate = ~uint64_t(0);
+
+// eviction_policy_interface is the interface that eviction policies
+// must implement. Each shard has its own instance, and all calls on that
+// instance are made while holding the shard's mutex.
+struct eviction_policy_interface
+{
+    virtual ~eviction_policy_interface()
+    {
+    }
+
+    // Add a record that has just become unused.
+    virtual void
+    add(immutable_cache_record* record) = 0;
+
+    // Remove a record that's currently managed by the policy (either because
+    // it's being used again or because it's being evicted).
+    virtual void
+    remove(immutable_cache_record* record) = 0;
+
+    // Select the record that this policy would evict next.
+    // This returns nullptr if the policy isn't managing any records.
+    // Note that this is allowed to reorganize the policy's internal state,
+    // but it doesn't actually remove the selected record.
+    virtual immutable_cache_record*
+    select_victim() = 0;
+
+    // Get the rank of a record (as selected by select_victim()) so that it
+    // can be compared against candidates from other shards.
+    virtual eviction_rank
+    rank(immutable_cache_record const& record) const = 0;
+
+    // Get the rank of the record that select_victim() would return (or none
+    // if the policy isn't managing any records). Unlike select_victim(),
+    // this never changes the policy's state.
+    virtual optional<eviction_rank>
+    peek_victim_rank() const = 0;
+};
+
+// Create the eviction policy for one shard of a cache.
+// :sketch is the cache's frequency sketch. (This is only required for
+// policies that consider frequency.)
+std::unique_ptr<eviction_policy_interface>
+create_eviction_policy(
+    immutable_cache_config const& config,
+    std::size_t shard_count,
+    frequency_sketch* sketch);
+
+// Does the given config call for a frequency sketch?
+bool
+eviction_policy_uses_frequency(immutable_cache_config const& config);
+
+} // namespace detail
+} // namespace cradle
+
+#endif
@@ -1,26 +1,203 @@
 #include <cradle/caching/immutable/internals.h>
 
+#include <algorithm>
 #include <mutex>
 
+#include <boost/numeric/conversion/cast.hpp>
+
 #include <cradle/utilities/text.h>
 
 namespace cradle {
 
 namespace detail {
 
+immutable_cache_record*
+immutable_cache_record_pool::create()
+{
+    if (!free_list_)
+    {
+        std::unique_ptr<slot[]> slab(new slot[next_slab_size_]);
+        for (std::size_t i = 0; i != next_slab_size_; ++i)
+        {
+            slab[i].next_free = free_list_;
+            free_list_ = &slab[i];
+        }
+        slabs_.push_back(std::move(slab));
+        next_slab_size_ = std::min<std::size_t>(next_slab_size_ * 2, 1024);
+    }
+    slot* s = free_list_;
+    free_list_ = s->next_free;
+    return new (s->storage) immutable_cache_record;
+}
+
 void
-reduce_memory_cache_size(immutable_cache& cache, uint64_t desired_size)
+immutable_cache_record_pool::destroy(immutable_cache_record* record)
+{
+    record->~immutable_cache_record();
+    slot* s = reinterpret_cast<slot*>(record);
+    s->next_free = free_list_;
+    free_list_ = s;
+}
+
+immutable_cache_shard::~immutable_cache_shard()
+{
+    for (auto const& [key, record] : records)
+        pool.destroy(record);
+}
+
+void
+update_next_victim_rank(immutable_cache_shard& shard)
+{
+    auto const rank = shard.eviction_policy->peek_victim_rank();
+    shard.next_victim_rank.store(
+        rank ? encode_eviction_rank(*rank) : no_eviction_candidate,
+        std::memory_order_relaxed);
+}
+
+erased_cache_record
+erase_cache_record(
+    immutable_cache& cache,
+    immutable_cache_shard& shard,
+    cache_record_map::iterator i)
+{
+    immutable_cache_record* record = i->second;
+    assert(!record->eviction_list);
+    cache.total_size.fetch_sub(record->size, std::memory_order_relaxed);
+    if (record->retrying)
+        cache.retries_in_progress.fetch_sub(1, std::memory_order_relaxed);
+    cache.entry_count.fetch_sub(1, std::memory_order_relaxed);
+    // The map's key points into the record, so it has to be erased before
+    // the record's key is moved out.
+    shard.records.erase(i);
+    erased_cache_record erased{
+        std::move(record->key), std::move(record->task)};
+    shard.pool.destroy(record);
+    return erased;
+}
+
+immutable_cache::immutable_cache(immutable_cache_config config)
+    : config(std::move(config)),
+      unused_size_limit(uint64_t(this->config.unused_size_limit))
+{
+    shard_count = this->config.shard_count
+                      ? std::max<std::size_t>(
+                          boost::numeric_cast<std::size_t>(
+                              *this->config.shard_count),
+                          1)
+                      : default_immutable_cache_shard_count;
+    shards.reset(new immutable_cache_shard[shard_count]);
+    if (eviction_policy_uses_frequency(this->config))
+        access_frequencies = std::make_unique<frequency_sketch>(16);
+    for (std::size_t i = 0; i != shard_count; ++i)
+    {
+        shards[i].eviction_policy = create_eviction_policy(
+            this->config, shard_count, access_frequencies.get());
+    }
+}
+
+namespace {
+
+// Find the shard whose next victim ranks lowest across the whole cache.
+// This goes by the shards' next_victim_rank, so it doesn't lock any of them
+// (or disturb their eviction policies). Returns nullptr if there are no
+// unused entries.
+immutable_cache_shard*
+find_eviction_shard(immutable_cache& cache)
 {
-    std::scoped_lock<std::mutex> lock(cache.mutex);
-    while (!cache.eviction_list.records.empty()
-           && cache.eviction_list.total_size > desired_size)
+    immutable_cache_shard* best_shard = nullptr;
+    uint64_t best_rank = no_eviction_candidate;
+    for (std::size_t i = 0; i != cache.shard_count; ++i)
     {
-        auto const& record = cache.eviction_list.records.front();
-        auto data_size = record->size;
-        cache.records.erase(&*record->key);
-        cache.eviction_list.records.pop_front();
-        cache.eviction_list.total_size -= data_size;
+        auto& shard = cache.shards[i];
+        auto const rank
+            = shard.next_victim_rank.load(std::memory_order_relaxed);
+        if (rank < best_rank)
+        {
+            best_shard = &shard;
+            best_rank = rank;
+        }
     }
+    return best_shard;
+}
+
+// Pass an evicted record to the cache's eviction hook. The record's contents
+// are kept alive until the hook is done with them.
+void
+offer_to_eviction_hook(immutable_cache& cache, erased_cache_record evicted)
+{
+    auto record = std::make_shared<erased_cache_record>(std::move(evicted));
+    cache.eviction_hook(
+        *record->key, [record] { return record->task.encode(); });
+}
+
+// Evict unused entries (in the order dictated by the cache's eviction policy)
+// for as long as :should_evict() returns true (or until there are no unused
+// entries left).
+template<class Condition>
+void
+evict_unused_entries_while(immutable_cache& cache, Condition&& should_evict)
+{
+    while (should_evict())
+    {
+        auto* shard = find_eviction_shard(cache);
+        if (!shard)
+            break;
+
+        // The record is erased while the shard is locked, but its contents
+        // are destroyed after the lock is released, since destroying its task
+        // (and thus the cached value) may be expensive.
+        erased_cache_record evicted;
+        bool ready;
+        {
+            std::scoped_lock<std::mutex> lock(shard->mutex);
+            // Another thread may have emptied this shard in the meantime.
+            auto* record = shard->eviction_policy->select_victim();
+            if (!record)
+            {
+                update_next_victim_rank(*shard);
+                continue;
+            }
+            shard->eviction_policy->remove(record);
+            update_next_victim_rank(*shard);
+            cache.unused_size.fetch_sub(
+                record->size, std::memory_order_relaxed);
+            cache.eviction_count.fetch_add(1, std::memory_order_relaxed);
+            ready = record->state.load(std::memory_order_relaxed)
+                    == immutable_cache_entry_state::READY;
+            evicted = erase_cache_record(
+                cache, *shard, shard->records.find(&*record->key));
+        }
+        if (ready && evicted.task.is_encodable() && cache.eviction_hook)
+            offer_to_eviction_hook(cache, std::move(evicted));
+    }
+}
+
+} // namespace
+
+void
+reduce_memory_cache_size(immutable_cache& cache, uint64_t desired_size)
+{
+    evict_unused_entries_while(cache, [&] {
+        return cache.unused_size.load(std::memory_order_relaxed)
+               > desired_size;
+    });
+}
+
+bool
+is_over_size_limits(immutable_cache const& cache)
+{
+    return cache.unused_size.load(std::memory_order_relaxed)
+               > cache.unused_size_limit.load(std::memory_order_relaxed)
+           || (cache.config.total_size_limit
+               && cache.total_size.load(std::memory_order_relaxed)
+                      > uint64_t(*cache.config.total_size_limit));
+}
+
+void
+enforce_size_limits(immutable_cache& cache)
+{
+    evict_unused_entries_while(
+        cache, [&] { return is_over_size_limits(cache); });
 }
 
 } // namespace detail
@@ -1,13 +1,20 @@
 #ifndef CRADLE_CACHING_IMMUTABLE_INTERNALS_H
 #define CRADLE_CACHING_IMMUTABLE_INTERNALS_H
 
-#include <any>
 #include <atomic>
-#include <list>
+#include <cassert>
+#include <chrono>
+#include <memory>
 #include <mutex>
+#include <new>
 #include <unordered_map>
+#include <vector>
+
+#include <cppcoro/shared_task.hpp>
+#include <cppcoro/sync_wait.hpp>
 
 #include <cradle/caching/immutable/cache.hpp>
+#include <cradle/caching/immutable/eviction.h>
 
 namespace cradle {
 
@@ -16,69 +23,386 @@ struct immutable_cache_entry_watcher;
 namespace detail {
 
 struct immutable_cache;
+struct immutable_cache_shard;
+
+// cache_task_storage holds the cppcoro::shared_task<T> associated with a
+// record, where T varies from record to record. A shared_task is just a
+// handle to its coroutine (regardless of T), so unlike std::any, this can
+// always store it inline.
+struct cache_task_storage : noncopyable
+{
+    cache_task_storage()
+    {
+    }
+
+    cache_task_storage(cache_task_storage&& other) noexcept
+    {
+        move_in(std::move(other));
+    }
+
+    cache_task_storage&
+    operator=(cache_task_storage&& other) noexcept
+    {
+        reset();
+        move_in(std::move(other));
+        return *this;
+    }
+
+    ~cache_task_storage()
+    {
+        reset();
+    }
+
+    template<class T>
+    void
+    emplace(cppcoro::shared_task<T> task)
+    {
+        static_assert(
+            sizeof(cppcoro::shared_task<T>) <= sizeof(buffer_)
+            && alignof(cppcoro::shared_task<T>) <= alignof(buffer_type));
+        reset();
+        new (buffer_) cppcoro::shared_task<T>(std::move(task));
+        manager_ = &manage<T>;
+        if constexpr (immutable_cache_spills_on_eviction<T>::value)
+            encoder_ = &encode<T>;
+        else
+            encoder_ = nullptr;
+    }
+
+    // The caller must know the type of the task that's stored here.
+    template<class T>
+    cppcoro::shared_task<T> const&
+    get() const
+    {
+        assert(manager_ == &manage<T>);
+        return *std::launder(
+            reinterpret_cast<cppcoro::shared_task<T> const*>(buffer_));
+    }
+
+    // Can the stored task's value be converted to dynamic form? (This is
+    // only supported for types that spill on eviction.)
+    bool
+    is_encodable() const
+    {
+        return encoder_ != nullptr;
+    }
+
+    // Get the value of the stored task in dynamic form.
+    // The task must be encodable and have finished successfully.
+    dynamic
+    encode() const
+    {
+        assert(encoder_);
+        return encoder_(buffer_);
+    }
+
+    void
+    reset()
+    {
+        if (manager_)
+        {
+            manager_(buffer_, nullptr);
+            manager_ = nullptr;
+            encoder_ = nullptr;
+        }
+    }
+
+ private:
+    void
+    move_in(cache_task_storage&& other)
+    {
+        manager_ = other.manager_;
+        encoder_ = other.encoder_;
+        if (manager_)
+        {
+            manager_(other.buffer_, buffer_);
+            other.manager_ = nullptr;
+            other.encoder_ = nullptr;
+        }
+    }
+
+    // A manager destroys the task stored at :from, first moving it to :to
+    // if :to isn't null.
+    typedef void (*manager_function)(void* from, void* to);
+
+    template<class T>
+    static void
+    manage(void* from, void* to)
+    {
+        auto* task = std::launder(static_cast<cppcoro::shared_task<T>*>(from));
+        if (to)
+            new (to) cppcoro::shared_task<T>(std::move(*task));
+        task->~shared_task();
+    }
+
+    typedef dynamic (*encoder_function)(void const* task);
+
+    template<class T>
+    static dynamic
+    encode(void const* task)
+    {
+        return to_dynamic(cppcoro::sync_wait(*std::launder(
+            static_cast<cppcoro::shared_task<T> const*>(task))));
+    }
+
+    typedef cppcoro::shared_task<nil_t> buffer_type;
+    alignas(buffer_type) unsigned char buffer_[sizeof(buffer_type)];
+    manager_function manager_ = nullptr;
+    encoder_function encoder_ = nullptr;
+};
 
 struct immutable_cache_record
 {
     // These remain constant for the life of the record.
     immutable_cache* owner_cache;
+    immutable_cache_shard* owner_shard;
     captured_id key;
+    std::size_t key_hash;
 
-    // All of the following fields are protected by the cache mutex. The only
-    // exception is that the :state and :progress fields can be polled for
-    // informational purposes. However, before accessing any other fields based
-    // on the value of :state, you should acquire the mutex and recheck state.
+    // All of the following fields are protected by the mutex of the owning
+    // shard. The only exception is that the :state and :progress fields can
+    // be polled for informational purposes. However, before accessing any
+    // other fields based on the value of :state, you should acquire the mutex
+    // and recheck state.
 
     // This is a count of how many active pointers reference this data.
     // If this is 0, the data is no longer actively in use and is queued for
-    // eviction. In this case, :eviction_list_iterator points to this record's
-    // entry in the eviction list.
+    // eviction. In this case, it's managed by the eviction policy of the
+    // owning shard, :eviction_list is the list that the policy has placed it
+    // in, and :eviction_list_prev and :eviction_list_next are its neighbors
+    // in that list.
     unsigned ref_count = 0;
 
     // (See :ref_count comment.)
-    std::list<immutable_cache_record*>::iterator eviction_list_iterator;
+    cache_record_eviction_list* eviction_list = nullptr;
+    immutable_cache_record* eviction_list_prev = nullptr;
+    immutable_cache_record* eviction_list_next = nullptr;
+
+    // the value of the cache's release counter at the time that this record
+    // was added to the eviction list - This orders unused records across
+    // shards so that eviction can still proceed in global LRU order.
+    uint64_t release_time = 0;
+
+    // the number of times that the record has been looked up (including the
+    // lookup that created it)
+    unsigned access_count = 0;
 
     // Is the data ready?
     std::atomic<immutable_cache_entry_state> state
         = immutable_cache_entry_state::LOADING;
 
-    // the associated cppcoro task - This should probably be stored more
-    // efficiently. It holds a cppcoro::shared_task<T>, where T is the type
-    // of data associated with this record.
-    std::any task;
+    // the associated cppcoro task - This holds a cppcoro::shared_task<T>,
+    // where T is the type of data associated with this record.
+    cache_task_storage task;
 
     // the size of the data (if it's ready)
     std::size_t size = 0;
+
+    // If this is set, the record's data finished loading while the cache was
+    // over its total size limit, so the record is erased as soon as it's
+    // released instead of being handed to the eviction policy.
+    bool spilled = false;
+
+    // the number of consecutive times that the record's task has failed
+    unsigned failure_count = 0;
+
+    // If the record has failed, this is the earliest time at which it may be
+    // retried (according to the cache's retry policy).
+    std::chrono::steady_clock::time_point retry_time;
+
+    // Is the record's task a retry that's still in progress? (If so, it
+    // counts against the cache's limit on concurrent retries.)
+    bool retrying = false;
 };
 
+// The records in a shard are owned by its pool, so the map just holds
+// pointers to them.
 typedef std::unordered_map<
     id_interface const*,
-    std::unique_ptr<immutable_cache_record>,
+    immutable_cache_record*,
     id_interface_pointer_hash,
     id_interface_pointer_equality_test>
     cache_record_map;
 
-struct cache_record_eviction_list
+// immutable_cache_record_pool allocates records in slabs and recycles the
+// storage of destroyed records, so creating a record doesn't normally require
+// a trip to the heap. It's not thread-safe on its own: each shard has its own
+// pool, which is protected by the shard's mutex.
+//
+// All records must be destroyed before the pool itself is.
+//
+struct immutable_cache_record_pool : noncopyable
 {
-    std::list<immutable_cache_record*> records;
-    size_t total_size;
-    cache_record_eviction_list() : total_size(0)
+    // Create a (default-initialized) record.
+    immutable_cache_record*
+    create();
+
+    // Destroy a record that was created by this pool.
+    void
+    destroy(immutable_cache_record* record);
+
+ private:
+    union slot
     {
-    }
+        slot* next_free;
+        alignas(immutable_cache_record) unsigned char
+            storage[sizeof(immutable_cache_record)];
+    };
+
+    std::vector<std::unique_ptr<slot[]>> slabs_;
+    slot* free_list_ = nullptr;
+    // the number of slots to allocate in the next slab - This doubles with
+    // each slab (up to a point), so small caches don't waste much memory.
+    std::size_t next_slab_size_ = 16;
 };
 
-struct immutable_cache : noncopyable
+// A shard owns the records for a subset of the key space (as partitioned by
+// id_interface::hash()), along with the eviction bookkeeping for those
+// records. Each shard is protected by its own mutex, so operations on keys
+// in different shards don't contend with each other.
+struct immutable_cache_shard : noncopyable
 {
-    immutable_cache_config config;
+    ~immutable_cache_shard();
+
+    immutable_cache_record_pool pool;
     cache_record_map records;
-    cache_record_eviction_list eviction_list;
+    std::unique_ptr<eviction_policy_interface> eviction_policy;
     std::mutex mutex;
+    // the encoded rank (see encode_eviction_rank()) of the record that
+    // :eviction_policy would evict next, or no_eviction_candidate if it isn't
+    // managing any records - This is updated (with :mutex held) whenever the
+    // policy's contents change, but it's read without any locks, so that
+    // eviction can choose a shard without locking every shard. (Frequency
+    // estimates can change in the meantime, so it's only approximate.)
+    std::atomic<uint64_t> next_victim_rank = no_eviction_candidate;
 };
 
-// Evict unused entries (in LRU order) until the total size of unused entries
-// in the cache is at most :desired_size (in bytes).
+// Update :shard's next_victim_rank after a change to the contents of its
+// eviction policy. The caller must hold the shard's lock.
+void
+update_next_victim_rank(immutable_cache_shard& shard);
+
+// When a record is erased from its shard, its key and task are moved out into
+// one of these, and the record itself is returned to the shard's pool. This
+// allows the caller to destroy the key and task (which may be expensive)
+// after releasing the shard's lock.
+struct erased_cache_record
+{
+    captured_id key;
+    cache_task_storage task;
+};
+
+
+// the number of shards that are used when the config doesn't specify
+inline constexpr std::size_t default_immutable_cache_shard_count = 16;
+
+// the number of buckets in the load latency histogram
+// (See immutable_cache_stats::load_latency_histogram.)
+inline constexpr unsigned immutable_cache_load_latency_bucket_count = 32;
+
+struct immutable_cache : noncopyable
+{
+    immutable_cache(immutable_cache_config config);
+
+    immutable_cache_config config;
+
+    std::size_t shard_count;
+    std::unique_ptr<immutable_cache_shard[]> shards;
+
+    // estimates of how often keys are accessed - This is only present if the
+    // eviction policy considers frequency.
+    std::unique_ptr<frequency_sketch> access_frequencies;
+
+    // the limit that's currently enforced on :unused_size - This starts out
+    // as :config.unused_size_limit, but it can be adjusted at run time (e.g.,
+    // in response to memory pressure).
+    std::atomic<uint64_t> unused_size_limit;
+
+    // the total size of all unused entries, across all shards - This is what
+    // :unused_size_limit is enforced against.
+    std::atomic<uint64_t> unused_size = 0;
+
+    // the total size of all entries (used or not), across all shards - This
+    // is what :config.total_size_limit is enforced against.
+    std::atomic<uint64_t> total_size = 0;
+
+    // the number of records that have been spilled
+    // (See immutable_cache_record::spilled.)
+    std::atomic<uint64_t> spill_count = 0;
+
+    // the number of records that are currently retrying
+    // (See immutable_cache_record::retrying.)
+    std::atomic<uint64_t> retries_in_progress = 0;
+
+    // counters for immutable_cache_retry_stats
+    std::atomic<uint64_t> failure_count = 0;
+    std::atomic<uint64_t> failures_served_count = 0;
+    std::atomic<uint64_t> retry_count = 0;
+
+    // statistics (See immutable_cache_stats.)
+    std::atomic<uint64_t> entry_count = 0;
+    std::atomic<uint64_t> hit_count = 0;
+    std::atomic<uint64_t> miss_count = 0;
+    std::atomic<uint64_t> loads_in_progress = 0;
+    std::atomic<uint64_t> eviction_count = 0;
+    std::atomic<uint64_t> load_latency_histogram
+        [immutable_cache_load_latency_bucket_count];
+
+    // (See set_eviction_hook.)
+    immutable_cache_eviction_hook eviction_hook;
+
+    // This is incremented every time a record is added to an eviction list.
+    // (See immutable_cache_record::release_time.)
+    std::atomic<uint64_t> release_counter = 0;
+};
+
+// Erase the record that :i points to from :shard and return its contents.
+// The record must not be pending eviction, and the caller must hold the
+// shard's lock.
+erased_cache_record
+erase_cache_record(
+    immutable_cache& cache,
+    immutable_cache_shard& shard,
+    cache_record_map::iterator i);
+
+// Get the index of the shard that's responsible for the key with the given
+// hash.
+inline std::size_t
+get_shard_index(immutable_cache const& cache, std::size_t key_hash)
+{
+    // The hash is also used for bucketing within the shard's map, so mix it
+    // before selecting the shard to avoid correlating the two.
+    uint64_t mixed = uint64_t(key_hash) * 0x9e37'79b9'7f4a'7c15;
+    return std::size_t((mixed >> 32) % cache.shard_count);
+}
+
+// Get the shard that's responsible for the key with the given hash.
+inline immutable_cache_shard&
+get_shard(immutable_cache& cache, std::size_t key_hash)
+{
+    return cache.shards[get_shard_index(cache, key_hash)];
+}
+inline immutable_cache_shard&
+get_shard(immutable_cache& cache, id_interface const& key)
+{
+    return get_shard(cache, key.hash());
+}
+
+// Evict unused entries (in the order dictated by the cache's eviction policy)
+// until the total size of unused entries in the cache is at most
+// :desired_size (in bytes).
 void
 reduce_memory_cache_size(immutable_cache& cache, uint64_t desired_size);
 
+// Is the cache over either of its size limits?
+bool
+is_over_size_limits(immutable_cache const& cache);
+
+// Evict unused entries until the cache is within the size limits in its
+// config (or there are no unused entries left).
+void
+enforce_size_limits(immutable_cache& cache);
+
 } // namespace detail
 } // namespace cradle
 
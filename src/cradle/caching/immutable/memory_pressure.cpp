@@ -0,0 +1,196 @@
+#include <cradle/caching/immutable/memory_pressure.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+
+#include <boost/numeric/conversion/cast.hpp>
+
+#include <cradle/caching/immutable/internals.h>
+
+namespace cradle {
+
+namespace {
+
+// Parse the 'avg10' value from the 'some' line of a PSI file, which looks
+// like this:
+//
+//   some avg10=0.00 avg60=0.00 avg300=0.00 total=0
+//   full avg10=0.00 avg60=0.00 avg300=0.00 total=0
+//
+optional<double>
+read_psi_some_avg10(std::string const& path)
+{
+    std::ifstream input(path);
+    std::string line;
+    while (std::getline(input, line))
+    {
+        std::istringstream fields(line);
+        std::string kind;
+        fields >> kind;
+        if (kind != "some")
+            continue;
+        std::string field;
+        while (fields >> field)
+        {
+            if (field.compare(0, 6, "avg10=") == 0)
+            {
+                try
+                {
+                    return std::stod(field.substr(6));
+                }
+                catch (...)
+                {
+                    return none;
+                }
+            }
+        }
+    }
+    return none;
+}
+
+// Read a cgroup file that holds a single byte count. (memory.max holds "max"
+// when the cgroup isn't limited, in which case this returns none.)
+optional<uint64_t>
+read_cgroup_byte_count(std::string const& path)
+{
+    std::ifstream input(path);
+    std::string value;
+    if (!(input >> value))
+        return none;
+    try
+    {
+        std::size_t length;
+        auto count = std::stoull(value, &length);
+        if (length != value.size())
+            return none;
+        return uint64_t(count);
+    }
+    catch (...)
+    {
+        return none;
+    }
+}
+
+} // namespace
+
+memory_pressure_reading
+read_memory_pressure(memory_pressure_config const& config)
+{
+    std::string cgroup_path
+        = config.cgroup_path ? *config.cgroup_path : "/sys/fs/cgroup";
+    return memory_pressure_reading{
+        read_psi_some_avg10(
+            config.psi_path ? *config.psi_path : "/proc/pressure/memory"),
+        read_cgroup_byte_count(cgroup_path + "/memory.current"),
+        read_cgroup_byte_count(cgroup_path + "/memory.max")};
+}
+
+memory_pressure_monitor::memory_pressure_monitor(
+    immutable_cache& cache, memory_pressure_config config)
+    : cache_(cache),
+      config_(std::move(config)),
+      configured_limit_(
+          boost::numeric_cast<uint64_t>(cache.impl->config.unused_size_limit))
+{
+}
+
+memory_pressure_monitor::~memory_pressure_monitor()
+{
+    if (thread_.joinable())
+    {
+        {
+            std::scoped_lock<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        stop_requested_.notify_one();
+        thread_.join();
+    }
+    set_unused_size_limit(cache_, configured_limit_);
+}
+
+void
+memory_pressure_monitor::start()
+{
+    thread_ = std::thread([this] { run(); });
+}
+
+void
+memory_pressure_monitor::run()
+{
+    auto const interval = std::chrono::milliseconds(
+        config_.poll_interval ? *config_.poll_interval : 1000);
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stop_requested_.wait_for(
+        lock, interval, [&] { return stopping_; }))
+    {
+        poll();
+    }
+}
+
+namespace {
+
+// When there's no pressure, the budget recovers by this fraction (of the
+// configured limit) per poll. This is deliberately much slower than the
+// shrinking so that the cache doesn't oscillate.
+double const budget_recovery_step = 0.125;
+
+} // namespace
+
+void
+memory_pressure_monitor::poll()
+{
+    auto const reading = read_memory_pressure(config_);
+    auto& cache = *cache_.impl;
+
+    bool const psi_pressure
+        = reading.psi_some_avg10
+          && *reading.psi_some_avg10
+                 >= (config_.psi_threshold ? *config_.psi_threshold : 10.);
+
+    // If the cgroup is over its threshold, this is how much memory we'd
+    // need to free to get it back under.
+    uint64_t cgroup_excess = 0;
+    if (reading.cgroup_current && reading.cgroup_max)
+    {
+        auto const threshold = uint64_t(
+            double(*reading.cgroup_max)
+            * (config_.cgroup_usage_threshold ? *config_.cgroup_usage_threshold
+                                              : 0.9));
+        if (*reading.cgroup_current >= threshold)
+            cgroup_excess = *reading.cgroup_current - threshold;
+    }
+
+    double const min_fraction
+        = config_.min_budget_fraction ? *config_.min_budget_fraction : 0.;
+    double fraction = budget_fraction_.load(std::memory_order_relaxed);
+    if (psi_pressure || cgroup_excess != 0)
+    {
+        fraction /= 2;
+        // If the cgroup is over its threshold, also make sure that the
+        // budget is small enough that trimming the cache would free up the
+        // excess (as far as the cache can).
+        if (cgroup_excess != 0 && configured_limit_ != 0)
+        {
+            auto const unused_size
+                = cache.unused_size.load(std::memory_order_relaxed);
+            auto const target = unused_size > cgroup_excess
+                                    ? unused_size - cgroup_excess
+                                    : 0;
+            fraction = std::min(
+                fraction, double(target) / double(configured_limit_));
+        }
+        fraction = std::max(fraction, min_fraction);
+    }
+    else
+    {
+        fraction = std::min(fraction + budget_recovery_step, 1.);
+    }
+    budget_fraction_.store(fraction, std::memory_order_relaxed);
+
+    set_unused_size_limit(
+        cache_, uint64_t(double(configured_limit_) * fraction));
+}
+
+} // namespace cradle
@@ -0,0 +1,121 @@
+#ifndef CRADLE_CACHING_IMMUTABLE_MEMORY_PRESSURE_HPP
+#define CRADLE_CACHING_IMMUTABLE_MEMORY_PRESSURE_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <cradle/caching/immutable/cache.hpp>
+
+// This file provides a monitor that adjusts the budget of an immutable cache
+// in response to memory pressure on the system (or container) that it's
+// running in.
+//
+// Pressure is detected via Linux's pressure stall information (PSI) for
+// memory and/or the usage and limit of the cgroup (v2) that the process
+// belongs to. Either source may be missing (e.g., on other platforms or on
+// older kernels), in which case it's simply ignored.
+
+namespace cradle {
+
+api(struct)
+struct memory_pressure_config
+{
+    // how often to check for memory pressure, in milliseconds (defaults to
+    // 1000)
+    omissible<integer> poll_interval;
+
+    // the PSI 'some avg10' percentage (i.e., the percentage of the last ten
+    // seconds in which some task was stalled on memory) at or above which
+    // memory is considered under pressure (defaults to 10)
+    omissible<double> psi_threshold;
+
+    // the fraction of the cgroup's memory.max at or above which memory is
+    // considered under pressure (defaults to 0.9)
+    omissible<double> cgroup_usage_threshold;
+
+    // the smallest fraction of the cache's configured unused size limit that
+    // the budget can be reduced to (defaults to 0)
+    omissible<double> min_budget_fraction;
+
+    // the path to the PSI memory file (defaults to /proc/pressure/memory)
+    omissible<std::string> psi_path;
+
+    // the cgroup v2 directory containing the memory.current and memory.max
+    // files (defaults to /sys/fs/cgroup)
+    omissible<std::string> cgroup_path;
+};
+
+struct memory_pressure_reading
+{
+    // the PSI 'some avg10' percentage, if available
+    optional<double> psi_some_avg10;
+
+    // the current memory usage of the cgroup, in bytes, if available
+    optional<uint64_t> cgroup_current;
+
+    // the memory limit of the cgroup, in bytes, if available and the cgroup
+    // is actually limited
+    optional<uint64_t> cgroup_max;
+};
+
+// Read the current memory pressure information from the files specified in
+// :config.
+memory_pressure_reading
+read_memory_pressure(memory_pressure_config const& config);
+
+// A memory_pressure_monitor periodically checks for memory pressure and
+// adjusts the budget of a cache accordingly.
+//
+// The budget is expressed as a fraction of the :unused_size_limit in the
+// cache's config. While memory is under pressure, the fraction is halved
+// on each check (and cut further if necessary to bring the cgroup back
+// under its threshold), and the cache is trimmed to match. Once the
+// pressure subsides, the fraction recovers gradually.
+//
+// The cache must outlive the monitor. When the monitor is destroyed, the
+// cache's full budget is restored.
+//
+struct memory_pressure_monitor : noncopyable
+{
+    memory_pressure_monitor(
+        immutable_cache& cache, memory_pressure_config config);
+
+    ~memory_pressure_monitor();
+
+    // Start checking for memory pressure periodically (on a background
+    // thread).
+    void
+    start();
+
+    // Check for memory pressure once and adjust the cache's budget.
+    // (This is what the background thread does on each poll.)
+    void
+    poll();
+
+    // Get the current budget, as a fraction of the configured limit.
+    double
+    budget_fraction() const
+    {
+        return budget_fraction_.load(std::memory_order_relaxed);
+    }
+
+ private:
+    void
+    run();
+
+    immutable_cache& cache_;
+    memory_pressure_config config_;
+    uint64_t configured_limit_;
+    std::atomic<double> budget_fraction_ = 1;
+
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable stop_requested_;
+    bool stopping_ = false;
+};
+
+} // namespace cradle
+
+#endif
@@ -1,138 +1,384 @@
 #include <cradle/caching/immutable/ptr.h>
 
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
 #include <cradle/caching/immutable/internals.h>
 
 namespace cradle {
 namespace detail {
 
+namespace {
+
+void
+remove_from_eviction_list(immutable_cache_record* record)
+{
+    assert(record->eviction_list);
+    record->owner_shard->eviction_policy->remove(record);
+    update_next_victim_rank(*record->owner_shard);
+    record->owner_cache->unused_size.fetch_sub(
+        record->size, std::memory_order_relaxed);
+}
+
+// Spill the record associated with :key (if it's still in the cache).
+// (See immutable_cache_record::spilled.)
+void
+spill_cache_record(
+    immutable_cache& cache,
+    immutable_cache_shard& shard,
+    id_interface const& key)
+{
+    erased_cache_record erased;
+    {
+        std::scoped_lock<std::mutex> lock(shard.mutex);
+        cache_record_map::iterator i = shard.records.find(&key);
+        if (i == shard.records.end())
+            return;
+        immutable_cache_record& record = *i->second;
+        // If no one is using the record, there's no point in waiting, so it's
+        // just evicted.
+        if (record.eviction_list)
+        {
+            remove_from_eviction_list(&record);
+            cache.eviction_count.fetch_add(1, std::memory_order_relaxed);
+            erased = erase_cache_record(cache, shard, i);
+        }
+        else
+        {
+            record.spilled = true;
+            cache.spill_count.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+// If :record is retrying, note that its retry is over.
+void
+finish_retry(immutable_cache& cache, immutable_cache_record& record)
+{
+    if (record.retrying)
+    {
+        record.retrying = false;
+        cache.retries_in_progress.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+// Get the amount of time to wait before retrying a record that has failed
+// :failure_count times in a row.
+std::chrono::steady_clock::duration
+get_retry_backoff(
+    immutable_cache_retry_policy const& policy, unsigned failure_count)
+{
+    double const multiplier
+        = policy.backoff_multiplier ? *policy.backoff_multiplier : 2.;
+    double const max_backoff
+        = policy.max_backoff ? double(*policy.max_backoff) : 60'000.;
+    double const jitter = policy.jitter ? *policy.jitter : 0.1;
+    // (This clamps before jitter is applied so that records that have hit
+    // the maximum are still spread out.)
+    double backoff = std::min(
+        double(policy.initial_backoff)
+            * std::pow(multiplier, double(failure_count - 1)),
+        max_backoff);
+    if (jitter > 0)
+    {
+        thread_local std::minstd_rand generator(std::random_device{}());
+        std::uniform_real_distribution<double> distribution(-jitter, jitter);
+        backoff *= 1 + distribution(generator);
+    }
+    return std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double, std::milli>(std::max(backoff, 0.)));
+}
+
+// Try to reserve one of the cache's concurrent retry slots.
+bool
+reserve_retry(
+    immutable_cache& cache, immutable_cache_retry_policy const& policy)
+{
+    auto in_progress
+        = cache.retries_in_progress.load(std::memory_order_relaxed);
+    do
+    {
+        if (policy.max_concurrent_retries
+            && in_progress >= uint64_t(*policy.max_concurrent_retries))
+        {
+            return false;
+        }
+    } while (!cache.retries_in_progress.compare_exchange_weak(
+        in_progress, in_progress + 1, std::memory_order_relaxed));
+    return true;
+}
+
+// Decide whether or not a failed record should be retried now (as opposed to
+// just reporting its failure again). If so, this also begins the retry.
+bool
+begin_retry(immutable_cache& cache, immutable_cache_record& record)
+{
+    auto const& policy = cache.config.retry_policy;
+    if (policy)
+    {
+        if (std::chrono::steady_clock::now() < record.retry_time
+            || !reserve_retry(cache, *policy))
+        {
+            cache.failures_served_count.fetch_add(
+                1, std::memory_order_relaxed);
+            return false;
+        }
+        record.retrying = true;
+    }
+    cache.retry_count.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+// Undo begin_retry() for a retry that couldn't actually be started.
+// :record is left as it was (i.e., FAILED).
+void
+cancel_retry(immutable_cache& cache, immutable_cache_record& record)
+{
+    finish_retry(cache, record);
+    cache.retry_count.fetch_sub(1, std::memory_order_relaxed);
+}
+
+} // namespace
+
 void
 record_immutable_cache_value(
     immutable_cache& cache, id_interface const& key, size_t size)
 {
-    std::scoped_lock<std::mutex> lock(cache.mutex);
-    cache_record_map::iterator i = cache.records.find(&key);
-    if (i != cache.records.end())
+    auto& shard = get_shard(cache, key);
     {
+        std::scoped_lock<std::mutex> lock(shard.mutex);
+        cache_record_map::iterator i = shard.records.find(&key);
+        if (i == shard.records.end())
+            return;
         immutable_cache_record& record = *i->second;
+        finish_retry(cache, record);
+        record.failure_count = 0;
+        // If the record is already waiting for eviction, it has to be
+        // re-added to the eviction policy, since policies assume that the
+        // sizes of the records they manage don't change. Its size also now
+        // counts against the unused size limit.
+        bool const is_unused = record.eviction_list != nullptr;
+        if (is_unused)
+            shard.eviction_policy->remove(&record);
         record.state.store(
             immutable_cache_entry_state::READY, std::memory_order_relaxed);
         record.size = size;
+        cache.total_size.fetch_add(size, std::memory_order_relaxed);
+        if (is_unused)
+        {
+            shard.eviction_policy->add(&record);
+            update_next_victim_rank(shard);
+            cache.unused_size.fetch_add(size, std::memory_order_relaxed);
+        }
+    }
+    if (!is_over_size_limits(cache))
+        return;
+    // Try to make room for the new value by evicting unused entries. If that
+    // isn't enough, the new value itself has to be spilled.
+    enforce_size_limits(cache);
+    if (cache.config.total_size_limit
+        && cache.total_size.load(std::memory_order_relaxed)
+               > uint64_t(*cache.config.total_size_limit))
+    {
+        spill_cache_record(cache, shard, key);
     }
 }
 
 void
 record_immutable_cache_failure(immutable_cache& cache, id_interface const& key)
 {
-    std::scoped_lock<std::mutex> lock(cache.mutex);
-    cache_record_map::iterator i = cache.records.find(&key);
-    if (i != cache.records.end())
+    auto& shard = get_shard(cache, key);
+    std::scoped_lock<std::mutex> lock(shard.mutex);
+    cache_record_map::iterator i = shard.records.find(&key);
+    if (i != shard.records.end())
     {
         immutable_cache_record& record = *i->second;
         record.state.store(
             immutable_cache_entry_state::FAILED, std::memory_order_relaxed);
+        cache.failure_count.fetch_add(1, std::memory_order_relaxed);
+        finish_retry(cache, record);
+        ++record.failure_count;
+        if (cache.config.retry_policy)
+        {
+            record.retry_time
+                = std::chrono::steady_clock::now()
+                  + get_retry_backoff(
+                      *cache.config.retry_policy, record.failure_count);
+        }
     }
 }
 
 namespace {
 
-void
-remove_from_eviction_list(
-    immutable_cache& cache, immutable_cache_record* record)
-{
-    auto& list = cache.eviction_list;
-    assert(record->eviction_list_iterator != list.records.end());
-    list.records.erase(record->eviction_list_iterator);
-    record->eviction_list_iterator = list.records.end();
-    if (record->state.load(std::memory_order_relaxed)
-        == immutable_cache_entry_state::READY)
-    {
-        list.total_size -= record->size;
-    }
-}
-
 void
 acquire_cache_record_no_lock(immutable_cache_record* record)
 {
     ++record->ref_count;
-    auto& evictions = record->owner_cache->eviction_list.records;
-    if (record->eviction_list_iterator != evictions.end())
+    if (record->eviction_list)
     {
         assert(record->ref_count == 1);
-        remove_from_eviction_list(*record->owner_cache, record);
+        remove_from_eviction_list(record);
     }
 }
 
+// Find or create the record for :key in :shard and acquire it.
+// The caller must hold the shard's lock. If the record's task needs to be
+// (re)created, :create_task is called to store it.
+template<class CreateTask>
 immutable_cache_record*
-acquire_cache_record(
+acquire_cache_record_in_shard(
     immutable_cache& cache,
+    immutable_cache_shard& shard,
     id_interface const& key,
-    function_view<std::any(
-        immutable_cache& cache, id_interface const& key)> const& create_task)
-{
-    std::scoped_lock<std::mutex> lock(cache.mutex);
-    cache_record_map::iterator i = cache.records.find(&key);
-    if (i == cache.records.end())
-    {
-        auto record = std::make_unique<immutable_cache_record>();
-        record->owner_cache = &cache;
-        record->eviction_list_iterator = cache.eviction_list.records.end();
-        record->key.capture(key);
-        record->ref_count = 0;
-        record->task = create_task(cache, key);
-        i = cache.records.emplace(&*record->key, std::move(record)).first;
-    }
-    immutable_cache_record* record = i->second.get();
-    // TODO: Better (optional) retry logic.
-    if (record->state.load(std::memory_order_relaxed)
-        == immutable_cache_entry_state::FAILED)
-    {
-        record->task = create_task(cache, key);
-        record->state.store(
+    std::size_t key_hash,
+    CreateTask const& create_task)
+{
+    cache_record_map::iterator i = shard.records.find(&key);
+    if (i == shard.records.end())
+    {
+        auto* record = shard.pool.create();
+        try
+        {
+            record->owner_cache = &cache;
+            record->owner_shard = &shard;
+            record->key.capture(key);
+            record->key_hash = key_hash;
+            record->ref_count = 0;
+            create_task(record->task);
+            i = shard.records.emplace(&*record->key, record).first;
+            cache.entry_count.fetch_add(1, std::memory_order_relaxed);
+        }
+        catch (...)
+        {
+            shard.pool.destroy(record);
+            throw;
+        }
+        cache.miss_count.fetch_add(1, std::memory_order_relaxed);
+    }
+    else if (
+        i->second->state.load(std::memory_order_relaxed)
+            == immutable_cache_entry_state::FAILED
+        && begin_retry(cache, *i->second))
+    {
+        try
+        {
+            create_task(i->second->task);
+        }
+        catch (...)
+        {
+            // Otherwise, the retry slot would never be given back.
+            cancel_retry(cache, *i->second);
+            throw;
+        }
+        i->second->state.store(
             immutable_cache_entry_state::LOADING, std::memory_order_relaxed);
+        cache.miss_count.fetch_add(1, std::memory_order_relaxed);
+    }
+    else
+    {
+        cache.hit_count.fetch_add(1, std::memory_order_relaxed);
     }
+    immutable_cache_record* record = i->second;
+    ++record->access_count;
     acquire_cache_record_no_lock(record);
     return record;
 }
 
+immutable_cache_record*
+acquire_cache_record(
+    immutable_cache& cache,
+    id_interface const& key,
+    cache_task_creator const& create_task)
+{
+    auto const key_hash = key.hash();
+    if (cache.access_frequencies)
+        cache.access_frequencies->increment(key_hash);
+    auto& shard = get_shard(cache, key_hash);
+    std::scoped_lock<std::mutex> lock(shard.mutex);
+    return acquire_cache_record_in_shard(
+        cache, shard, key, key_hash, [&](cache_task_storage& task) {
+            create_task(cache, key, task);
+        });
+}
+
 void
 acquire_cache_record(immutable_cache_record* record)
 {
-    std::scoped_lock<std::mutex> lock(record->owner_cache->mutex);
+    std::scoped_lock<std::mutex> lock(record->owner_shard->mutex);
     acquire_cache_record_no_lock(record);
 }
 
 void
-add_to_eviction_list(immutable_cache& cache, immutable_cache_record* record)
+add_to_eviction_list(immutable_cache_record* record)
 {
-    auto& list = cache.eviction_list;
-    assert(record->eviction_list_iterator == list.records.end());
-    record->eviction_list_iterator
-        = list.records.insert(list.records.end(), record);
-    list.total_size += record->size;
+    auto& cache = *record->owner_cache;
+    assert(!record->eviction_list);
+    record->release_time
+        = cache.release_counter.fetch_add(1, std::memory_order_relaxed);
+    record->owner_shard->eviction_policy->add(record);
+    update_next_victim_rank(*record->owner_shard);
+    cache.unused_size.fetch_add(record->size, std::memory_order_relaxed);
 }
 
 void
 release_cache_record(immutable_cache_record* record)
 {
     auto& cache = *record->owner_cache;
-    bool do_lru_eviction = false;
+    auto& shard = *record->owner_shard;
+    erased_cache_record erased;
+    bool do_eviction = false;
     {
-        std::scoped_lock<std::mutex> lock(cache.mutex);
+        std::scoped_lock<std::mutex> lock(shard.mutex);
         --record->ref_count;
         if (record->ref_count == 0)
         {
-            add_to_eviction_list(cache, record);
-            do_lru_eviction = true;
+            if (record->spilled)
+            {
+                erased = erase_cache_record(
+                    cache, shard, shard.records.find(&*record->key));
+            }
+            else
+            {
+                add_to_eviction_list(record);
+                do_eviction = is_over_size_limits(cache);
+            }
         }
     }
-    if (do_lru_eviction)
-    {
-        reduce_memory_cache_size(cache, cache.config.unused_size_limit);
-    }
+    if (do_eviction)
+        enforce_size_limits(cache);
 }
 
 } // namespace
 
+// IMMUTABLE_CACHE_LOAD_TIMER
+
+immutable_cache_load_timer::immutable_cache_load_timer(immutable_cache& cache)
+    : cache_(cache), start_time_(std::chrono::steady_clock::now())
+{
+    cache_.loads_in_progress.fetch_add(1, std::memory_order_relaxed);
+}
+
+immutable_cache_load_timer::~immutable_cache_load_timer()
+{
+    cache_.loads_in_progress.fetch_sub(1, std::memory_order_relaxed);
+    auto const microseconds
+        = std::chrono::duration_cast<std::chrono::microseconds>(
+              std::chrono::steady_clock::now() - start_time_)
+              .count();
+    // Bucket i counts loads that took less than 2^i microseconds (but at
+    // least 2^(i-1)), and the last bucket also counts anything longer.
+    unsigned bucket = 0;
+    while (bucket + 1 < immutable_cache_load_latency_bucket_count
+           && (int64_t(1) << bucket) <= microseconds)
+    {
+        ++bucket;
+    }
+    cache_.load_latency_histogram[bucket].fetch_add(
+        1, std::memory_order_relaxed);
+}
+
 // UNTYPED_IMMUTABLE_CACHE_PTR
 
 void
@@ -143,18 +389,72 @@ untyped_immutable_cache_ptr::reset()
         detail::release_cache_record(record_);
         record_ = nullptr;
     }
-    key_.clear();
 }
 
 void
 untyped_immutable_cache_ptr::acquire(
     cradle::immutable_cache& cache,
     id_interface const& key,
-    function_view<std::any(
-        immutable_cache& cache, id_interface const& key)> const& create_task)
+    cache_task_creator const& create_task)
 {
     record_ = detail::acquire_cache_record(*cache.impl, key, create_task);
-    key_.capture(key);
+}
+
+void
+untyped_immutable_cache_ptr::reset_batch(
+    cradle::immutable_cache& cache_object,
+    std::span<id_interface const* const> keys,
+    batch_cache_task_creator const& create_task,
+    std::span<untyped_immutable_cache_ptr* const> ptrs)
+{
+    assert(keys.size() == ptrs.size());
+    auto& cache = *cache_object.impl;
+    for (auto* ptr : ptrs)
+        ptr->reset();
+
+    // Hash all the keys and sort them by shard (via a counting sort).
+    std::size_t const n = keys.size();
+    std::vector<std::size_t> key_hashes(n);
+    std::vector<std::size_t> shard_indices(n);
+    std::vector<std::size_t> shard_offsets(cache.shard_count + 1, 0);
+    for (std::size_t i = 0; i != n; ++i)
+    {
+        key_hashes[i] = keys[i]->hash();
+        if (cache.access_frequencies)
+            cache.access_frequencies->increment(key_hashes[i]);
+        shard_indices[i] = get_shard_index(cache, key_hashes[i]);
+        ++shard_offsets[shard_indices[i] + 1];
+    }
+    for (std::size_t s = 0; s != cache.shard_count; ++s)
+        shard_offsets[s + 1] += shard_offsets[s];
+    std::vector<std::size_t> order(n);
+    {
+        auto next = shard_offsets;
+        for (std::size_t i = 0; i != n; ++i)
+            order[next[shard_indices[i]]++] = i;
+    }
+
+    // Now visit each shard that has keys and acquire all of its records
+    // under a single lock.
+    for (std::size_t s = 0; s != cache.shard_count; ++s)
+    {
+        if (shard_offsets[s] == shard_offsets[s + 1])
+            continue;
+        auto& shard = cache.shards[s];
+        std::scoped_lock<std::mutex> lock(shard.mutex);
+        for (std::size_t j = shard_offsets[s]; j != shard_offsets[s + 1]; ++j)
+        {
+            std::size_t const i = order[j];
+            ptrs[i]->record_ = acquire_cache_record_in_shard(
+                cache,
+                shard,
+                *keys[i],
+                key_hashes[i],
+                [&](cache_task_storage& task) {
+                    create_task(cache, *keys[i], i, task);
+                });
+        }
+    }
 }
 
 void
@@ -163,7 +463,6 @@ untyped_immutable_cache_ptr::copy(untyped_immutable_cache_ptr const& other)
     record_ = other.record_;
     if (record_)
         detail::acquire_cache_record(record_);
-    key_ = other.key_;
 }
 
 void
@@ -171,7 +470,6 @@ untyped_immutable_cache_ptr::move_in(untyped_immutable_cache_ptr&& other)
 {
     record_ = other.record_;
     other.record_ = nullptr;
-    key_ = std::move(other.key_);
 }
 
 } // namespace detail
@@ -1,6 +1,9 @@
 #ifndef CRADLE_CACHING_IMMUTABLE_PTR_H
 #define CRADLE_CACHING_IMMUTABLE_PTR_H
 
+#include <span>
+#include <vector>
+
 #include <cppcoro/shared_task.hpp>
 
 #include <cradle/caching/immutable/cache.hpp>
@@ -14,10 +17,39 @@ namespace cradle {
 
 struct immutable_cache;
 
+// sized_cache_value<Value> pairs a value with the amount of memory that it
+// occupies (in bytes). Tasks that already know this (e.g., because they
+// decoded the value themselves) can produce these instead of plain values so
+// that the cache doesn't have to traverse the value (via deep_sizeof) to
+// determine its size.
+template<class Value>
+struct sized_cache_value
+{
+    Value value;
+    std::size_t size;
+};
+
 namespace detail {
 
 struct immutable_cache_record;
 
+// A cache_task_creator is called (with the cache's internal lock held) to
+// create the task for a cache entry. It stores the task (a
+// cppcoro::shared_task<T>) into the supplied storage.
+typedef function_view<void(
+    immutable_cache& cache, id_interface const& key, cache_task_storage& task)>
+    cache_task_creator;
+
+// A batch_cache_task_creator is the equivalent of a cache_task_creator for
+// batch acquisitions. It also receives the index (within the batch) of the
+// key whose task is needed.
+typedef function_view<void(
+    immutable_cache& cache,
+    id_interface const& key,
+    std::size_t index,
+    cache_task_storage& task)>
+    batch_cache_task_creator;
+
 // untyped_immutable_cache_ptr provides all of the functionality of
 // immutable_cache_ptr without compile-time knowledge of the data type.
 struct untyped_immutable_cache_ptr
@@ -62,14 +94,23 @@ struct untyped_immutable_cache_ptr
     reset(
         cradle::immutable_cache& cache,
         id_interface const& key,
-        function_view<
-            std::any(immutable_cache& cache, id_interface const& key)> const&
-            create_task)
+        cache_task_creator const& create_task)
     {
         this->reset();
         acquire(cache, key, create_task);
     }
 
+    // Reset a batch of pointers at once. This is equivalent to calling
+    // reset(cache, keys[i], ...) on each of :ptrs[i], but each of the
+    // cache's shards is only locked once, and all missing tasks are created
+    // while it is.
+    static void
+    reset_batch(
+        cradle::immutable_cache& cache,
+        std::span<id_interface const* const> keys,
+        batch_cache_task_creator const& create_task,
+        std::span<untyped_immutable_cache_ptr* const> ptrs);
+
     bool
     is_initialized() const
     {
@@ -79,10 +120,12 @@ struct untyped_immutable_cache_ptr
     // Everything below here should only be called if the pointer is
     // initialized...
 
+    // This refers to the key stored in the cache record, so it's valid for as
+    // long as the pointer is.
     id_interface const&
     key() const
     {
-        return *key_;
+        return *record_->key;
     }
 
     immutable_cache_record*
@@ -102,17 +145,25 @@ struct untyped_immutable_cache_ptr
     acquire(
         cradle::immutable_cache& cache,
         id_interface const& key,
-        function_view<
-            std::any(immutable_cache& cache, id_interface const& key)> const&
-            create_task);
-
-    // the key of the entry
-    captured_id key_;
+        cache_task_creator const& create_task);
 
     // the internal cache record for the entry
     detail::immutable_cache_record* record_ = nullptr;
 };
 
+// immutable_cache_load_timer tracks a load (i.e., the execution of a cache
+// entry's task) for the cache's statistics. It should live for the duration
+// of the load.
+struct immutable_cache_load_timer : noncopyable
+{
+    immutable_cache_load_timer(immutable_cache& cache);
+    ~immutable_cache_load_timer();
+
+ private:
+    immutable_cache& cache_;
+    std::chrono::steady_clock::time_point start_time_;
+};
+
 void
 record_immutable_cache_value(
     immutable_cache& cache, id_interface const& key, size_t size);
@@ -126,6 +177,7 @@ cppcoro::shared_task<Value>
 cache_task_wrapper(
     immutable_cache& cache, captured_id key, cppcoro::task<Value> task)
 {
+    immutable_cache_load_timer timer(cache);
     try
     {
         Value value = co_await task;
@@ -139,13 +191,36 @@ cache_task_wrapper(
     }
 }
 
+template<class Value>
+cppcoro::shared_task<Value>
+cache_task_wrapper(
+    immutable_cache& cache,
+    captured_id key,
+    cppcoro::task<sized_cache_value<Value>> task)
+{
+    immutable_cache_load_timer timer(cache);
+    try
+    {
+        sized_cache_value<Value> sized = co_await std::move(task);
+        record_immutable_cache_value(cache, *key, sized.size);
+        co_return std::move(sized.value);
+    }
+    catch (...)
+    {
+        record_immutable_cache_failure(cache, *key);
+        throw;
+    }
+}
+
 template<class Value, class CreateTask>
 auto
 wrap_task_creator(CreateTask&& create_task)
 {
     return [create_task = std::forward<CreateTask>(create_task)](
-               immutable_cache& cache, id_interface const& key) {
-        return cache_task_wrapper<Value>(cache, key, create_task());
+               immutable_cache& cache,
+               id_interface const& key,
+               cache_task_storage& task) {
+        task.emplace(cache_task_wrapper<Value>(cache, key, create_task()));
     };
 }
 
@@ -224,8 +299,7 @@ struct immutable_cache_ptr
     cppcoro::shared_task<T> const&
     task() const
     {
-        return std::any_cast<cppcoro::shared_task<T> const&>(
-            untyped_.record()->task);
+        return untyped_.record()->task.template get<T>();
     }
 
     immutable_cache_entry_state
@@ -259,6 +333,48 @@ struct immutable_cache_ptr
     detail::untyped_immutable_cache_ptr untyped_;
 };
 
+// Acquire pointers to the entries for a batch of keys at once.
+//
+// This is equivalent to constructing an immutable_cache_ptr<T> for each key,
+// but it only locks each of the cache's shards once, and all missing tasks
+// are created in that same pass. This is much cheaper when fanning out to a
+// large number of keys.
+//
+// :keys is a random-access range of ID objects (i.e., objects whose types
+// implement id_interface). :create_task(i) is called to create the task for
+// keys[i] if needed.
+//
+template<class T, class Keys, class CreateTask>
+std::vector<immutable_cache_ptr<T>>
+acquire_cache_ptrs(
+    cradle::immutable_cache& cache, Keys const& keys, CreateTask&& create_task)
+{
+    std::vector<id_interface const*> key_ptrs;
+    key_ptrs.reserve(std::size(keys));
+    for (auto const& key : keys)
+        key_ptrs.push_back(&key);
+
+    std::vector<immutable_cache_ptr<T>> ptrs(key_ptrs.size());
+    std::vector<detail::untyped_immutable_cache_ptr*> untyped_ptrs;
+    untyped_ptrs.reserve(ptrs.size());
+    for (auto& ptr : ptrs)
+        untyped_ptrs.push_back(&ptr.untyped());
+
+    detail::untyped_immutable_cache_ptr::reset_batch(
+        cache,
+        key_ptrs,
+        [&](detail::immutable_cache& cache,
+            id_interface const& key,
+            std::size_t index,
+            detail::cache_task_storage& task) {
+            task.emplace(
+                detail::cache_task_wrapper<T>(cache, key, create_task(index)));
+        },
+        untyped_ptrs);
+
+    return ptrs;
+}
+
 } // namespace cradle
 
 #endif
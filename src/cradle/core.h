@@ -2,8 +2,10 @@
 #define CRADLE_CORE_H
 
 #include <cradle/core/api_types.hpp>
+#include <cradle/core/coercion.h>
 #include <cradle/core/dynamic.h>
 #include <cradle/core/exception.h>
+#include <cradle/core/field_dispatch.h>
 #include <cradle/core/flags.h>
 #include <cradle/core/id.h>
 #include <cradle/core/immutable.h>
@@ -2,8 +2,7 @@
 #include <cradle/core/api_types.hpp>
 #include <cradle/encodings/base64.h>
 #include <cradle/encodings/json.h>
-
-#include <picosha2.h>
+#include <cradle/encodings/sha256.h>
 
 #include <boost/algorithm/string/regex.hpp>
 #include <boost/algorithm/string/replace.hpp>
@@ -21,7 +20,8 @@ generate_function_uid(
     auto json = value_to_json(to_dynamic(uid));
 
     return base64_encode(
-        picosha2::hash256_hex_string(json), get_mime_base64_character_set());
+        format_sha256_digest(compute_sha256(json.data(), json.size())),
+        get_mime_base64_character_set());
 }
 
 void
@@ -0,0 +1,956 @@
+#include <cradle/core/coercion.h>
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include <cradle/core.h>
+
+namespace cradle {
+
+namespace detail {
+
+// A field of a structure (or member of a union) within a coercion plan
+struct coercion_plan_field
+{
+    string name;
+    // :name as a map key (which is also how it appears in error paths)
+    dynamic key;
+    // the node for the field's values
+    size_t node;
+    // the node for columns of the field's values (i.e., arrays of them)
+    size_t column_node;
+    bool required;
+};
+
+struct coercion_plan_node
+{
+    // This is the type of the values that the node applies to. Named types
+    // are resolved when the plan is compiled, so a NAMED_TYPE node is just
+    // an alias for its :element node. (That only happens when one named
+    // type is defined as another.) Types that values can't be coerced to
+    // are treated as NIL_TYPE.
+    api_type_info_tag tag = api_type_info_tag::NIL_TYPE;
+    // the node for the elements of an array, the values of a map, the value
+    // of an optional, or the target of an alias
+    size_t element = 0;
+    // the node for the keys of a map
+    size_t key = 0;
+    // the valid values of an enum (in order)
+    std::vector<string> values;
+    // the fields of a structure or the members of a union (in name order)
+    std::vector<coercion_plan_field> fields;
+    // In a lazily compiled plan (see coerce_value()), named types are only
+    // resolved once a value reaches them. Until then, their nodes are
+    // NAMED_TYPE nodes with this set.
+    bool unresolved = false;
+};
+
+struct coercion_plan_nodes
+{
+    // The root node (for the type that the plan was compiled from) is first.
+    std::vector<coercion_plan_node> nodes;
+};
+
+} // namespace detail
+
+using detail::coercion_plan_field;
+using detail::coercion_plan_node;
+
+size_t
+deep_sizeof(coercion_plan const& plan)
+{
+    size_t size = sizeof(coercion_plan);
+    if (plan.nodes)
+    {
+        size += sizeof(detail::coercion_plan_nodes);
+        for (auto const& node : plan.nodes->nodes)
+        {
+            size += sizeof(coercion_plan_node) + deep_sizeof(node.values);
+            for (auto const& field : node.fields)
+            {
+                size += sizeof(coercion_plan_field) + deep_sizeof(field.name)
+                        + deep_sizeof(field.key);
+            }
+        }
+    }
+    return size;
+}
+
+// COMPILATION
+
+namespace {
+
+struct coercion_plan_compiler
+{
+    std::function<cppcoro::task<api_type_info>(
+        api_named_type_reference const& ref)> const& look_up_named_type;
+    std::vector<coercion_plan_node> nodes;
+    // the node for each named type that's been encountered so far
+    std::map<api_named_type_reference, size_t> named_nodes;
+    // If this is set, named types are left unresolved until
+    // resolve_named_node() is called on them.
+    bool lazy = false;
+};
+
+size_t
+add_node(coercion_plan_compiler& compiler, api_type_info_tag tag)
+{
+    size_t const index = compiler.nodes.size();
+    compiler.nodes.emplace_back();
+    compiler.nodes[index].tag = tag;
+    return index;
+}
+
+cppcoro::task<void>
+compile_node(
+    coercion_plan_compiler& compiler, size_t index, api_type_info const& type);
+
+// Compile :type into a new node (or find the existing node for it, if it's a
+// named type) and return the node's index.
+//
+// Note that compiling can add nodes to the compiler (and thus move the
+// existing ones), so nodes are always referred to by index.
+cppcoro::task<size_t>
+compile_type(coercion_plan_compiler& compiler, api_type_info const& type)
+{
+    if (get_tag(type) == api_type_info_tag::NAMED_TYPE)
+    {
+        auto const& ref = as_named_type(type);
+        if (auto i = compiler.named_nodes.find(ref);
+            i != compiler.named_nodes.end())
+        {
+            co_return i->second;
+        }
+        // Register the node before resolving the type, so that recursive
+        // references to it find it.
+        size_t const index = add_node(compiler, api_type_info_tag::NIL_TYPE);
+        compiler.named_nodes[ref] = index;
+        if (compiler.lazy)
+        {
+            compiler.nodes[index].tag = api_type_info_tag::NAMED_TYPE;
+            compiler.nodes[index].unresolved = true;
+            co_return index;
+        }
+        co_await compile_node(
+            compiler, index, co_await compiler.look_up_named_type(ref));
+        co_return index;
+    }
+    size_t const index = add_node(compiler, get_tag(type));
+    co_await compile_node(compiler, index, type);
+    co_return index;
+}
+
+// Compile :type into the existing node at :index.
+cppcoro::task<void>
+compile_node(
+    coercion_plan_compiler& compiler, size_t index, api_type_info const& type)
+{
+    auto& nodes = compiler.nodes;
+    nodes[index].tag = get_tag(type);
+    switch (get_tag(type))
+    {
+        case api_type_info_tag::ARRAY_TYPE: {
+            size_t const element = co_await compile_type(
+                compiler, as_array_type(type).element_schema);
+            nodes[index].element = element;
+            break;
+        }
+        case api_type_info_tag::ENUM_TYPE: {
+            std::vector<string> values;
+            for (auto const& [value, info] : as_enum_type(type).values)
+                values.push_back(value);
+            nodes[index].values = std::move(values);
+            break;
+        }
+        case api_type_info_tag::MAP_TYPE: {
+            auto const& map_type = as_map_type(type);
+            size_t const key
+                = co_await compile_type(compiler, map_type.key_schema);
+            size_t const value
+                = co_await compile_type(compiler, map_type.value_schema);
+            nodes[index].key = key;
+            nodes[index].element = value;
+            break;
+        }
+        case api_type_info_tag::NAMED_TYPE: {
+            size_t const target = co_await compile_type(compiler, type);
+            nodes[index].element = target;
+            break;
+        }
+        case api_type_info_tag::OPTIONAL_TYPE: {
+            size_t const element
+                = co_await compile_type(compiler, as_optional_type(type));
+            nodes[index].element = element;
+            break;
+        }
+        case api_type_info_tag::STRUCTURE_TYPE: {
+            std::vector<coercion_plan_field> fields;
+            for (auto const& [name, info] : as_structure_type(type).fields)
+            {
+                size_t const node
+                    = co_await compile_type(compiler, info.schema);
+                size_t const column_node
+                    = add_node(compiler, api_type_info_tag::ARRAY_TYPE);
+                nodes[column_node].element = node;
+                fields.push_back(coercion_plan_field{
+                    name,
+                    make_map_key(name),
+                    node,
+                    column_node,
+                    !info.omissible || !*info.omissible});
+            }
+            nodes[index].fields = std::move(fields);
+            break;
+        }
+        case api_type_info_tag::UNION_TYPE: {
+            std::vector<coercion_plan_field> members;
+            for (auto const& [name, info] : as_union_type(type).members)
+            {
+                size_t const node
+                    = co_await compile_type(compiler, info.schema);
+                members.push_back(coercion_plan_field{
+                    name, make_map_key(name), node, 0, true});
+            }
+            nodes[index].fields = std::move(members);
+            break;
+        }
+        case api_type_info_tag::BLOB_TYPE:
+        case api_type_info_tag::BOOLEAN_TYPE:
+        case api_type_info_tag::DATETIME_TYPE:
+        case api_type_info_tag::DYNAMIC_TYPE:
+        case api_type_info_tag::FLOAT_TYPE:
+        case api_type_info_tag::INTEGER_TYPE:
+        case api_type_info_tag::NIL_TYPE:
+        case api_type_info_tag::REFERENCE_TYPE:
+        case api_type_info_tag::STRING_TYPE:
+            break;
+        default:
+            nodes[index].tag = api_type_info_tag::NIL_TYPE;
+            break;
+    }
+}
+
+// Compile the root node (for :type itself), which is always at index 0.
+cppcoro::task<void>
+compile_root(coercion_plan_compiler& compiler, api_type_info const& type)
+{
+    size_t const root = add_node(compiler, get_tag(type));
+    if (get_tag(type) == api_type_info_tag::NAMED_TYPE)
+        compiler.nodes[root].element = co_await compile_type(compiler, type);
+    else
+        co_await compile_node(compiler, root, type);
+}
+
+// Resolve the (lazily compiled) named type node at :index.
+cppcoro::task<void>
+resolve_named_node(coercion_plan_compiler& compiler, size_t index)
+{
+    auto const entry = std::find_if(
+        compiler.named_nodes.begin(),
+        compiler.named_nodes.end(),
+        [&](auto const& named) { return named.second == index; });
+    compiler.nodes[index].unresolved = false;
+    co_await compile_node(
+        compiler,
+        index,
+        co_await compiler.look_up_named_type(entry->first));
+}
+
+} // namespace
+
+cppcoro::task<coercion_plan>
+compile_coercion_plan(
+    std::function<cppcoro::task<api_type_info>(
+        api_named_type_reference const& ref)> const& look_up_named_type,
+    api_type_info const& type)
+{
+    coercion_plan_compiler compiler{look_up_named_type, {}, {}};
+    co_await compile_root(compiler, type);
+    auto nodes = std::make_shared<detail::coercion_plan_nodes>();
+    nodes->nodes = std::move(compiler.nodes);
+    co_return coercion_plan{std::move(nodes)};
+}
+
+// SERIALIZATION
+
+namespace {
+
+dynamic
+to_dynamic_index(size_t index)
+{
+    return dynamic(integer(index));
+}
+
+size_t
+from_dynamic_index(dynamic const& v, size_t n_nodes)
+{
+    integer const index = cast<integer>(v);
+    if (index < 0 || size_t(index) >= n_nodes)
+    {
+        CRADLE_THROW(
+            invalid_coercion_plan() << coercion_plan_node_index_info(index));
+    }
+    return size_t(index);
+}
+
+} // namespace
+
+void
+to_dynamic(dynamic* v, coercion_plan const& plan)
+{
+    dynamic_array nodes;
+    if (plan.nodes)
+    {
+        for (auto const& node : plan.nodes->nodes)
+        {
+            dynamic_array fields;
+            for (auto const& field : node.fields)
+            {
+                dynamic_map encoded_field;
+                encoded_field[dynamic("name")] = dynamic(field.name);
+                encoded_field[dynamic("node")] = to_dynamic_index(field.node);
+                encoded_field[dynamic("column_node")]
+                    = to_dynamic_index(field.column_node);
+                encoded_field[dynamic("required")] = dynamic(field.required);
+                fields.push_back(dynamic(std::move(encoded_field)));
+            }
+            dynamic_map encoded_node;
+            encoded_node[dynamic("tag")] = dynamic(integer(node.tag));
+            encoded_node[dynamic("element")] = to_dynamic_index(node.element);
+            encoded_node[dynamic("key")] = to_dynamic_index(node.key);
+            to_dynamic(&encoded_node[dynamic("values")], node.values);
+            encoded_node[dynamic("fields")] = dynamic(std::move(fields));
+            nodes.push_back(dynamic(std::move(encoded_node)));
+        }
+    }
+    *v = dynamic(std::move(nodes));
+}
+
+void
+from_dynamic(coercion_plan* plan, dynamic const& v)
+{
+    // The encoded nodes (and fields) are arrays of records, so they may come
+    // back from an encoding as tables.
+    std::vector<dynamic> encoded_nodes;
+    from_dynamic(&encoded_nodes, v);
+    size_t const n_nodes = encoded_nodes.size();
+    // Every plan has at least its root node.
+    if (n_nodes == 0)
+    {
+        CRADLE_THROW(
+            invalid_coercion_plan() << coercion_plan_node_index_info(0));
+    }
+    auto nodes = std::make_shared<detail::coercion_plan_nodes>();
+    for (auto const& encoded_node : encoded_nodes)
+    {
+        auto const& map = cast<dynamic_map>(encoded_node);
+        coercion_plan_node node;
+        node.tag = api_type_info_tag(cast<integer>(get_field(map, "tag")));
+        node.element = from_dynamic_index(get_field(map, "element"), n_nodes);
+        node.key = from_dynamic_index(get_field(map, "key"), n_nodes);
+        from_dynamic(&node.values, get_field(map, "values"));
+        std::vector<dynamic> encoded_fields;
+        from_dynamic(&encoded_fields, get_field(map, "fields"));
+        for (auto const& encoded_field : encoded_fields)
+        {
+            auto const& field_map = cast<dynamic_map>(encoded_field);
+            string name = cast<string>(get_field(field_map, "name"));
+            dynamic key = make_map_key(name);
+            node.fields.push_back(coercion_plan_field{
+                std::move(name),
+                std::move(key),
+                from_dynamic_index(get_field(field_map, "node"), n_nodes),
+                from_dynamic_index(
+                    get_field(field_map, "column_node"), n_nodes),
+                cast<bool>(get_field(field_map, "required"))});
+        }
+        nodes->nodes.push_back(std::move(node));
+    }
+    plan->nodes = std::move(nodes);
+}
+
+// APPLICATION
+
+namespace {
+
+typedef std::vector<coercion_plan_node> coercion_plan_node_list;
+
+bool
+is_packed_array(dynamic const& v)
+{
+    return visit_packed_array(v, [](auto const&) {});
+}
+
+// Errors within the column of a table have paths that start with the row
+// index, but in the equivalent array of records, the field name comes next.
+void
+add_column_path_element(boost::exception& e, dynamic const& field_name)
+{
+    std::list<dynamic>* path = get_error_info<dynamic_value_path_info>(e);
+    if (path && !path->empty())
+        path->insert(std::next(path->begin()), field_name);
+    else
+        add_dynamic_path_element(e, field_name);
+}
+
+// Throw the error for a table that's missing a field. (Every row is missing
+// it, so this reports the first.)
+[[noreturn]] void
+throw_missing_table_field(string const& field_name)
+{
+    CRADLE_THROW(
+        missing_field() << field_name_info(field_name)
+                        << dynamic_value_path_info(
+                               std::list<dynamic>({integer(0)})));
+}
+
+// This is thrown when a value reaches a named type that hasn't been resolved
+// yet. (See coerce_lazily_if_required().)
+struct unresolved_named_type
+{
+    // the index of the named type's node
+    size_t node;
+};
+
+// Throw unresolved_named_type if :node (within :nodes) is unresolved.
+void
+check_resolved(
+    coercion_plan_node_list const& nodes, coercion_plan_node const& node)
+{
+    if (node.unresolved)
+        throw unresolved_named_type{size_t(&node - nodes.data())};
+}
+
+// Follow :node through any aliases to the node that actually describes its
+// values.
+coercion_plan_node const&
+resolve_aliases(
+    coercion_plan_node_list const& nodes, coercion_plan_node const& node)
+{
+    coercion_plan_node const* resolved = &node;
+    while (resolved->tag == api_type_info_tag::NAMED_TYPE)
+    {
+        check_resolved(nodes, *resolved);
+        resolved = &nodes[resolved->element];
+    }
+    return *resolved;
+}
+
+// Find the member of a union called :name (or nullptr if there's none).
+coercion_plan_field const*
+find_union_member(coercion_plan_node const& node, std::string_view name)
+{
+    auto i = std::lower_bound(
+        node.fields.begin(),
+        node.fields.end(),
+        name,
+        [](coercion_plan_field const& member, std::string_view name) {
+            return member.name < name;
+        });
+    return i != node.fields.end() && i->name == name ? &*i : nullptr;
+}
+
+optional<dynamic>
+coerce_if_required(
+    coercion_plan_node_list const& nodes,
+    coercion_plan_node const& node,
+    dynamic const& value);
+
+// Coerce :value (which is part of a larger value) if it requires coercion,
+// adding :path_element to the path of any errors.
+template<class PathElement>
+optional<dynamic>
+coerce_part_if_required(
+    coercion_plan_node_list const& nodes,
+    coercion_plan_node const& node,
+    dynamic const& value,
+    PathElement const& path_element)
+{
+    try
+    {
+        return coerce_if_required(nodes, node, value);
+    }
+    catch (boost::exception& e)
+    {
+        add_dynamic_path_element(e, path_element);
+        throw;
+    }
+}
+
+// If :value is a packed array of numbers that just need to be converted to
+// arrays of :element_tag, convert it (without unpacking it) and return
+// true. Otherwise, return false.
+bool
+coerce_packed_array(api_type_info_tag element_tag, dynamic& value)
+{
+    switch (element_tag)
+    {
+        case api_type_info_tag::FLOAT_TYPE:
+            if (auto const* integers = get_packed_array<integer>(value))
+            {
+                std::vector<double> doubles(integers->size());
+                std::transform(
+                    integers->values.begin(),
+                    integers->values.end(),
+                    doubles.begin(),
+                    [](integer i) { return double(i); });
+                value = packed_array<double>(std::move(doubles));
+                return true;
+            }
+            break;
+        case api_type_info_tag::INTEGER_TYPE:
+            if (auto const* doubles = get_packed_array<double>(value))
+            {
+                std::vector<integer> integers(doubles->size());
+                for (size_t i = 0; i != integers.size(); ++i)
+                {
+                    double d = doubles->values[i];
+                    integer n = boost::numeric_cast<integer>(d);
+                    // Check that coercion doesn't change the value.
+                    if (boost::numeric_cast<double>(n) != d)
+                    {
+                        CRADLE_THROW(
+                            type_mismatch()
+                            << expected_value_type_info(value_type::INTEGER)
+                            << actual_value_type_info(value_type::FLOAT)
+                            << dynamic_value_path_info(
+                                   std::list<dynamic>({integer(i)})));
+                    }
+                    integers[i] = n;
+                }
+                value = packed_array<integer>(std::move(integers));
+                return true;
+            }
+            break;
+        default:
+            break;
+    }
+    return false;
+}
+
+// Coerce the records in :table to :structure, column by column. (Only the
+// columns that require it are replaced, so the others stay shared.)
+optional<dynamic>
+coerce_table_if_required(
+    coercion_plan_node_list const& nodes,
+    coercion_plan_node const& structure,
+    record_table const& table)
+{
+    optional<record_table> coerced;
+    for (auto const& field : structure.fields)
+    {
+        auto const* column = table.find_column(field.name);
+        if (!column)
+        {
+            if (field.required)
+                throw_missing_table_field(field.name);
+            continue;
+        }
+        optional<dynamic> coerced_column;
+        try
+        {
+            coerced_column = coerce_if_required(
+                nodes, nodes[field.column_node], *column);
+        }
+        catch (boost::exception& e)
+        {
+            add_column_path_element(e, field.key);
+            throw;
+        }
+        if (coerced_column)
+        {
+            if (!coerced)
+                coerced = table;
+            *coerced->find_column(field.name) = std::move(*coerced_column);
+        }
+    }
+    if (!coerced)
+        return none;
+    return dynamic(std::move(*coerced));
+}
+
+// Coerce the elements of the array :value to :element, one by one.
+optional<dynamic>
+coerce_elements_if_required(
+    coercion_plan_node_list const& nodes,
+    coercion_plan_node const& element,
+    dynamic const& value)
+{
+    optional<dynamic> coerced;
+    // the elements of :coerced, once it exists
+    dynamic_array* items = nullptr;
+    size_t const size = get_array_size(value);
+    for (size_t i = 0; i != size; ++i)
+    {
+        optional<dynamic> coerced_item;
+        visit_array_element(value, i, [&](dynamic const& item) {
+            coerced_item
+                = coerce_part_if_required(nodes, element, item, integer(i));
+        });
+        if (coerced_item)
+        {
+            if (!coerced)
+            {
+                coerced = value;
+                items = &cast<dynamic_array>(*coerced);
+            }
+            (*items)[i] = std::move(*coerced_item);
+        }
+    }
+    return coerced;
+}
+
+// Coerce the map :value to :node (a MAP_TYPE node).
+optional<dynamic>
+coerce_map_if_required(
+    coercion_plan_node_list const& nodes,
+    coercion_plan_node const& node,
+    dynamic const& value)
+{
+    // This is a little hack to support the fact that JSON maps are encoded as
+    // arrays and they don't get recognized as maps when they're empty.
+    if (value.type() == value_type::ARRAY && get_array_size(value) == 0)
+        return dynamic(dynamic_map());
+
+    auto const& map = cast<dynamic_map>(value);
+    auto const& key_node = nodes[node.key];
+    auto const& value_node = nodes[node.element];
+    // Once any entry requires coercion, this holds the coerced key and value
+    // (if any) for each entry.
+    std::vector<std::pair<optional<dynamic>, optional<dynamic>>> coerced;
+    bool keys_coerced = false;
+    size_t index = 0;
+    for (auto const& [k, v] : map)
+    {
+        try
+        {
+            auto coerced_key = coerce_if_required(nodes, key_node, k);
+            auto coerced_value = coerce_if_required(nodes, value_node, v);
+            if ((coerced_key || coerced_value) && coerced.empty())
+                coerced.resize(map.size());
+            if (coerced_key)
+                keys_coerced = true;
+            if (!coerced.empty())
+            {
+                coerced[index] = std::make_pair(
+                    std::move(coerced_key), std::move(coerced_value));
+            }
+        }
+        catch (boost::exception& e)
+        {
+            add_dynamic_path_element(e, k);
+            throw;
+        }
+        ++index;
+    }
+    if (coerced.empty())
+        return none;
+
+    // Since we can't mutate the keys in the map, if any of them were
+    // coerced, just create a new map.
+    if (keys_coerced)
+    {
+        dynamic_map result;
+        index = 0;
+        for (auto const& [k, v] : map)
+        {
+            auto& [coerced_key, coerced_value] = coerced[index];
+            result[coerced_key ? std::move(*coerced_key) : k]
+                = coerced_value ? std::move(*coerced_value) : v;
+            ++index;
+        }
+        return dynamic(std::move(result));
+    }
+    // Otherwise, replace the values within a copy of the original map.
+    dynamic result = value;
+    index = 0;
+    for (auto& entry : cast<dynamic_map>(result))
+    {
+        if (auto& coerced_value = coerced[index].second)
+            entry.second = std::move(*coerced_value);
+        ++index;
+    }
+    return result;
+}
+
+// If :value requires coercion according to :node, return its coerced form.
+// Otherwise, return none. Either way, this throws if :value can't be coerced.
+// :value itself isn't modified, and only the parts of it that require
+// coercion are copied, so the rest stay shared with the result. Each part of
+// :value is visited once.
+optional<dynamic>
+coerce_if_required(
+    coercion_plan_node_list const& nodes,
+    coercion_plan_node const& node,
+    dynamic const& value)
+{
+    switch (node.tag)
+    {
+        case api_type_info_tag::ARRAY_TYPE: {
+            auto const& element = nodes[node.element];
+            // Tables of records are coerced column by column. (Tables of
+            // anything else are handled element by element.)
+            if (auto const* table = get_record_table(value))
+            {
+                auto const& row = resolve_aliases(nodes, element);
+                if (row.tag == api_type_info_tag::STRUCTURE_TYPE)
+                    return coerce_table_if_required(nodes, row, *table);
+                return coerce_elements_if_required(nodes, element, value);
+            }
+            // The elements of a packed array all have the same type, and
+            // whether or not a number requires coercion only depends on its
+            // type, so checking the first element is enough.
+            if (is_packed_array(value))
+            {
+                if (get_array_size(value) == 0
+                    || !coerce_part_if_required(
+                        nodes,
+                        element,
+                        get_array_element(value, 0),
+                        integer(0)))
+                {
+                    return none;
+                }
+                dynamic coerced = value;
+                if (coerce_packed_array(
+                        resolve_aliases(nodes, element).tag, coerced))
+                {
+                    return coerced;
+                }
+            }
+            return coerce_elements_if_required(nodes, element, value);
+        }
+        case api_type_info_tag::BLOB_TYPE:
+            check_type(value_type::BLOB, value.type());
+            return none;
+        case api_type_info_tag::BOOLEAN_TYPE:
+            check_type(value_type::BOOLEAN, value.type());
+            return none;
+        case api_type_info_tag::DATETIME_TYPE:
+            // Be forgiving of clients that leave their datetimes as strings.
+            if (value.type() == value_type::STRING)
+            {
+                try
+                {
+                    return dynamic(parse_ptime(cast<string>(value)));
+                }
+                catch (...)
+                {
+                }
+            }
+            check_type(value_type::DATETIME, value.type());
+            return none;
+        case api_type_info_tag::DYNAMIC_TYPE:
+            return none;
+        case api_type_info_tag::ENUM_TYPE:
+            check_type(value_type::STRING, value.type());
+            if (!std::binary_search(
+                    node.values.begin(),
+                    node.values.end(),
+                    cast<string>(value)))
+            {
+                CRADLE_THROW(
+                    invalid_enum_string()
+                    << enum_string_info(cast<string>(value)));
+            }
+            return none;
+        case api_type_info_tag::FLOAT_TYPE:
+            if (value.type() == value_type::INTEGER)
+            {
+                return dynamic(
+                    boost::numeric_cast<double>(cast<integer>(value)));
+            }
+            check_type(value_type::FLOAT, value.type());
+            return none;
+        case api_type_info_tag::INTEGER_TYPE:
+            if (value.type() == value_type::FLOAT)
+            {
+                double d = cast<double>(value);
+                integer i = boost::numeric_cast<integer>(d);
+                // Check that coercion doesn't change the value.
+                if (boost::numeric_cast<double>(i) == d)
+                    return dynamic(i);
+            }
+            check_type(value_type::INTEGER, value.type());
+            return none;
+        case api_type_info_tag::MAP_TYPE:
+            return coerce_map_if_required(nodes, node, value);
+        case api_type_info_tag::NAMED_TYPE:
+            check_resolved(nodes, node);
+            return coerce_if_required(nodes, nodes[node.element], value);
+        case api_type_info_tag::NIL_TYPE:
+        default:
+            check_type(value_type::NIL, value.type());
+            return none;
+        case api_type_info_tag::OPTIONAL_TYPE: {
+            auto const& map = cast<dynamic_map>(value);
+            auto const& tag = cast<string>(get_union_tag(map));
+            if (tag == "some")
+            {
+                auto coerced_some = coerce_part_if_required(
+                    nodes,
+                    nodes[node.element],
+                    get_field(map, "some"),
+                    "some");
+                if (!coerced_some)
+                    return none;
+                dynamic coerced = value;
+                get_field(cast<dynamic_map>(coerced), "some")
+                    = std::move(*coerced_some);
+                return coerced;
+            }
+            else if (tag == "none")
+            {
+                check_type(value_type::NIL, get_field(map, "none").type());
+                return none;
+            }
+            else
+            {
+                CRADLE_THROW(
+                    invalid_optional_type() << optional_type_tag_info(tag));
+            }
+        }
+        case api_type_info_tag::REFERENCE_TYPE:
+        case api_type_info_tag::STRING_TYPE:
+            check_type(value_type::STRING, value.type());
+            return none;
+        case api_type_info_tag::STRUCTURE_TYPE: {
+            auto const& map = cast<dynamic_map>(value);
+            optional<dynamic> coerced;
+            // the fields of :coerced, once it exists
+            dynamic_map* coerced_map = nullptr;
+            for (auto const& field : node.fields)
+            {
+                auto i = map.find(field.key);
+                if (i != map.end())
+                {
+                    auto coerced_field = coerce_part_if_required(
+                        nodes, nodes[field.node], i->second, field.key);
+                    if (coerced_field)
+                    {
+                        if (!coerced)
+                        {
+                            coerced = value;
+                            coerced_map = &cast<dynamic_map>(*coerced);
+                        }
+                        // The copy has the same entries in the same order.
+                        (coerced_map->begin() + (i - map.begin()))->second
+                            = std::move(*coerced_field);
+                    }
+                }
+                else if (field.required)
+                {
+                    CRADLE_THROW(
+                        missing_field() << field_name_info(field.name));
+                }
+            }
+            return coerced;
+        }
+        case api_type_info_tag::UNION_TYPE: {
+            auto const& map = cast<dynamic_map>(value);
+            auto const& tag = cast<string>(get_union_tag(map));
+            auto const* member = find_union_member(node, tag);
+            if (!member)
+            {
+                CRADLE_THROW(
+                    invalid_enum_string() <<
+                    // This should technically include enum_id_info.
+                    enum_string_info(tag));
+            }
+            auto coerced_member = coerce_part_if_required(
+                nodes, nodes[member->node], map.begin()->second, member->key);
+            if (!coerced_member)
+                return none;
+            dynamic coerced = value;
+            cast<dynamic_map>(coerced).begin()->second
+                = std::move(*coerced_member);
+            return coerced;
+        }
+    }
+}
+
+} // namespace
+
+dynamic
+apply_coercion_plan(coercion_plan const& plan, dynamic value)
+{
+    auto const& nodes = plan.nodes->nodes;
+    // Most values are already the right type, and checking that doesn't
+    // require modifying (and thus unsharing) any part of :value.
+    auto coerced = coerce_if_required(nodes, nodes.front(), value);
+    return coerced ? std::move(*coerced) : std::move(value);
+}
+
+bool
+value_requires_coercion(coercion_plan const& plan, dynamic const& value)
+{
+    auto const& nodes = plan.nodes->nodes;
+    return bool(coerce_if_required(nodes, nodes.front(), value));
+}
+
+// LAZY COERCION
+
+namespace {
+
+// Coerce :value to :type if it requires coercion, via a plan that's compiled
+// lazily: Named types are only looked up once :value actually reaches them.
+// Whenever it reaches one that hasn't been looked up yet, the type is looked
+// up and the plan is applied again from the start. (This means that the
+// lookups happen in the order that :value reaches them, and errors are the
+// same as they'd be with a fully compiled plan.)
+cppcoro::task<optional<dynamic>>
+coerce_lazily_if_required(
+    std::function<cppcoro::task<api_type_info>(
+        api_named_type_reference const& ref)> const& look_up_named_type,
+    api_type_info const& type,
+    dynamic const& value)
+{
+    coercion_plan_compiler compiler{look_up_named_type, {}, {}, true};
+    co_await compile_root(compiler, type);
+    while (true)
+    {
+        size_t unresolved = 0;
+        try
+        {
+            co_return coerce_if_required(
+                compiler.nodes, compiler.nodes.front(), value);
+        }
+        catch (unresolved_named_type const& e)
+        {
+            unresolved = e.node;
+        }
+        co_await resolve_named_node(compiler, unresolved);
+    }
+}
+
+} // namespace
+
+cppcoro::task<dynamic>
+coerce_value(
+    std::function<cppcoro::task<api_type_info>(
+        api_named_type_reference const& ref)> const& look_up_named_type,
+    api_type_info type,
+    dynamic value)
+{
+    auto coerced
+        = co_await coerce_lazily_if_required(look_up_named_type, type, value);
+    co_return coerced ? std::move(*coerced) : std::move(value);
+}
+
+namespace detail {
+
+cppcoro::task<bool>
+value_requires_coercion(
+    std::function<cppcoro::task<api_type_info>(
+        api_named_type_reference const& ref)> const& look_up_named_type,
+    api_type_info const& type,
+    dynamic const& value)
+{
+    co_return bool(co_await coerce_lazily_if_required(
+        look_up_named_type, type, value));
+}
+
+} // namespace detail
+
+} // namespace cradle
@@ -0,0 +1,74 @@
+#ifndef CRADLE_CORE_COERCION_H
+#define CRADLE_CORE_COERCION_H
+
+#include <functional>
+#include <memory>
+
+#include <cppcoro/task.hpp>
+
+#include <cradle/core/dynamic.h>
+
+// COERCION PLANS - A coercion_plan is the compiled form of a type's
+// api_type_info: Its named types are resolved once, when it's compiled, so
+// applying it to a value is a plain (synchronous) traversal of the value.
+// Compiling resolves every named type that the type can reach, so plans are
+// meant to be compiled once per type and applied to many values.
+// coerce_value() (see dynamic.h) applies the same rules, but it compiles its
+// plan lazily, only looking up the named types that the value reaches, so
+// it's cheaper for one-off coercions.
+
+namespace cradle {
+
+namespace detail {
+
+struct coercion_plan_nodes;
+
+}
+
+// A coercion_plan is immutable, and copies of it share their compiled form.
+struct coercion_plan
+{
+    std::shared_ptr<detail::coercion_plan_nodes const> nodes;
+};
+
+size_t
+deep_sizeof(coercion_plan const& plan);
+
+// Coercion plans can be converted to and from dynamic values (e.g., so that
+// they can be stored in the disk cache). Converting back checks that the node
+// indices are in range and throws invalid_coercion_plan if they aren't.
+CRADLE_DEFINE_EXCEPTION(invalid_coercion_plan)
+CRADLE_DEFINE_ERROR_INFO(integer, coercion_plan_node_index)
+
+void
+to_dynamic(dynamic* v, coercion_plan const& plan);
+
+void
+from_dynamic(coercion_plan* plan, dynamic const& v);
+
+// Compile a coercion plan for values of type :type. This resolves all the
+// named types that :type refers to (directly or indirectly) via
+// :look_up_named_type, each of them once. (They can be recursive.)
+cppcoro::task<coercion_plan>
+compile_coercion_plan(
+    std::function<cppcoro::task<api_type_info>(
+        api_named_type_reference const& ref)> const& look_up_named_type,
+    api_type_info const& type);
+
+// Coerce :value according to :plan. The result (or error) is the same as
+// coerce_value() gives for the type that :plan was compiled from. Only the
+// parts of :value that actually require coercion are modified, so if it
+// already conforms to the type, it's returned as it is (still sharing its
+// storage with the original).
+dynamic
+apply_coercion_plan(coercion_plan const& plan, dynamic value);
+
+// Does :value require coercion under :plan? (This throws if :value can't be
+// coerced. It checks all of :value, so it costs about as much as
+// apply_coercion_plan().)
+bool
+value_requires_coercion(coercion_plan const& plan, dynamic const& value);
+
+} // namespace cradle
+
+#endif
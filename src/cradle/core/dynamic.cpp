@@ -1,6 +1,12 @@
 #include <cradle/core/dynamic.h>
 
 #include <algorithm>
+#include <cstring>
+#include <deque>
+#include <shared_mutex>
+#include <stdexcept>
+#include <type_traits>
+#include <unordered_map>
 
 #include <cradle/core.h>
 #include <cradle/encodings/yaml.h>
@@ -64,18 +70,18 @@ dynamic::dynamic(std::initializer_list<dynamic> list)
     // If this is a list of arrays, all of which are length two and have
     // strings as their first elements, treat it as a map.
     if (std::all_of(list.begin(), list.end(), [](dynamic const& v) {
-            return v.type() == value_type::ARRAY
-                   && cast<dynamic_array>(v).size() == 2
-                   && cast<dynamic_array>(v)[0].type() == value_type::STRING;
+            return v.type() == value_type::ARRAY && get_array_size(v) == 2
+                   && get_array_element(v, 0).type() == value_type::STRING;
         }))
     {
-        dynamic_map map;
-        for (auto v : list)
+        dynamic_map::entry_list entries;
+        entries.reserve(list.size());
+        for (auto const& v : list)
         {
-            auto const& array = cast<dynamic_array>(v);
-            map[array[0]] = array[1];
+            entries.emplace_back(
+                get_array_element(v, 0), get_array_element(v, 1));
         }
-        *this = std::move(map);
+        *this = dynamic_map(std::move(entries));
     }
     else
     {
@@ -107,24 +113,324 @@ operator<<(std::ostream& os, std::list<dynamic> const& v)
 size_t
 deep_sizeof(dynamic const& v)
 {
+    // Symbols are shared by all the strings that refer to them (and live for
+    // the lifetime of the program), so they're not counted.
+    if (get_string_symbol(v))
+        return sizeof(dynamic);
+    if (auto const* table = get_record_table(v))
+        return sizeof(dynamic) + deep_sizeof(*table);
+    size_t packed_size = 0;
+    if (visit_packed_array(
+            v, [&](auto const& array) { packed_size = deep_sizeof(array); }))
+    {
+        return sizeof(dynamic) + packed_size;
+    }
     return sizeof(dynamic) + apply_to_dynamic(CRADLE_LAMBDIFY(deep_sizeof), v);
 }
 
+namespace {
+
+// Hash the dynamic form of a scalar. (Packed arrays use these to hash their
+// elements without creating dynamic values for them.)
+size_t
+hash_scalar(bool x)
+{
+    return combine_hashes(invoke_hash(value_type::BOOLEAN), invoke_hash(x));
+}
+size_t
+hash_scalar(integer x)
+{
+    return combine_hashes(invoke_hash(value_type::INTEGER), invoke_hash(x));
+}
+size_t
+hash_scalar(double x)
+{
+    // 0 and -0 are equal, so they have to hash the same.
+    if (x == 0)
+        x = 0;
+    uint64_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    return combine_hashes(invoke_hash(value_type::FLOAT), hash_integer(bits));
+}
+
+// Hash the element at :index in the array :v.
+size_t
+hash_array_element(dynamic const& v, size_t index)
+{
+    size_t h = 0;
+    if (!visit_packed_array(
+            v, [&](auto const& array) { h = hash_scalar(array[index]); }))
+    {
+        visit_array_element(
+            v, index, [&](dynamic const& x) { h = hash_value(x); });
+    }
+    return h;
+}
+
+// Hash :table the same way as the equivalent array of maps.
+size_t
+hash_table(size_t type_hash, record_table const& table)
+{
+    std::vector<size_t> key_hashes;
+    key_hashes.reserve(table.keys.size());
+    for (auto const& key : table.keys)
+        key_hashes.push_back(hash_value(key));
+    size_t const map_type_hash = invoke_hash(value_type::MAP);
+    size_t h = combine_hashes(type_hash, table.size());
+    for (size_t i = 0; i != table.size(); ++i)
+    {
+        size_t row_hash = combine_hashes(map_type_hash, table.keys.size());
+        for (size_t j = 0; j != table.keys.size(); ++j)
+        {
+            row_hash = combine_hashes(
+                row_hash,
+                key_hashes[j],
+                hash_array_element(table.columns[j], i));
+        }
+        h = combine_hashes(h, row_hash);
+    }
+    return h;
+}
+
+} // namespace
+
 size_t
 hash_value(dynamic const& x)
 {
-    return apply_to_dynamic(CRADLE_LAMBDIFY(invoke_hash), x);
+    // The type is mixed into the hash so that (e.g.) an empty array and an
+    // empty map don't collide, and arrays and maps are hashed element by
+    // element (in order), so permutations of their contents don't either.
+    size_t const type_hash = invoke_hash(x.type());
+    switch (x.type())
+    {
+        case value_type::NIL:
+        default:
+            return type_hash;
+        case value_type::BOOLEAN:
+            return hash_scalar(cast<bool>(x));
+        case value_type::INTEGER:
+            return hash_scalar(cast<integer>(x));
+        case value_type::FLOAT:
+            return hash_scalar(cast<double>(x));
+        case value_type::STRING:
+            if (auto const* symbol = get_string_symbol(x))
+                return combine_hashes(type_hash, symbol->hash);
+            return combine_hashes(type_hash, invoke_hash(cast<string>(x)));
+        case value_type::BLOB:
+            return combine_hashes(type_hash, invoke_hash(cast<blob>(x)));
+        case value_type::DATETIME:
+            return combine_hashes(
+                type_hash, invoke_hash(cast<boost::posix_time::ptime>(x)));
+        case value_type::ARRAY: {
+            if (auto const* table = get_record_table(x))
+                return hash_table(type_hash, *table);
+            size_t h = combine_hashes(type_hash, get_array_size(x));
+            if (!visit_packed_array(x, [&](auto const& array) {
+                    for (size_t i = 0; i != array.size(); ++i)
+                        h = combine_hashes(h, hash_scalar(array[i]));
+                }))
+            {
+                for (auto const& item : *get_dynamic_array(x))
+                    h = combine_hashes(h, hash_value(item));
+            }
+            return h;
+        }
+        case value_type::MAP: {
+            auto const& map = cast<dynamic_map>(x);
+            size_t h = combine_hashes(type_hash, map.size());
+            for (auto const& [key, value] : map)
+                h = combine_hashes(h, hash_value(key), hash_value(value));
+            return h;
+        }
+    }
 }
 
 // COMPARISON OPERATORS
 
+namespace {
+
+// If :a and :b are both packed arrays of the same type, compare their values
+// with :compare and return the result. Otherwise, return none.
+template<class Compare>
+optional<bool>
+compare_packed_arrays(dynamic const& a, dynamic const& b, Compare&& compare)
+{
+    optional<bool> result;
+    visit_packed_array(a, [&](auto const& x) {
+        typedef typename std::decay_t<decltype(x)>::element_type T;
+        if (auto const* y = get_packed_array<T>(b))
+            result = compare(x.values, y->values);
+    });
+    return result;
+}
+
+// If :a or :b is a packed array (and they're not packed arrays of the same
+// type), compare them element by element with :compare_elements, without
+// unpacking either one, and return the result. Otherwise, return none.
+//
+// :compare_elements(x, y) is called on each pair of elements in turn, and it
+// returns whether or not that pair decides the comparison, along with the
+// result if it does. If none of them do, :result_for_sizes(a_size, b_size)
+// decides it.
+//
+template<class CompareElements, class ResultForSizes>
+optional<bool>
+compare_mixed_packed_arrays(
+    dynamic const& a,
+    dynamic const& b,
+    CompareElements&& compare_elements,
+    ResultForSizes&& result_for_sizes)
+{
+    auto is_packed = [](dynamic const& v) {
+        return visit_packed_array(v, [](auto const&) {});
+    };
+    if (!is_packed(a) && !is_packed(b))
+        return none;
+    size_t const a_size = get_array_size(a);
+    size_t const b_size = get_array_size(b);
+    for (size_t i = 0; i != a_size && i != b_size; ++i)
+    {
+        optional<bool> result;
+        visit_array_element(a, i, [&](dynamic const& x) {
+            visit_array_element(b, i, [&](dynamic const& y) {
+                result = compare_elements(x, y);
+            });
+        });
+        if (result)
+            return result;
+    }
+    return result_for_sizes(a_size, b_size);
+}
+
+// Check if row :i of :table is equal to :v.
+bool
+row_equals(record_table const& table, size_t i, dynamic const& v)
+{
+    if (v.type() != value_type::MAP)
+        return false;
+    auto const& map = cast<dynamic_map>(v);
+    if (map.size() != table.keys.size())
+        return false;
+    size_t j = 0;
+    for (auto const& [key, value] : map)
+    {
+        if (key != table.keys[j])
+            return false;
+        bool equal = false;
+        visit_array_element(table.columns[j], i, [&](dynamic const& x) {
+            equal = x == value;
+        });
+        if (!equal)
+            return false;
+        ++j;
+    }
+    return true;
+}
+
+// If either :a or :b is a table (and they're both arrays), check if they're
+// equal (without expanding the tables) and return the result. Otherwise,
+// return none.
+optional<bool>
+compare_tables_for_equality(dynamic const& a, dynamic const& b)
+{
+    auto const* x = get_record_table(a);
+    auto const* y = get_record_table(b);
+    if (x && y)
+    {
+        return x == y
+               || (x->size() == y->size() && x->keys == y->keys
+                   && x->columns == y->columns);
+    }
+    if (!x && !y)
+        return none;
+    auto const& table = x ? *x : *y;
+    auto const& other = x ? b : a;
+    if (get_array_size(other) != table.size())
+        return false;
+    // Packed arrays can't hold records.
+    if (visit_packed_array(other, [](auto const&) {}))
+        return table.size() == 0;
+    auto const& array = *get_dynamic_array(other);
+    for (size_t i = 0; i != table.size(); ++i)
+    {
+        if (!row_equals(table, i, array[i]))
+            return false;
+    }
+    return true;
+}
+
+// If either :a or :b is a table (and they're both arrays), check if :a is
+// less than :b (without expanding the tables) and return the result.
+// Otherwise, return none.
+optional<bool>
+compare_tables_for_ordering(dynamic const& a, dynamic const& b)
+{
+    if (!get_record_table(a) && !get_record_table(b))
+        return none;
+    size_t const a_size = get_array_size(a);
+    size_t const b_size = get_array_size(b);
+    for (size_t i = 0; i != a_size && i != b_size; ++i)
+    {
+        auto const x = get_array_element(a, i);
+        auto const y = get_array_element(b, i);
+        if (x < y)
+            return true;
+        if (y < x)
+            return false;
+    }
+    return a_size < b_size;
+}
+
+} // namespace
+
 bool
 operator==(dynamic const& a, dynamic const& b)
 {
     if (a.type() != b.type())
         return false;
+    // Interned strings are equal iff they refer to the same symbol.
+    if (auto const* x = get_string_symbol(a))
+    {
+        if (auto const* y = get_string_symbol(b))
+            return x == y;
+    }
+    if (auto packed = compare_packed_arrays(
+            a, b, [](auto const& x, auto const& y) {
+                return &x == &y || x == y;
+            }))
+    {
+        return *packed;
+    }
+    if (auto tables = compare_tables_for_equality(a, b))
+        return *tables;
+    if (auto mixed = compare_mixed_packed_arrays(
+            a,
+            b,
+            [](dynamic const& x, dynamic const& y) -> optional<bool> {
+                if (x != y)
+                    return false;
+                return none;
+            },
+            [](size_t a_size, size_t b_size) { return a_size == b_size; }))
+    {
+        return *mixed;
+    }
     return apply_to_dynamic_pair(
-        [](auto const& x, auto const& y) { return x == y; }, a, b);
+        [](auto const& x, auto const& y) {
+            // Copies of arrays, maps and large strings share storage, so
+            // check for that before comparing them element by element.
+            typedef std::decay_t<decltype(x)> T;
+            if constexpr (
+                std::is_same_v<T, dynamic_array>
+                || std::is_same_v<T, dynamic_map> || std::is_same_v<T, string>)
+            {
+                if (&x == &y)
+                    return true;
+            }
+            return x == y;
+        },
+        a,
+        b);
 }
 bool
 operator!=(dynamic const& a, dynamic const& b)
@@ -137,6 +443,31 @@ operator<(dynamic const& a, dynamic const& b)
 {
     if (a.type() != b.type())
         return a.type() < b.type();
+    // Interned strings are still ordered by their contents (since that's the
+    // order that map keys have to be in), but identical ones can be skipped.
+    if (auto const* x = get_string_symbol(a); x && x == get_string_symbol(b))
+        return false;
+    if (auto packed = compare_packed_arrays(
+            a, b, [](auto const& x, auto const& y) { return x < y; }))
+    {
+        return *packed;
+    }
+    if (auto tables = compare_tables_for_ordering(a, b))
+        return *tables;
+    if (auto mixed = compare_mixed_packed_arrays(
+            a,
+            b,
+            [](dynamic const& x, dynamic const& y) -> optional<bool> {
+                if (x < y)
+                    return true;
+                if (y < x)
+                    return false;
+                return none;
+            },
+            [](size_t a_size, size_t b_size) { return a_size < b_size; }))
+    {
+        return *mixed;
+    }
     return apply_to_dynamic_pair(
         [](auto const& x, auto const& y) { return x < y; }, a, b);
 }
@@ -156,40 +487,703 @@ operator>=(dynamic const& a, dynamic const& b)
     return !(a < b);
 }
 
+// INTERNED STRINGS
+
+namespace {
+
+// make_map_key() doesn't intern keys longer than this. (They're unlikely to
+// be field names.)
+size_t const max_interned_key_size = 64;
+
+// Once the symbol table holds this many symbols, make_map_key() stops adding
+// to it, so that decoding data with arbitrary keys can't grow it without
+// bound.
+size_t const max_interned_key_count = 0x10000;
+
+struct string_view_hash
+{
+    size_t
+    operator()(std::string_view s) const
+    {
+        return size_t(hash_bytes(s.data(), s.size()));
+    }
+};
+
+struct symbol_table
+{
+    std::shared_mutex mutex;
+    // std::deque never moves its elements, so symbols stay where they are.
+    std::deque<string_symbol> symbols;
+    std::unordered_map<
+        std::string_view,
+        string_symbol const*,
+        string_view_hash>
+        index;
+};
+
+// The table is deliberately leaked so that it outlives any static values
+// that refer to its symbols.
+symbol_table&
+get_symbol_table()
+{
+    static symbol_table* const table = new symbol_table;
+    return *table;
+}
+
+// Look up the symbol for :s. If there isn't one yet, this adds it, unless
+// :limited is true and the table is full (in which case it returns nullptr).
+string_symbol const*
+look_up_symbol(std::string_view s, bool limited)
+{
+    auto& table = get_symbol_table();
+    {
+        std::shared_lock<std::shared_mutex> lock(table.mutex);
+        auto i = table.index.find(s);
+        if (i != table.index.end())
+            return i->second;
+    }
+    std::unique_lock<std::shared_mutex> lock(table.mutex);
+    auto i = table.index.find(s);
+    if (i != table.index.end())
+        return i->second;
+    if (limited && table.symbols.size() >= max_interned_key_count)
+        return nullptr;
+    string text(s);
+    size_t const hash = invoke_hash(text);
+    auto const& symbol
+        = table.symbols.emplace_back(string_symbol{std::move(text), hash});
+    table.index.emplace(std::string_view(symbol.text), &symbol);
+    return &symbol;
+}
+
+} // namespace
+
+string_symbol const&
+intern_string(std::string_view s)
+{
+    return *look_up_symbol(s, false);
+}
+
+dynamic
+make_map_key(std::string_view s)
+{
+    if (s.size() <= max_interned_key_size)
+    {
+        if (auto const* symbol = look_up_symbol(s, true))
+            return *symbol;
+    }
+    return string(s);
+}
+
+// ARRAYS
+
+size_t
+get_array_size(dynamic const& v)
+{
+    size_t size = 0;
+    if (!visit_packed_array(
+            v, [&](auto const& array) { size = array.size(); }))
+    {
+        if (auto const* table = get_record_table(v))
+            size = table->size();
+        else
+        {
+            check_type(value_type::ARRAY, v.type());
+            size = get_dynamic_array(v)->size();
+        }
+    }
+    return size;
+}
+
+dynamic
+get_array_element(dynamic const& v, size_t index)
+{
+    dynamic element;
+    if (!visit_packed_array(v, [&](auto const& array) {
+            if (index >= array.size())
+                throw std::out_of_range("packed_array index out of range");
+            element = array[index];
+        }))
+    {
+        if (auto const* table = get_record_table(v))
+        {
+            if (index >= table->size())
+                throw std::out_of_range("record_table index out of range");
+            element = table->row(index);
+        }
+        else
+        {
+            check_type(value_type::ARRAY, v.type());
+            element = get_dynamic_array(v)->at(index);
+        }
+    }
+    return element;
+}
+
+namespace {
+
+// If :array can be stored as a table, return it as one.
+optional<record_table>
+make_record_table(dynamic_array& array)
+{
+    if (array.size() < 2
+        || !std::all_of(array.begin(), array.end(), [](dynamic const& v) {
+               return v.type() == value_type::MAP;
+           }))
+    {
+        return none;
+    }
+    auto const& first = cast<dynamic_map>(std::as_const(array[0]));
+    if (first.empty())
+        return none;
+    for (auto const& record : array)
+    {
+        auto const& map = cast<dynamic_map>(record);
+        if (map.size() != first.size()
+            || !std::equal(
+                map.begin(),
+                map.end(),
+                first.begin(),
+                [](auto const& a, auto const& b) {
+                    return a.first == b.first;
+                }))
+        {
+            return none;
+        }
+    }
+
+    std::vector<dynamic> keys;
+    keys.reserve(first.size());
+    for (auto const& entry : first)
+        keys.push_back(entry.first);
+    std::vector<dynamic_array> columns(keys.size());
+    for (auto& column : columns)
+        column.reserve(array.size());
+    for (auto& record : array)
+    {
+        size_t j = 0;
+        for (auto& entry : cast<dynamic_map>(record))
+            columns[j++].push_back(std::move(entry.second));
+    }
+    std::vector<dynamic> compacted;
+    compacted.reserve(columns.size());
+    for (auto& column : columns)
+        compacted.push_back(compact_array(std::move(column)));
+    return record_table(std::move(keys), std::move(compacted), array.size());
+}
+
+// If the elements of :array are all Ts, return them as a packed array.
+template<class T>
+optional<dynamic>
+pack_elements(dynamic_array const& array)
+{
+    std::vector<typename packed_array<T>::storage_type> values;
+    values.reserve(array.size());
+    for (auto const& v : array)
+    {
+        if (v.type() != value_type_of<T>::value)
+            return none;
+        values.push_back(cast<T>(v));
+    }
+    return dynamic(packed_array<T>(std::move(values)));
+}
+
+} // namespace
+
+dynamic
+compact_array(dynamic_array array)
+{
+    if (!array.empty())
+    {
+        optional<dynamic> packed;
+        switch (array.front().type())
+        {
+            case value_type::BOOLEAN:
+                packed = pack_elements<bool>(array);
+                break;
+            case value_type::INTEGER:
+                packed = pack_elements<integer>(array);
+                break;
+            case value_type::FLOAT:
+                packed = pack_elements<double>(array);
+                break;
+            case value_type::MAP:
+                if (auto table = make_record_table(array))
+                    packed = dynamic(std::move(*table));
+                break;
+            default:
+                break;
+        }
+        if (packed)
+            return std::move(*packed);
+    }
+    return array;
+}
+
+// TABLES
+
+namespace {
+
+template<class Table>
+auto
+find_table_column(Table& table, std::string_view key)
+    -> decltype(&table.columns[0])
+{
+    // Tables are narrow, so the keys are just scanned.
+    for (size_t i = 0; i != table.keys.size(); ++i)
+    {
+        auto const& k = table.keys[i];
+        if (k.type() == value_type::STRING && cast<string>(k) == key)
+            return &table.columns[i];
+    }
+    return nullptr;
+}
+
+} // namespace
+
+dynamic const*
+record_table::find_column(std::string_view key) const
+{
+    return find_table_column(*this, key);
+}
+
+dynamic*
+record_table::find_column(std::string_view key)
+{
+    return find_table_column(*this, key);
+}
+
+dynamic_map
+record_table::row(size_t i) const
+{
+    dynamic_map::entry_list entries;
+    entries.reserve(keys.size());
+    for (size_t j = 0; j != keys.size(); ++j)
+    {
+        visit_array_element(columns[j], i, [&](dynamic const& value) {
+            entries.emplace_back(keys[j], value);
+        });
+    }
+    // The keys are already in order, so this doesn't need to sort them.
+    return dynamic_map(std::move(entries));
+}
+
+dynamic_array
+record_table::unpack() const
+{
+    dynamic_array array;
+    array.reserve(row_count);
+    for (size_t i = 0; i != row_count; ++i)
+        array.emplace_back(row(i));
+    return array;
+}
+
+size_t
+deep_sizeof(record_table const& x)
+{
+    size_t size = sizeof(record_table);
+    for (auto const& key : x.keys)
+        size += deep_sizeof(key);
+    for (auto const& column : x.columns)
+        size += deep_sizeof(column);
+    return size;
+}
+
+// ARENAS
+
+namespace {
+
+// the resource that dynamic storage is allocated from on this thread (or
+// nullptr if it's the heap)
+thread_local std::pmr::memory_resource* current_dynamic_memory_resource
+    = nullptr;
+
+} // namespace
+
+std::pmr::memory_resource*
+get_dynamic_memory_resource()
+{
+    auto* resource = current_dynamic_memory_resource;
+    return resource ? resource : std::pmr::new_delete_resource();
+}
+
+bool
+dynamic_memory_is_scoped()
+{
+    auto* resource = current_dynamic_memory_resource;
+    return resource && resource != std::pmr::new_delete_resource();
+}
+
+dynamic_memory_scope::dynamic_memory_scope(
+    std::pmr::memory_resource* resource)
+    : previous_(current_dynamic_memory_resource)
+{
+    current_dynamic_memory_resource = resource;
+}
+
+dynamic_memory_scope::~dynamic_memory_scope()
+{
+    current_dynamic_memory_resource = previous_;
+}
+
+namespace {
+
+// Copy :v into newly allocated storage. Nothing that has its own node is
+// shared with :v (except blob data, which isn't part of the node).
+dynamic
+deep_copy(dynamic const& v)
+{
+    if (get_string_symbol(v))
+        return v;
+    if (auto const* table = get_record_table(v))
+    {
+        std::vector<dynamic> keys, columns;
+        keys.reserve(table->keys.size());
+        for (auto const& key : table->keys)
+            keys.push_back(deep_copy(key));
+        columns.reserve(table->columns.size());
+        for (auto const& column : table->columns)
+            columns.push_back(deep_copy(column));
+        return record_table(
+            std::move(keys), std::move(columns), table->size());
+    }
+    dynamic copy;
+    if (visit_packed_array(
+            v, [&](auto const& array) { copy = dynamic(array); }))
+    {
+        return copy;
+    }
+    switch (v.type())
+    {
+        case value_type::STRING:
+            return dynamic(cast<string>(v));
+        case value_type::BLOB:
+            return dynamic(cast<blob>(v));
+        case value_type::ARRAY: {
+            auto const& array = *get_dynamic_array(v);
+            dynamic_array copied;
+            copied.reserve(array.size());
+            for (auto const& item : array)
+                copied.push_back(deep_copy(item));
+            return dynamic(std::move(copied));
+        }
+        case value_type::MAP: {
+            auto const& map = cast<dynamic_map>(v);
+            dynamic_map::entry_list entries;
+            entries.reserve(map.size());
+            for (auto const& [key, value] : map)
+                entries.emplace_back(deep_copy(key), deep_copy(value));
+            return dynamic_map(std::move(entries));
+        }
+        default:
+            return v;
+    }
+}
+
+} // namespace
+
+dynamic
+copy_to_heap(dynamic const& v)
+{
+    dynamic_memory_scope heap(std::pmr::new_delete_resource());
+    return deep_copy(v);
+}
+
+// MAPS
+
+namespace {
+
+bool
+entry_key_less_than(dynamic_map::value_type const& entry, dynamic const& key)
+{
+    return entry.first < key;
+}
+
+bool
+entry_keys_less_than(
+    dynamic_map::value_type const& a, dynamic_map::value_type const& b)
+{
+    return a.first < b.first;
+}
+
+// Compare :key to the string :s, consistently with how dynamic values are
+// ordered (i.e., first by type and then by value).
+int
+compare_key_to_string(dynamic const& key, std::string_view s)
+{
+    if (key.type() != value_type::STRING)
+        return key.type() < value_type::STRING ? -1 : 1;
+    return std::string_view(cast<string>(key)).compare(s);
+}
+
+// Find the first entry in :entries whose key isn't less than :key.
+template<class Entries>
+auto
+lower_bound_entry(Entries& entries, dynamic const& key)
+{
+    // Maps are usually built in key order, so check the end first.
+    if (entries.empty() || entries.back().first < key)
+        return entries.end();
+    return std::lower_bound(
+        entries.begin(), entries.end(), key, entry_key_less_than);
+}
+
+// Maps up to this size are searched linearly for interned keys.
+size_t const max_scanned_map_size = 16;
+
+template<class Entries>
+auto
+find_entry(Entries& entries, dynamic const& key)
+{
+    // Records are small and their keys are usually interned, so when :key is
+    // interned, it's faster to scan the entries for its symbol than it is to
+    // binary search them by comparing strings.
+    if (auto const* symbol = get_string_symbol(key);
+        symbol && entries.size() <= max_scanned_map_size)
+    {
+        for (auto i = entries.begin(); i != entries.end(); ++i)
+        {
+            if (get_string_symbol(i->first) == symbol)
+                return i;
+        }
+        // The key might still be there as a regular string, so fall back to
+        // the search below.
+    }
+    auto i = lower_bound_entry(entries, key);
+    if (i != entries.end() && key < i->first)
+        return entries.end();
+    return i;
+}
+
+template<class Entries>
+auto
+find_string_entry(Entries& entries, std::string_view key)
+{
+    auto i = std::lower_bound(
+        entries.begin(),
+        entries.end(),
+        key,
+        [](dynamic_map::value_type const& entry, std::string_view key) {
+            return compare_key_to_string(entry.first, key) < 0;
+        });
+    if (i != entries.end() && compare_key_to_string(i->first, key) != 0)
+        return entries.end();
+    return i;
+}
+
+template<class Key>
+dynamic&
+get_or_insert_entry(dynamic_map::entry_list& entries, Key&& key)
+{
+    auto i = lower_bound_entry(entries, key);
+    if (i == entries.end() || key < i->first)
+        i = entries.emplace(i, std::forward<Key>(key), dynamic());
+    return i->second;
+}
+
+} // namespace
+
+dynamic_map::dynamic_map(std::initializer_list<value_type> entries)
+    : dynamic_map(entry_list(entries))
+{
+}
+
+dynamic_map::dynamic_map(std::vector<value_type> entries)
+    : dynamic_map(entry_list(
+        std::make_move_iterator(entries.begin()),
+        std::make_move_iterator(entries.end())))
+{
+}
+
+dynamic_map::dynamic_map(entry_list entries) : entries_(std::move(entries))
+{
+    if (!std::is_sorted(
+            entries_.begin(), entries_.end(), entry_keys_less_than))
+    {
+        std::stable_sort(
+            entries_.begin(), entries_.end(), entry_keys_less_than);
+    }
+    // Remove duplicate keys, keeping the last entry for each.
+    auto output = entries_.begin();
+    for (auto i = entries_.begin(); i != entries_.end(); ++i)
+    {
+        auto next = std::next(i);
+        if (next != entries_.end() && !(i->first < next->first))
+            continue;
+        if (output != i)
+            *output = std::move(*i);
+        ++output;
+    }
+    entries_.erase(output, entries_.end());
+}
+
+dynamic&
+dynamic_map::operator[](dynamic const& key)
+{
+    return get_or_insert_entry(entries_, key);
+}
+
+dynamic&
+dynamic_map::operator[](dynamic&& key)
+{
+    return get_or_insert_entry(entries_, std::move(key));
+}
+
+dynamic&
+dynamic_map::at(dynamic const& key)
+{
+    auto i = find(key);
+    if (i == end())
+        throw std::out_of_range("dynamic_map::at");
+    return i->second;
+}
+
+dynamic const&
+dynamic_map::at(dynamic const& key) const
+{
+    auto i = find(key);
+    if (i == end())
+        throw std::out_of_range("dynamic_map::at");
+    return i->second;
+}
+
+dynamic_map::iterator
+dynamic_map::find(dynamic const& key)
+{
+    return find_entry(entries_, key);
+}
+
+dynamic_map::const_iterator
+dynamic_map::find(dynamic const& key) const
+{
+    return find_entry(entries_, key);
+}
+
+dynamic_map::iterator
+dynamic_map::find_string(std::string_view key)
+{
+    return find_string_entry(entries_, key);
+}
+
+dynamic_map::const_iterator
+dynamic_map::find_string(std::string_view key) const
+{
+    return find_string_entry(entries_, key);
+}
+
+dynamic_map::size_type
+dynamic_map::count(dynamic const& key) const
+{
+    return find(key) != end() ? 1 : 0;
+}
+
+std::pair<dynamic_map::iterator, bool>
+dynamic_map::insert(value_type entry)
+{
+    auto i = lower_bound_entry(entries_, entry.first);
+    if (i != entries_.end() && !(entry.first < i->first))
+        return std::make_pair(i, false);
+    return std::make_pair(entries_.insert(i, std::move(entry)), true);
+}
+
+dynamic_map::iterator
+dynamic_map::erase(const_iterator position)
+{
+    return entries_.erase(position);
+}
+
+dynamic_map::size_type
+dynamic_map::erase(dynamic const& key)
+{
+    auto i = find(key);
+    if (i == end())
+        return 0;
+    entries_.erase(i);
+    return 1;
+}
+
+bool
+operator==(dynamic_map const& a, dynamic_map const& b)
+{
+    return std::equal(a.begin(), a.end(), b.begin(), b.end());
+}
+bool
+operator!=(dynamic_map const& a, dynamic_map const& b)
+{
+    return !(a == b);
+}
+
+bool
+operator<(dynamic_map const& a, dynamic_map const& b)
+{
+    return std::lexicographical_compare(
+        a.begin(), a.end(), b.begin(), b.end());
+}
+
+size_t
+deep_sizeof(dynamic_map const& x)
+{
+    size_t size = sizeof(dynamic_map);
+    for (auto const& [key, value] : x)
+        size += deep_sizeof(key) + deep_sizeof(value);
+    return size;
+}
+
 dynamic const&
-get_field(dynamic_map const& r, string const& field)
+get_field(dynamic_map const& r, std::string_view field)
 {
     dynamic const* v;
     if (!get_field(&v, r, field))
     {
-        CRADLE_THROW(missing_field() << field_name_info(field));
+        CRADLE_THROW(missing_field() << field_name_info(string(field)));
     }
     return *v;
 }
 
 dynamic&
-get_field(dynamic_map& r, string const& field)
+get_field(dynamic_map& r, std::string_view field)
 {
     dynamic* v;
     if (!get_field(&v, r, field))
     {
-        CRADLE_THROW(missing_field() << field_name_info(field));
+        CRADLE_THROW(missing_field() << field_name_info(string(field)));
     }
     return *v;
 }
 
 bool
-get_field(dynamic const** v, dynamic_map const& r, string const& field)
+get_field(dynamic const** v, dynamic_map const& r, std::string_view field)
 {
-    auto i = r.find(dynamic(field));
+    auto i = r.find(field);
+    if (i == r.end())
+        return false;
+    *v = &i->second;
+    return true;
+}
+
+bool
+get_field(dynamic** v, dynamic_map& r, std::string_view field)
+{
+    auto i = r.find(field);
     if (i == r.end())
         return false;
     *v = &i->second;
     return true;
 }
 
+dynamic const&
+get_field(dynamic_map const& r, string_symbol const& field)
+{
+    dynamic const* v;
+    if (!get_field(&v, r, field))
+    {
+        CRADLE_THROW(missing_field() << field_name_info(field.text));
+    }
+    return *v;
+}
+
 bool
-get_field(dynamic** v, dynamic_map& r, string const& field)
+get_field(dynamic const** v, dynamic_map const& r, string_symbol const& field)
 {
     auto i = r.find(dynamic(field));
     if (i == r.end())
@@ -228,489 +1222,4 @@ add_dynamic_path_element(boost::exception& e, dynamic const& path_element)
     }
 }
 
-namespace detail {
-
-cppcoro::task<bool>
-value_requires_coercion(
-    std::function<cppcoro::task<api_type_info>(
-        api_named_type_reference const& ref)> const& look_up_named_type,
-    api_type_info const& type,
-    dynamic const& value)
-{
-    auto recurse = [&look_up_named_type](
-                       api_type_info const& type,
-                       dynamic const& value) -> cppcoro::task<bool> {
-        return value_requires_coercion(look_up_named_type, type, value);
-    };
-
-    switch (get_tag(type))
-    {
-        case api_type_info_tag::ARRAY_TYPE: {
-            integer index = 0;
-            for (auto const& item : cast<dynamic_array>(value))
-            {
-                auto this_index = index++;
-                try
-                {
-                    if (co_await recurse(
-                            as_array_type(type).element_schema, item))
-                        co_return true;
-                }
-                catch (boost::exception& e)
-                {
-                    cradle::add_dynamic_path_element(e, this_index);
-                    throw;
-                }
-            }
-            co_return false;
-        }
-        case api_type_info_tag::BLOB_TYPE:
-            check_type(value_type::BLOB, value.type());
-            co_return false;
-        case api_type_info_tag::BOOLEAN_TYPE:
-            check_type(value_type::BOOLEAN, value.type());
-            co_return false;
-        case api_type_info_tag::DATETIME_TYPE:
-            // Be forgiving of clients that leave their datetimes as strings.
-            if (value.type() == value_type::STRING)
-            {
-                try
-                {
-                    parse_ptime(cast<string>(value));
-                    co_return true;
-                }
-                catch (...)
-                {
-                }
-            }
-            check_type(value_type::DATETIME, value.type());
-            co_return false;
-        case api_type_info_tag::DYNAMIC_TYPE:
-            co_return false;
-        case api_type_info_tag::ENUM_TYPE:
-            check_type(value_type::STRING, value.type());
-            if (as_enum_type(type).values.find(cast<string>(value))
-                == as_enum_type(type).values.end())
-            {
-                CRADLE_THROW(
-                    cradle::invalid_enum_string()
-                    << cradle::enum_string_info(cast<string>(value)));
-            }
-            co_return false;
-        case api_type_info_tag::FLOAT_TYPE:
-            if (value.type() == value_type::INTEGER)
-                co_return true;
-            check_type(value_type::FLOAT, value.type());
-            co_return false;
-        case api_type_info_tag::INTEGER_TYPE:
-            if (value.type() == value_type::FLOAT)
-            {
-                double d = cast<double>(value);
-                integer i = boost::numeric_cast<integer>(d);
-                // Check that coercion doesn't change the value.
-                if (boost::numeric_cast<double>(i) == d)
-                    co_return true;
-            }
-            check_type(value_type::INTEGER, value.type());
-            co_return false;
-        case api_type_info_tag::MAP_TYPE: {
-            auto const& map_type = as_map_type(type);
-            // This is a little hack to support the fact that JSON maps are
-            // encoded as arrays and they don't get recognized as maps when
-            // they're empty.
-            if (value.type() == value_type::ARRAY
-                && cast<dynamic_array>(value).empty())
-            {
-                co_return true;
-            }
-            for (auto const& key_value : cast<dynamic_map>(value))
-            {
-                try
-                {
-                    if (co_await recurse(map_type.key_schema, key_value.first)
-                        || co_await recurse(
-                            map_type.value_schema, key_value.second))
-                    {
-                        co_return true;
-                    }
-                }
-                catch (boost::exception& e)
-                {
-                    cradle::add_dynamic_path_element(e, key_value.first);
-                    throw;
-                }
-            }
-            co_return false;
-        }
-        case api_type_info_tag::NAMED_TYPE:
-            co_return co_await recurse(
-                co_await look_up_named_type(as_named_type(type)), value);
-        case api_type_info_tag::NIL_TYPE:
-        default:
-            check_type(value_type::NIL, value.type());
-            co_return false;
-        case api_type_info_tag::OPTIONAL_TYPE: {
-            auto const& map = cast<dynamic_map>(value);
-            auto const& tag = cast<string>(cradle::get_union_tag(map));
-            if (tag == "some")
-            {
-                try
-                {
-                    co_return co_await recurse(
-                        as_optional_type(type), get_field(map, "some"));
-                }
-                catch (boost::exception& e)
-                {
-                    cradle::add_dynamic_path_element(e, "some");
-                    throw;
-                }
-            }
-            else if (tag == "none")
-            {
-                check_type(value_type::NIL, get_field(map, "none").type());
-                co_return false;
-            }
-            else
-            {
-                CRADLE_THROW(
-                    invalid_optional_type() << optional_type_tag_info(tag));
-            }
-        }
-        case api_type_info_tag::REFERENCE_TYPE:
-            check_type(value_type::STRING, value.type());
-            co_return false;
-        case api_type_info_tag::STRING_TYPE:
-            check_type(value_type::STRING, value.type());
-            co_return false;
-        case api_type_info_tag::STRUCTURE_TYPE: {
-            auto const& structure_type = as_structure_type(type);
-            auto const& map = cast<dynamic_map>(value);
-            for (auto const& key_value : structure_type.fields)
-            {
-                auto const& field_name = key_value.first;
-                auto const& field_info = key_value.second;
-                dynamic const* field_value;
-                bool field_present
-                    = get_field(&field_value, map, key_value.first);
-                if (field_present)
-                {
-                    try
-                    {
-                        if (co_await recurse(field_info.schema, *field_value))
-                            co_return true;
-                    }
-                    catch (boost::exception& e)
-                    {
-                        cradle::add_dynamic_path_element(e, field_name);
-                        throw;
-                    }
-                }
-                else if (!field_info.omissible || !*field_info.omissible)
-                {
-                    CRADLE_THROW(
-                        missing_field() << field_name_info(field_name));
-                }
-            }
-            co_return false;
-        }
-        case api_type_info_tag::UNION_TYPE: {
-            auto const& union_type = as_union_type(type);
-            auto const& map = cast<dynamic_map>(value);
-            auto const& tag = cast<string>(cradle::get_union_tag(map));
-            for (auto const& key_value : union_type.members)
-            {
-                auto const& member_name = key_value.first;
-                auto const& member_info = key_value.second;
-                if (tag == member_name)
-                {
-                    try
-                    {
-                        co_return co_await recurse(
-                            member_info.schema, get_field(map, member_name));
-                    }
-                    catch (boost::exception& e)
-                    {
-                        cradle::add_dynamic_path_element(e, member_name);
-                        throw;
-                    }
-                }
-            }
-            CRADLE_THROW(
-                cradle::invalid_enum_string() <<
-                // This should technically include enum_id_info.
-                cradle::enum_string_info(tag));
-        }
-    }
-}
-
-} // namespace detail
-
-cppcoro::task<void>
-coerce_value_impl(
-    std::function<cppcoro::task<api_type_info>(
-        api_named_type_reference const& ref)> const& look_up_named_type,
-    api_type_info const& type,
-    dynamic& value)
-{
-    auto recurse = [&look_up_named_type](
-                       api_type_info const& type,
-                       dynamic& value) -> cppcoro::task<void> {
-        return coerce_value_impl(look_up_named_type, type, value);
-    };
-
-    switch (get_tag(type))
-    {
-        case api_type_info_tag::ARRAY_TYPE: {
-            integer index = 0;
-            for (dynamic& item : cast<dynamic_array>(value))
-            {
-                auto this_index = index++;
-                try
-                {
-                    co_await recurse(as_array_type(type).element_schema, item);
-                }
-                catch (boost::exception& e)
-                {
-                    cradle::add_dynamic_path_element(e, this_index);
-                    throw;
-                }
-            }
-            break;
-        }
-        case api_type_info_tag::BLOB_TYPE:
-            check_type(value_type::BLOB, value.type());
-            break;
-        case api_type_info_tag::BOOLEAN_TYPE:
-            check_type(value_type::BOOLEAN, value.type());
-            break;
-        case api_type_info_tag::DATETIME_TYPE:
-            // Be forgiving of clients that leave their datetimes as strings.
-            if (value.type() == value_type::STRING)
-            {
-                try
-                {
-                    value = dynamic(parse_ptime(cast<string>(value)));
-                    break;
-                }
-                catch (...)
-                {
-                }
-            }
-            check_type(value_type::DATETIME, value.type());
-            break;
-        case api_type_info_tag::DYNAMIC_TYPE:
-            break;
-        case api_type_info_tag::ENUM_TYPE:
-            check_type(value_type::STRING, value.type());
-            if (as_enum_type(type).values.find(cast<string>(value))
-                == as_enum_type(type).values.end())
-            {
-                CRADLE_THROW(
-                    cradle::invalid_enum_string()
-                    << cradle::enum_string_info(cast<string>(value)));
-            }
-            break;
-        case api_type_info_tag::FLOAT_TYPE:
-            if (value.type() == value_type::INTEGER)
-            {
-                value = boost::numeric_cast<double>(cast<integer>(value));
-                break;
-            }
-            check_type(value_type::FLOAT, value.type());
-            break;
-        case api_type_info_tag::INTEGER_TYPE:
-            if (value.type() == value_type::FLOAT)
-            {
-                double d = cast<double>(value);
-                integer i = boost::numeric_cast<integer>(d);
-                // Check that coercion doesn't change the value.
-                if (boost::numeric_cast<double>(i) == d)
-                {
-                    value = dynamic(i);
-                    break;
-                }
-            }
-            check_type(value_type::INTEGER, value.type());
-            break;
-        case api_type_info_tag::MAP_TYPE: {
-            auto const& map_type = as_map_type(type);
-            // This is a little hack to support the fact that JSON maps are
-            // encoded as arrays and they don't get recognized as maps when
-            // they're empty.
-            if (value.type() == value_type::ARRAY
-                && cast<dynamic_array>(value).empty())
-            {
-                value = dynamic_map();
-                break;
-            }
-            // Since we can't mutate the keys in the map, first check to see if
-            // that's necessary.
-            bool key_coercion_required = false;
-            for (auto const& key_value : cast<dynamic_map>(value))
-            {
-                if (co_await detail::value_requires_coercion(
-                        look_up_named_type,
-                        map_type.key_schema,
-                        key_value.first))
-                {
-                    key_coercion_required = true;
-                    break;
-                }
-            }
-            // If the keys need to be coerced, just create a new map.
-            if (key_coercion_required)
-            {
-                dynamic_map coerced;
-                for (auto& key_value : cast<dynamic_map>(value))
-                {
-                    try
-                    {
-                        dynamic k = key_value.first;
-                        dynamic v = std::move(key_value.second);
-                        co_await recurse(map_type.key_schema, k);
-                        co_await recurse(map_type.value_schema, v);
-                        coerced[k] = v;
-                    }
-                    catch (boost::exception& e)
-                    {
-                        cradle::add_dynamic_path_element(e, key_value.first);
-                        throw;
-                    }
-                }
-                value = coerced;
-            }
-            // Otherwise, coerce the values within the original map.
-            else
-            {
-                for (auto& key_value : cast<dynamic_map>(value))
-                {
-                    try
-                    {
-                        co_await recurse(
-                            map_type.value_schema, key_value.second);
-                    }
-                    catch (boost::exception& e)
-                    {
-                        cradle::add_dynamic_path_element(e, key_value.first);
-                        throw;
-                    }
-                }
-            }
-            break;
-        }
-        case api_type_info_tag::NAMED_TYPE: {
-            auto resolved_type
-                = co_await look_up_named_type(as_named_type(type));
-            co_await recurse(resolved_type, value);
-            break;
-        }
-        case api_type_info_tag::NIL_TYPE:
-        default:
-            check_type(value_type::NIL, value.type());
-            break;
-        case api_type_info_tag::OPTIONAL_TYPE: {
-            auto& map = cast<dynamic_map>(value);
-            auto const& tag = cast<string>(cradle::get_union_tag(map));
-            if (tag == "some")
-            {
-                try
-                {
-                    co_await recurse(
-                        as_optional_type(type), get_field(map, "some"));
-                }
-                catch (boost::exception& e)
-                {
-                    cradle::add_dynamic_path_element(e, "some");
-                    throw;
-                }
-            }
-            else if (tag == "none")
-            {
-                check_type(value_type::NIL, get_field(map, "none").type());
-            }
-            else
-            {
-                CRADLE_THROW(
-                    invalid_optional_type() << optional_type_tag_info(tag));
-            }
-            break;
-        }
-        case api_type_info_tag::REFERENCE_TYPE:
-            check_type(value_type::STRING, value.type());
-            break;
-        case api_type_info_tag::STRING_TYPE:
-            check_type(value_type::STRING, value.type());
-            break;
-        case api_type_info_tag::STRUCTURE_TYPE: {
-            auto const& structure_type = as_structure_type(type);
-            auto& map = cast<dynamic_map>(value);
-            for (auto const& key_value : structure_type.fields)
-            {
-                auto const& field_name = key_value.first;
-                auto const& field_info = key_value.second;
-                dynamic* field_value;
-                bool field_present
-                    = get_field(&field_value, map, key_value.first);
-                if (field_present)
-                {
-                    try
-                    {
-                        co_await recurse(field_info.schema, *field_value);
-                    }
-                    catch (boost::exception& e)
-                    {
-                        cradle::add_dynamic_path_element(e, field_name);
-                        throw;
-                    }
-                }
-                else if (!field_info.omissible || !*field_info.omissible)
-                {
-                    CRADLE_THROW(
-                        missing_field() << field_name_info(field_name));
-                }
-            }
-            break;
-        }
-        case api_type_info_tag::UNION_TYPE: {
-            auto const& union_type = as_union_type(type);
-            auto& map = cast<dynamic_map>(value);
-            auto const& tag = cast<string>(cradle::get_union_tag(map));
-            for (auto const& key_value : union_type.members)
-            {
-                auto const& member_name = key_value.first;
-                auto const& member_info = key_value.second;
-                if (tag == member_name)
-                {
-                    try
-                    {
-                        co_await recurse(
-                            member_info.schema, get_field(map, member_name));
-                        co_return;
-                    }
-                    catch (boost::exception& e)
-                    {
-                        cradle::add_dynamic_path_element(e, member_name);
-                        throw;
-                    }
-                }
-            }
-            CRADLE_THROW(
-                cradle::invalid_enum_string() <<
-                // This should technically include enum_id_info.
-                cradle::enum_string_info(tag));
-        }
-    }
-}
-
-cppcoro::task<dynamic>
-coerce_value(
-    std::function<cppcoro::task<api_type_info>(
-        api_named_type_reference const& ref)> const& look_up_named_type,
-    api_type_info type,
-    dynamic value)
-{
-    co_await coerce_value_impl(look_up_named_type, type, value);
-    co_return value;
-}
-
 } // namespace cradle
@@ -1,8 +1,14 @@
 #ifndef CRADLE_CORE_DYNAMIC_H
 #define CRADLE_CORE_DYNAMIC_H
 
+#include <atomic>
+#include <cstddef>
 #include <initializer_list>
 #include <list>
+#include <memory>
+#include <memory_resource>
+#include <string_view>
+#include <utility>
 
 #include <boost/date_time/posix_time/posix_time_types.hpp>
 
@@ -84,10 +90,10 @@ struct value_type_of<dynamic_map>
 // This queries a map for a field with a key matching the given string.
 // If the field is not present in the map, an exception is thrown.
 dynamic const&
-get_field(dynamic_map const& r, string const& field);
+get_field(dynamic_map const& r, std::string_view field);
 // non-const version
 dynamic&
-get_field(dynamic_map& r, string const& field);
+get_field(dynamic_map& r, std::string_view field);
 
 CRADLE_DEFINE_EXCEPTION(missing_field)
 CRADLE_DEFINE_ERROR_INFO(string, field_name)
@@ -95,10 +101,17 @@ CRADLE_DEFINE_ERROR_INFO(string, field_name)
 // This is the same as above, but its return value indicates whether or not
 // the field is in the map.
 bool
-get_field(dynamic const** v, dynamic_map const& r, string const& field);
+get_field(dynamic const** v, dynamic_map const& r, std::string_view field);
 // non-const version
 bool
-get_field(dynamic** v, dynamic_map& r, string const& field);
+get_field(dynamic** v, dynamic_map& r, std::string_view field);
+
+// These are the same as above, but they look up fields by their interned
+// names (which is faster for records with interned keys).
+dynamic const&
+get_field(dynamic_map const& r, string_symbol const& field);
+bool
+get_field(dynamic const** v, dynamic_map const& r, string_symbol const& field);
 
 // Given a dynamic_map that's meant to represent a union value, this checks
 // that the map contains only one value and returns its key.
@@ -107,6 +120,148 @@ get_union_tag(dynamic_map const& map);
 
 CRADLE_DEFINE_EXCEPTION(multifield_union)
 
+// INTERNED STRINGS
+
+// Get the symbol for :s, interning it if necessary.
+// Symbols are never freed, so this should only be used for strings that come
+// from code (e.g., the field names of structures). For strings that come from
+// data, use make_map_key().
+string_symbol const&
+intern_string(std::string_view s);
+
+// Make a dynamic string to use as a map key.
+// If :s is short enough (and the symbol table isn't full), this interns it.
+// Otherwise, it's stored like any other string.
+dynamic
+make_map_key(std::string_view s);
+
+// If :v is an interned string, get its symbol. Otherwise, return nullptr.
+inline string_symbol const*
+get_string_symbol(dynamic const& v)
+{
+    auto const* p = std::get_if<string_symbol const*>(&v.contents());
+    return p ? *p : nullptr;
+}
+
+// ARRAYS
+
+// If :v is an array that's stored packed as Ts, get its packed array.
+// Otherwise, return nullptr.
+template<class T>
+packed_array<T> const*
+get_packed_array(dynamic const& v)
+{
+    auto const* p
+        = std::get_if<std::shared_ptr<packed_array<T>>>(&v.contents());
+    return p ? p->get() : nullptr;
+}
+
+// If :v is a packed array, call :fn on it (as a packed_array<T> const&, for
+// whichever T it holds) and return true. Otherwise, return false.
+template<class Fn>
+bool
+visit_packed_array(dynamic const& v, Fn&& fn)
+{
+    if (auto const* d = get_packed_array<double>(v))
+        fn(*d);
+    else if (auto const* i = get_packed_array<integer>(v))
+        fn(*i);
+    else if (auto const* b = get_packed_array<bool>(v))
+        fn(*b);
+    else
+        return false;
+    return true;
+}
+
+// If :v is an array that's stored as a table, get its table.
+// Otherwise, return nullptr.
+inline record_table const*
+get_record_table(dynamic const& v)
+{
+    auto const* p = std::get_if<std::shared_ptr<record_table>>(&v.contents());
+    return p ? p->get() : nullptr;
+}
+
+// If :v is an array that's stored as a regular dynamic_array (i.e., it's
+// neither packed nor stored as a table), get it. Otherwise, return nullptr.
+// (cast<dynamic_array>() only provides mutable access, since a packed array
+// has no dynamic_array to refer to until it's unpacked.)
+inline dynamic_array const*
+get_dynamic_array(dynamic const& v)
+{
+    auto const* p
+        = std::get_if<std::shared_ptr<dynamic_array>>(&v.contents());
+    return p ? p->get() : nullptr;
+}
+
+// Get the number of elements in the array :v.
+// This doesn't unpack packed arrays (or expand tables).
+size_t
+get_array_size(dynamic const& v);
+
+// Get (a copy of) the element at :index in the array :v.
+// This doesn't unpack packed arrays (or expand tables).
+// (As with at(), an out-of-range :index throws std::out_of_range.)
+dynamic
+get_array_element(dynamic const& v, size_t index);
+
+// Call :fn on the element at :index in the array :v (as a dynamic const&).
+// Unlike get_array_element(), this doesn't copy elements that are stored as
+// dynamic values, so it's the better choice for the columns of tables.
+// (:index isn't checked.)
+template<class Fn>
+void
+visit_array_element(dynamic const& v, size_t index, Fn&& fn)
+{
+    if (visit_packed_array(
+            v, [&](auto const& array) { fn(dynamic(array[index])); }))
+    {
+        return;
+    }
+    if (auto const* table = get_record_table(v))
+        fn(dynamic(table->row(index)));
+    else
+        fn((*get_dynamic_array(v))[index]);
+}
+
+// Call :fn on the array :v (as a dynamic_array const&) and return its result.
+// If :v is packed (or stored as a table), it's unpacked into a temporary
+// array that only lives for the duration of the call.
+template<class Fn>
+auto
+visit_unpacked_array(dynamic const& v, Fn&& fn)
+{
+    check_type(value_type::ARRAY, v.type());
+    if (auto const* d = get_packed_array<double>(v))
+    {
+        dynamic_array const unpacked = d->unpack();
+        return fn(unpacked);
+    }
+    if (auto const* i = get_packed_array<integer>(v))
+    {
+        dynamic_array const unpacked = i->unpack();
+        return fn(unpacked);
+    }
+    if (auto const* b = get_packed_array<bool>(v))
+    {
+        dynamic_array const unpacked = b->unpack();
+        return fn(unpacked);
+    }
+    if (auto const* table = get_record_table(v))
+    {
+        dynamic_array const unpacked = table->unpack();
+        return fn(unpacked);
+    }
+    return fn(*get_dynamic_array(v));
+}
+
+// Store :array in the most compact form that its elements allow: packed if
+// they're all booleans, all integers or all doubles, as a table if there are
+// at least two of them and they're all records with the same keys, or
+// otherwise as is.
+dynamic
+compact_array(dynamic_array array);
+
 // When an error occurs in the processing of a dynamic value, this provides the
 // path to the location within the value where the error occurred.
 CRADLE_DEFINE_ERROR_INFO(std::list<dynamic>, dynamic_value_path)
@@ -157,6 +312,128 @@ struct dynamic_caster<blob>
     }
 };
 
+namespace detail {
+
+// Get mutable access to the copy-on-write value held by :p.
+// If :p shares its value with other pointers, it's given its own copy first.
+//
+// Values are shared between threads (e.g., through the immutable cache), so
+// this relies on an ownership rule: if :p is the only pointer to its value,
+// no other thread can gain a new reference to it, since that would have to
+// go through :p (and the caller has exclusive access to :p). (There are never
+// any weak_ptrs to dynamic storage.) However, other threads may have only
+// just released their references, and their accesses to the value must be
+// ordered before any modifications that are made through :p. use_count() is
+// just a relaxed load, so that's what the acquire fence is for. (It pairs
+// with the release that the shared_ptr destructor does as it decrements the
+// count.)
+template<class T>
+T&
+unshare(std::shared_ptr<T>& p)
+{
+    if (p.use_count() != 1)
+        p = allocate_dynamic_node<T>(std::as_const(*p));
+    else
+        std::atomic_thread_fence(std::memory_order_acquire);
+    return *p;
+}
+
+} // namespace detail
+
+// Arrays and maps are stored as copy-on-write values, so they have to be
+// unshared before they're exposed for modification.
+template<class T>
+struct shared_dynamic_caster
+{
+    static T const&
+    cast(dynamic const& v)
+    {
+        return *std::get<std::shared_ptr<T>>(v.contents());
+    }
+
+    static T&
+    cast(dynamic& v)
+    {
+        return detail::unshare(std::get<std::shared_ptr<T>>(v.contents()));
+    }
+
+    static T&&
+    cast(dynamic&& v)
+    {
+        return std::move(cast(v));
+    }
+};
+
+// Arrays can also be packed (or stored as tables), in which case they have
+// no dynamic_array to refer to. So arrays only provide mutable access, which
+// replaces a packed array (or table) with a regular array. (Const access goes
+// through visit_unpacked_array(), get_array_element(), get_dynamic_array(),
+// etc. instead.)
+template<>
+struct dynamic_caster<dynamic_array>
+{
+    static dynamic_array&
+    cast(dynamic& v)
+    {
+        visit_packed_array(v, [&](auto const& packed) {
+            v.contents()
+                = allocate_dynamic_node<dynamic_array>(packed.unpack());
+        });
+        if (auto const* table = get_record_table(v))
+        {
+            v.contents()
+                = allocate_dynamic_node<dynamic_array>(table->unpack());
+        }
+        return detail::unshare(
+            std::get<std::shared_ptr<dynamic_array>>(v.contents()));
+    }
+
+    static dynamic_array&&
+    cast(dynamic&& v)
+    {
+        return std::move(cast(v));
+    }
+};
+
+template<>
+struct dynamic_caster<dynamic_map> : shared_dynamic_caster<dynamic_map>
+{
+};
+
+// Strings are stored inline unless they're large, in which case they're
+// treated like arrays and maps. Interned strings are read from their symbols
+// (and replaced with regular strings before they're modified).
+template<>
+struct dynamic_caster<string>
+{
+    static string const&
+    cast(dynamic const& v)
+    {
+        if (auto const* s = std::get_if<string>(&v.contents()))
+            return *s;
+        if (auto const* symbol = get_string_symbol(v))
+            return symbol->text;
+        return *std::get<std::shared_ptr<string>>(v.contents());
+    }
+
+    static string&
+    cast(dynamic& v)
+    {
+        if (auto const* symbol = get_string_symbol(v))
+            v.contents() = symbol->text;
+        if (auto* s = std::get_if<string>(&v.contents()))
+            return *s;
+        return detail::unshare(
+            std::get<std::shared_ptr<string>>(v.contents()));
+    }
+
+    static string&&
+    cast(dynamic&& v)
+    {
+        return std::move(cast(v));
+    }
+};
+
 // Cast to a blob. (Blobs are stored differently.)
 template<class T>
 T const&
@@ -180,6 +457,11 @@ cast(dynamic&& v)
     return dynamic_caster<T>::cast(std::move(v));
 }
 
+// There's no const access to arrays. (See dynamic_caster<dynamic_array>.)
+template<>
+dynamic_array const&
+cast<dynamic_array>(dynamic const& v) = delete;
+
 std::ostream&
 operator<<(std::ostream& os, dynamic const& v);
 
@@ -201,6 +483,20 @@ struct type_info_query<dynamic>
 size_t
 deep_sizeof(dynamic const& v);
 
+size_t
+deep_sizeof(dynamic_map const& x);
+
+template<class T>
+size_t
+deep_sizeof(packed_array<T> const& x)
+{
+    return sizeof(packed_array<T>)
+           + sizeof(typename packed_array<T>::storage_type) * x.size();
+}
+
+size_t
+deep_sizeof(record_table const& x);
+
 void
 swap(dynamic& a, dynamic& b);
 
@@ -217,6 +513,58 @@ operator>(dynamic const& a, dynamic const& b);
 bool
 operator>=(dynamic const& a, dynamic const& b);
 
+// ARENAS
+
+// A dynamic_arena is a region of memory for dynamic values that are built
+// and discarded together (e.g., the values that are decoded, transformed and
+// encoded while processing a single request). Allocating from an arena is
+// just a pointer bump, and everything in it is released at once when it's
+// destroyed, so it's much cheaper than allocating each node separately.
+//
+// Storage is allocated from the arena while a dynamic_memory_scope for it is
+// active, e.g.:
+//
+//   dynamic_arena arena;
+//   {
+//       dynamic_memory_scope scope(arena.resource());
+//       auto value = parse_msgpack_value(...);
+//       ...
+//   }
+//
+// Values allocated in an arena must NOT outlive it, so values that escape
+// (e.g., into a cache) have to be copied out with copy_to_heap(). (While an
+// arena is active, from_dynamic() does this for dynamic values that are read
+// into other types.)
+//
+struct dynamic_arena : noncopyable
+{
+    dynamic_arena() : resource_(initial_buffer_, sizeof(initial_buffer_))
+    {
+    }
+
+    std::pmr::memory_resource*
+    resource()
+    {
+        return &resource_;
+    }
+
+ private:
+    // Small requests fit entirely within this (so they don't touch the heap
+    // at all).
+    alignas(std::max_align_t) std::byte initial_buffer_[4096];
+    std::pmr::monotonic_buffer_resource resource_;
+};
+
+// Is dynamic storage on this thread currently allocated from somewhere other
+// than the heap?
+bool
+dynamic_memory_is_scoped();
+
+// Copy :v (and everything within it) into storage that's allocated from the
+// heap, so that it doesn't depend on any arena.
+dynamic
+copy_to_heap(dynamic const& v);
+
 inline void
 to_dynamic(dynamic* v, dynamic const& x)
 {
@@ -225,7 +573,12 @@ to_dynamic(dynamic* v, dynamic const& x)
 inline void
 from_dynamic(dynamic* x, dynamic const& v)
 {
-    *x = v;
+    // The value that :v is part of may live in an arena, but :x may outlive
+    // it, so :v has to be copied out.
+    if (dynamic_memory_is_scoped())
+        *x = copy_to_heap(v);
+    else
+        *x = v;
 }
 
 size_t
@@ -276,7 +629,8 @@ apply_to_dynamic(Fn&& fn, dynamic const& v)
         case value_type::DATETIME:
             return fn(cast<boost::posix_time::ptime>(v));
         case value_type::ARRAY:
-            return fn(cast<dynamic_array>(v));
+            return visit_unpacked_array(
+                v, [&](dynamic_array const& array) { return fn(array); });
         case value_type::MAP:
             return fn(cast<dynamic_map>(v));
     }
@@ -309,7 +663,10 @@ apply_to_dynamic_pair(Fn&& fn, dynamic const& a, dynamic const& b)
                 cast<boost::posix_time::ptime>(a),
                 cast<boost::posix_time::ptime>(b));
         case value_type::ARRAY:
-            return fn(cast<dynamic_array>(a), cast<dynamic_array>(b));
+            return visit_unpacked_array(a, [&](dynamic_array const& x) {
+                return visit_unpacked_array(
+                    b, [&](dynamic_array const& y) { return fn(x, y); });
+            });
         case value_type::MAP:
             return fn(cast<dynamic_map>(a), cast<dynamic_map>(b));
     }
@@ -322,6 +679,10 @@ struct api_type_info;
 // This only applies very gentle coercions (e.g., lossless numeric casts).
 // :look_up_named_type must be implemented by the caller as a means for the
 // algorithm to look up named types.
+// This compiles a coercion plan for :type lazily, so it only looks up the
+// named types that :value actually reaches. Code that coerces many values of
+// the same type should compile a plan once and apply it to each value
+// instead. (See coercion.h.)
 cppcoro::task<dynamic>
 coerce_value(
     std::function<cppcoro::task<api_type_info>(
@@ -340,34 +701,14 @@ value_requires_coercion(
 
 }
 
-// This is a generic function for reading a field from a dynamic_map.
-// It exists primarily so that omissible types can override it.
-template<class Field>
-void
-read_field_from_record(
-    Field* field_value, dynamic_map const& record, string const& field_name)
-{
-    auto dynamic_field_value = get_field(record, field_name);
-    try
-    {
-        from_dynamic(field_value, dynamic_field_value);
-    }
-    catch (boost::exception& e)
-    {
-        cradle::add_dynamic_path_element(e, field_name);
-        throw;
-    }
-}
-
 // This is a generic function for writing a field to a dynamic_map.
 // It exists primarily so that omissible types can override it.
 template<class Field>
 void
 write_field_to_record(
-    dynamic_map& record, std::string field_name, Field field_value)
+    dynamic_map& record, string_symbol const& field_name, Field field_value)
 {
-    to_dynamic(
-        &record[dynamic(std::move(field_name))], std::move(field_value));
+    to_dynamic(&record[dynamic(field_name)], std::move(field_value));
 }
 
 } // namespace cradle
@@ -0,0 +1,256 @@
+#ifndef CRADLE_CORE_FIELD_DISPATCH_H
+#define CRADLE_CORE_FIELD_DISPATCH_H
+
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+#include <cradle/core/dynamic.h>
+
+// FIELD DISPATCH - The generated from_dynamic() functions for structures
+// read records in a single pass over their entries. Each entry's key is
+// looked up in a perfect hash table of the structure's field names (which is
+// built at compile time), and the entry's value is read into the field that
+// it names. The fields that have been read are recorded as the pass goes,
+// so once it's done, any missing fields can be dealt with.
+//
+// The preprocessor generates the following for each structure:
+//
+// - read_record_field(x, name, key, value, fields_read, offset) reads
+//   :value into the field of :x called :name and marks that field in
+//   :fields_read. (:key is the record's key for the entry, and :name is its
+//   text.) It returns false if :x has no such field.
+//
+// - finish_record_fields(x, fields_read, offset) handles the fields of :x
+//   that aren't marked in :fields_read (by calling finish_record_field() for
+//   every field).
+//
+// Within :fields_read, a structure's own fields are numbered from :offset
+// (in the order that they're declared), and its supertype's fields follow
+// them.
+
+namespace cradle {
+
+namespace detail {
+
+// Get the FNV-1a hash of a field name.
+constexpr uint64_t
+hash_field_name(std::string_view name)
+{
+    uint64_t h = 0xcbf29ce484222325;
+    for (char c : name)
+    {
+        h ^= uint8_t(c);
+        h *= 0x100000001b3;
+    }
+    return h;
+}
+
+// Mix the displacement :d into the field name hash :h. (This is the
+// finalizer from splitmix64.)
+constexpr uint64_t
+displace_field_hash(uint64_t h, uint32_t d)
+{
+    h += uint64_t(d) * 0x9e3779b97f4a7c15;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111eb;
+    return h ^ (h >> 31);
+}
+
+} // namespace detail
+
+// A field_name_table is a perfect hash table of a structure's N field names.
+// It's built at compile time (by hashing and displacing): Each name hashes
+// to one of N buckets, and each bucket has a displacement that's chosen so
+// that the names in it land in slots that no other names occupy. Looking up
+// a name takes one hash and (at most) one string comparison.
+template<std::size_t N>
+struct field_name_table
+{
+    // Keeping the table at most half full means that suitable displacements
+    // are quick to find.
+    static constexpr std::size_t slot_count = std::bit_ceil(2 * N);
+
+    consteval explicit field_name_table(
+        std::array<std::string_view, N> const& field_names)
+        : names(field_names)
+    {
+        slots.fill(-1);
+
+        std::array<uint64_t, N> hashes{};
+        std::array<std::size_t, N> bucket_sizes{};
+        for (std::size_t i = 0; i != N; ++i)
+        {
+            for (std::size_t j = 0; j != i; ++j)
+            {
+                if (names[j] == names[i])
+                    throw "duplicate field name";
+            }
+            hashes[i] = detail::hash_field_name(names[i]);
+            ++bucket_sizes[hashes[i] % N];
+        }
+
+        // Place the largest buckets first, since they're the hardest to
+        // place.
+        for (std::size_t size = N; size != 0; --size)
+        {
+            for (std::size_t bucket = 0; bucket != N; ++bucket)
+            {
+                if (bucket_sizes[bucket] == size)
+                    place_bucket(hashes, bucket);
+            }
+        }
+    }
+
+    // Get the index (within the list that the table was built from) of the
+    // field called :name, or -1 if there's no such field.
+    int
+    find(std::string_view name) const
+    {
+        if constexpr (N == 0)
+        {
+            return -1;
+        }
+        else
+        {
+            uint64_t const h = detail::hash_field_name(name);
+            int const index = slots[slot_of(h, displacements[h % N])];
+            return index >= 0 && names[index] == name ? index : -1;
+        }
+    }
+
+    std::array<std::string_view, N> names{};
+    // the displacement for each bucket
+    std::array<uint32_t, N> displacements{};
+    // the index of the field in each slot (or -1 if the slot is empty)
+    std::array<int, slot_count> slots{};
+
+ private:
+    static constexpr std::size_t
+    slot_of(uint64_t h, uint32_t d)
+    {
+        return std::size_t(detail::displace_field_hash(h, d))
+               & (slot_count - 1);
+    }
+
+    constexpr void
+    place_bucket(std::array<uint64_t, N> const& hashes, std::size_t bucket)
+    {
+        for (uint32_t d = 0;; ++d)
+        {
+            auto trial = slots;
+            bool fits = true;
+            for (std::size_t i = 0; fits && i != N; ++i)
+            {
+                if (hashes[i] % N != bucket)
+                    continue;
+                auto& slot = trial[slot_of(hashes[i], d)];
+                if (slot >= 0)
+                    fits = false;
+                else
+                    slot = int(i);
+            }
+            if (fits)
+            {
+                slots = trial;
+                displacements[bucket] = d;
+                return;
+            }
+        }
+    }
+};
+
+// record_field_set is the set of fields (identified by number) that have
+// been read from a record. Fields beyond the first 128 are rare, so they're
+// kept separately.
+struct record_field_set
+{
+    void
+    mark(unsigned field)
+    {
+        if (field < inline_field_count)
+        {
+            inline_words_[field / 64] |= uint64_t(1) << (field % 64);
+        }
+        else
+        {
+            unsigned const word = (field - inline_field_count) / 64;
+            if (word >= extra_words_.size())
+                extra_words_.resize(word + 1, 0);
+            extra_words_[word] |= uint64_t(1) << (field % 64);
+        }
+    }
+
+    bool
+    contains(unsigned field) const
+    {
+        if (field < inline_field_count)
+            return (inline_words_[field / 64] >> (field % 64)) & 1;
+        unsigned const word = (field - inline_field_count) / 64;
+        return word < extra_words_.size()
+               && ((extra_words_[word] >> (field % 64)) & 1);
+    }
+
+ private:
+    static constexpr unsigned inline_field_count = 128;
+    uint64_t inline_words_[inline_field_count / 64] = {0, 0};
+    std::vector<uint64_t> extra_words_;
+};
+
+// Read a field's value from a record entry. This exists primarily so that
+// omissible types can override it. (:key is the entry's key, which becomes
+// part of the path for any errors.)
+template<class Field>
+void
+read_record_field_value(
+    Field* field_value, dynamic const& key, dynamic const& value)
+{
+    try
+    {
+        from_dynamic(field_value, value);
+    }
+    catch (boost::exception& e)
+    {
+        cradle::add_dynamic_path_element(e, key);
+        throw;
+    }
+}
+
+// Finish a field once a record has been read. :was_read indicates whether or
+// not the record had a value for it. Fields are required unless they're
+// omissible (which overrides this).
+template<class Field>
+void
+finish_record_field(Field*, bool was_read, std::string_view field_name)
+{
+    if (!was_read)
+    {
+        CRADLE_THROW(missing_field() << field_name_info(string(field_name)));
+    }
+}
+
+// Read the fields of the structure :x from :record.
+// Keys that don't name fields of :x are ignored (as they always have been),
+// as are keys that aren't strings.
+template<class Structure>
+void
+read_record_fields(Structure& x, dynamic_map const& record)
+{
+    record_field_set fields_read;
+    for (auto const& [key, value] : record)
+    {
+        if (key.type() == value_type::STRING)
+        {
+            read_record_field(
+                x, cast<string>(key), key, value, fields_read, 0);
+        }
+    }
+    finish_record_fields(x, fields_read, 0);
+}
+
+} // namespace cradle
+
+#endif
@@ -1,26 +1,193 @@
 #ifndef CRADLE_CORE_HASH_H
 #define CRADLE_CORE_HASH_H
 
+#include <cstdint>
+#include <cstring>
 #include <functional>
+#include <string>
+#include <type_traits>
 
 #include <boost/functional/hash.hpp>
 
+#if defined(_MSC_VER) && defined(_M_X64) && !defined(__SIZEOF_INT128__)
+#include <intrin.h>
+#endif
+
+// This file provides the hashing primitives that are used for in-memory hash
+// tables (e.g., the memory cache). They're based on wyhash, which is fast and
+// mixes well, so structurally similar keys (which are common in calculation
+// requests) don't cluster in the same buckets.
+//
+// Note that these hashes are NOT stable across platforms or versions, so they
+// should never be persisted. (Disk caching uses SHA-256.)
+
 namespace cradle {
 
+namespace detail {
+
+inline constexpr uint64_t hash_secrets[4]
+    = {0x2d358dccaa6c78a5ull,
+       0x8bb84b93962eacc9ull,
+       0x4b33a62ed433d4a3ull,
+       0x4d5a2da51de1aa47ull};
+
+// Multiply :a and :b as 128-bit integers and return the low and high halves
+// of the product in :a and :b (respectively).
+inline void
+multiply_128(uint64_t& a, uint64_t& b)
+{
+#if defined(__SIZEOF_INT128__)
+    __uint128_t product = __uint128_t(a) * b;
+    a = uint64_t(product);
+    b = uint64_t(product >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    a = _umul128(a, b, &b);
+#else
+    uint64_t const a_hi = a >> 32, a_lo = uint32_t(a);
+    uint64_t const b_hi = b >> 32, b_lo = uint32_t(b);
+    uint64_t const hi_hi = a_hi * b_hi, hi_lo = a_hi * b_lo;
+    uint64_t const lo_hi = a_lo * b_hi, lo_lo = a_lo * b_lo;
+    uint64_t const cross = (lo_lo >> 32) + uint32_t(hi_lo) + lo_hi;
+    a = (cross << 32) | uint32_t(lo_lo);
+    b = hi_hi + (hi_lo >> 32) + (cross >> 32);
+#endif
+}
+
+inline uint64_t
+mix_words(uint64_t a, uint64_t b)
+{
+    multiply_128(a, b);
+    return a ^ b;
+}
+
+inline uint64_t
+read_u64(uint8_t const* p)
+{
+    uint64_t v;
+    std::memcpy(&v, p, 8);
+    return v;
+}
+
+inline uint64_t
+read_u32(uint8_t const* p)
+{
+    uint32_t v;
+    std::memcpy(&v, p, 4);
+    return v;
+}
+
+} // namespace detail
+
+// Hash the :size bytes at :data.
+inline uint64_t
+hash_bytes(void const* data, std::size_t size, uint64_t seed = 0)
+{
+    using detail::hash_secrets;
+    using detail::mix_words;
+    using detail::read_u32;
+    using detail::read_u64;
+
+    auto const* p = static_cast<uint8_t const*>(data);
+    seed ^= mix_words(seed ^ hash_secrets[0], hash_secrets[1]);
+    uint64_t a, b;
+    if (size <= 16)
+    {
+        if (size >= 4)
+        {
+            std::size_t const offset = (size >> 3) << 2;
+            a = (read_u32(p) << 32) | read_u32(p + offset);
+            b = (read_u32(p + size - 4) << 32)
+                | read_u32(p + size - 4 - offset);
+        }
+        else if (size > 0)
+        {
+            a = (uint64_t(p[0]) << 16) | (uint64_t(p[size >> 1]) << 8)
+                | p[size - 1];
+            b = 0;
+        }
+        else
+        {
+            a = b = 0;
+        }
+    }
+    else
+    {
+        std::size_t i = size;
+        if (i >= 48)
+        {
+            uint64_t seed1 = seed, seed2 = seed;
+            do
+            {
+                seed = mix_words(
+                    read_u64(p) ^ hash_secrets[1], read_u64(p + 8) ^ seed);
+                seed1 = mix_words(
+                    read_u64(p + 16) ^ hash_secrets[2],
+                    read_u64(p + 24) ^ seed1);
+                seed2 = mix_words(
+                    read_u64(p + 32) ^ hash_secrets[3],
+                    read_u64(p + 40) ^ seed2);
+                p += 48;
+                i -= 48;
+            } while (i >= 48);
+            seed ^= seed1 ^ seed2;
+        }
+        while (i > 16)
+        {
+            seed = mix_words(
+                read_u64(p) ^ hash_secrets[1], read_u64(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = read_u64(p + i - 16);
+        b = read_u64(p + i - 8);
+    }
+    a ^= hash_secrets[1];
+    b ^= seed;
+    detail::multiply_128(a, b);
+    return mix_words(a ^ hash_secrets[0] ^ size, b ^ hash_secrets[1]);
+}
+
+// Hash a 64-bit integer.
+inline uint64_t
+hash_integer(uint64_t x)
+{
+    uint64_t a = x ^ detail::hash_secrets[0];
+    uint64_t b = x ^ detail::hash_secrets[1];
+    detail::multiply_128(a, b);
+    return detail::mix_words(
+        a ^ detail::hash_secrets[0], b ^ detail::hash_secrets[1]);
+}
+
+// Get the hash of :x.
+//
+// Strings, integers and enums are hashed directly. Other types are hashed via
+// boost::hash (and thus their hash_value() overloads).
+//
 template<class T>
 std::size_t
 invoke_hash(T const& x)
 {
-    return boost::hash<T>()(x);
+    if constexpr (std::is_same_v<T, std::string>)
+        return std::size_t(hash_bytes(x.data(), x.size()));
+    else if constexpr (std::is_integral_v<T> || std::is_enum_v<T>)
+        return std::size_t(hash_integer(uint64_t(x)));
+    else
+        return boost::hash<T>()(x);
 }
 
+// Combine a sequence of hashes into a single hash. Unlike XOR, this depends
+// on the order of the hashes (so combine_hashes(a, b) and combine_hashes(b, a)
+// are different), and equal hashes don't cancel each other out.
 template<class... Hashes>
-size_t
+std::size_t
 combine_hashes(Hashes... hashes)
 {
-    size_t seed = 0;
-    (boost::hash_combine(seed, hashes), ...);
-    return seed;
+    uint64_t seed = detail::hash_secrets[2];
+    ((seed = detail::mix_words(
+          seed ^ detail::hash_secrets[0],
+          uint64_t(hashes) ^ detail::hash_secrets[1])),
+     ...);
+    return std::size_t(seed);
 }
 
 } // namespace cradle
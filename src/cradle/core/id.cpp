@@ -54,6 +54,54 @@ clone_into(std::unique_ptr<id_interface>& storage, id_interface const* id)
     }
 }
 
+void
+captured_id::clear() noexcept
+{
+    if (is_inline_)
+        id_->~id_interface();
+    else
+        delete id_;
+    id_ = nullptr;
+    is_inline_ = false;
+}
+
+void
+captured_id::capture(id_interface const& new_id)
+{
+    if (id_ && types_match(*id_, new_id))
+    {
+        new_id.deep_copy(id_);
+        return;
+    }
+    this->clear();
+    if (auto* copy = new_id.copy_into(buffer_, inline_size))
+    {
+        id_ = copy;
+        is_inline_ = true;
+    }
+    else
+    {
+        id_ = new_id.clone();
+    }
+}
+
+void
+captured_id::take(captured_id& other) noexcept
+{
+    if (other.is_inline_)
+    {
+        // IDs that were copied inline are guaranteed to move inline.
+        id_ = other.id_->move_into(buffer_, inline_size);
+        is_inline_ = true;
+        other.clear();
+    }
+    else
+    {
+        id_ = other.id_;
+        other.id_ = nullptr;
+    }
+}
+
 bool
 operator==(captured_id const& a, captured_id const& b)
 {
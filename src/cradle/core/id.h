@@ -1,9 +1,12 @@
 #ifndef CRADLE_CORE_ID_H
 #define CRADLE_CORE_ID_H
 
+#include <cstddef>
 #include <functional>
 #include <memory>
+#include <new>
 #include <sstream>
+#include <type_traits>
 
 #include <boost/lexical_cast.hpp>
 
@@ -49,8 +52,73 @@ struct id_interface
     // Generate a hash of the ID.
     virtual size_t
     hash() const = 0;
+
+    // Construct a standalone copy of the ID in :buffer, which provides :size
+    // bytes aligned for std::max_align_t. Return a pointer to the copy, or
+    // nullptr if the ID doesn't fit (in which case nothing is constructed and
+    // the caller should fall back to clone()).
+    //
+    // An ID that's copied into a buffer must be able to move_into() another
+    // buffer of the same size.
+    //
+    virtual id_interface*
+    copy_into(void*, size_t) const
+    {
+        return nullptr;
+    }
+
+    // Given that this ID is standalone (e.g., because it was produced by
+    // copy_into()), move it into :buffer (under the same rules as
+    // copy_into()). This ID is left in a valid but unspecified state.
+    virtual id_interface*
+    move_into(void*, size_t) noexcept
+    {
+        return nullptr;
+    }
 };
 
+namespace detail {
+
+template<class Id>
+constexpr bool
+id_fits_in_buffer(size_t size)
+{
+    return sizeof(Id) <= size && alignof(Id) <= alignof(std::max_align_t)
+           && std::is_nothrow_move_constructible_v<Id>;
+}
+
+// Implement id_interface::copy_into() for :id (via deep_copy()).
+template<class Id>
+id_interface*
+copy_id_into(Id const& id, void* buffer, size_t size)
+{
+    if (!id_fits_in_buffer<Id>(size))
+        return nullptr;
+    Id* copy = new (buffer) Id;
+    try
+    {
+        id.deep_copy(copy);
+    }
+    catch (...)
+    {
+        copy->~Id();
+        throw;
+    }
+    return copy;
+}
+
+// Implement id_interface::move_into() for :id.
+template<class Id>
+id_interface*
+move_id_into(Id& id, void* buffer, size_t size) noexcept
+{
+    if (!id_fits_in_buffer<Id>(size))
+        return nullptr;
+    return new (buffer) Id(std::move(id));
+}
+
+} // namespace detail
+
 // The following convert the interface of the ID operations into the usual form
 // that one would expect, as free functions.
 
@@ -124,10 +192,19 @@ clone_into(id_interface*& storage, id_interface const* id);
 void
 clone_into(std::unique_ptr<id_interface>& storage, id_interface const* id);
 
+// IDs that fit in this many bytes are stored directly inside captured_id
+// (rather than on the heap). The default is enough for a sha256_hashed_id of a
+// tag and three strings (on 64-bit platforms), which covers most cache keys.
+#ifndef CRADLE_CAPTURED_ID_INLINE_SIZE
+#define CRADLE_CAPTURED_ID_INLINE_SIZE 160
+#endif
+
 // captured_id is used to capture an ID for long-term storage (beyond the point
 // where the id_interface reference will be valid).
 struct captured_id
 {
+    static constexpr size_t inline_size = CRADLE_CAPTURED_ID_INLINE_SIZE;
+
     captured_id()
     {
     }
@@ -142,7 +219,11 @@ struct captured_id
     }
     captured_id(captured_id&& other) noexcept
     {
-        id_ = std::move(other.id_);
+        this->take(other);
+    }
+    ~captured_id()
+    {
+        this->clear();
     }
     captured_id&
     operator=(captured_id const& other)
@@ -156,24 +237,28 @@ struct captured_id
     captured_id&
     operator=(captured_id&& other) noexcept
     {
-        id_ = std::move(other.id_);
+        if (this != &other)
+        {
+            this->clear();
+            this->take(other);
+        }
         return *this;
     }
     void
-    clear()
-    {
-        id_.reset();
-    }
+    clear() noexcept;
     void
-    capture(id_interface const& new_id)
-    {
-        clone_into(id_, &new_id);
-    }
+    capture(id_interface const& new_id);
     bool
     is_initialized() const
     {
         return id_ ? true : false;
     }
+    // Is the ID stored inline (rather than on the heap)?
+    bool
+    is_inline() const
+    {
+        return is_inline_;
+    }
     id_interface const&
     operator*() const
     {
@@ -187,11 +272,20 @@ struct captured_id
     friend void
     swap(captured_id& a, captured_id& b) noexcept
     {
-        swap(a.id_, b.id_);
+        captured_id tmp(std::move(a));
+        a = std::move(b);
+        b = std::move(tmp);
     }
 
  private:
-    std::unique_ptr<id_interface> id_;
+    // Take the ID from :other (which must be different from this one), which
+    // is left empty. This ID must already be empty.
+    void
+    take(captured_id& other) noexcept;
+
+    id_interface* id_ = nullptr;
+    bool is_inline_ = false;
+    alignas(std::max_align_t) unsigned char buffer_[inline_size];
 };
 bool
 operator==(captured_id const& a, captured_id const& b);
@@ -261,6 +355,18 @@ struct id_ref : id_interface
         return id_->hash();
     }
 
+    id_interface*
+    copy_into(void* buffer, size_t size) const override
+    {
+        return detail::copy_id_into(*this, buffer, size);
+    }
+
+    id_interface*
+    move_into(void* buffer, size_t size) noexcept override
+    {
+        return detail::move_id_into(*this, buffer, size);
+    }
+
  private:
     id_interface const* id_;
     std::shared_ptr<id_interface> ownership_;
@@ -329,6 +435,20 @@ struct simple_id : id_interface
         return invoke_hash(value_);
     }
 
+    id_interface*
+    copy_into(void* buffer, size_t size) const override
+    {
+        if (!detail::id_fits_in_buffer<simple_id>(size))
+            return nullptr;
+        return new (buffer) simple_id(*this);
+    }
+
+    id_interface*
+    move_into(void* buffer, size_t size) noexcept override
+    {
+        return detail::move_id_into(*this, buffer, size);
+    }
+
     Value value_;
 };
 
@@ -405,6 +525,18 @@ struct simple_id_by_reference : id_interface
         return invoke_hash(*value_);
     }
 
+    id_interface*
+    copy_into(void* buffer, size_t size) const override
+    {
+        return detail::copy_id_into(*this, buffer, size);
+    }
+
+    id_interface*
+    move_into(void* buffer, size_t size) noexcept override
+    {
+        return detail::move_id_into(*this, buffer, size);
+    }
+
  private:
     Value const* value_;
     std::shared_ptr<Value> storage_;
@@ -471,7 +603,19 @@ struct id_pair : id_interface
     size_t
     hash() const override
     {
-        return id0_.hash() ^ id1_.hash();
+        return combine_hashes(id0_.hash(), id1_.hash());
+    }
+
+    id_interface*
+    copy_into(void* buffer, size_t size) const override
+    {
+        return detail::copy_id_into(*this, buffer, size);
+    }
+
+    id_interface*
+    move_into(void* buffer, size_t size) noexcept override
+    {
+        return detail::move_id_into(*this, buffer, size);
     }
 
  private:
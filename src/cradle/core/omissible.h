@@ -42,37 +42,34 @@ deep_sizeof(omissible<T> const& x)
 }
 template<class T>
 void
-read_field_from_record(
-    omissible<T>* field_value,
-    dynamic_map const& record,
-    std::string const& field_name)
+read_record_field_value(
+    omissible<T>* field_value, dynamic const& key, dynamic const& value)
 {
-    // If the field doesn't appear in the record, just set it to none.
-    dynamic const* dynamic_field_value;
-    if (get_field(&dynamic_field_value, record, field_name))
+    try
     {
-        try
-        {
-            T value;
-            from_dynamic(&value, *dynamic_field_value);
-            *field_value = value;
-        }
-        catch (boost::exception& e)
-        {
-            cradle::add_dynamic_path_element(e, field_name);
-            throw;
-        }
+        T x;
+        from_dynamic(&x, value);
+        *field_value = std::move(x);
     }
-    else
+    catch (boost::exception& e)
     {
-        *field_value = none;
+        cradle::add_dynamic_path_element(e, key);
+        throw;
     }
 }
 template<class T>
 void
+finish_record_field(omissible<T>* field_value, bool was_read, std::string_view)
+{
+    // If the field didn't appear in the record, just set it to none.
+    if (!was_read)
+        *field_value = none;
+}
+template<class T>
+void
 write_field_to_record(
     dynamic_map& record,
-    string const& field_name,
+    string_symbol const& field_name,
     omissible<T> const& field_value)
 {
     // Only write the field to the record if it has a value.
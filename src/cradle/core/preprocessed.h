@@ -3,6 +3,7 @@
 
 #include <cradle/core/api_types.hpp>
 #include <cradle/core/dynamic.h>
+#include <cradle/core/field_dispatch.h>
 #include <cradle/core/immutable.h>
 #include <cradle/core/monitoring.h>
 #include <cradle/core/omissible.h>
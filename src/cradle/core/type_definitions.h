@@ -2,11 +2,19 @@
 #define CRADLE_CORE_TYPE_DEFINITIONS_H
 
 #include <any>
+#include <cstdint>
+#include <initializer_list>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <memory_resource>
 #include <optional>
 #include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
 #include <variant>
+#include <vector>
 
 #include <boost/core/noncopyable.hpp>
 #include <boost/date_time/posix_time/posix_time_types.hpp>
@@ -100,6 +108,10 @@ struct structure_field_type_info_adder
 };
 
 struct dynamic;
+struct dynamic_map;
+
+// the set of fields that have been read from a record (see field_dispatch.h)
+struct record_field_set;
 
 enum class value_type
 {
@@ -114,12 +126,362 @@ enum class value_type
     MAP, // dynamic_map - collection of named dynamic values
 };
 
+// The storage that dynamic values share between copies (i.e., the nodes that
+// hold arrays, maps, large strings, etc., along with the entries of maps) is
+// allocated from the current thread's dynamic memory resource. Normally,
+// that's just the heap, but code that builds and discards lots of transient
+// values can have them allocated in a dynamic_arena instead. (See dynamic.h.)
+
+// Get the memory resource that dynamic storage is currently allocated from
+// on this thread.
+std::pmr::memory_resource*
+get_dynamic_memory_resource();
+
+// While a dynamic_memory_scope is alive, dynamic storage on the current
+// thread is allocated from :resource. Since the scope is per-thread, it must
+// NOT be held across a co_await.
+struct dynamic_memory_scope : noncopyable
+{
+    explicit dynamic_memory_scope(std::pmr::memory_resource* resource);
+    ~dynamic_memory_scope();
+
+ private:
+    std::pmr::memory_resource* previous_;
+};
+
+// dynamic_allocator<T> allocates from the dynamic memory resource that was
+// current when it was created, so storage is always returned to the
+// resource that it came from (even if it's released outside of the scope
+// that it was allocated in).
+template<class T>
+struct dynamic_allocator
+{
+    typedef T value_type;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    dynamic_allocator() noexcept : resource(get_dynamic_memory_resource())
+    {
+    }
+
+    template<class U>
+    dynamic_allocator(dynamic_allocator<U> const& other) noexcept
+        : resource(other.resource)
+    {
+    }
+
+    T*
+    allocate(std::size_t n)
+    {
+        return static_cast<T*>(resource->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void
+    deallocate(T* p, std::size_t n)
+    {
+        resource->deallocate(p, n * sizeof(T), alignof(T));
+    }
+
+    // Copies of containers are allocated from the current resource (and not
+    // the resource of the original).
+    dynamic_allocator
+    select_on_container_copy_construction() const
+    {
+        return dynamic_allocator();
+    }
+
+    std::pmr::memory_resource* resource;
+};
+
+template<class T, class U>
+bool
+operator==(dynamic_allocator<T> const& a, dynamic_allocator<U> const& b)
+{
+    return a.resource == b.resource;
+}
+template<class T, class U>
+bool
+operator!=(dynamic_allocator<T> const& a, dynamic_allocator<U> const& b)
+{
+    return a.resource != b.resource;
+}
+
+// Allocate a node of dynamic storage (from the current resource).
+template<class T, class... Args>
+std::shared_ptr<T>
+allocate_dynamic_node(Args&&... args)
+{
+    return std::allocate_shared<T>(
+        dynamic_allocator<T>(), std::forward<Args>(args)...);
+}
+
 // Arrays are represented as std::vectors and can be manipulated as such.
 typedef std::vector<dynamic> dynamic_array;
 
-// Maps are represented as std::maps and can be manipulated as such.
-typedef std::map<dynamic, dynamic> dynamic_map;
+// Arrays of numbers (or booleans) that all have the same type can also be
+// stored packed, as a contiguous buffer of Ts (where T is bool, integer or
+// double). This is much more compact than a dynamic_array (and much faster to
+// encode, decode and convert), so the decoders produce packed arrays for any
+// nonempty array whose elements are all of the same one of those types.
+//
+// A packed array is still just an array as far as users of dynamic are
+// concerned (i.e., its type is value_type::ARRAY, and it compares and hashes
+// the same as the equivalent dynamic_array). The buffer is the only form that
+// it's ever stored in: code that needs a dynamic_array can get a temporary
+// one from visit_unpacked_array(), but code that handles large arrays should
+// use get_packed_array() (and friends) to access the buffer directly.
+//
+template<class T>
+struct packed_array
+{
+    typedef T element_type;
+
+    // std::vector<bool> isn't contiguous, so booleans are stored as bytes.
+    typedef std::conditional_t<std::is_same_v<T, bool>, std::uint8_t, T>
+        storage_type;
+
+    packed_array() = default;
+
+    explicit packed_array(std::vector<storage_type> values)
+        : values(std::move(values))
+    {
+    }
+
+    std::size_t
+    size() const
+    {
+        return values.size();
+    }
+
+    bool
+    empty() const
+    {
+        return values.empty();
+    }
+
+    T
+    operator[](std::size_t i) const
+    {
+        return T(values[i]);
+    }
+
+    // Copy the values into a new dynamic_array.
+    dynamic_array
+    unpack() const;
+
+    std::vector<storage_type> values;
+};
 
+// Arrays of records (maps) that all have the same keys can also be stored as
+// tables: the keys are stored once, and the values for each key are stored
+// together, as an array (a column). Since columns are arrays, columns of
+// numbers are stored packed, so a table is much more compact than the
+// equivalent array of maps. The MessagePack and native decoders produce
+// tables for any array of two or more records that have identical keys.
+//
+// As with packed arrays, a table is still just an array as far as users of
+// dynamic are concerned, and the columns are the only form that it's ever
+// stored in. visit_unpacked_array() expands it into temporary rows, but code
+// that handles large arrays should use get_record_table() to access the
+// columns directly.
+//
+struct record_table
+{
+    record_table() = default;
+
+    // :keys must be in map order (i.e., sorted and unique), and there must be
+    // one column for each key, holding :row_count elements.
+    record_table(
+        std::vector<dynamic> keys,
+        std::vector<dynamic> columns,
+        std::size_t row_count);
+
+    std::size_t
+    size() const
+    {
+        return row_count;
+    }
+
+    // Find the column for the string :key.
+    // If there isn't one, this returns nullptr.
+    dynamic const*
+    find_column(std::string_view key) const;
+    dynamic*
+    find_column(std::string_view key);
+
+    // Get row :i as a map.
+    dynamic_map
+    row(std::size_t i) const;
+
+    // Copy the rows into a new dynamic_array.
+    dynamic_array
+    unpack() const;
+
+    std::vector<dynamic> keys;
+    std::vector<dynamic> columns;
+    std::size_t row_count = 0;
+};
+
+// Maps are represented as flat vectors of key/value pairs, sorted by key.
+// They provide the parts of the std::map interface that are used with dynamic
+// values (and iterate in the same order as a std::map would), but they're
+// much more compact and lookups don't chase pointers.
+//
+// Since most maps are records, string keys can also be looked up directly
+// via std::string_view (without constructing a dynamic for the key).
+//
+// As with any flat map, inserting or erasing entries invalidates iterators
+// and references into the map. Also, keys must NOT be modified through
+// iterators, since that would break the ordering.
+//
+struct dynamic_map
+{
+    typedef dynamic key_type;
+    typedef dynamic mapped_type;
+    typedef std::pair<dynamic, dynamic> value_type;
+    // the storage for the entries (which comes from the dynamic memory
+    // resource)
+    typedef std::vector<value_type, dynamic_allocator<value_type>> entry_list;
+    typedef entry_list::iterator iterator;
+    typedef entry_list::const_iterator const_iterator;
+    typedef std::size_t size_type;
+
+    dynamic_map() = default;
+
+    dynamic_map(std::initializer_list<value_type> entries);
+
+    // Construct a map from a list of entries in any order. If a key appears
+    // more than once, the last entry with that key wins (as it would if the
+    // entries were assigned to a std::map one by one).
+    explicit dynamic_map(entry_list entries);
+    explicit dynamic_map(std::vector<value_type> entries);
+
+    iterator
+    begin();
+    const_iterator
+    begin() const;
+    iterator
+    end();
+    const_iterator
+    end() const;
+
+    bool
+    empty() const;
+    size_type
+    size() const;
+
+    void
+    clear();
+    void
+    reserve(size_type capacity);
+
+    // Get the value associated with :key, inserting a nil value if there
+    // isn't one yet. Inserting keys in order is amortized O(1).
+    dynamic&
+    operator[](dynamic const& key);
+    dynamic&
+    operator[](dynamic&& key);
+
+    // Get the value associated with :key.
+    // If there isn't one, this throws std::out_of_range.
+    dynamic&
+    at(dynamic const& key);
+    dynamic const&
+    at(dynamic const& key) const;
+
+    iterator
+    find(dynamic const& key);
+    const_iterator
+    find(dynamic const& key) const;
+
+    // Find a string key. (This accepts anything that converts to a
+    // std::string_view.)
+    template<
+        class Key,
+        std::enable_if_t<
+            std::is_convertible_v<Key const&, std::string_view>,
+            int> = 0>
+    iterator
+    find(Key const& key)
+    {
+        return find_string(std::string_view(key));
+    }
+    template<
+        class Key,
+        std::enable_if_t<
+            std::is_convertible_v<Key const&, std::string_view>,
+            int> = 0>
+    const_iterator
+    find(Key const& key) const
+    {
+        return find_string(std::string_view(key));
+    }
+
+    size_type
+    count(dynamic const& key) const;
+    template<
+        class Key,
+        std::enable_if_t<
+            std::is_convertible_v<Key const&, std::string_view>,
+            int> = 0>
+    size_type
+    count(Key const& key) const
+    {
+        return find(key) != end() ? 1 : 0;
+    }
+
+    // Insert :entry if its key isn't already in the map.
+    // The returned flag indicates whether or not the insertion happened.
+    std::pair<iterator, bool>
+    insert(value_type entry);
+
+    iterator
+    erase(const_iterator position);
+    size_type
+    erase(dynamic const& key);
+
+ private:
+    iterator
+    find_string(std::string_view key);
+    const_iterator
+    find_string(std::string_view key) const;
+
+    entry_list entries_;
+};
+
+bool
+operator==(dynamic_map const& a, dynamic_map const& b);
+bool
+operator!=(dynamic_map const& a, dynamic_map const& b);
+bool
+operator<(dynamic_map const& a, dynamic_map const& b);
+
+// Map keys (i.e., field names) are repeated in every record, so they can be
+// interned: each distinct key string is stored once, as a string_symbol in a
+// global symbol table, and the dynamic values for the keys just point to
+// their symbols. Symbols live for the lifetime of the program, so two
+// interned strings are equal iff they point to the same symbol.
+//
+// Interned strings are still just strings as far as users of dynamic are
+// concerned. (See intern_string() for how to create them.)
+//
+struct string_symbol
+{
+    string text;
+    // the hash of :text (as computed by invoke_hash)
+    std::size_t hash;
+};
+
+// Arrays, maps and large strings are held by shared_ptr so that copying a
+// dynamic value doesn't copy its whole tree. They're copy-on-write: they're
+// shared between copies until one of the copies is modified. (cast<T>()
+// handles this, so it's transparent to users of dynamic.)
+//
+// The alternatives mirror value_type, except that large strings, packed
+// arrays, tables and interned strings are stored in extra alternatives at the
+// end.
+// (Small strings aren't worth an extra allocation.)
+//
 using dynamic_storage = std::variant<
     nil_t,
     bool,
@@ -128,8 +490,14 @@ using dynamic_storage = std::variant<
     string,
     std::shared_ptr<blob>,
     boost::posix_time::ptime,
-    dynamic_array,
-    dynamic_map>;
+    std::shared_ptr<dynamic_array>,
+    std::shared_ptr<dynamic_map>,
+    std::shared_ptr<string>,
+    std::shared_ptr<packed_array<bool>>,
+    std::shared_ptr<packed_array<integer>>,
+    std::shared_ptr<packed_array<double>>,
+    std::shared_ptr<record_table>,
+    string_symbol const*>;
 
 struct dynamic
 {
@@ -170,6 +538,10 @@ struct dynamic
     {
         set(string(v));
     }
+    dynamic(string_symbol const& v)
+    {
+        set(v);
+    }
     dynamic(blob const& v)
     {
         set(v);
@@ -202,6 +574,24 @@ struct dynamic
     {
         set(std::move(v));
     }
+    template<class T>
+    dynamic(packed_array<T> const& v)
+    {
+        set(v);
+    }
+    template<class T>
+    dynamic(packed_array<T>&& v)
+    {
+        set(std::move(v));
+    }
+    dynamic(record_table const& v)
+    {
+        set(v);
+    }
+    dynamic(record_table&& v)
+    {
+        set(std::move(v));
+    }
 
     // Construct from an initializer list.
     dynamic(std::initializer_list<dynamic> list);
@@ -212,8 +602,30 @@ struct dynamic
     value_type
     type() const
     {
-        return value_type(storage_.index());
-    }
+        return storage_types[storage_.index()];
+    }
+
+    // Strings at least this long are shared between copies.
+    static constexpr std::size_t large_string_size = 256;
+
+    // the value_type of each alternative within dynamic_storage
+    static constexpr value_type
+        storage_types[std::variant_size_v<dynamic_storage>]
+        = {value_type::NIL,
+           value_type::BOOLEAN,
+           value_type::INTEGER,
+           value_type::FLOAT,
+           value_type::STRING,
+           value_type::BLOB,
+           value_type::DATETIME,
+           value_type::ARRAY,
+           value_type::MAP,
+           value_type::STRING,
+           value_type::ARRAY,
+           value_type::ARRAY,
+           value_type::ARRAY,
+           value_type::ARRAY,
+           value_type::STRING};
 
     // Get the contents.
     // This should be used with caution.
@@ -266,12 +678,18 @@ struct dynamic
     void
     set(string const& v)
     {
-        storage_ = v;
+        if (v.size() >= large_string_size)
+            storage_ = allocate_dynamic_node<string>(v);
+        else
+            storage_ = v;
     }
     void
     set(string&& v)
     {
-        storage_ = std::move(v);
+        if (v.size() >= large_string_size)
+            storage_ = allocate_dynamic_node<string>(std::move(v));
+        else
+            storage_ = std::move(v);
     }
     void
     set(char const* v)
@@ -279,14 +697,19 @@ struct dynamic
         set(string(v));
     }
     void
+    set(string_symbol const& v)
+    {
+        storage_ = &v;
+    }
+    void
     set(blob const& v)
     {
-        storage_ = std::make_shared<blob>(v);
+        storage_ = allocate_dynamic_node<blob>(v);
     }
     void
     set(blob&& v)
     {
-        storage_ = std::make_shared<blob>(std::move(v));
+        storage_ = allocate_dynamic_node<blob>(std::move(v));
     }
     void
     set(boost::posix_time::ptime const& v)
@@ -301,22 +724,44 @@ struct dynamic
     void
     set(dynamic_array const& v)
     {
-        storage_ = v;
+        storage_ = allocate_dynamic_node<dynamic_array>(v);
     }
     void
     set(dynamic_array&& v)
     {
-        storage_ = std::move(v);
+        storage_ = allocate_dynamic_node<dynamic_array>(std::move(v));
     }
     void
     set(dynamic_map const& v)
     {
-        storage_ = v;
+        storage_ = allocate_dynamic_node<dynamic_map>(v);
     }
     void
     set(dynamic_map&& v)
     {
-        storage_ = std::move(v);
+        storage_ = allocate_dynamic_node<dynamic_map>(std::move(v));
+    }
+    template<class T>
+    void
+    set(packed_array<T> const& v)
+    {
+        storage_ = allocate_dynamic_node<packed_array<T>>(v);
+    }
+    template<class T>
+    void
+    set(packed_array<T>&& v)
+    {
+        storage_ = allocate_dynamic_node<packed_array<T>>(std::move(v));
+    }
+    void
+    set(record_table const& v)
+    {
+        storage_ = allocate_dynamic_node<record_table>(v);
+    }
+    void
+    set(record_table&& v)
+    {
+        storage_ = allocate_dynamic_node<record_table>(std::move(v));
     }
 
     friend void
@@ -325,6 +770,68 @@ struct dynamic
     dynamic_storage storage_;
 };
 
+inline dynamic_map::iterator
+dynamic_map::begin()
+{
+    return entries_.begin();
+}
+inline dynamic_map::const_iterator
+dynamic_map::begin() const
+{
+    return entries_.begin();
+}
+inline dynamic_map::iterator
+dynamic_map::end()
+{
+    return entries_.end();
+}
+inline dynamic_map::const_iterator
+dynamic_map::end() const
+{
+    return entries_.end();
+}
+
+inline bool
+dynamic_map::empty() const
+{
+    return entries_.empty();
+}
+inline dynamic_map::size_type
+dynamic_map::size() const
+{
+    return entries_.size();
+}
+
+inline void
+dynamic_map::clear()
+{
+    entries_.clear();
+}
+inline void
+dynamic_map::reserve(size_type capacity)
+{
+    entries_.reserve(capacity);
+}
+
+template<class T>
+dynamic_array
+packed_array<T>::unpack() const
+{
+    dynamic_array array;
+    array.reserve(values.size());
+    for (auto const& value : values)
+        array.emplace_back(T(value));
+    return array;
+}
+
+inline record_table::record_table(
+    std::vector<dynamic> keys,
+    std::vector<dynamic> columns,
+    std::size_t row_count)
+    : keys(std::move(keys)), columns(std::move(columns)), row_count(row_count)
+{
+}
+
 // omissible<T> is essentially the same as optional<T>, but it obeys
 // Thinknode's behavior for omissible fields. (It should only be used as a
 // field in a structure.)
@@ -236,8 +236,7 @@ from_dynamic(blob* x, dynamic const& v)
 size_t
 hash_value(blob const& x)
 {
-    uint8_t const* bytes = reinterpret_cast<uint8_t const*>(x.data);
-    return boost::hash_range(bytes, bytes + x.size);
+    return size_t(hash_bytes(x.data, x.size));
 }
 
 blob
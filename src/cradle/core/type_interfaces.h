@@ -1,7 +1,10 @@
 #ifndef CRADLE_CORE_TYPE_INTERFACES_HPP
 #define CRADLE_CORE_TYPE_INTERFACES_HPP
 
+#include <algorithm>
+#include <cstring>
 #include <map>
+#include <type_traits>
 #include <vector>
 
 #include <boost/date_time/gregorian/gregorian_types.hpp>
@@ -326,10 +329,98 @@ make_blob(byte_vector v);
 
 // STD::VECTOR
 
+namespace detail {
+
+// Read the elements of :array into :x (which must have room for all of them).
+// When the element types match, this is a single memcpy.
+template<class T, class Element>
+void
+from_packed_array(T* x, packed_array<Element> const& array)
+{
+    size_t n_elements = array.size();
+    if constexpr (std::is_same_v<T, Element> && !std::is_same_v<T, bool>)
+    {
+        if (n_elements != 0)
+            std::memcpy(x, array.values.data(), n_elements * sizeof(T));
+    }
+    else if constexpr (
+        std::is_same_v<T, double> && std::is_same_v<Element, integer>)
+    {
+        std::transform(
+            array.values.begin(),
+            array.values.end(),
+            x,
+            [](integer i) { return double(i); });
+    }
+    else
+    {
+        for (size_t i = 0; i != n_elements; ++i)
+        {
+            try
+            {
+                from_dynamic(&x[i], dynamic(array[i]));
+            }
+            catch (boost::exception& e)
+            {
+                add_dynamic_path_element(e, integer(i));
+                throw;
+            }
+        }
+    }
+}
+
+// Read the rows of :table into :x (which must have room for all of them).
+// Each row is read from the same record, with its values replaced from the
+// columns as it goes, so the table is never expanded.
+template<class T>
+void
+from_record_table(T* x, record_table const& table)
+{
+    if (table.size() == 0)
+        return;
+    dynamic record = table.row(0);
+    for (size_t i = 0; i != table.size(); ++i)
+    {
+        try
+        {
+            if (i != 0)
+            {
+                size_t j = 0;
+                for (auto& entry : cast<dynamic_map>(record))
+                {
+                    visit_array_element(
+                        table.columns[j++], i, [&](dynamic const& value) {
+                            entry.second = value;
+                        });
+                }
+            }
+            from_dynamic(&x[i], std::as_const(record));
+        }
+        catch (boost::exception& e)
+        {
+            add_dynamic_path_element(e, integer(i));
+            throw;
+        }
+    }
+}
+
+} // namespace detail
+
 template<class T>
 void
 to_dynamic(dynamic* v, std::vector<T> const& x)
 {
+    // Arrays of doubles and integers can be stored packed (which is just a
+    // copy of :x). Empty arrays are never packed.
+    if constexpr (std::is_same_v<T, double> || std::is_same_v<T, integer>)
+    {
+        if (!x.empty())
+        {
+            *v = packed_array<T>(x);
+            return;
+        }
+    }
+
     dynamic_array array;
     size_t n_elements = x.size();
     array.resize(n_elements);
@@ -353,7 +444,22 @@ from_dynamic(std::vector<T>* x, dynamic const& v)
         return;
     }
 
-    dynamic_array const& array = cast<dynamic_array>(v);
+    if (visit_packed_array(v, [x](auto const& array) {
+            x->resize(array.size());
+            detail::from_packed_array(x->data(), array);
+        }))
+    {
+        return;
+    }
+    if (auto const* table = get_record_table(v))
+    {
+        x->resize(table->size());
+        detail::from_record_table(x->data(), *table);
+        return;
+    }
+
+    check_type(value_type::ARRAY, v.type());
+    dynamic_array const& array = *get_dynamic_array(v);
     size_t n_elements = array.size();
     x->resize(n_elements);
     for (size_t i = 0; i != n_elements; ++i)
@@ -423,7 +529,22 @@ from_dynamic(std::array<T, N>* x, dynamic const& v)
         }
     }
 
-    dynamic_array const& l = cast<dynamic_array>(v);
+    if (visit_packed_array(v, [x](auto const& array) {
+            check_array_size(N, array.size());
+            detail::from_packed_array(x->data(), array);
+        }))
+    {
+        return;
+    }
+    if (auto const* table = get_record_table(v))
+    {
+        check_array_size(N, table->size());
+        detail::from_record_table(x->data(), *table);
+        return;
+    }
+
+    check_type(value_type::ARRAY, v.type());
+    dynamic_array const& l = *get_dynamic_array(v);
     check_array_size(N, l.size());
     for (size_t i = 0; i != N; ++i)
     {
@@ -481,7 +602,7 @@ from_dynamic(std::map<Key, Value>* x, dynamic const& v)
     // Certain ways of encoding values (e.g., JSON) have the same
     // representation for empty arrays and empty maps, so if we encounter an
     // empty array here, we should treat it as an empty map.
-    if (v.type() == value_type::ARRAY && cast<dynamic_array>(v).empty())
+    if (v.type() == value_type::ARRAY && get_array_size(v) == 0)
     {
         // *x is already empty because it's default-constructed.
         return;
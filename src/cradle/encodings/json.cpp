@@ -45,6 +45,77 @@ array_resembles_map(simdjson::dom::array const& array)
     return true;
 }
 
+// Read the elements of :source as a packed array of Ts (into :v) if they're
+// all accepted by :is_element.
+template<class T, class IsElement, class ReadElement>
+static bool
+read_packed_elements(
+    dynamic& v,
+    simdjson::dom::array const& source,
+    IsElement&& is_element,
+    ReadElement&& read_element)
+{
+    for (auto const& element : source)
+    {
+        if (!is_element(element.type()))
+            return false;
+    }
+    std::vector<typename packed_array<T>::storage_type> values;
+    values.reserve(source.size());
+    for (auto const& element : source)
+        values.push_back(read_element(element));
+    v = packed_array<T>(std::move(values));
+    return true;
+}
+
+// Nonempty arrays of numbers (or booleans) that all have the same type are
+// read as packed arrays. If :source is one of those, this reads it into :v and
+// returns true.
+static bool
+read_packed_array(dynamic& v, simdjson::dom::array const& source)
+{
+    if (source.size() == 0)
+        return false;
+    typedef simdjson::dom::element_type element_type;
+    switch ((*source.begin()).type())
+    {
+        case element_type::BOOL:
+            return read_packed_elements<bool>(
+                v,
+                source,
+                [](element_type type) { return type == element_type::BOOL; },
+                [](simdjson::dom::element const& element) {
+                    return uint8_t(bool(element) ? 1 : 0);
+                });
+        case element_type::INT64:
+        case element_type::UINT64:
+            return read_packed_elements<integer>(
+                v,
+                source,
+                [](element_type type) {
+                    return type == element_type::INT64
+                           || type == element_type::UINT64;
+                },
+                [](simdjson::dom::element const& element) {
+                    if (element.type() == element_type::INT64)
+                        return boost::numeric_cast<integer>(int64_t(element));
+                    return boost::numeric_cast<integer>(uint64_t(element));
+                });
+        case element_type::DOUBLE:
+            return read_packed_elements<double>(
+                v,
+                source,
+                [](element_type type) {
+                    return type == element_type::DOUBLE;
+                },
+                [](simdjson::dom::element const& element) {
+                    return double(element);
+                });
+        default:
+            return false;
+    }
+}
+
 static bool
 safe_isdigit(char ch)
 {
@@ -99,17 +170,22 @@ read_json_value(simdjson::dom::element const& json)
             // If this resembles an encoded map, read it as that.
             if (array_resembles_map(source))
             {
-                dynamic_map map;
+                dynamic_map::entry_list entries;
+                entries.reserve(source.size());
                 for (auto const& i : source)
                 {
-                    map[read_json_value(i["key"])]
-                        = read_json_value(i["value"]);
+                    entries.emplace_back(
+                        read_json_value(i["key"]),
+                        read_json_value(i["value"]));
                 }
-                return map;
+                return dynamic_map(std::move(entries));
             }
             // Otherwise, read it as an actual array.
             else
             {
+                dynamic packed;
+                if (read_packed_array(packed, source))
+                    return packed;
                 dynamic_array array;
                 array.reserve(source.size());
                 for (auto const& i : source)
@@ -162,13 +238,16 @@ read_json_value(simdjson::dom::element const& json)
             }
             else
             {
-                // Otherwise, interpret it as a map.
-                dynamic_map map;
+                // Otherwise, interpret it as a map. (Keys are usually field
+                // names, so they're interned.)
+                dynamic_map::entry_list entries;
+                entries.reserve(object.size());
                 for (auto const& i : object)
                 {
-                    map[string(i.key)] = read_json_value(i.value);
+                    entries.emplace_back(
+                        make_map_key(i.key), read_json_value(i.value));
                 }
-                return map;
+                return dynamic_map(std::move(entries));
             }
         }
     }
@@ -238,9 +317,46 @@ to_nlohmann_json(dynamic const& v)
             return to_value_string(cast<boost::posix_time::ptime>(v));
         case value_type::ARRAY: {
             nlohmann::json json(nlohmann::json::value_t::array);
-            for (auto const& i : cast<dynamic_array>(v))
+            if (auto const* table = get_record_table(v))
+            {
+                // Tables are written straight from their columns (unless
+                // they have non-string keys, in which case each row is
+                // written as a map).
+                bool string_keys = true;
+                for (auto const& key : table->keys)
+                {
+                    if (key.type() != value_type::STRING)
+                        string_keys = false;
+                }
+                for (size_t i = 0; i != table->size(); ++i)
+                {
+                    if (!string_keys)
+                    {
+                        json.push_back(
+                            to_nlohmann_json(get_array_element(v, i)));
+                        continue;
+                    }
+                    nlohmann::json row(nlohmann::json::value_t::object);
+                    for (size_t j = 0; j != table->keys.size(); ++j)
+                    {
+                        visit_array_element(
+                            table->columns[j], i, [&](dynamic const& x) {
+                                row[cast<string>(table->keys[j])]
+                                    = to_nlohmann_json(x);
+                            });
+                    }
+                    json.push_back(std::move(row));
+                }
+            }
+            else if (!visit_packed_array(v, [&](auto const& array) {
+                         for (size_t i = 0; i != array.size(); ++i)
+                             json.push_back(array[i]);
+                     }))
             {
-                json.push_back(to_nlohmann_json(i));
+                for (auto const& i : *get_dynamic_array(v))
+                {
+                    json.push_back(to_nlohmann_json(i));
+                }
             }
             return json;
         }
@@ -1,11 +1,158 @@
 #include <cradle/encodings/msgpack.h>
 
+#include <algorithm>
+
 #include <cradle/encodings/msgpack_internals.h>
 #include <cradle/utilities/text.h>
 
 namespace cradle {
 
+// Read the elements of :array as a packed array of Ts (into :v) if they're
+// all accepted by :is_element.
+template<class T, class IsElement, class ReadElement>
+static bool
+read_packed_elements(
+    dynamic& v,
+    msgpack::object_array const& array,
+    IsElement&& is_element,
+    ReadElement&& read_element)
+{
+    auto const* begin = array.ptr;
+    auto const* end = array.ptr + array.size;
+    if (!std::all_of(begin, end, is_element))
+        return false;
+    std::vector<typename packed_array<T>::storage_type> values(array.size);
+    std::transform(begin, end, values.begin(), read_element);
+    v = packed_array<T>(std::move(values));
+    return true;
+}
+
+// Nonempty arrays of numbers (or booleans) that all have the same type are
+// read as packed arrays. If :array is one of those, this reads it into :v and
+// returns true.
+static bool
+read_packed_array(dynamic& v, msgpack::object_array const& array)
+{
+    if (array.size == 0)
+        return false;
+    auto is_integer = [](msgpack::object const& object) {
+        return object.type == msgpack::type::POSITIVE_INTEGER
+               || object.type == msgpack::type::NEGATIVE_INTEGER;
+    };
+    switch (array.ptr[0].type)
+    {
+        case msgpack::type::BOOLEAN:
+            return read_packed_elements<bool>(
+                v,
+                array,
+                [](msgpack::object const& object) {
+                    return object.type == msgpack::type::BOOLEAN;
+                },
+                [](msgpack::object const& object) {
+                    return uint8_t(object.via.boolean ? 1 : 0);
+                });
+        case msgpack::type::POSITIVE_INTEGER:
+        case msgpack::type::NEGATIVE_INTEGER:
+            return read_packed_elements<integer>(
+                v, array, is_integer, [](msgpack::object const& object) {
+                    return object.type == msgpack::type::POSITIVE_INTEGER
+                               ? boost::numeric_cast<integer>(object.via.u64)
+                               : boost::numeric_cast<integer>(object.via.i64);
+                });
+        case msgpack::type::FLOAT:
+            return read_packed_elements<double>(
+                v,
+                array,
+                [](msgpack::object const& object) {
+                    return object.type == msgpack::type::FLOAT;
+                },
+                [](msgpack::object const& object) {
+                    return boost::numeric_cast<double>(object.via.f64);
+                });
+        default:
+            return false;
+    }
+}
+
+// Read a map key. Keys are usually field names, so string keys are interned.
 static dynamic
+read_msgpack_key(
+    ownership_holder const& ownership, msgpack::object const& key)
+{
+    if (key.type == msgpack::type::STR)
+    {
+        return make_map_key(
+            std::string_view(key.via.str.ptr, key.via.str.size));
+    }
+    return read_msgpack_value(ownership, key);
+}
+
+// Arrays of two or more records that all have the same keys (in the same
+// order) are read as tables. If :array is one of those, this reads it into
+// :v and returns true. Otherwise, it returns false.
+static bool
+read_record_table(
+    ownership_holder const& ownership,
+    dynamic& v,
+    msgpack::object_array const& array)
+{
+    if (array.size < 2 || array.ptr[0].type != msgpack::type::MAP)
+        return false;
+    auto const& first = array.ptr[0].via.map;
+    if (first.size == 0)
+        return false;
+    for (size_t i = 1; i != array.size; ++i)
+    {
+        auto const& record = array.ptr[i];
+        if (record.type != msgpack::type::MAP
+            || record.via.map.size != first.size)
+        {
+            return false;
+        }
+        for (size_t j = 0; j != first.size; ++j)
+        {
+            if (!(record.via.map.ptr[j].key == first.ptr[j].key))
+                return false;
+        }
+    }
+
+    // The keys don't have to be in order, but they do have to be unique.
+    std::vector<dynamic> keys;
+    keys.reserve(first.size);
+    for (size_t j = 0; j != first.size; ++j)
+        keys.push_back(read_msgpack_key(ownership, first.ptr[j].key));
+    std::vector<size_t> order(first.size);
+    for (size_t j = 0; j != first.size; ++j)
+        order[j] = j;
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return keys[a] < keys[b];
+    });
+    for (size_t j = 1; j != first.size; ++j)
+    {
+        if (!(keys[order[j - 1]] < keys[order[j]]))
+            return false;
+    }
+
+    std::vector<dynamic> sorted_keys;
+    sorted_keys.reserve(first.size);
+    std::vector<dynamic> columns;
+    columns.reserve(first.size);
+    for (size_t j : order)
+    {
+        dynamic_array column(array.size);
+        for (size_t i = 0; i != array.size; ++i)
+        {
+            column[i] = read_msgpack_value(
+                ownership, array.ptr[i].via.map.ptr[j].val);
+        }
+        sorted_keys.push_back(std::move(keys[j]));
+        columns.push_back(compact_array(std::move(column)));
+    }
+    v = record_table(std::move(sorted_keys), std::move(columns), array.size);
+    return true;
+}
+
+dynamic
 read_msgpack_value(
     ownership_holder const& ownership, msgpack::object const& object)
 {
@@ -35,6 +182,12 @@ read_msgpack_value(
             return b;
         }
         case msgpack::type::ARRAY: {
+            dynamic compact;
+            if (read_packed_array(compact, object.via.array)
+                || read_record_table(ownership, compact, object.via.array))
+            {
+                return compact;
+            }
             size_t size = object.via.array.size;
             dynamic_array array;
             array.reserve(size);
@@ -46,14 +199,16 @@ read_msgpack_value(
             return array;
         }
         case msgpack::type::MAP: {
-            dynamic_map map;
+            dynamic_map::entry_list entries;
+            entries.reserve(object.via.map.size);
             for (size_t i = 0; i != object.via.map.size; ++i)
             {
                 auto const& pair = object.via.map.ptr[i];
-                map[read_msgpack_value(ownership, pair.key)]
-                    = read_msgpack_value(ownership, pair.val);
+                entries.emplace_back(
+                    read_msgpack_key(ownership, pair.key),
+                    read_msgpack_value(ownership, pair.val));
             }
-            return map;
+            return dynamic_map(std::move(entries));
         }
         case msgpack::type::EXT: {
             switch (object.via.ext.type())
@@ -107,8 +262,8 @@ read_msgpack_value(
     }
 }
 
-dynamic
-parse_msgpack_value(uint8_t const* data, size_t size)
+std::shared_ptr<msgpack::object_handle>
+unpack_shared_msgpack_object(uint8_t const* data, size_t size)
 {
     // msgpack::unpack returns a unique handle which contains the object and
     // also owns the data stored within the object. Copying the handle
@@ -122,6 +277,13 @@ parse_msgpack_value(uint8_t const* data, size_t size)
     std::shared_ptr<msgpack::object_handle> shared_handle(
         new msgpack::object_handle);
     *shared_handle = std::move(handle);
+    return shared_handle;
+}
+
+dynamic
+parse_msgpack_value(uint8_t const* data, size_t size)
+{
+    auto const shared_handle = unpack_shared_msgpack_object(data, size);
     ownership_holder ownership;
     ownership = shared_handle;
     return read_msgpack_value(ownership, shared_handle->get());
@@ -2,7 +2,7 @@
 #define CRADLE_ENCODINGS_MSGPACK_INTERNALS_H
 
 // This file provides a generic implementation of msgpack encodings/decoding on
-// dynamic values. (Well, currently only encoding is implemented.)
+// dynamic values, along with direct encoding/decoding of typed values.
 //
 // This takes care of understanding CRADLE dynamic values and interfacing them
 // with msgpack-c, but it leaves it up to you to supply the implementation of
@@ -14,10 +14,17 @@
 // includes all sorts of other stuff, includings windows.h on Windows, so use
 // with caution.
 
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string_view>
+
 #include <boost/endian/conversion.hpp>
 #include <boost/numeric/conversion/cast.hpp>
 
 #include <cradle/encodings/msgpack.h>
+#include <cradle/encodings/typed_encoding.h>
 
 // Include msgpack-c, disabling any warnings that it would trigger.
 #define MSGPACK_USE_CPP11
@@ -37,89 +44,159 @@
 
 namespace cradle {
 
+namespace detail {
+
+// Write a scalar. (These are shared by scalar values and the elements of
+// packed arrays.)
+
+template<class Buffer>
+void
+write_msgpack_scalar(msgpack::packer<Buffer>& packer, bool x)
+{
+    if (x)
+        packer.pack_true();
+    else
+        packer.pack_false();
+}
+
+template<class Buffer>
+void
+write_msgpack_scalar(msgpack::packer<Buffer>& packer, integer x)
+{
+    packer.pack_int64(x);
+}
+
+template<class Buffer>
+void
+write_msgpack_scalar(msgpack::packer<Buffer>& packer, double x)
+{
+    packer.pack_double(x);
+}
+
+template<class Buffer>
+void
+write_msgpack_string(msgpack::packer<Buffer>& packer, std::string_view s)
+{
+    packer.pack_str(boost::numeric_cast<uint32_t>(s.length()));
+    packer.pack_str_body(s.data(), boost::numeric_cast<uint32_t>(s.length()));
+}
+
+template<class Buffer>
+void
+write_msgpack_blob(msgpack::packer<Buffer>& packer, blob const& x)
+{
+    // Check to make sure that the blob size is within the MessagePack
+    // specification's limit.
+    if (x.size >= 0x1'00'00'00'00)
+    {
+        CRADLE_THROW(
+            msgpack_blob_size_limit_exceeded()
+            << msgpack_blob_size_info(x.size)
+            << msgpack_blob_size_limit_info(0x1'00'00'00'00));
+    }
+    packer.pack_bin(boost::numeric_cast<uint32_t>(x.size));
+    packer.pack_bin_body(
+        reinterpret_cast<char const*>(x.data),
+        boost::numeric_cast<uint32_t>(x.size));
+}
+
+template<class Buffer>
+void
+write_msgpack_datetime(msgpack::packer<Buffer>& packer, ptime const& time)
+{
+    int8_t const ext_type = 1; // Thinknode datetime ext type
+    int64_t t = (time - ptime(date(1970, 1, 1))).total_milliseconds();
+    // We need to use the smallest possible int type to store the datetime.
+    if (t >= -0x80 && t < 0x80)
+    {
+        int8_t x = int8_t(t);
+        packer.pack_ext(1, ext_type);
+        packer.pack_ext_body(reinterpret_cast<char const*>(&x), 1);
+    }
+    else if (t >= -0x80'00 && t < 0x80'00)
+    {
+        int16_t x = int16_t(t);
+        boost::endian::native_to_big_inplace(x);
+        packer.pack_ext(2, ext_type);
+        packer.pack_ext_body(reinterpret_cast<char const*>(&x), 2);
+    }
+    else if (t >= -int64_t(0x80'00'00'00) && t < int64_t(0x80'00'00'00))
+    {
+        int32_t x = int32_t(t);
+        boost::endian::native_to_big_inplace(x);
+        packer.pack_ext(4, ext_type);
+        packer.pack_ext_body(reinterpret_cast<char const*>(&x), 4);
+    }
+    else
+    {
+        int64_t x = int64_t(t);
+        boost::endian::native_to_big_inplace(x);
+        packer.pack_ext(8, ext_type);
+        packer.pack_ext_body(reinterpret_cast<char const*>(&x), 8);
+    }
+}
+
+} // namespace detail
+
 template<class Buffer>
 void
 write_msgpack_value(msgpack::packer<Buffer>& packer, dynamic const& v)
 {
+    // Packed arrays are written directly from their packed values.
+    if (visit_packed_array(v, [&](auto const& array) {
+            packer.pack_array(boost::numeric_cast<uint32_t>(array.size()));
+            for (size_t i = 0; i != array.size(); ++i)
+                detail::write_msgpack_scalar(packer, array[i]);
+        }))
+    {
+        return;
+    }
+    // Tables are written as the arrays of records that they represent,
+    // straight from their columns.
+    if (auto const* table = get_record_table(v))
+    {
+        auto const key_count
+            = boost::numeric_cast<uint32_t>(table->keys.size());
+        packer.pack_array(boost::numeric_cast<uint32_t>(table->size()));
+        for (size_t i = 0; i != table->size(); ++i)
+        {
+            packer.pack_map(key_count);
+            for (size_t j = 0; j != table->keys.size(); ++j)
+            {
+                write_msgpack_value(packer, table->keys[j]);
+                visit_array_element(
+                    table->columns[j], i, [&](dynamic const& x) {
+                        write_msgpack_value(packer, x);
+                    });
+            }
+        }
+        return;
+    }
     switch (v.type())
     {
         case value_type::NIL:
             packer.pack_nil();
             break;
         case value_type::BOOLEAN:
-            if (cast<bool>(v))
-                packer.pack_true();
-            else
-                packer.pack_false();
+            detail::write_msgpack_scalar(packer, cast<bool>(v));
             break;
         case value_type::INTEGER:
-            packer.pack_int64(cast<integer>(v));
+            detail::write_msgpack_scalar(packer, cast<integer>(v));
             break;
         case value_type::FLOAT:
-            packer.pack_double(cast<double>(v));
+            detail::write_msgpack_scalar(packer, cast<double>(v));
             break;
-        case value_type::STRING: {
-            auto const& s = cast<string>(v);
-            packer.pack_str(boost::numeric_cast<uint32_t>(s.length()));
-            packer.pack_str_body(
-                s.c_str(), boost::numeric_cast<uint32_t>(s.length()));
+        case value_type::STRING:
+            detail::write_msgpack_string(packer, cast<string>(v));
             break;
-        }
-        case value_type::BLOB: {
-            blob const& x = cast<blob>(v);
-            // Check to make sure that the blob size is within the MessagePack
-            // specification's limit.
-            if (x.size >= 0x1'00'00'00'00)
-            {
-                CRADLE_THROW(
-                    msgpack_blob_size_limit_exceeded()
-                    << msgpack_blob_size_info(x.size)
-                    << msgpack_blob_size_limit_info(0x1'00'00'00'00));
-            }
-            packer.pack_bin(boost::numeric_cast<uint32_t>(x.size));
-            packer.pack_bin_body(
-                reinterpret_cast<char const*>(x.data),
-                boost::numeric_cast<uint32_t>(x.size));
+        case value_type::BLOB:
+            detail::write_msgpack_blob(packer, cast<blob>(v));
             break;
-        }
-        case value_type::DATETIME: {
-            int8_t const ext_type = 1; // Thinknode datetime ext type
-            int64_t t = (cast<ptime>(v) - ptime(date(1970, 1, 1)))
-                            .total_milliseconds();
-            // We need to use the smallest possible int type to store the
-            // datetime.
-            if (t >= -0x80 && t < 0x80)
-            {
-                int8_t x = int8_t(t);
-                packer.pack_ext(1, ext_type);
-                packer.pack_ext_body(reinterpret_cast<char const*>(&x), 1);
-            }
-            else if (t >= -0x80'00 && t < 0x80'00)
-            {
-                int16_t x = int16_t(t);
-                boost::endian::native_to_big_inplace(x);
-                packer.pack_ext(2, ext_type);
-                packer.pack_ext_body(reinterpret_cast<char const*>(&x), 2);
-            }
-            else if (
-                t >= -int64_t(0x80'00'00'00) && t < int64_t(0x80'00'00'00))
-            {
-                int32_t x = int32_t(t);
-                boost::endian::native_to_big_inplace(x);
-                packer.pack_ext(4, ext_type);
-                packer.pack_ext_body(reinterpret_cast<char const*>(&x), 4);
-            }
-            else
-            {
-                int64_t x = int64_t(t);
-                boost::endian::native_to_big_inplace(x);
-                packer.pack_ext(8, ext_type);
-                packer.pack_ext_body(reinterpret_cast<char const*>(&x), 8);
-            }
+        case value_type::DATETIME:
+            detail::write_msgpack_datetime(packer, cast<ptime>(v));
             break;
-        }
         case value_type::ARRAY: {
-            dynamic_array const& x = cast<dynamic_array>(v);
+            dynamic_array const& x = *get_dynamic_array(v);
             size_t size = x.size();
             packer.pack_array(boost::numeric_cast<uint32_t>(size));
             for (size_t i = 0; i != size; ++i)
@@ -139,6 +216,422 @@ write_msgpack_value(msgpack::packer<Buffer>& packer, dynamic const& v)
     }
 }
 
+// TYPED ENCODING
+//
+// The following overloads write the MessagePack encoding of a typed value
+// (i.e., the encoding of to_dynamic(x)) without converting the value to a
+// dynamic first. Types without an overload of their own fall back to the
+// conversion.
+
+template<class Buffer, class T>
+void
+write_msgpack_value(msgpack::packer<Buffer>& packer, T const& x)
+{
+    write_msgpack_value(packer, to_dynamic(x));
+}
+
+template<class Buffer>
+void
+write_msgpack_value(msgpack::packer<Buffer>& packer, bool x)
+{
+    detail::write_msgpack_scalar(packer, x);
+}
+
+template<class Buffer, dynamic_integer_type T>
+void
+write_msgpack_value(msgpack::packer<Buffer>& packer, T const& x)
+{
+    detail::write_msgpack_scalar(packer, boost::numeric_cast<integer>(x));
+}
+
+template<class Buffer, std::floating_point T>
+void
+write_msgpack_value(msgpack::packer<Buffer>& packer, T const& x)
+{
+    detail::write_msgpack_scalar(packer, double(x));
+}
+
+template<class Buffer>
+void
+write_msgpack_value(msgpack::packer<Buffer>& packer, string const& x)
+{
+    detail::write_msgpack_string(packer, x);
+}
+
+template<class Buffer>
+void
+write_msgpack_value(msgpack::packer<Buffer>& packer, blob const& x)
+{
+    detail::write_msgpack_blob(packer, x);
+}
+
+template<class Buffer>
+void
+write_msgpack_value(msgpack::packer<Buffer>& packer, ptime const& x)
+{
+    detail::write_msgpack_datetime(packer, x);
+}
+
+template<class Buffer, class T>
+void
+write_msgpack_value(msgpack::packer<Buffer>& packer, std::vector<T> const& x)
+{
+    packer.pack_array(boost::numeric_cast<uint32_t>(x.size()));
+    for (auto const& item : x)
+        write_msgpack_value(packer, item);
+}
+
+namespace detail {
+
+// optional and omissible values are both encoded as unions of "some" and
+// "none".
+template<class Buffer, class Optional>
+void
+write_msgpack_optional(msgpack::packer<Buffer>& packer, Optional const& x)
+{
+    packer.pack_map(1);
+    if (x)
+    {
+        write_msgpack_string(packer, "some");
+        write_msgpack_value(packer, *x);
+    }
+    else
+    {
+        write_msgpack_string(packer, "none");
+        packer.pack_nil();
+    }
+}
+
+} // namespace detail
+
+template<class Buffer, class T>
+void
+write_msgpack_value(msgpack::packer<Buffer>& packer, optional<T> const& x)
+{
+    detail::write_msgpack_optional(packer, x);
+}
+
+template<class Buffer, class T>
+void
+write_msgpack_value(msgpack::packer<Buffer>& packer, omissible<T> const& x)
+{
+    detail::write_msgpack_optional(packer, x);
+}
+
+// Maps with string keys iterate in the same order as their dynamic forms.
+// (Maps with other types of keys go through their dynamic forms.)
+template<class Buffer, class Value>
+void
+write_msgpack_value(
+    msgpack::packer<Buffer>& packer, std::map<string, Value> const& x)
+{
+    packer.pack_map(boost::numeric_cast<uint32_t>(x.size()));
+    for (auto const& [key, value] : x)
+    {
+        detail::write_msgpack_string(packer, key);
+        write_msgpack_value(packer, value);
+    }
+}
+
+// API types are written via their generated visitors. (See
+// typed_encoding.h.)
+
+template<class Buffer, visitable_structure T>
+void
+write_msgpack_value(msgpack::packer<Buffer>& packer, T const& x)
+{
+    if (!fields_are_in_key_order(x))
+    {
+        write_msgpack_value(packer, to_dynamic(x));
+        return;
+    }
+    packer.pack_map(boost::numeric_cast<uint32_t>(count_encoded_fields(x)));
+    visit_encoded_fields(x, [&](std::string_view name, auto const& value) {
+        detail::write_msgpack_string(packer, name);
+        write_msgpack_value(packer, value);
+    });
+}
+
+template<class Buffer, visitable_union T>
+void
+write_msgpack_value(msgpack::packer<Buffer>& packer, T const& x)
+{
+    packer.pack_map(1);
+    visit_union_member(x, [&](std::string_view name, auto const& value) {
+        detail::write_msgpack_string(packer, name);
+        write_msgpack_value(packer, value);
+    });
+}
+
+template<class Buffer, preprocessed_enum T>
+void
+write_msgpack_value(msgpack::packer<Buffer>& packer, T const& x)
+{
+    detail::write_msgpack_string(packer, get_value_id(x));
+}
+
+template<non_dynamic T>
+string
+value_to_msgpack_string(T const& x)
+{
+    std::stringstream stream;
+    msgpack::packer<std::stringstream> packer(stream);
+    write_msgpack_value(packer, x);
+    return stream.str();
+}
+
+template<non_dynamic T>
+blob
+value_to_msgpack_blob(T const& x)
+{
+    std::shared_ptr<msgpack::sbuffer> sbuffer(new msgpack::sbuffer);
+    msgpack::packer<msgpack::sbuffer> packer(*sbuffer);
+    write_msgpack_value(packer, x);
+    blob b;
+    b.ownership = sbuffer;
+    b.data = sbuffer->data();
+    b.size = sbuffer->size();
+    return b;
+}
+
+// TYPED DECODING
+//
+// The following overloads read an unpacked MessagePack object directly into
+// a typed value. They're equivalent to reading the object as a dynamic and
+// calling from_dynamic(), but values whose dynamic forms would be built up
+// from nodes (structures, unions, arrays, etc.) are read without building
+// them. Other types (and objects that don't have the expected shape) fall
+// back to the dynamic form, so the results (and errors) are the same.
+//
+// :ownership provides ownership of the data that :object points into (so
+// that blobs can reference it).
+
+dynamic
+read_msgpack_value(
+    ownership_holder const& ownership, msgpack::object const& object);
+
+template<class T>
+void
+read_msgpack_value(
+    ownership_holder const& ownership, msgpack::object const& object, T* x)
+{
+    from_dynamic(x, read_msgpack_value(ownership, object));
+}
+
+inline void
+read_msgpack_value(
+    ownership_holder const& ownership,
+    msgpack::object const& object,
+    string* x)
+{
+    if (object.type == msgpack::type::STR)
+        x->assign(object.via.str.ptr, object.via.str.size);
+    else
+        from_dynamic(x, read_msgpack_value(ownership, object));
+}
+
+namespace detail {
+
+inline bool
+is_msgpack_string(msgpack::object const& object, std::string_view s)
+{
+    return object.type == msgpack::type::STR
+           && std::string_view(object.via.str.ptr, object.via.str.size) == s;
+}
+
+} // namespace detail
+
+// Arrays of numbers are decoded as packed arrays, which from_dynamic() can
+// copy directly, so those go through the dynamic form.
+template<class T>
+void
+read_msgpack_value(
+    ownership_holder const& ownership,
+    msgpack::object const& object,
+    std::vector<T>* x)
+{
+    if constexpr (!std::is_arithmetic_v<T>)
+    {
+        if (object.type == msgpack::type::ARRAY)
+        {
+            auto const& array = object.via.array;
+            x->resize(array.size);
+            for (size_t i = 0; i != array.size; ++i)
+            {
+                try
+                {
+                    read_msgpack_value(ownership, array.ptr[i], &(*x)[i]);
+                }
+                catch (boost::exception& e)
+                {
+                    add_dynamic_path_element(e, integer(i));
+                    throw;
+                }
+            }
+            return;
+        }
+    }
+    from_dynamic(x, read_msgpack_value(ownership, object));
+}
+
+template<class T>
+void
+read_msgpack_value(
+    ownership_holder const& ownership,
+    msgpack::object const& object,
+    optional<T>* x)
+{
+    if (object.type != msgpack::type::MAP || object.via.map.size != 1
+        || !detail::is_msgpack_string(object.via.map.ptr[0].key, "some"))
+    {
+        from_dynamic(x, read_msgpack_value(ownership, object));
+        return;
+    }
+    try
+    {
+        T value;
+        read_msgpack_value(ownership, object.via.map.ptr[0].val, &value);
+        *x = std::move(value);
+    }
+    catch (boost::exception& e)
+    {
+        add_dynamic_path_element(e, "some");
+        throw;
+    }
+}
+
+template<class Value>
+void
+read_msgpack_value(
+    ownership_holder const& ownership,
+    msgpack::object const& object,
+    std::map<string, Value>* x)
+{
+    if (object.type != msgpack::type::MAP
+        || !std::all_of(
+            object.via.map.ptr,
+            object.via.map.ptr + object.via.map.size,
+            [](auto const& pair) {
+                return pair.key.type == msgpack::type::STR;
+            }))
+    {
+        from_dynamic(x, read_msgpack_value(ownership, object));
+        return;
+    }
+    auto const& map = object.via.map;
+    for (size_t i = 0; i != map.size; ++i)
+    {
+        string key(map.ptr[i].key.via.str.ptr, map.ptr[i].key.via.str.size);
+        try
+        {
+            read_msgpack_value(ownership, map.ptr[i].val, &(*x)[key]);
+        }
+        catch (boost::exception& e)
+        {
+            add_dynamic_path_element(e, key);
+            throw;
+        }
+    }
+}
+
+namespace detail {
+
+// Read the structure :x from :object. If :object doesn't match the
+// structure's fields, this returns false.
+template<visitable_structure T>
+bool
+read_msgpack_structure(
+    ownership_holder const& ownership, msgpack::object const& object, T& x)
+{
+    if (object.type != msgpack::type::MAP
+        || count_fields(x) > max_directly_decoded_fields)
+    {
+        return false;
+    }
+    start_reading_structure(x);
+    structure_read_state state;
+    for (size_t i = 0; i != object.via.map.size; ++i)
+    {
+        auto const& pair = object.via.map.ptr[i];
+        if (pair.key.type != msgpack::type::STR)
+            return false;
+        // Fields that the structure doesn't know about are ignored.
+        auto const result = read_structure_field(
+            x,
+            std::string_view(pair.key.via.str.ptr, pair.key.via.str.size),
+            state,
+            [&](auto* value) {
+                read_msgpack_value(ownership, pair.val, value);
+            });
+        if (result == field_read_result::DUPLICATE)
+            return false;
+    }
+    return finish_reading_structure(x, state);
+}
+
+template<visitable_union T>
+bool
+read_msgpack_union(
+    ownership_holder const& ownership, msgpack::object const& object, T& x)
+{
+    if (object.type != msgpack::type::MAP || object.via.map.size != 1)
+        return false;
+    auto const& pair = object.via.map.ptr[0];
+    return pair.key.type == msgpack::type::STR
+           && read_union_member(
+               x,
+               std::string_view(pair.key.via.str.ptr, pair.key.via.str.size),
+               [&](auto& value) {
+                   read_msgpack_value(ownership, pair.val, &value);
+               });
+}
+
+} // namespace detail
+
+template<visitable_structure T>
+void
+read_msgpack_value(
+    ownership_holder const& ownership, msgpack::object const& object, T* x)
+{
+    if (!detail::read_msgpack_structure(ownership, object, *x))
+        from_dynamic(x, read_msgpack_value(ownership, object));
+}
+
+template<visitable_union T>
+void
+read_msgpack_value(
+    ownership_holder const& ownership, msgpack::object const& object, T* x)
+{
+    if (!detail::read_msgpack_union(ownership, object, *x))
+        from_dynamic(x, read_msgpack_value(ownership, object));
+}
+
+// Unpack :data (which holds :size bytes). The returned handle owns the
+// unpacked object (and so can serve as the ownership_holder for it).
+std::shared_ptr<msgpack::object_handle>
+unpack_shared_msgpack_object(uint8_t const* data, size_t size);
+
+// Parse the MessagePack in :data (which holds :size bytes) into :x.
+template<class T>
+void
+parse_msgpack_value(T* x, uint8_t const* data, size_t size)
+{
+    auto const handle = unpack_shared_msgpack_object(data, size);
+    ownership_holder ownership;
+    ownership = handle;
+    read_msgpack_value(ownership, handle->get(), x);
+}
+
+template<class T>
+void
+parse_msgpack_value(T* x, string const& msgpack)
+{
+    parse_msgpack_value(
+        x,
+        reinterpret_cast<uint8_t const*>(msgpack.c_str()),
+        msgpack.length());
+}
+
 } // namespace cradle
 
 #endif
@@ -1,6 +1,6 @@
-#include <cradle/io/raw_memory_io.h>
+#include <cradle/encodings/native.h>
 
-#include <picosha2.h>
+#include <cstring>
 
 #include <cradle/encodings/yaml.h>
 
@@ -10,9 +10,294 @@ namespace cradle {
 static boost::posix_time::ptime const
     the_epoch(boost::gregorian::date(1970, 1, 1));
 
+// Read the :length elements of an array as a packed array of Ts, if they're
+// all Ts. (Since Ts have a fixed size in the native encoding, this can check
+// that without decoding anything.) If they're not, this leaves :r untouched
+// and returns false.
+template<class T>
+static bool
+read_packed_elements(
+    raw_memory_reader<raw_input_buffer>& r,
+    size_t length,
+    dynamic& v,
+    size_t& deep_size)
+{
+    typedef typename packed_array<T>::storage_type storage_type;
+    size_t const stride = 4 + sizeof(storage_type);
+    auto& buffer = r.buffer;
+    if (buffer.size() / stride < length)
+        return false;
+    uint8_t const* const data = buffer.data();
+    uint32_t const tag = uint32_t(value_type_of<T>::value);
+    for (size_t i = 0; i != length; ++i)
+    {
+        uint32_t t;
+        std::memcpy(&t, data + i * stride, 4);
+        if (t != tag)
+            return false;
+    }
+    std::vector<storage_type> values(length);
+    for (size_t i = 0; i != length; ++i)
+    {
+        std::memcpy(
+            &values[i], data + i * stride + 4, sizeof(storage_type));
+    }
+    if constexpr (std::is_same_v<T, bool>)
+    {
+        for (auto& x : values)
+            x = x != 0 ? 1 : 0;
+    }
+    buffer.advance(length * stride);
+    packed_array<T> array(std::move(values));
+    deep_size += deep_sizeof(array);
+    v = std::move(array);
+    return true;
+}
+
+// Nonempty arrays of numbers (or booleans) that all have the same type are
+// decoded as packed arrays. This reads the :length elements of an array that
+// way if it can. If it can't, this leaves :r untouched and returns false.
+static bool
+read_packed_array(
+    raw_memory_reader<raw_input_buffer>& r,
+    size_t length,
+    dynamic& v,
+    size_t& deep_size)
+{
+    if (length == 0 || r.buffer.size() < 4)
+        return false;
+    uint32_t t;
+    std::memcpy(&t, r.buffer.data(), 4);
+    switch (value_type(t))
+    {
+        case value_type::BOOLEAN:
+            return read_packed_elements<bool>(r, length, v, deep_size);
+        case value_type::INTEGER:
+            return read_packed_elements<integer>(r, length, v, deep_size);
+        case value_type::FLOAT:
+            return read_packed_elements<double>(r, length, v, deep_size);
+        default:
+            return false;
+    }
+}
+
+// Read the length of the encoded string whose length field is at :p. (Like
+// other integers that go through write_int(), it's stored big-endian.)
+static uint32_t
+read_string_length(uint8_t const* p)
+{
+    uint32_t length;
+    std::memcpy(&length, p, 4);
+    swap_on_little_endian(&length);
+    return length;
+}
+
+// Read a map key. Keys are usually field names, so string keys are interned
+// (directly from the buffer, without reading them into strings first).
+static void
+read_map_key(
+    raw_memory_reader<raw_input_buffer>& r, dynamic& key, size_t& deep_size)
+{
+    auto& buffer = r.buffer;
+    if (buffer.size() >= 8)
+    {
+        uint32_t t;
+        std::memcpy(&t, buffer.data(), 4);
+        uint32_t const length = read_string_length(buffer.data() + 4);
+        if (value_type(t) == value_type::STRING
+            && buffer.size() - 8 >= length)
+        {
+            key = make_map_key(std::string_view(
+                reinterpret_cast<char const*>(buffer.data() + 8), length));
+            deep_size += deep_sizeof(key);
+            buffer.advance(8 + size_t(length));
+            return;
+        }
+    }
+    read_natively_encoded_value(r, key, deep_size);
+}
+
+// Get the size of the encoded value at the start of :data (which holds :size
+// bytes) without decoding it. If it's truncated (or corrupt), this returns
+// none.
+static optional<size_t>
+get_encoded_size(uint8_t const* data, size_t size)
+{
+    if (size < 4)
+        return none;
+    uint32_t t;
+    std::memcpy(&t, data, 4);
+    size_t header_size = 4, body_size = 0;
+    switch (value_type(t))
+    {
+        case value_type::NIL:
+            break;
+        case value_type::BOOLEAN:
+            body_size = 1;
+            break;
+        case value_type::INTEGER:
+        case value_type::FLOAT:
+        case value_type::DATETIME:
+            body_size = 8;
+            break;
+        case value_type::STRING: {
+            if (size < 8)
+                return none;
+            header_size = 8;
+            body_size = read_string_length(data + 4);
+            break;
+        }
+        case value_type::BLOB: {
+            if (size < 12)
+                return none;
+            uint64_t length;
+            std::memcpy(&length, data + 4, 8);
+            if (length > size)
+                return none;
+            header_size = 12;
+            body_size = size_t(length);
+            break;
+        }
+        case value_type::ARRAY:
+        case value_type::MAP: {
+            if (size < 12)
+                return none;
+            uint64_t length;
+            std::memcpy(&length, data + 4, 8);
+            if (length > size)
+                return none;
+            size_t offset = 12;
+            size_t const n_values = value_type(t) == value_type::MAP
+                                        ? size_t(length) * 2
+                                        : size_t(length);
+            for (size_t i = 0; i != n_values; ++i)
+            {
+                auto value_size
+                    = get_encoded_size(data + offset, size - offset);
+                if (!value_size)
+                    return none;
+                offset += *value_size;
+            }
+            return offset;
+        }
+        default:
+            return none;
+    }
+    if (size - header_size < body_size)
+        return none;
+    return header_size + body_size;
+}
+
+// Arrays of two or more records that all have the same keys are decoded as
+// tables. This checks (without decoding anything) whether the :length
+// elements of an array are such records, and if so, it reads them into :v.
+// If not, it leaves :r untouched and returns false.
+static bool
+read_record_table(
+    raw_memory_reader<raw_input_buffer>& r,
+    size_t length,
+    dynamic& v,
+    size_t& deep_size)
+{
+    auto& buffer = r.buffer;
+    uint8_t const* const data = buffer.data();
+    size_t const size = buffer.size();
+    if (length < 2)
+        return false;
+
+    // Find the (encoded) keys of the first record and check that the others
+    // have the same ones.
+    struct encoded_key
+    {
+        size_t offset, size;
+    };
+    std::vector<encoded_key> first_keys;
+    size_t offset = 0;
+    for (size_t i = 0; i != length; ++i)
+    {
+        if (size - offset < 12)
+            return false;
+        uint32_t t;
+        std::memcpy(&t, data + offset, 4);
+        uint64_t key_count;
+        std::memcpy(&key_count, data + offset + 4, 8);
+        if (value_type(t) != value_type::MAP || key_count == 0
+            || (i != 0 && key_count != first_keys.size()))
+        {
+            return false;
+        }
+        offset += 12;
+        for (uint64_t j = 0; j != key_count; ++j)
+        {
+            auto key_size = get_encoded_size(data + offset, size - offset);
+            if (!key_size)
+                return false;
+            if (i == 0)
+            {
+                first_keys.push_back(encoded_key{offset, *key_size});
+            }
+            else if (
+                *key_size != first_keys[j].size
+                || std::memcmp(
+                       data + offset,
+                       data + first_keys[j].offset,
+                       *key_size)
+                       != 0)
+            {
+                return false;
+            }
+            offset += *key_size;
+            auto value_size = get_encoded_size(data + offset, size - offset);
+            if (!value_size)
+                return false;
+            offset += *value_size;
+        }
+    }
+
+    // Maps are written in key order, but check that anyway.
+    size_t const key_count = first_keys.size();
+    size_t ignored_size = 0;
+    std::vector<dynamic> keys(key_count);
+    for (size_t j = 0; j != key_count; ++j)
+    {
+        raw_input_buffer key_buffer(
+            data + first_keys[j].offset, first_keys[j].size);
+        raw_memory_reader key_reader(key_buffer);
+        read_map_key(key_reader, keys[j], ignored_size);
+        if (j != 0 && !(keys[j - 1] < keys[j]))
+            return false;
+    }
+
+    // The deep size of the table is computed at the end (since the columns
+    // are compacted after they're read).
+    std::vector<dynamic_array> columns(key_count, dynamic_array(length));
+    for (size_t i = 0; i != length; ++i)
+    {
+        buffer.advance(12);
+        for (size_t j = 0; j != key_count; ++j)
+        {
+            buffer.advance(first_keys[j].size);
+            read_natively_encoded_value(r, columns[j][i], ignored_size);
+        }
+    }
+    std::vector<dynamic> compacted;
+    compacted.reserve(key_count);
+    for (auto& column : columns)
+        compacted.push_back(compact_array(std::move(column)));
+    record_table table(std::move(keys), std::move(compacted), length);
+    deep_size += deep_sizeof(table);
+    v = std::move(table);
+    return true;
+}
+
+// This also accumulates the deep_sizeof() of the decoded value into
+// :deep_size as it goes, so that callers don't have to traverse the value a
+// second time to determine its size.
 void
-read_natively_encoded_value(raw_memory_reader<raw_input_buffer>& r, dynamic& v)
+read_natively_encoded_value(
+    raw_memory_reader<raw_input_buffer>& r, dynamic& v, size_t& deep_size)
 {
+    deep_size += sizeof(dynamic);
     value_type type;
     {
         uint32_t t;
@@ -28,22 +313,27 @@ read_natively_encoded_value(raw_memory_reader<raw_input_buffer>& r, dynamic& v)
             uint8_t x;
             raw_read(r, &x, 1);
             v = bool(x != 0);
+            deep_size += sizeof(bool);
             break;
         }
         case value_type::INTEGER: {
             integer x;
             raw_read(r, &x, 8);
             v = x;
+            deep_size += sizeof(integer);
             break;
         }
         case value_type::FLOAT: {
             double x;
             raw_read(r, &x, 8);
             v = x;
+            deep_size += sizeof(double);
             break;
         }
         case value_type::STRING: {
-            v = read_string<uint32_t>(r);
+            string x = read_string<uint32_t>(r);
+            deep_size += deep_sizeof(x);
+            v = std::move(x);
             break;
         }
         case value_type::BLOB: {
@@ -56,6 +346,7 @@ read_natively_encoded_value(raw_memory_reader<raw_input_buffer>& r, dynamic& v)
             x.ownership = ptr;
             x.data = reinterpret_cast<char const*>(ptr.get());
             raw_read(r, const_cast<char*>(x.data), x.size);
+            deep_size += deep_sizeof(x);
             v = x;
             break;
         }
@@ -63,53 +354,104 @@ read_natively_encoded_value(raw_memory_reader<raw_input_buffer>& r, dynamic& v)
             int64_t t;
             raw_read(r, &t, 8);
             v = the_epoch + boost::posix_time::milliseconds(t);
+            deep_size += sizeof(boost::posix_time::ptime);
             break;
         }
         case value_type::ARRAY: {
             uint64_t length;
             raw_read(r, &length, 8);
+            if (read_packed_array(
+                    r, boost::numeric_cast<size_t>(length), v, deep_size)
+                || read_record_table(
+                    r, boost::numeric_cast<size_t>(length), v, deep_size))
+            {
+                break;
+            }
             dynamic_array value(boost::numeric_cast<size_t>(length));
+            deep_size += sizeof(dynamic_array);
             for (auto& item : value)
-                read_natively_encoded_value(r, item);
-            v = value;
+                read_natively_encoded_value(r, item, deep_size);
+            v = std::move(value);
             break;
         }
         case value_type::MAP: {
             uint64_t length;
             raw_read(r, &length, 8);
+            // Maps are written in key order, so each entry is appended to the
+            // end of the map.
             dynamic_map map;
+            deep_size += sizeof(dynamic_map);
             for (uint64_t i = 0; i != length; ++i)
             {
                 dynamic key;
-                read_natively_encoded_value(r, key);
+                read_map_key(r, key, deep_size);
                 dynamic value;
-                read_natively_encoded_value(r, value);
-                map[key] = value;
+                read_natively_encoded_value(r, value, deep_size);
+                map[std::move(key)] = std::move(value);
             }
-            v = map;
+            v = std::move(map);
             break;
         }
     }
 }
 
 dynamic
-read_natively_encoded_value(uint8_t const* data, size_t size)
+read_natively_encoded_value(
+    uint8_t const* data, size_t size, size_t* deep_size)
 {
     dynamic value;
     raw_input_buffer buffer(data, size);
     raw_memory_reader r(buffer);
-    read_natively_encoded_value(r, value);
+    size_t value_deep_size = 0;
+    read_natively_encoded_value(r, value, value_deep_size);
+    if (deep_size)
+        *deep_size = value_deep_size;
     return value;
 }
 
+dynamic
+read_natively_encoded_value(uint8_t const* data, size_t size)
+{
+    return read_natively_encoded_value(data, size, nullptr);
+}
+
 template<class Buffer>
 void
 write_natively_encoded_value(raw_memory_writer<Buffer>& w, dynamic const& v)
 {
+    if (visit_packed_array(v, [&](auto const& packed) {
+            write_natively_encoded_value(w, packed);
+        }))
+    {
+        return;
+    }
     {
         uint32_t t = uint32_t(v.type());
         raw_write(w, &t, 4);
     }
+    // Tables are written as the arrays of records that they represent,
+    // straight from their columns.
+    if (auto const* table = get_record_table(v))
+    {
+        uint64_t size = table->size();
+        raw_write(w, &size, 8);
+        uint32_t const map_tag = uint32_t(value_type::MAP);
+        uint64_t const key_count = table->keys.size();
+        for (size_t i = 0; i != table->size(); ++i)
+        {
+            raw_write(w, &map_tag, 4);
+            raw_write(w, &key_count, 8);
+            for (size_t j = 0; j != table->keys.size(); ++j)
+            {
+                write_natively_encoded_value(w, table->keys[j]);
+                visit_array_element(
+                    table->columns[j], i, [&](dynamic const& x) {
+                        write_natively_encoded_value(w, x);
+                    });
+            }
+        }
+        return;
+    }
     switch (v.type())
     {
         case value_type::NIL:
@@ -146,7 +488,7 @@ write_natively_encoded_value(raw_memory_writer<Buffer>& w, dynamic const& v)
             break;
         }
         case value_type::ARRAY: {
-            dynamic_array const& x = cast<dynamic_array>(v);
+            dynamic_array const& x = *get_dynamic_array(v);
             uint64_t size = x.size();
             raw_write(w, &size, 8);
             for (auto const& item : x)
@@ -167,6 +509,16 @@ write_natively_encoded_value(raw_memory_writer<Buffer>& w, dynamic const& v)
     }
 }
 
+template void
+write_natively_encoded_value(
+    raw_memory_writer<byte_vector_buffer>& w, dynamic const& v);
+template void
+write_natively_encoded_value(
+    raw_memory_writer<counting_buffer>& w, dynamic const& v);
+template void
+write_natively_encoded_value(
+    raw_memory_writer<sha256_hashing_buffer>& w, dynamic const& v);
+
 byte_vector
 write_natively_encoded_value(dynamic const& value)
 {
@@ -186,36 +538,12 @@ natively_encoded_sizeof(dynamic const& value)
     return buffer.size();
 }
 
-struct sha256_hashing_buffer
-{
-    string
-    hash()
-    {
-        std::ostringstream oss;
-        hasher_.finish();
-        picosha2::byte_t hashed[32];
-        hasher_.get_hash_bytes(hashed, hashed + 32);
-        picosha2::output_hex(hashed, hashed + 32, oss);
-        return oss.str();
-    }
-
-    void
-    write(char const* data, size_t size)
-    {
-        hasher_.process(data, data + size);
-    }
-
- private:
-    picosha2::hash256_one_by_one hasher_;
-};
-
 string
 natively_encoded_sha256(dynamic const& value)
 {
-    sha256_hashing_buffer buffer;
-    raw_memory_writer<sha256_hashing_buffer> writer(buffer);
-    write_natively_encoded_value(writer, value);
-    return buffer.hash();
+    sha256_hasher hasher;
+    fold_natively_encoded_value(hasher, value);
+    return format_sha256_digest(hasher.finish());
 }
 
 } // namespace cradle
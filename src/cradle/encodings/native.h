@@ -1,8 +1,15 @@
 #ifndef CRADLE_ENCODINGS_NATIVE_H
 #define CRADLE_ENCODINGS_NATIVE_H
 
+#include <concepts>
+#include <cstring>
+#include <map>
+#include <string_view>
+
 #include <cradle/core.h>
 
+#include <cradle/encodings/sha256.h>
+#include <cradle/encodings/typed_encoding.h>
 #include <cradle/io/raw_memory_io.h>
 
 namespace cradle {
@@ -10,12 +17,557 @@ namespace cradle {
 dynamic
 read_natively_encoded_value(uint8_t const* data, size_t size);
 
+// This is the same as above, but it also stores the deep_sizeof() of the
+// decoded value in :deep_size (computed during decoding, without a separate
+// traversal of the value).
+dynamic
+read_natively_encoded_value(
+    uint8_t const* data, size_t size, size_t* deep_size);
+
 byte_vector
 write_natively_encoded_value(dynamic const& value);
 
+// Write the native encoding of :value to :w.
+// This is explicitly instantiated for the buffer types in this file and
+// raw_memory_io.h.
+template<class Buffer>
+void
+write_natively_encoded_value(raw_memory_writer<Buffer>& w, dynamic const& v);
+
+// TYPED ENCODING
+//
+// The following overloads write the native encoding of a typed value (i.e.,
+// the native encoding of to_dynamic(x)) without converting the value to a
+// dynamic first. Types without an overload of their own fall back to the
+// conversion.
+
+template<class Buffer, class T>
+void
+write_natively_encoded_value(raw_memory_writer<Buffer>& w, T const& x)
+{
+    write_natively_encoded_value(w, to_dynamic(x));
+}
+
+namespace detail {
+
+template<class Buffer>
+void
+write_native_type_tag(raw_memory_writer<Buffer>& w, value_type type)
+{
+    uint32_t t = uint32_t(type);
+    raw_write(w, &t, 4);
+}
+
+template<class Buffer>
+void
+write_native_string(raw_memory_writer<Buffer>& w, std::string_view s)
+{
+    write_native_type_tag(w, value_type::STRING);
+    write_int(w, boost::numeric_cast<uint32_t>(s.length()));
+    raw_write(w, s.data(), s.length());
+}
+
+} // namespace detail
+
+template<class Buffer>
+void
+write_natively_encoded_value(raw_memory_writer<Buffer>& w, bool x)
+{
+    detail::write_native_type_tag(w, value_type::BOOLEAN);
+    uint8_t t = x ? 1 : 0;
+    raw_write(w, &t, 1);
+}
+
+template<class Buffer, dynamic_integer_type T>
+void
+write_natively_encoded_value(raw_memory_writer<Buffer>& w, T const& x)
+{
+    detail::write_native_type_tag(w, value_type::INTEGER);
+    integer t = boost::numeric_cast<integer>(x);
+    raw_write(w, &t, 8);
+}
+
+template<class Buffer, std::floating_point T>
+void
+write_natively_encoded_value(raw_memory_writer<Buffer>& w, T const& x)
+{
+    detail::write_native_type_tag(w, value_type::FLOAT);
+    double t = double(x);
+    raw_write(w, &t, 8);
+}
+
+template<class Buffer>
+void
+write_natively_encoded_value(raw_memory_writer<Buffer>& w, string const& x)
+{
+    detail::write_native_type_tag(w, value_type::STRING);
+    write_string<uint32_t>(w, x);
+}
+
+template<class Buffer>
+void
+write_natively_encoded_value(raw_memory_writer<Buffer>& w, blob const& x)
+{
+    detail::write_native_type_tag(w, value_type::BLOB);
+    uint64_t length = x.size;
+    raw_write(w, &length, 8);
+    raw_write(w, x.data, x.size);
+}
+
+template<class Buffer, class T>
+void
+write_natively_encoded_value(
+    raw_memory_writer<Buffer>& w, std::vector<T> const& x)
+{
+    detail::write_native_type_tag(w, value_type::ARRAY);
+    uint64_t size = x.size();
+    raw_write(w, &size, 8);
+    for (auto const& item : x)
+        write_natively_encoded_value(w, item);
+}
+
+// Packed arrays are encoded exactly like their unpacked equivalents.
+template<class Buffer, class T>
+void
+write_natively_encoded_value(
+    raw_memory_writer<Buffer>& w, packed_array<T> const& x)
+{
+    detail::write_native_type_tag(w, value_type::ARRAY);
+    uint64_t size = x.size();
+    raw_write(w, &size, 8);
+    for (size_t i = 0; i != x.size(); ++i)
+        write_natively_encoded_value(w, x[i]);
+}
+
+namespace detail {
+
+// optional and omissible values are both encoded as unions of "some" and
+// "none".
+template<class Buffer, class Optional>
+void
+write_native_optional(raw_memory_writer<Buffer>& w, Optional const& x)
+{
+    write_native_type_tag(w, value_type::MAP);
+    uint64_t size = 1;
+    raw_write(w, &size, 8);
+    if (x)
+    {
+        write_native_string(w, "some");
+        write_natively_encoded_value(w, *x);
+    }
+    else
+    {
+        write_native_string(w, "none");
+        write_native_type_tag(w, value_type::NIL);
+    }
+}
+
+} // namespace detail
+
+template<class Buffer, class T>
+void
+write_natively_encoded_value(
+    raw_memory_writer<Buffer>& w, optional<T> const& x)
+{
+    detail::write_native_optional(w, x);
+}
+
+template<class Buffer, class T>
+void
+write_natively_encoded_value(
+    raw_memory_writer<Buffer>& w, omissible<T> const& x)
+{
+    detail::write_native_optional(w, x);
+}
+
+// Maps with string keys iterate in the same order as their dynamic forms.
+// (Maps with other types of keys go through their dynamic forms.)
+template<class Buffer, class Value>
+void
+write_natively_encoded_value(
+    raw_memory_writer<Buffer>& w, std::map<string, Value> const& x)
+{
+    detail::write_native_type_tag(w, value_type::MAP);
+    uint64_t size = x.size();
+    raw_write(w, &size, 8);
+    for (auto const& [key, value] : x)
+    {
+        detail::write_native_string(w, key);
+        write_natively_encoded_value(w, value);
+    }
+}
+
+// API types are written via their generated visitors. (See
+// typed_encoding.h.)
+
+template<class Buffer, visitable_structure T>
+void
+write_natively_encoded_value(raw_memory_writer<Buffer>& w, T const& x)
+{
+    if (!fields_are_in_key_order(x))
+    {
+        write_natively_encoded_value(w, to_dynamic(x));
+        return;
+    }
+    detail::write_native_type_tag(w, value_type::MAP);
+    uint64_t size = count_encoded_fields(x);
+    raw_write(w, &size, 8);
+    visit_encoded_fields(x, [&](std::string_view name, auto const& value) {
+        detail::write_native_string(w, name);
+        write_natively_encoded_value(w, value);
+    });
+}
+
+template<class Buffer, visitable_union T>
+void
+write_natively_encoded_value(raw_memory_writer<Buffer>& w, T const& x)
+{
+    detail::write_native_type_tag(w, value_type::MAP);
+    uint64_t size = 1;
+    raw_write(w, &size, 8);
+    visit_union_member(x, [&](std::string_view name, auto const& value) {
+        detail::write_native_string(w, name);
+        write_natively_encoded_value(w, value);
+    });
+}
+
+template<class Buffer, preprocessed_enum T>
+void
+write_natively_encoded_value(raw_memory_writer<Buffer>& w, T const& x)
+{
+    detail::write_native_string(w, get_value_id(x));
+}
+
+// Get the native encoding of :x.
+template<non_dynamic T>
+byte_vector
+write_natively_encoded_value(T const& x)
+{
+    byte_vector data;
+    byte_vector_buffer buffer(data);
+    raw_memory_writer<byte_vector_buffer> writer(buffer);
+    write_natively_encoded_value(writer, x);
+    return data;
+}
+
+// TYPED DECODING
+//
+// The following overloads read a native encoding directly into a typed
+// value. They're equivalent to reading the encoding as a dynamic and calling
+// from_dynamic(), but values whose dynamic forms would be built up from
+// nodes (structures, unions, arrays, etc.) are read without building them.
+// Other types (and encodings that don't have the expected shape) fall back
+// to the dynamic form, so the results (and errors) are the same. In
+// particular, errors that arise within a value carry the same path
+// information that from_dynamic() would give them, since each level adds its
+// own path element as the error propagates.
+
+// Read a natively encoded dynamic value from :r into :v, accumulating its
+// deep_sizeof() into :deep_size.
+void
+read_natively_encoded_value(
+    raw_memory_reader<raw_input_buffer>& r, dynamic& v, size_t& deep_size);
+
+namespace detail {
+
+template<class T>
+void
+read_native_value_via_dynamic(raw_memory_reader<raw_input_buffer>& r, T* x)
+{
+    dynamic v;
+    size_t deep_size = 0;
+    read_natively_encoded_value(r, v, deep_size);
+    from_dynamic(x, v);
+}
+
+// Get the type of the next value in :r (without reading it). If there isn't
+// room for a type tag, this returns none.
+inline optional<value_type>
+peek_native_type(raw_memory_reader<raw_input_buffer> const& r)
+{
+    if (r.buffer.size() < 4)
+        return none;
+    uint32_t t;
+    std::memcpy(&t, r.buffer.data(), 4);
+    return value_type(t);
+}
+
+// Read the header of a map or array (i.e., its type tag and length) if the
+// next value in :r has type :type. Otherwise (or if the rest of :r is too
+// short to hold that many items), this returns none and leaves :r alone.
+inline optional<uint64_t>
+read_native_container_header(
+    raw_memory_reader<raw_input_buffer>& r, value_type type)
+{
+    if (peek_native_type(r) != type || r.buffer.size() < 12)
+        return none;
+    uint64_t length;
+    std::memcpy(&length, r.buffer.data() + 4, 8);
+    // Every item takes at least four bytes (for its type tag).
+    if (length > (r.buffer.size() - 12) / 4)
+        return none;
+    r.buffer.advance(12);
+    return length;
+}
+
+// Read a string map key (without copying it out of the buffer). If the next
+// value in :r isn't a string, this returns none (and leaves :r alone).
+inline optional<std::string_view>
+read_native_string_key(raw_memory_reader<raw_input_buffer>& r)
+{
+    if (peek_native_type(r) != value_type::STRING || r.buffer.size() < 8)
+        return none;
+    uint32_t length;
+    std::memcpy(&length, r.buffer.data() + 4, 4);
+    swap_on_little_endian(&length);
+    if (r.buffer.size() - 8 < length)
+        return none;
+    std::string_view key(
+        reinterpret_cast<char const*>(r.buffer.data() + 8), length);
+    r.buffer.advance(8 + size_t(length));
+    return key;
+}
+
+} // namespace detail
+
+template<class T>
+void
+read_natively_encoded_value(raw_memory_reader<raw_input_buffer>& r, T* x)
+{
+    detail::read_native_value_via_dynamic(r, x);
+}
+
+inline void
+read_natively_encoded_value(raw_memory_reader<raw_input_buffer>& r, string* x)
+{
+    if (detail::peek_native_type(r) == value_type::STRING)
+    {
+        r.buffer.advance(4);
+        *x = read_string<uint32_t>(r);
+    }
+    else
+    {
+        detail::read_native_value_via_dynamic(r, x);
+    }
+}
+
+// Arrays of numbers are decoded as packed arrays, which from_dynamic() can
+// copy directly, so those go through the dynamic form.
+template<class T>
+void
+read_natively_encoded_value(
+    raw_memory_reader<raw_input_buffer>& r, std::vector<T>* x)
+{
+    if constexpr (!std::is_arithmetic_v<T>)
+    {
+        auto const length
+            = detail::read_native_container_header(r, value_type::ARRAY);
+        if (length)
+        {
+            x->resize(boost::numeric_cast<size_t>(*length));
+            for (size_t i = 0; i != x->size(); ++i)
+            {
+                try
+                {
+                    read_natively_encoded_value(r, &(*x)[i]);
+                }
+                catch (boost::exception& e)
+                {
+                    add_dynamic_path_element(e, integer(i));
+                    throw;
+                }
+            }
+            return;
+        }
+    }
+    detail::read_native_value_via_dynamic(r, x);
+}
+
+template<class T>
+void
+read_natively_encoded_value(
+    raw_memory_reader<raw_input_buffer>& r, optional<T>* x)
+{
+    auto const start = r.buffer;
+    if (detail::read_native_container_header(r, value_type::MAP)
+            == uint64_t(1)
+        && detail::read_native_string_key(r) == "some")
+    {
+        try
+        {
+            T value;
+            read_natively_encoded_value(r, &value);
+            *x = std::move(value);
+        }
+        catch (boost::exception& e)
+        {
+            add_dynamic_path_element(e, "some");
+            throw;
+        }
+        return;
+    }
+    r.buffer = start;
+    detail::read_native_value_via_dynamic(r, x);
+}
+
+template<class Value>
+void
+read_natively_encoded_value(
+    raw_memory_reader<raw_input_buffer>& r, std::map<string, Value>* x)
+{
+    auto const start = r.buffer;
+    auto const length
+        = detail::read_native_container_header(r, value_type::MAP);
+    if (length)
+    {
+        uint64_t i = 0;
+        for (; i != *length; ++i)
+        {
+            auto const key = detail::read_native_string_key(r);
+            if (!key)
+                break;
+            try
+            {
+                read_natively_encoded_value(r, &(*x)[string(*key)]);
+            }
+            catch (boost::exception& e)
+            {
+                add_dynamic_path_element(e, string(*key));
+                throw;
+            }
+        }
+        if (i == *length)
+            return;
+    }
+    r.buffer = start;
+    detail::read_native_value_via_dynamic(r, x);
+}
+
+namespace detail {
+
+// Read the structure :x from :r. If the encoding doesn't match the
+// structure's fields, this returns false (and :r is left in an unspecified
+// state).
+template<visitable_structure T>
+bool
+read_native_structure(raw_memory_reader<raw_input_buffer>& r, T& x)
+{
+    if (count_fields(x) > max_directly_decoded_fields)
+        return false;
+    auto const length = read_native_container_header(r, value_type::MAP);
+    if (!length)
+        return false;
+    start_reading_structure(x);
+    structure_read_state state;
+    for (uint64_t i = 0; i != *length; ++i)
+    {
+        auto const name = read_native_string_key(r);
+        if (!name)
+            return false;
+        auto const result = read_structure_field(
+            x, *name, state, [&](auto* value) {
+                read_natively_encoded_value(r, value);
+            });
+        switch (result)
+        {
+            case field_read_result::READ:
+                break;
+            case field_read_result::UNKNOWN: {
+                // Fields that the structure doesn't know about are ignored.
+                dynamic ignored;
+                size_t deep_size = 0;
+                read_natively_encoded_value(r, ignored, deep_size);
+                break;
+            }
+            case field_read_result::DUPLICATE:
+                return false;
+        }
+    }
+    return finish_reading_structure(x, state);
+}
+
+template<visitable_union T>
+bool
+read_native_union(raw_memory_reader<raw_input_buffer>& r, T& x)
+{
+    if (read_native_container_header(r, value_type::MAP) != 1)
+        return false;
+    auto const name = read_native_string_key(r);
+    return name && read_union_member(x, *name, [&](auto& value) {
+               read_natively_encoded_value(r, &value);
+           });
+}
+
+} // namespace detail
+
+template<visitable_structure T>
+void
+read_natively_encoded_value(raw_memory_reader<raw_input_buffer>& r, T* x)
+{
+    auto const start = r.buffer;
+    if (!detail::read_native_structure(r, *x))
+    {
+        r.buffer = start;
+        detail::read_native_value_via_dynamic(r, x);
+    }
+}
+
+template<visitable_union T>
+void
+read_natively_encoded_value(raw_memory_reader<raw_input_buffer>& r, T* x)
+{
+    auto const start = r.buffer;
+    if (!detail::read_native_union(r, *x))
+    {
+        r.buffer = start;
+        detail::read_native_value_via_dynamic(r, x);
+    }
+}
+
+// Read the native encoding in :data (which holds :size bytes) into :x.
+template<class T>
+void
+read_natively_encoded_value(T* x, uint8_t const* data, size_t size)
+{
+    raw_input_buffer buffer(data, size);
+    raw_memory_reader<raw_input_buffer> r(buffer);
+    read_natively_encoded_value(r, x);
+}
+
 size_t
 natively_encoded_sizeof(dynamic const& value);
 
+// HASHING
+
+// sha256_hashing_buffer is a raw_memory_writer buffer that feeds everything
+// that's written to it into a SHA-256 hasher, so values can be hashed without
+// materializing their encodings.
+struct sha256_hashing_buffer
+{
+    sha256_hashing_buffer(sha256_hasher& hasher) : hasher_(hasher)
+    {
+    }
+
+    void
+    write(char const* data, size_t size)
+    {
+        hasher_.process(data, size);
+    }
+
+ private:
+    sha256_hasher& hasher_;
+};
+
+// Feed the native encoding of :value into :hasher.
+template<class Value>
+void
+fold_natively_encoded_value(sha256_hasher& hasher, Value const& value)
+{
+    sha256_hashing_buffer buffer(hasher);
+    raw_memory_writer<sha256_hashing_buffer> writer(buffer);
+    write_natively_encoded_value(writer, value);
+}
+
 string
 natively_encoded_sha256(dynamic const& value);
 
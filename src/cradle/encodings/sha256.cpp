@@ -0,0 +1,642 @@
+#include <cradle/encodings/sha256.h>
+
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define CRADLE_SHA256_X86
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#include <immintrin.h>
+#endif
+
+// On GCC and Clang, intrinsics can only be used in functions that are
+// compiled for the corresponding instruction sets. (MSVC doesn't require
+// this.)
+#if defined(CRADLE_SHA256_X86) && !defined(_MSC_VER)
+#define CRADLE_SHA256_TARGET(isa) __attribute__((target(isa)))
+#else
+#define CRADLE_SHA256_TARGET(isa)
+#endif
+
+namespace cradle {
+
+namespace {
+
+uint32_t const initial_state[8]
+    = {0x6a09e667,
+       0xbb67ae85,
+       0x3c6ef372,
+       0xa54ff53a,
+       0x510e527f,
+       0x9b05688c,
+       0x1f83d9ab,
+       0x5be0cd19};
+
+alignas(16) uint32_t const round_constants[64]
+    = {0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+       0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+       0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+       0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+       0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+       0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+       0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+       0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+       0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+       0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+       0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+uint32_t
+load_big_endian(uint8_t const* p)
+{
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16)
+           | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+void
+store_big_endian(uint8_t* p, uint32_t x)
+{
+    p[0] = uint8_t(x >> 24);
+    p[1] = uint8_t(x >> 16);
+    p[2] = uint8_t(x >> 8);
+    p[3] = uint8_t(x);
+}
+
+sha256_digest
+make_digest(uint32_t const* state)
+{
+    sha256_digest digest;
+    for (int i = 0; i != 8; ++i)
+        store_big_endian(&digest[i * 4], state[i]);
+    return digest;
+}
+
+// Write the padding for a message of :length bytes (whose final partial block
+// of :tail_size bytes is already at the start of :tail). :tail must have room
+// for two blocks. Return the number of blocks in the padded tail.
+size_t
+pad_message(uint8_t* tail, size_t tail_size, uint64_t length)
+{
+    size_t const block_count = tail_size + 9 <= 64 ? 1 : 2;
+    tail[tail_size] = 0x80;
+    std::fill(tail + tail_size + 1, tail + block_count * 64 - 8, uint8_t(0));
+    uint64_t const bit_length = length * 8;
+    store_big_endian(
+        tail + block_count * 64 - 8, uint32_t(bit_length >> 32));
+    store_big_endian(tail + block_count * 64 - 4, uint32_t(bit_length));
+    return block_count;
+}
+
+// PORTABLE
+
+uint32_t
+rotate_right(uint32_t x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+void
+compress_portably(uint32_t* state, uint8_t const* blocks, size_t block_count)
+{
+    for (; block_count != 0; --block_count, blocks += 64)
+    {
+        uint32_t w[64];
+        for (int t = 0; t != 16; ++t)
+            w[t] = load_big_endian(blocks + t * 4);
+        for (int t = 16; t != 64; ++t)
+        {
+            uint32_t s0 = rotate_right(w[t - 15], 7)
+                          ^ rotate_right(w[t - 15], 18) ^ (w[t - 15] >> 3);
+            uint32_t s1 = rotate_right(w[t - 2], 17)
+                          ^ rotate_right(w[t - 2], 19) ^ (w[t - 2] >> 10);
+            w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3],
+                 e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int t = 0; t != 64; ++t)
+        {
+            uint32_t s1 = rotate_right(e, 6) ^ rotate_right(e, 11)
+                          ^ rotate_right(e, 25);
+            uint32_t ch = (e & f) ^ (~e & g);
+            uint32_t t1 = h + s1 + ch + round_constants[t] + w[t];
+            uint32_t s0 = rotate_right(a, 2) ^ rotate_right(a, 13)
+                          ^ rotate_right(a, 22);
+            uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+            uint32_t t2 = s0 + maj;
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#ifdef CRADLE_SHA256_X86
+
+// CPU FEATURE DETECTION
+
+struct x86_features
+{
+    bool sha_ni = false;
+    bool avx2 = false;
+};
+
+void
+query_cpuid(int leaf, int subleaf, uint32_t* registers)
+{
+#if defined(_MSC_VER)
+    int r[4];
+    __cpuidex(r, leaf, subleaf);
+    std::copy(r, r + 4, registers);
+#else
+    __cpuid_count(
+        leaf, subleaf, registers[0], registers[1], registers[2], registers[3]);
+#endif
+}
+
+// Get the state components that the OS saves on context switches.
+CRADLE_SHA256_TARGET("xsave")
+uint64_t
+get_enabled_xsave_features()
+{
+    return _xgetbv(0);
+}
+
+x86_features
+detect_x86_features()
+{
+    x86_features features;
+    uint32_t r[4];
+    query_cpuid(0, 0, r);
+    uint32_t const max_leaf = r[0];
+    if (max_leaf < 7)
+        return features;
+
+    query_cpuid(1, 0, r);
+    bool const ssse3 = (r[2] & (1u << 9)) != 0;
+    bool const sse41 = (r[2] & (1u << 19)) != 0;
+    bool const osxsave = (r[2] & (1u << 27)) != 0;
+    bool const avx = (r[2] & (1u << 28)) != 0;
+
+    query_cpuid(7, 0, r);
+    bool const avx2 = (r[1] & (1u << 5)) != 0;
+    bool const sha = (r[1] & (1u << 29)) != 0;
+
+    features.sha_ni = sha && ssse3 && sse41;
+    // AVX2 also requires the OS to preserve the YMM registers.
+    features.avx2 = avx && avx2 && osxsave
+                    && (get_enabled_xsave_features() & 0x6) == 0x6;
+    return features;
+}
+
+x86_features const&
+get_x86_features()
+{
+    static x86_features const features = detect_x86_features();
+    return features;
+}
+
+// SHA_NI
+
+CRADLE_SHA256_TARGET("sha,ssse3,sse4.1")
+void
+compress_with_sha_ni(
+    uint32_t* state, uint8_t const* blocks, size_t block_count)
+{
+    __m128i const byte_swap
+        = _mm_set_epi64x(0x0c0d0e0f08090a0bull, 0x0405060700010203ull);
+
+    // The SHA instructions expect the state as (A, B, E, F) and (C, D, G, H).
+    __m128i tmp = _mm_loadu_si128(reinterpret_cast<__m128i const*>(state));
+    __m128i state1
+        = _mm_loadu_si128(reinterpret_cast<__m128i const*>(state + 4));
+    tmp = _mm_shuffle_epi32(tmp, 0xb1);
+    state1 = _mm_shuffle_epi32(state1, 0x1b);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+    for (; block_count != 0; --block_count, blocks += 64)
+    {
+        __m128i const saved0 = state0;
+        __m128i const saved1 = state1;
+
+        // Each iteration performs four rounds. :w holds the last sixteen
+        // message schedule words (four per register).
+        __m128i w[4];
+        for (int i = 0; i != 16; ++i)
+        {
+            __m128i& current = w[i % 4];
+            if (i < 4)
+            {
+                current = _mm_shuffle_epi8(
+                    _mm_loadu_si128(
+                        reinterpret_cast<__m128i const*>(blocks + i * 16)),
+                    byte_swap);
+            }
+            else
+            {
+                __m128i const& w1 = w[(i - 1) % 4];
+                __m128i const& w2 = w[(i - 2) % 4];
+                __m128i const& w3 = w[(i - 3) % 4];
+                current = _mm_sha256msg2_epu32(
+                    _mm_add_epi32(
+                        _mm_sha256msg1_epu32(current, w3),
+                        _mm_alignr_epi8(w1, w2, 4)),
+                    w1);
+            }
+            __m128i message = _mm_add_epi32(
+                current,
+                _mm_load_si128(reinterpret_cast<__m128i const*>(
+                    round_constants + i * 4)));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, message);
+            message = _mm_shuffle_epi32(message, 0x0e);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, message);
+        }
+
+        state0 = _mm_add_epi32(state0, saved0);
+        state1 = _mm_add_epi32(state1, saved1);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b);
+    state1 = _mm_shuffle_epi32(state1, 0xb1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xf0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(state), state0);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(state + 4), state1);
+}
+
+// AVX2
+
+CRADLE_SHA256_TARGET("avx2")
+inline __m256i
+rotate_right(__m256i x, int n)
+{
+    return _mm256_or_si256(
+        _mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n));
+}
+
+// The AVX2 implementation runs eight independent hashes in parallel, one in
+// each 32-bit lane. :state holds the eight state words of each lane, in
+// transposed form (i.e., state[i][lane] is word i of that lane's state), and
+// :blocks[lane] is the next block for that lane.
+CRADLE_SHA256_TARGET("avx2")
+void
+compress_eight_with_avx2(uint32_t (*state)[8], uint8_t const* const* blocks)
+{
+    __m256i w[16];
+    for (int t = 0; t != 16; ++t)
+    {
+        w[t] = _mm256_setr_epi32(
+            int(load_big_endian(blocks[0] + t * 4)),
+            int(load_big_endian(blocks[1] + t * 4)),
+            int(load_big_endian(blocks[2] + t * 4)),
+            int(load_big_endian(blocks[3] + t * 4)),
+            int(load_big_endian(blocks[4] + t * 4)),
+            int(load_big_endian(blocks[5] + t * 4)),
+            int(load_big_endian(blocks[6] + t * 4)),
+            int(load_big_endian(blocks[7] + t * 4)));
+    }
+
+    __m256i v[8];
+    for (int i = 0; i != 8; ++i)
+        v[i] = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(state[i]));
+    __m256i a = v[0], b = v[1], c = v[2], d = v[3], e = v[4], f = v[5],
+            g = v[6], h = v[7];
+
+    for (int t = 0; t != 64; ++t)
+    {
+        // :w is a ring buffer of the last sixteen schedule words.
+        __m256i& wt = w[t % 16];
+        if (t >= 16)
+        {
+            __m256i const w15 = w[(t - 15) % 16];
+            __m256i const w2 = w[(t - 2) % 16];
+            __m256i const s0 = _mm256_xor_si256(
+                _mm256_xor_si256(
+                    rotate_right(w15, 7), rotate_right(w15, 18)),
+                _mm256_srli_epi32(w15, 3));
+            __m256i const s1 = _mm256_xor_si256(
+                _mm256_xor_si256(
+                    rotate_right(w2, 17), rotate_right(w2, 19)),
+                _mm256_srli_epi32(w2, 10));
+            wt = _mm256_add_epi32(
+                _mm256_add_epi32(wt, s0),
+                _mm256_add_epi32(w[(t - 7) % 16], s1));
+        }
+
+        __m256i const s1 = _mm256_xor_si256(
+            _mm256_xor_si256(rotate_right(e, 6), rotate_right(e, 11)),
+            rotate_right(e, 25));
+        __m256i const ch = _mm256_xor_si256(
+            _mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+        __m256i const t1 = _mm256_add_epi32(
+            _mm256_add_epi32(h, s1),
+            _mm256_add_epi32(
+                _mm256_add_epi32(
+                    ch, _mm256_set1_epi32(int(round_constants[t]))),
+                wt));
+        __m256i const s0 = _mm256_xor_si256(
+            _mm256_xor_si256(rotate_right(a, 2), rotate_right(a, 13)),
+            rotate_right(a, 22));
+        __m256i const maj = _mm256_xor_si256(
+            _mm256_xor_si256(_mm256_and_si256(a, b), _mm256_and_si256(a, c)),
+            _mm256_and_si256(b, c));
+        __m256i const t2 = _mm256_add_epi32(s0, maj);
+        h = g;
+        g = f;
+        f = e;
+        e = _mm256_add_epi32(d, t1);
+        d = c;
+        c = b;
+        b = a;
+        a = _mm256_add_epi32(t1, t2);
+    }
+
+    __m256i const results[8] = {a, b, c, d, e, f, g, h};
+    for (int i = 0; i != 8; ++i)
+    {
+        _mm256_storeu_si256(
+            reinterpret_cast<__m256i*>(state[i]),
+            _mm256_add_epi32(v[i], results[i]));
+    }
+}
+
+// Hash :messages with the AVX2 implementation.
+//
+// Each lane works through its own message, block by block. When a lane
+// finishes, it picks up the next message that hasn't been started, so lanes
+// stay busy even when the messages have very different lengths.
+//
+void
+hash_messages_with_avx2(
+    std::span<blob const> messages, std::vector<sha256_digest>& digests)
+{
+    struct message_lane
+    {
+        // the index of the message that this lane is hashing (or -1 if the
+        // lane is idle)
+        std::ptrdiff_t message = -1;
+        // the number of blocks that come directly from the message
+        size_t full_blocks;
+        // the total number of blocks (including the padded tail)
+        size_t total_blocks;
+        // the next block to process
+        size_t next_block;
+        // the final block(s) of the message, with padding
+        uint8_t tail[128];
+    };
+    message_lane lanes[8];
+    uint32_t state[8][8];
+    uint8_t const idle_block[64] = {};
+
+    size_t next_message = 0;
+    auto start_message = [&](int l) {
+        message_lane& lane = lanes[l];
+        if (next_message == messages.size())
+        {
+            lane.message = -1;
+            return;
+        }
+        blob const& message = messages[next_message];
+        lane.message = std::ptrdiff_t(next_message);
+        ++next_message;
+        lane.full_blocks = message.size / 64;
+        size_t const tail_size = message.size % 64;
+        std::memcpy(
+            lane.tail, message.data + lane.full_blocks * 64, tail_size);
+        lane.total_blocks
+            = lane.full_blocks
+              + pad_message(lane.tail, tail_size, message.size);
+        lane.next_block = 0;
+        for (int i = 0; i != 8; ++i)
+            state[i][l] = initial_state[i];
+    };
+    for (int l = 0; l != 8; ++l)
+        start_message(l);
+
+    while (true)
+    {
+        uint8_t const* blocks[8];
+        bool any_active = false;
+        for (int l = 0; l != 8; ++l)
+        {
+            message_lane const& lane = lanes[l];
+            if (lane.message < 0)
+            {
+                blocks[l] = idle_block;
+                continue;
+            }
+            any_active = true;
+            blocks[l]
+                = lane.next_block < lane.full_blocks
+                      ? reinterpret_cast<uint8_t const*>(
+                            messages[lane.message].data)
+                            + lane.next_block * 64
+                      : lane.tail + (lane.next_block - lane.full_blocks) * 64;
+        }
+        if (!any_active)
+            break;
+
+        compress_eight_with_avx2(state, blocks);
+
+        for (int l = 0; l != 8; ++l)
+        {
+            message_lane& lane = lanes[l];
+            if (lane.message < 0 || ++lane.next_block != lane.total_blocks)
+                continue;
+            uint32_t lane_state[8];
+            for (int i = 0; i != 8; ++i)
+                lane_state[i] = state[i][l];
+            digests[lane.message] = make_digest(lane_state);
+            start_message(l);
+        }
+    }
+}
+
+#endif
+
+detail::sha256_compression_function
+get_compression_function(sha256_implementation implementation)
+{
+    if (!is_sha256_implementation_supported(implementation)
+        || implementation == sha256_implementation::AVX2)
+    {
+        CRADLE_THROW(
+            unsupported_sha256_implementation()
+            << requested_sha256_implementation_info(implementation));
+    }
+#ifdef CRADLE_SHA256_X86
+    if (implementation == sha256_implementation::SHA_NI)
+        return &compress_with_sha_ni;
+#endif
+    return &compress_portably;
+}
+
+detail::sha256_compression_function
+get_best_compression_function()
+{
+    static detail::sha256_compression_function const function
+        = get_compression_function(get_sha256_implementation());
+    return function;
+}
+
+} // namespace
+
+bool
+is_sha256_implementation_supported(sha256_implementation implementation)
+{
+    switch (implementation)
+    {
+        case sha256_implementation::PORTABLE:
+            return true;
+#ifdef CRADLE_SHA256_X86
+        case sha256_implementation::SHA_NI:
+            return get_x86_features().sha_ni;
+        case sha256_implementation::AVX2:
+            return get_x86_features().avx2;
+#endif
+        default:
+            return false;
+    }
+}
+
+sha256_implementation
+get_sha256_implementation()
+{
+    return is_sha256_implementation_supported(sha256_implementation::SHA_NI)
+               ? sha256_implementation::SHA_NI
+               : sha256_implementation::PORTABLE;
+}
+
+sha256_implementation
+get_batch_sha256_implementation()
+{
+    // SHA_NI is at least as fast as AVX2 (even with all eight lanes busy),
+    // and it doesn't depend on the messages having similar lengths.
+    if (is_sha256_implementation_supported(sha256_implementation::SHA_NI))
+        return sha256_implementation::SHA_NI;
+    if (is_sha256_implementation_supported(sha256_implementation::AVX2))
+        return sha256_implementation::AVX2;
+    return sha256_implementation::PORTABLE;
+}
+
+sha256_hasher::sha256_hasher() : compress_(get_best_compression_function())
+{
+    std::copy(initial_state, initial_state + 8, state_);
+}
+
+sha256_hasher::sha256_hasher(sha256_implementation implementation)
+    : compress_(get_compression_function(implementation))
+{
+    std::copy(initial_state, initial_state + 8, state_);
+}
+
+void
+sha256_hasher::process_blocks(uint8_t const* data, size_t size)
+{
+    length_ += size;
+
+    // Complete the buffered block (if there is one).
+    if (buffered_ != 0)
+    {
+        size_t const n = sizeof(buffer_) - buffered_;
+        std::memcpy(buffer_ + buffered_, data, n);
+        compress_(state_, buffer_, 1);
+        data += n;
+        size -= n;
+        buffered_ = 0;
+    }
+
+    // Compress whole blocks directly from the input.
+    size_t const block_count = size / 64;
+    if (block_count != 0)
+    {
+        compress_(state_, data, block_count);
+        data += block_count * 64;
+        size -= block_count * 64;
+    }
+
+    std::memcpy(buffer_, data, size);
+    buffered_ = size;
+}
+
+sha256_digest
+sha256_hasher::finish()
+{
+    uint8_t tail[128];
+    std::memcpy(tail, buffer_, buffered_);
+    compress_(state_, tail, pad_message(tail, buffered_, length_));
+    return make_digest(state_);
+}
+
+sha256_digest
+compute_sha256(void const* data, size_t size)
+{
+    sha256_hasher hasher;
+    hasher.process(data, size);
+    return hasher.finish();
+}
+
+std::vector<sha256_digest>
+compute_sha256_digests(std::span<blob const> messages)
+{
+    return compute_sha256_digests(
+        messages, get_batch_sha256_implementation());
+}
+
+std::vector<sha256_digest>
+compute_sha256_digests(
+    std::span<blob const> messages, sha256_implementation implementation)
+{
+    std::vector<sha256_digest> digests(messages.size());
+#ifdef CRADLE_SHA256_X86
+    if (implementation == sha256_implementation::AVX2)
+    {
+        if (!is_sha256_implementation_supported(implementation))
+        {
+            CRADLE_THROW(
+                unsupported_sha256_implementation()
+                << requested_sha256_implementation_info(implementation));
+        }
+        hash_messages_with_avx2(messages, digests);
+        return digests;
+    }
+#endif
+    for (size_t i = 0; i != messages.size(); ++i)
+    {
+        sha256_hasher hasher(implementation);
+        hasher.process(messages[i].data, messages[i].size);
+        digests[i] = hasher.finish();
+    }
+    return digests;
+}
+
+string
+format_sha256_digest(sha256_digest const& digest)
+{
+    static char const digits[] = "0123456789abcdef";
+    string hex(digest.size() * 2, '0');
+    for (size_t i = 0; i != digest.size(); ++i)
+    {
+        hex[i * 2] = digits[digest[i] >> 4];
+        hex[i * 2 + 1] = digits[digest[i] & 0xf];
+    }
+    return hex;
+}
+
+} // namespace cradle
@@ -0,0 +1,134 @@
+#ifndef CRADLE_ENCODINGS_SHA256_H
+#define CRADLE_ENCODINGS_SHA256_H
+
+#include <array>
+#include <cstring>
+#include <span>
+#include <vector>
+
+#include <cradle/core.h>
+
+// This file provides SHA-256 hashing.
+//
+// There are several implementations of the compression function, and the
+// best one that the CPU supports is selected at run time:
+//
+// - SHA_NI uses the x86 SHA extensions to hash a single message.
+//
+// - AVX2 hashes eight independent messages at once (one per 32-bit lane of
+//   the AVX2 registers). Since this requires multiple messages, it's only
+//   used by compute_sha256_digests().
+//
+// - PORTABLE is plain C++ and is always available.
+//
+// All implementations produce identical results.
+
+namespace cradle {
+
+typedef std::array<uint8_t, 32> sha256_digest;
+
+enum class sha256_implementation
+{
+    PORTABLE,
+    SHA_NI,
+    AVX2
+};
+
+// Is :implementation supported on the current CPU?
+bool
+is_sha256_implementation_supported(sha256_implementation implementation);
+
+// Get the implementation that's used to hash individual messages.
+sha256_implementation
+get_sha256_implementation();
+
+// Get the implementation that's used to hash batches of messages.
+sha256_implementation
+get_batch_sha256_implementation();
+
+// This is thrown when a SHA-256 implementation is explicitly requested but
+// isn't available.
+CRADLE_DEFINE_EXCEPTION(unsupported_sha256_implementation)
+CRADLE_DEFINE_ERROR_INFO(
+    sha256_implementation, requested_sha256_implementation)
+
+namespace detail {
+
+// A sha256_compression_function applies the SHA-256 compression function to
+// :state for each of the :block_count consecutive 64-byte blocks at
+// :blocks.
+typedef void (*sha256_compression_function)(
+    uint32_t* state, uint8_t const* blocks, size_t block_count);
+
+} // namespace detail
+
+// sha256_hasher computes the SHA-256 digest of a message that's supplied
+// incrementally.
+struct sha256_hasher
+{
+    // Hash with the best implementation for individual messages.
+    sha256_hasher();
+
+    // Hash with a specific implementation.
+    // This throws unsupported_sha256_implementation if :implementation isn't
+    // supported. (AVX2 is never supported for individual messages.)
+    explicit sha256_hasher(sha256_implementation implementation);
+
+    // Add :size bytes at :data to the message.
+    void
+    process(void const* data, size_t size)
+    {
+        // Small writes are common (e.g., when hashing encoded values), so
+        // handle those inline.
+        if (size < sizeof(buffer_) - buffered_)
+        {
+            std::memcpy(buffer_ + buffered_, data, size);
+            buffered_ += size;
+            length_ += size;
+        }
+        else
+        {
+            process_blocks(static_cast<uint8_t const*>(data), size);
+        }
+    }
+
+    // Finish the message and get its digest.
+    // No further calls can be made after this.
+    sha256_digest
+    finish();
+
+ private:
+    void
+    process_blocks(uint8_t const* data, size_t size);
+
+    detail::sha256_compression_function compress_;
+    uint32_t state_[8];
+    uint8_t buffer_[64];
+    size_t buffered_ = 0;
+    uint64_t length_ = 0;
+};
+
+// Compute the SHA-256 digest of the :size bytes at :data.
+sha256_digest
+compute_sha256(void const* data, size_t size);
+
+// Compute the SHA-256 digests of a batch of independent messages.
+// This is faster than hashing them one by one when there's no hardware
+// support for SHA-256 but AVX2 is available.
+std::vector<sha256_digest>
+compute_sha256_digests(std::span<blob const> messages);
+
+// Same as above, but with a specific implementation.
+// This throws unsupported_sha256_implementation if :implementation isn't
+// supported.
+std::vector<sha256_digest>
+compute_sha256_digests(
+    std::span<blob const> messages, sha256_implementation implementation);
+
+// Format a digest as a (lowercase) hex string.
+string
+format_sha256_digest(sha256_digest const& digest);
+
+} // namespace cradle
+
+#endif
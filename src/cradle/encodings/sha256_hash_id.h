@@ -1,40 +1,127 @@
 #ifndef CRADLE_ENCODINGS_SHA256_HASH_ID_H
 #define CRADLE_ENCODINGS_SHA256_HASH_ID_H
 
-#include <picosha2.h>
+#include <atomic>
+#include <cstring>
+#include <sstream>
 
 #include <spdlog/spdlog.h>
 
 #include <cradle/core/id.h>
 #include <cradle/encodings/native.h>
+#include <cradle/encodings/sha256.h>
 
 namespace cradle {
 
 namespace detail {
 
+// Values are hashed via their native encodings, but this streams the
+// encoding straight into the hasher rather than materializing it.
 template<class Value>
 void
-fold_into_sha256(picosha2::hash256_one_by_one& hasher, Value const& value)
+fold_into_sha256(sha256_hasher& hasher, Value const& value)
 {
-    auto natively_encoded = write_natively_encoded_value(to_dynamic(value));
-    hasher.process(natively_encoded.begin(), natively_encoded.end());
+    fold_natively_encoded_value(hasher, value);
 }
 
 inline void
-fold_into_sha256(
-    picosha2::hash256_one_by_one& hasher, std::string const& value)
+fold_into_sha256(sha256_hasher& hasher, std::string const& value)
 {
-    hasher.process(value.begin(), value.end());
+    hasher.process(value.data(), value.size());
 }
 
 inline void
-fold_into_sha256(picosha2::hash256_one_by_one& hasher, char const* value)
+fold_into_sha256(sha256_hasher& hasher, char const* value)
 {
-    hasher.process(value, value + strlen(value));
+    hasher.process(value, std::strlen(value));
 }
 
 } // namespace detail
 
+namespace detail {
+
+// sha256_digest_cache holds the SHA-256 digest of an ID once it's been
+// computed. The digest is computed lazily (on the first call to get()) and
+// is thread-safe: If multiple threads race to compute it, they'll all get
+// the same result, and the first one to finish publishes it. It's also
+// copyable, so copies of an ID (via clone() or deep_copy()) don't have to
+// recompute the digest.
+struct sha256_digest_cache
+{
+    typedef sha256_digest digest;
+
+    sha256_digest_cache()
+    {
+    }
+
+    sha256_digest_cache(sha256_digest_cache const& other) noexcept
+    {
+        copy_from(other);
+    }
+
+    sha256_digest_cache&
+    operator=(sha256_digest_cache const& other) noexcept
+    {
+        if (this != &other)
+            copy_from(other);
+        return *this;
+    }
+
+    // Get the digest, calling :compute() to compute it if necessary.
+    template<class Compute>
+    digest
+    get(Compute&& compute) const
+    {
+        if (state_.load(std::memory_order_acquire) == ready)
+            return digest_;
+        digest computed = std::forward<Compute>(compute)();
+        int expected = empty;
+        if (state_.compare_exchange_strong(
+                expected, publishing, std::memory_order_acquire))
+        {
+            digest_ = computed;
+            state_.store(ready, std::memory_order_release);
+        }
+        return computed;
+    }
+
+ private:
+    void
+    copy_from(sha256_digest_cache const& other) noexcept
+    {
+        // This object is being assigned to, so no one else should be
+        // accessing it.
+        if (other.state_.load(std::memory_order_acquire) == ready)
+        {
+            digest_ = other.digest_;
+            state_.store(ready, std::memory_order_release);
+        }
+        else
+        {
+            state_.store(empty, std::memory_order_relaxed);
+        }
+    }
+
+    enum
+    {
+        empty,
+        publishing,
+        ready
+    };
+
+    mutable std::atomic<int> state_ = empty;
+    mutable digest digest_;
+};
+
+} // namespace detail
+
+// sha256_hashed_id identifies a value by the SHA-256 digest of its arguments
+// (in their native encodings), which makes it suitable as a disk cache key.
+// The digest is computed once per ID (and shared with its copies).
+//
+// Each time the digest is computed, the arguments that went into it are
+// logged to the 'cradle' logger at debug level (if it's enabled).
+//
 template<class... Args>
 struct sha256_hashed_id : id_interface
 {
@@ -49,7 +136,7 @@ struct sha256_hashed_id : id_interface
     id_interface*
     clone() const override
     {
-        return new sha256_hashed_id(args_);
+        return new sha256_hashed_id(*this);
     }
 
     bool
@@ -77,27 +164,8 @@ struct sha256_hashed_id : id_interface
     void
     stream(std::ostream& o) const override
     {
-        picosha2::hash256_one_by_one hasher;
-        std::apply(
-            [&hasher](auto... args) {
-                (detail::fold_into_sha256(hasher, args), ...);
-            },
-            args_);
-        hasher.finish();
-        picosha2::byte_t hashed[32];
-        hasher.get_hash_bytes(hashed, hashed + 32);
-        picosha2::output_hex(hashed, hashed + 32, o);
-        {
-            std::ostringstream s;
-            s << "sha256_hash_id::stream\n";
-            std::apply(
-                [&s](auto... args) {
-                    ((s << "<- " << to_dynamic(args) << std::endl), ...);
-                },
-                args_);
-            picosha2::output_hex(hashed, hashed + 32, s);
-            spdlog::get("cradle")->info(s.str());
-        }
+        o << format_sha256_digest(
+            digest_.get([&] { return compute_digest(); }));
     }
 
     size_t
@@ -108,8 +176,54 @@ struct sha256_hashed_id : id_interface
             args_);
     }
 
+    id_interface*
+    copy_into(void* buffer, size_t size) const override
+    {
+        if (!detail::id_fits_in_buffer<sha256_hashed_id>(size))
+            return nullptr;
+        return new (buffer) sha256_hashed_id(*this);
+    }
+
+    id_interface*
+    move_into(void* buffer, size_t size) noexcept override
+    {
+        return detail::move_id_into(*this, buffer, size);
+    }
+
  private:
+    detail::sha256_digest_cache::digest
+    compute_digest() const
+    {
+        sha256_hasher hasher;
+        std::apply(
+            [&hasher](auto const&... args) {
+                (detail::fold_into_sha256(hasher, args), ...);
+            },
+            args_);
+        auto hashed = hasher.finish();
+        log_digest(hashed);
+        return hashed;
+    }
+
+    void
+    log_digest(detail::sha256_digest_cache::digest const& hashed) const
+    {
+        auto logger = spdlog::get("cradle");
+        if (!logger || !logger->should_log(spdlog::level::debug))
+            return;
+        std::ostringstream s;
+        s << "sha256_hash_id::stream\n";
+        std::apply(
+            [&s](auto const&... args) {
+                ((s << "<- " << to_dynamic(args) << std::endl), ...);
+            },
+            args_);
+        s << format_sha256_digest(hashed);
+        logger->debug(s.str());
+    }
+
     std::tuple<Args...> args_;
+    detail::sha256_digest_cache digest_;
 };
 
 template<class... Args>
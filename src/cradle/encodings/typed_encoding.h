@@ -0,0 +1,278 @@
+#ifndef CRADLE_ENCODINGS_TYPED_ENCODING_H
+#define CRADLE_ENCODINGS_TYPED_ENCODING_H
+
+#include <concepts>
+#include <cstdint>
+#include <string_view>
+#include <type_traits>
+
+#include <cradle/core.h>
+
+// This file provides the encoding-independent support for encoding typed
+// values directly (and decoding them into typed values directly), without
+// going through their dynamic forms. The encodings themselves (see native.h
+// and msgpack_internals.h) build on it.
+//
+// The preprocessor generates the following visitors for API types, which
+// is what this works from:
+//
+// - visit_fields(x, visitor) calls visitor(name, field) for each field of the
+//   structure :x, including those of its supertype. (The supertype's fields
+//   come first, and each type's own fields are visited in key order.)
+//
+// - read_field(x, name, read, offset) calls read(index, field) for the field
+//   of the structure :x called :name (found via a field_name_table), where
+//   :index identifies the field within :x. It returns false if there's no
+//   such field.
+//
+// - visit_union_member(x, visitor) calls visitor(name, member) for the
+//   active member of the union :x.
+//
+// - read_union_member(x, name, read) sets :x to its member called :name,
+//   calling read(member) to read the member's value. It returns false if
+//   there's no such member.
+//
+// Enums don't need visitors. They're encoded as the strings that their
+// get_value_id() functions return.
+
+namespace cradle {
+
+namespace detail {
+
+struct null_field_visitor
+{
+    template<class Field>
+    void
+    operator()(std::string_view, Field const&) const
+    {
+    }
+};
+
+} // namespace detail
+
+template<class T>
+concept visitable_structure = requires(T const& x)
+{
+    visit_fields(x, detail::null_field_visitor());
+};
+
+template<class T>
+concept visitable_union = requires(T const& x)
+{
+    visit_union_member(x, detail::null_field_visitor());
+};
+
+template<class T>
+concept preprocessed_enum = std::is_enum_v<T> && requires(T x)
+{
+    {
+        get_value_id(x)
+        } -> std::convertible_to<char const*>;
+};
+
+// values that aren't dynamic values already (or implicitly convertible to
+// them), which is what the top-level typed encoding functions accept
+template<class T>
+concept non_dynamic = !std::convertible_to<T const&, dynamic>;
+
+// the arithmetic types that to_dynamic() stores as integers
+template<class T>
+concept dynamic_integer_type
+    = std::integral<T> && !std::same_as<T, bool> && !std::same_as<T, char>;
+
+template<class T>
+inline constexpr bool is_omissible_v = false;
+template<class T>
+inline constexpr bool is_omissible_v<omissible<T>> = true;
+
+// WRITING
+
+// Get the number of entries in the dynamic form of the structure :x. (Only
+// omissible fields can be left out.)
+template<visitable_structure Structure>
+size_t
+count_encoded_fields(Structure const& x)
+{
+    size_t count = 0;
+    visit_fields(x, [&](std::string_view, auto const& field) {
+        if constexpr (is_omissible_v<std::decay_t<decltype(field)>>)
+        {
+            if (field)
+                ++count;
+        }
+        else
+        {
+            ++count;
+        }
+    });
+    return count;
+}
+
+// Are the fields of Structure visited in key order (i.e., the order that
+// they take in its dynamic form)? This is true unless Structure has a
+// supertype whose fields don't all come before its own. Since the answer is
+// the same for every Structure, it's only determined once. (:x is only used
+// for its field names.)
+template<visitable_structure Structure>
+bool
+fields_are_in_key_order(Structure const& x)
+{
+    static bool const in_order = [&] {
+        bool in_order = true;
+        std::string_view previous;
+        visit_fields(x, [&](std::string_view name, auto const&) {
+            if (!(previous < name))
+                in_order = false;
+            previous = name;
+        });
+        return in_order;
+    }();
+    return in_order;
+}
+
+// Visit the fields of the structure :x that appear in its dynamic form (in
+// key order), calling visitor(name, value) for each. For omissible fields,
+// :value is the underlying value.
+template<visitable_structure Structure, class Visitor>
+void
+visit_encoded_fields(Structure const& x, Visitor&& visitor)
+{
+    visit_fields(x, [&](std::string_view name, auto const& field) {
+        if constexpr (is_omissible_v<std::decay_t<decltype(field)>>)
+        {
+            if (field)
+                visitor(name, *field);
+        }
+        else
+        {
+            visitor(name, field);
+        }
+    });
+}
+
+// READING
+//
+// When a structure is decoded, the fields that have been read are tracked
+// (by the indices that read_field() reports) in a bit mask, so structures
+// with more fields than that can hold are always decoded via their dynamic
+// forms.
+
+inline constexpr unsigned max_directly_decoded_fields = 64;
+
+template<visitable_structure Structure>
+unsigned
+count_fields(Structure const& x)
+{
+    unsigned count = 0;
+    visit_fields(x, [&](std::string_view, auto const&) { ++count; });
+    return count;
+}
+
+// Get the number of fields of Structure that aren't omissible. Like
+// fields_are_in_key_order(), this is only determined once.
+template<visitable_structure Structure>
+unsigned
+count_required_fields(Structure const& x)
+{
+    static unsigned const count = [&] {
+        unsigned count = 0;
+        visit_fields(x, [&](std::string_view, auto const& field) {
+            if constexpr (!is_omissible_v<std::decay_t<decltype(field)>>)
+                ++count;
+        });
+        return count;
+    }();
+    return count;
+}
+
+// the progress of reading a structure
+struct structure_read_state
+{
+    // the fields that have been read (by index)
+    uint64_t fields_read = 0;
+    // how many of those aren't omissible
+    unsigned required_fields_read = 0;
+};
+
+// Start reading the structure :x. Its omissible fields are cleared, since
+// they're simply left out of the encoding when they're not set.
+template<visitable_structure Structure>
+void
+start_reading_structure(Structure& x)
+{
+    visit_fields(x, [&](std::string_view, auto& field) {
+        if constexpr (is_omissible_v<std::decay_t<decltype(field)>>)
+            field = none;
+    });
+}
+
+enum class field_read_result
+{
+    READ,
+    UNKNOWN,
+    DUPLICATE
+};
+
+// If the structure :x has a field called :name (that hasn't already been
+// read), this reads its value via read_value(&value) and records it in
+// :state. For omissible fields, the underlying value is read.
+template<visitable_structure Structure, class ReadValue>
+field_read_result
+read_structure_field(
+    Structure& x,
+    std::string_view name,
+    structure_read_state& state,
+    ReadValue&& read_value)
+{
+    auto result = field_read_result::UNKNOWN;
+    read_field(
+        x,
+        name,
+        [&](unsigned index, auto& field) {
+            uint64_t const bit = uint64_t(1) << index;
+            if (state.fields_read & bit)
+            {
+                result = field_read_result::DUPLICATE;
+                return;
+            }
+            typedef std::decay_t<decltype(field)> field_type;
+            try
+            {
+                if constexpr (is_omissible_v<field_type>)
+                {
+                    typename field_type::value_type value;
+                    read_value(&value);
+                    field = std::move(value);
+                }
+                else
+                {
+                    read_value(&field);
+                }
+            }
+            catch (boost::exception& e)
+            {
+                add_dynamic_path_element(e, dynamic(string(name)));
+                throw;
+            }
+            state.fields_read |= bit;
+            if constexpr (!is_omissible_v<field_type>)
+                ++state.required_fields_read;
+            result = field_read_result::READ;
+        },
+        0);
+    return result;
+}
+
+// Finish reading the structure :x. If any of its required fields weren't
+// read, this returns false (and :x has to be decoded via its dynamic form so
+// that the error is reported the same way).
+template<visitable_structure Structure>
+bool
+finish_reading_structure(Structure const& x, structure_read_state const& state)
+{
+    return state.required_fields_read == count_required_fields(x);
+}
+
+} // namespace cradle
+
+#endif
@@ -186,15 +186,16 @@ read_yaml_value(YAML::Node const& yaml)
             else
             {
                 // Otherwise, interpret it as a map.
-                dynamic_map map;
+                dynamic_map::entry_list entries;
+                entries.reserve(yaml.size());
                 for (YAML::Node::const_iterator i = yaml.begin();
                      i != yaml.end();
                      ++i)
                 {
-                    map[read_yaml_value(i->first)]
-                        = read_yaml_value(i->second);
+                    entries.emplace_back(
+                        read_yaml_value(i->first), read_yaml_value(i->second));
                 }
-                return map;
+                return dynamic_map(std::move(entries));
             }
         }
     }
@@ -266,10 +267,13 @@ emit_yaml_value(YAML::Emitter& out, dynamic const& v)
                 << to_value_string(cast<boost::posix_time::ptime>(v));
             break;
         case value_type::ARRAY: {
+            // (This goes element by element so that packed arrays don't have
+            // to be unpacked.)
             out << YAML::BeginSeq;
-            for (auto const& i : cast<dynamic_array>(v))
+            size_t size = get_array_size(v);
+            for (size_t i = 0; i != size; ++i)
             {
-                emit_yaml_value(out, i);
+                emit_yaml_value(out, get_array_element(v, i));
             }
             out << YAML::EndSeq;
             break;
@@ -368,20 +372,19 @@ emit_diagnostic_yaml_value(YAML::Emitter& out, dynamic const& v)
                 << to_value_string(cast<boost::posix_time::ptime>(v));
             break;
         case value_type::ARRAY: {
-            dynamic_array const& array = cast<dynamic_array>(v);
-            if (array.size() < 64)
+            size_t size = get_array_size(v);
+            if (size < 64)
             {
                 out << YAML::BeginSeq;
-                for (auto const& i : array)
+                for (size_t i = 0; i != size; ++i)
                 {
-                    emit_diagnostic_yaml_value(out, i);
+                    emit_diagnostic_yaml_value(out, get_array_element(v, i));
                 }
                 out << YAML::EndSeq;
             }
             else
             {
-                out << "<array - size: " + lexical_cast<string>(array.size())
-                           + ">";
+                out << "<array - size: " + lexical_cast<string>(size) + ">";
             }
             break;
         }
@@ -25,9 +25,20 @@
 #include <cradle/fs/file_io.h>
 #include <cradle/fs/utilities.h>
 #include <cradle/service/internals.h>
+#include <cradle/service/warm_start.h>
 
 namespace cradle {
 
+namespace detail {
+
+void
+spill_to_disk_cache(
+    service_core_internals& core,
+    std::string const& key,
+    std::function<dynamic()> const& get_value);
+
+} // namespace detail
+
 void
 service_core::reset()
 {
@@ -40,7 +51,8 @@ service_core::reset(service_config const& config)
     impl_.reset(new detail::service_core_internals{
         .cache = immutable_cache(
             config.immutable_cache ? *config.immutable_cache
-                                   : immutable_cache_config(0x40'00'00'00)),
+                                   : immutable_cache_config(
+                                       0x40'00'00'00, none, none, none, none)),
         .http_pool = cppcoro::static_thread_pool(
             config.http_concurrency ? *config.http_concurrency : 36),
         .disk_cache = disk_cache(
@@ -48,6 +60,23 @@ service_core::reset(service_config const& config)
                               : disk_cache_config(none, 0x1'00'00'00'00)),
         .disk_read_pool = cppcoro::static_thread_pool(2),
         .disk_write_pool = thread_pool(2)});
+    set_eviction_hook(
+        impl_->cache,
+        [&internals = *impl_](
+            id_interface const& key, std::function<dynamic()> get_value) {
+            internals.disk_write_pool.push_task(
+                [&internals,
+                 key = boost::lexical_cast<std::string>(key),
+                 get_value = std::move(get_value)] {
+                    detail::spill_to_disk_cache(internals, key, get_value);
+                });
+        });
+    if (config.memory_pressure)
+    {
+        impl_->memory_pressure = std::make_unique<memory_pressure_monitor>(
+            impl_->cache, *config.memory_pressure);
+        impl_->memory_pressure->start();
+    }
 }
 
 service_core::~service_core()
@@ -98,18 +127,23 @@ serialize(blob* dst, blob src)
     *dst = std::move(src);
 }
 
-void
+// The deserialize() functions return the deep_sizeof() of the value that
+// they produce.
+
+size_t
 deserialize(blob* dst, std::string src)
 {
     *dst = make_blob(std::move(src));
+    return deep_sizeof(*dst);
 }
 
-void
+size_t
 deserialize(blob* dst, std::unique_ptr<uint8_t[]> ptr, size_t size)
 {
     dst->data = reinterpret_cast<char const*>(ptr.get());
     dst->ownership = std::shared_ptr<uint8_t[]>{std::move(ptr)};
     dst->size = size;
+    return deep_sizeof(*dst);
 }
 
 void
@@ -118,34 +152,49 @@ serialize(blob* dst, dynamic src)
     *dst = make_blob(write_natively_encoded_value(src));
 }
 
-void
+size_t
 deserialize(dynamic* dst, string x)
 {
+    size_t deep_size;
     *dst = read_natively_encoded_value(
-        reinterpret_cast<uint8_t const*>(x.data()), x.size());
+        reinterpret_cast<uint8_t const*>(x.data()), x.size(), &deep_size);
+    return deep_size;
 }
 
-void
+size_t
 deserialize(dynamic* dst, std::unique_ptr<uint8_t[]> ptr, size_t size)
 {
-    *dst = read_natively_encoded_value(ptr.get(), size);
+    size_t deep_size;
+    *dst = read_natively_encoded_value(ptr.get(), size, &deep_size);
+    return deep_size;
 }
 
 } // namespace
 
 } // namespace detail
 
+// Look up :key in the disk cache and decode its value (if it's there).
+// This also reports the size of the value, which is determined while
+// decoding it.
 template<class T>
-cppcoro::task<T>
-generic_disk_cached(
-    service_core& core,
-    std::string key,
-    std::function<cppcoro::task<T>()> create_task)
+cppcoro::task<optional<sized_cache_value<T>>>
+read_disk_cached(service_core& core, std::string key)
 {
-    // Check the cache for an existing value.
     auto& cache = core.internals().disk_cache;
     try
     {
+        // If the entry was prefetched for a warm start, its data is already
+        // in memory.
+        auto prefetched = detail::take_prefetched_disk_cache_entry(core, key);
+        if (prefetched)
+        {
+            spdlog::get("cradle")->info(
+                "prefetched disk cache hit on {}", key);
+            T x;
+            size_t size = detail::deserialize(&x, std::move(*prefetched));
+            co_return sized_cache_value<T>{std::move(x), size};
+        }
+
         auto entry = cache.find(key);
         if (entry)
         {
@@ -157,11 +206,12 @@ generic_disk_cached(
                     *entry->value, get_mime_base64_character_set());
 
                 T x;
-                detail::deserialize(&x, std::move(natively_encoded_data));
+                size_t size = detail::deserialize(
+                    &x, std::move(natively_encoded_data));
                 spdlog::get("cradle")->info(
                     "deserialized: {}",
                     boost::lexical_cast<std::string>(to_dynamic(x)));
-                co_return x;
+                co_return sized_cache_value<T>{std::move(x), size};
             }
             else
             {
@@ -187,10 +237,10 @@ generic_disk_cached(
                 {
                     spdlog::get("cradle")->info("decoding", key);
                     T decoded;
-                    detail::deserialize(
+                    size_t size = detail::deserialize(
                         &decoded, std::move(decompressed_data), original_size);
                     spdlog::get("cradle")->info("returning", key);
-                    co_return decoded;
+                    co_return sized_cache_value<T>{std::move(decoded), size};
                 }
             }
         }
@@ -201,69 +251,124 @@ generic_disk_cached(
         // pretend it's not there. (It will be overwritten.)
         spdlog::get("cradle")->warn("error reading disk cache entry {}", key);
     }
+    co_return none;
+}
+
+// Encode :value and write it to the disk cache under :key.
+// This should be called from the disk write pool.
+template<class T>
+void
+write_disk_cached(
+    detail::service_core_internals& core, std::string const& key, T value)
+{
+    auto& cache = core.disk_cache;
+    try
+    {
+        blob encoded_data;
+        detail::serialize(&encoded_data, std::move(value));
+        if (encoded_data.size > 1024)
+        {
+            size_t max_compressed_size
+                = lz4::max_compressed_size(encoded_data.size);
+
+            std::unique_ptr<uint8_t[]> compressed_data(
+                new uint8_t[max_compressed_size]);
+            size_t actual_compressed_size = lz4::compress(
+                compressed_data.get(),
+                max_compressed_size,
+                encoded_data.data,
+                encoded_data.size);
+
+            auto cache_id = cache.initiate_insert(key);
+            {
+                auto entry_path = cache.get_path_for_id(cache_id);
+                std::ofstream output;
+                open_file(
+                    output,
+                    entry_path,
+                    std::ios::out | std::ios::trunc | std::ios::binary);
+                output.write(
+                    reinterpret_cast<char const*>(compressed_data.get()),
+                    actual_compressed_size);
+            }
+            boost::crc_32_type crc;
+            crc.process_bytes(encoded_data.data, encoded_data.size);
+            cache.finish_insert(
+                cache_id, crc.checksum(), encoded_data.size);
+        }
+        else
+        {
+            cache.insert(
+                key,
+                base64_encode(
+                    reinterpret_cast<uint8_t const*>(encoded_data.data),
+                    encoded_data.size,
+                    get_mime_base64_character_set()));
+        }
+    }
+    catch (...)
+    {
+        // Something went wrong trying to write the cached value, so issue a
+        // warning and move on.
+        spdlog::get("cradle")->warn("error writing disk cache entry {}", key);
+    }
+}
+
+namespace detail {
+
+// This is used (via the memory cache's eviction hook) to write values that
+// are evicted from the memory cache to the disk cache. Values that are
+// already in the disk cache (e.g., because they were produced by
+// fully_cached()) are left alone.
+void
+spill_to_disk_cache(
+    service_core_internals& core,
+    std::string const& key,
+    std::function<dynamic()> const& get_value)
+{
+    try
+    {
+        if (core.disk_cache.find(key))
+            return;
+    }
+    catch (...)
+    {
+        spdlog::get("cradle")->warn("error reading disk cache entry {}", key);
+        return;
+    }
+    write_disk_cached(core, key, get_value());
+}
+
+} // namespace detail
+
+// This also reports the size of the value that it produces. When the value
+// comes from the disk cache, the size is determined while decoding it.
+template<class T>
+cppcoro::task<sized_cache_value<T>>
+generic_disk_cached(
+    service_core& core,
+    std::string key,
+    std::function<cppcoro::task<T>()> create_task)
+{
+    // Check the cache for an existing value.
+    auto cached = co_await read_disk_cached<T>(core, key);
+    if (cached)
+        co_return std::move(*cached);
     spdlog::get("cradle")->info("disk cache miss on {}", key);
 
     // We didn't get it from the cache, so actually create the task to compute
     // the result.
     auto result = co_await create_task();
+    // There's no decoder to tell us the size in this case, so we have to
+    // measure it directly.
+    auto size = deep_sizeof(result);
 
     // Cache the result.
     core.internals().disk_write_pool.push_task([&core, key, result] {
-        auto& cache = core.internals().disk_cache;
-        try
-        {
-            blob encoded_data;
-            detail::serialize(&encoded_data, std::move(result));
-            if (encoded_data.size > 1024)
-            {
-                size_t max_compressed_size
-                    = lz4::max_compressed_size(encoded_data.size);
-
-                std::unique_ptr<uint8_t[]> compressed_data(
-                    new uint8_t[max_compressed_size]);
-                size_t actual_compressed_size = lz4::compress(
-                    compressed_data.get(),
-                    max_compressed_size,
-                    encoded_data.data,
-                    encoded_data.size);
-
-                auto cache_id = cache.initiate_insert(key);
-                {
-                    auto entry_path = cache.get_path_for_id(cache_id);
-                    std::ofstream output;
-                    open_file(
-                        output,
-                        entry_path,
-                        std::ios::out | std::ios::trunc | std::ios::binary);
-                    output.write(
-                        reinterpret_cast<char const*>(compressed_data.get()),
-                        actual_compressed_size);
-                }
-                boost::crc_32_type crc;
-                crc.process_bytes(encoded_data.data, encoded_data.size);
-                cache.finish_insert(
-                    cache_id, crc.checksum(), encoded_data.size);
-            }
-            else
-            {
-                cache.insert(
-                    key,
-                    base64_encode(
-                        reinterpret_cast<uint8_t const*>(encoded_data.data),
-                        encoded_data.size,
-                        get_mime_base64_character_set()));
-            }
-        }
-        catch (...)
-        {
-            // Something went wrong trying to write the cached value, so issue
-            // a warning and move on.
-            spdlog::get("cradle")->warn(
-                "error writing disk cache entry {}", key);
-        }
+        write_disk_cached(core.internals(), key, result);
     });
 
-    co_return result;
+    co_return sized_cache_value<T>{std::move(result), size};
 }
 
 cppcoro::task<dynamic>
@@ -272,8 +377,9 @@ disk_cached(
     std::string key,
     std::function<cppcoro::task<dynamic>()> create_task)
 {
-    return generic_disk_cached<dynamic>(
-        core, std::move(key), std::move(create_task));
+    co_return (co_await generic_disk_cached<dynamic>(
+                   core, std::move(key), std::move(create_task)))
+        .value;
 }
 
 cppcoro::task<dynamic>
@@ -282,7 +388,7 @@ disk_cached(
     id_interface const& key,
     std::function<cppcoro::task<dynamic>()> create_task)
 {
-    return generic_disk_cached<dynamic>(
+    return disk_cached(
         core, boost::lexical_cast<std::string>(key), std::move(create_task));
 }
 
@@ -292,8 +398,9 @@ disk_cached(
     std::string key,
     std::function<cppcoro::task<blob>()> create_task)
 {
-    return generic_disk_cached<blob>(
-        core, std::move(key), std::move(create_task));
+    co_return (co_await generic_disk_cached<blob>(
+                   core, std::move(key), std::move(create_task)))
+        .value;
 }
 
 cppcoro::task<blob>
@@ -301,6 +408,33 @@ disk_cached(
     service_core& core,
     id_interface const& key,
     std::function<cppcoro::task<blob>()> create_task)
+{
+    return disk_cached(
+        core, boost::lexical_cast<std::string>(key), std::move(create_task));
+}
+
+cppcoro::task<optional<sized_cache_value<dynamic>>>
+look_up_disk_cached(service_core& core, id_interface const& key)
+{
+    return read_disk_cached<dynamic>(
+        core, boost::lexical_cast<std::string>(key));
+}
+
+cppcoro::task<sized_cache_value<dynamic>>
+sized_disk_cached(
+    service_core& core,
+    id_interface const& key,
+    std::function<cppcoro::task<dynamic>()> create_task)
+{
+    return generic_disk_cached<dynamic>(
+        core, boost::lexical_cast<std::string>(key), std::move(create_task));
+}
+
+cppcoro::task<sized_cache_value<blob>>
+sized_disk_cached(
+    service_core& core,
+    id_interface const& key,
+    std::function<cppcoro::task<blob>()> create_task)
 {
     return generic_disk_cached<blob>(
         core, boost::lexical_cast<std::string>(key), std::move(create_task));
@@ -314,11 +448,13 @@ init_test_service(service_core& core)
     reset_directory(cache_dir);
 
     core.reset(service_config(
-        immutable_cache_config(0x40'00'00'00),
+        immutable_cache_config(0x40'00'00'00, none, none, none, none),
+        none,
         disk_cache_config(some(cache_dir.string()), 0x40'00'00'00),
         2,
         2,
-        2));
+        2,
+        none));
 }
 
 mock_http_session&
@@ -2,11 +2,15 @@
 #define CRADLE_SERVICE_CORE_H
 
 #include <memory>
+#include <type_traits>
+#include <vector>
 
 #include <cppcoro/fmap.hpp>
 #include <cppcoro/task.hpp>
 
 #include <cradle/caching/immutable.h>
+#include <cradle/core/coercion.h>
+#include <cradle/encodings/native.h>
 #include <cradle/io/http_requests.hpp>
 #include <cradle/service/internals.h>
 #include <cradle/service/types.hpp>
@@ -19,6 +23,15 @@ struct service_core_internals;
 
 }
 
+// Compiling a coercion plan means resolving all the named types that it
+// reaches (which can require a round trip to Thinknode for each), so plans
+// are spilled to the disk cache when they're evicted rather than being
+// compiled again.
+template<>
+struct immutable_cache_spills_on_eviction<coercion_plan> : std::true_type
+{
+};
+
 struct service_core
 {
     service_core()
@@ -91,6 +104,32 @@ disk_cached(
     id_interface const& key,
     std::function<cppcoro::task<blob>()> create_task);
 
+namespace detail {
+
+// Other types of values are stored in their native encodings, which they're
+// encoded to (and decoded from) directly, without going through their
+// dynamic forms. (The encoding is the same one that their dynamic forms
+// would be stored in, so the disk cache entries are the same either way.)
+
+template<class Value>
+blob
+natively_encode_for_disk_cache(Value const& value)
+{
+    return make_blob(write_natively_encoded_value(value));
+}
+
+template<class Value>
+Value
+natively_decode_from_disk_cache(blob const& encoded)
+{
+    Value value;
+    read_natively_encoded_value(
+        &value, reinterpret_cast<uint8_t const*>(encoded.data), encoded.size);
+    return value;
+}
+
+} // namespace detail
+
 template<class Value>
 cppcoro::task<Value>
 disk_cached(
@@ -99,13 +138,115 @@ disk_cached(
     std::function<cppcoro::task<Value>()> create_task)
 {
     return cppcoro::make_task(cppcoro::fmap(
-        CRADLE_LAMBDIFY(from_dynamic<Value>),
+        CRADLE_LAMBDIFY(detail::natively_decode_from_disk_cache<Value>),
         disk_cached(core, key, [create_task = std::move(create_task)]() {
             return cppcoro::make_task(cppcoro::fmap(
-                CRADLE_LAMBDIFY(to_dynamic<Value>), create_task()));
+                CRADLE_LAMBDIFY(detail::natively_encode_for_disk_cache<Value>),
+                create_task()));
         })));
 }
 
+// The sized_disk_cached() functions are equivalent to disk_cached(), but
+// they also report the size of the value that they produce, so they can
+// supply tasks for the immutable cache directly. (See sized_cache_value.)
+
+cppcoro::task<sized_cache_value<dynamic>>
+sized_disk_cached(
+    service_core& core,
+    id_interface const& key,
+    std::function<cppcoro::task<dynamic>()> create_task);
+
+cppcoro::task<sized_cache_value<blob>>
+sized_disk_cached(
+    service_core& core,
+    id_interface const& key,
+    std::function<cppcoro::task<blob>()> create_task);
+
+// Look up :key in the disk cache. Unlike the functions above, this doesn't
+// compute (or cache) anything if the key isn't there.
+cppcoro::task<optional<sized_cache_value<dynamic>>>
+look_up_disk_cached(service_core& core, id_interface const& key);
+
+// For other types of values, the disk cache only sees their encodings, so
+// the reported size is measured from the decoded value.
+template<class Value>
+cppcoro::task<sized_cache_value<Value>>
+sized_disk_cached(
+    service_core& core,
+    id_interface const& key,
+    std::function<cppcoro::task<Value>()> create_task)
+{
+    return cppcoro::make_task(cppcoro::fmap(
+        [](sized_cache_value<blob> x) {
+            auto value
+                = detail::natively_decode_from_disk_cache<Value>(x.value);
+            auto size = deep_sizeof(value);
+            return sized_cache_value<Value>{std::move(value), size};
+        },
+        sized_disk_cached(
+            core, key, [create_task = std::move(create_task)]() {
+                return cppcoro::make_task(cppcoro::fmap(
+                    CRADLE_LAMBDIFY(
+                        detail::natively_encode_for_disk_cache<Value>),
+                    create_task()));
+            })));
+}
+
+namespace detail {
+
+// For value types that spill to disk when they're evicted from the memory
+// cache (see immutable_cache_spills_on_eviction), a memory cache miss may
+// still be satisfied from the disk cache, so this checks there before
+// resorting to :task.
+template<class Value>
+cppcoro::task<sized_cache_value<Value>>
+recover_spilled_value(
+    service_core& core, captured_id key, cppcoro::task<Value> task)
+{
+    auto spilled = co_await look_up_disk_cached(core, *key);
+    if (spilled)
+    {
+        co_return sized_cache_value<Value>{
+            from_dynamic<Value>(spilled->value), spilled->size};
+    }
+    Value value = co_await std::move(task);
+    auto size = deep_sizeof(value);
+    co_return sized_cache_value<Value>{std::move(value), size};
+}
+
+// Does a task produced by TaskCreator (when called with Args) need to
+// recover spilled values? This only applies to tasks that produce plain
+// Values. (Tasks that produce sized_cache_values come from the disk cache
+// already.)
+template<class Value, class TaskCreator, class... Args>
+inline constexpr bool recovers_spilled_values
+    = immutable_cache_spills_on_eviction<Value>::value
+      && std::is_same_v<
+          std::invoke_result_t<TaskCreator const&, Args...>,
+          cppcoro::task<Value>>;
+
+// Wrap :task_creator so that it recovers spilled values if necessary.
+// (Otherwise, this is a no-op.)
+template<class Value, class TaskCreator>
+auto
+recover_spilled_values(
+    service_core& core, id_interface const& key, TaskCreator task_creator)
+{
+    if constexpr (recovers_spilled_values<Value, TaskCreator>)
+    {
+        return [&core, &key, task_creator = std::move(task_creator)] {
+            return recover_spilled_value<Value>(
+                core, captured_id(key), task_creator());
+        };
+    }
+    else
+    {
+        return task_creator;
+    }
+}
+
+} // namespace detail
+
 template<class Value, class Key>
 cppcoro::shared_task<Value>
 cached(service_core& core, Key key, cppcoro::task<Value> task)
@@ -113,7 +254,8 @@ cached(service_core& core, Key key, cppcoro::task<Value> task)
     immutable_cache_ptr<Value> ptr(
         core.internals().cache,
         key,
-        detail::cached_task_creator<Value>{&task});
+        detail::recover_spilled_values<Value>(
+            core, key, detail::cached_task_creator<Value>{&task}));
     return ptr.task();
 }
 
@@ -121,7 +263,10 @@ template<class Value, class Key, class TaskCreator>
 cppcoro::shared_task<Value>
 cached(service_core& core, Key key, TaskCreator task_creator)
 {
-    immutable_cache_ptr<Value> ptr(core.internals().cache, key, task_creator);
+    immutable_cache_ptr<Value> ptr(
+        core.internals().cache,
+        key,
+        detail::recover_spilled_values<Value>(core, key, task_creator));
     return ptr.task();
 }
 
@@ -130,7 +275,51 @@ cppcoro::shared_task<Value>
 fully_cached(service_core& core, Key key, TaskCreator task_creator)
 {
     return cached<Value>(core, key, [=, &core] {
-        return disk_cached<Value>(core, key, std::move(task_creator));
+        return sized_disk_cached<Value>(core, key, std::move(task_creator));
+    });
+}
+
+// cached_batch() is the batch equivalent of cached(). It resolves all of
+// :keys against the service's memory cache in one pass per cache shard
+// (see acquire_cache_ptrs) and returns the tasks in the same order as the
+// keys. :task_creator(i) must return the task for keys[i].
+template<class Value, class Keys, class TaskCreator>
+std::vector<cppcoro::shared_task<Value>>
+cached_batch(service_core& core, Keys const& keys, TaskCreator&& task_creator)
+{
+    constexpr bool recover_spilled_values
+        = detail::recovers_spilled_values<
+            Value,
+            std::remove_cvref_t<TaskCreator>,
+            std::size_t>;
+    auto ptrs = acquire_cache_ptrs<Value>(
+        core.internals().cache, keys, [&](std::size_t i) {
+            if constexpr (recover_spilled_values)
+            {
+                return detail::recover_spilled_value<Value>(
+                    core, captured_id(keys[i]), task_creator(i));
+            }
+            else
+            {
+                return task_creator(i);
+            }
+        });
+    std::vector<cppcoro::shared_task<Value>> tasks;
+    tasks.reserve(ptrs.size());
+    for (auto const& ptr : ptrs)
+        tasks.push_back(ptr.task());
+    return tasks;
+}
+
+// fully_cached_batch() is the batch equivalent of fully_cached().
+template<class Value, class Keys, class TaskCreator>
+std::vector<cppcoro::shared_task<Value>>
+fully_cached_batch(
+    service_core& core, Keys const& keys, TaskCreator task_creator)
+{
+    return cached_batch<Value>(core, keys, [&](std::size_t i) {
+        return sized_disk_cached<Value>(
+            core, keys[i], [=] { return task_creator(i); });
     });
 }
 
@@ -1,6 +1,13 @@
 #ifndef CRADLE_SERVICE_INTERNALS_H
 #define CRADLE_SERVICE_INTERNALS_H
 
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+
 #include <cppcoro/static_thread_pool.hpp>
 
 #include <thread-pool/thread_pool.hpp>
@@ -14,10 +21,58 @@ namespace cradle {
 
 namespace detail {
 
+// the state of a warm-start prefetch (see warm_start.h)
+struct warm_start_prefetch
+{
+    // the keys listed in the manifest
+    std::vector<std::string> keys;
+
+    // the index of the next key to prefetch
+    std::atomic<std::size_t> next_key = 0;
+
+    // the decoded data for entries that have been prefetched but not yet
+    // used, indexed by key, along with its total size - These (and the flags
+    // below) are protected by :mutex.
+    std::mutex mutex;
+    std::unordered_map<std::string, std::string> entries;
+    uint64_t total_size = 0;
+
+    // This is set once the retention period is over. At that point, any
+    // entries that are still unused are dropped, and no more are added.
+    bool expired = false;
+
+    // This is set when the prefetch is being destroyed.
+    bool stopping = false;
+
+    // progress counters (see warm_start_progress)
+    std::atomic<std::size_t> finished_count = 0;
+    std::atomic<std::size_t> prefetched_count = 0;
+    std::atomic<std::size_t> used_count = 0;
+    std::atomic<std::size_t> expired_count = 0;
+
+    // If this is set, the workers stop as soon as they finish their current
+    // entry.
+    std::atomic<bool> canceled = false;
+
+    std::vector<std::thread> workers;
+
+    // This thread waits for the retention period to end (or for :stopping)
+    // and then drops the unused entries. It waits on :expiry_wakeup.
+    std::thread expiry;
+    std::condition_variable expiry_wakeup;
+
+    // This cancels the prefetch and waits for its threads to stop.
+    ~warm_start_prefetch();
+};
+
 struct service_core_internals
 {
     cradle::immutable_cache cache;
 
+    // This is only present if the service is configured to respond to memory
+    // pressure. (It must be destroyed before :cache.)
+    std::unique_ptr<memory_pressure_monitor> memory_pressure;
+
     cppcoro::static_thread_pool http_pool;
 
     std::map<
@@ -30,6 +85,13 @@ struct service_core_internals
     thread_pool disk_write_pool;
 
     std::unique_ptr<mock_http_session> mock_http;
+
+    // This comes last so that its workers are stopped before anything they
+    // use is destroyed. Requests may look up prefetched entries while it's
+    // being replaced, so it's only accessed while holding
+    // :warm_start_mutex (exclusively to replace it).
+    std::shared_mutex warm_start_mutex;
+    std::unique_ptr<warm_start_prefetch> warm_start;
 };
 
 } // namespace detail
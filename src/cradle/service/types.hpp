@@ -3,15 +3,45 @@
 
 #include <cradle/caching/disk_cache.hpp>
 #include <cradle/caching/immutable.h>
+#include <cradle/caching/immutable/memory_pressure.hpp>
 
 namespace cradle {
 
+api(struct)
+struct warm_start_config
+{
+    // the path to the warm-start manifest - When the server shuts down, it
+    // records the keys of the hottest entries in its memory cache here, and
+    // when it starts up, it prefetches those entries from the disk cache.
+    std::string manifest_path;
+
+    // the maximum number of keys to record in the manifest (defaults to 1000)
+    omissible<integer> max_entries;
+
+    // how many entries to prefetch concurrently (defaults to 2)
+    omissible<integer> prefetch_concurrency;
+
+    // the maximum total size (in bytes) of prefetched data that can be held
+    // while waiting to be used (defaults to 256 MB)
+    omissible<integer> prefetch_size_limit;
+
+    // how long (in milliseconds, from the start of the prefetch) prefetched
+    // data is held while waiting to be used (defaults to 300,000, i.e., five
+    // minutes) - Prefetched data isn't part of the memory cache's budget, so
+    // whatever hasn't been used by then is dropped.
+    omissible<integer> prefetch_retention;
+};
+
 api(struct)
 struct service_config
 {
     // config for the immutable memory cache
     omissible<immutable_cache_config> immutable_cache;
 
+    // config for adjusting the memory cache's budget in response to memory
+    // pressure - If this is omitted, the budget is fixed.
+    omissible<memory_pressure_config> memory_pressure;
+
     // config for the disk cache
     omissible<disk_cache_config> disk_cache;
 
@@ -25,6 +55,10 @@ struct service_config
 
     // how many concurrent threads to use for HTTP requests
     omissible<integer> http_concurrency;
+
+    // config for warm starts - If this is omitted, the memory cache always
+    // starts out cold.
+    omissible<warm_start_config> warm_start;
 };
 
 } // namespace cradle
@@ -0,0 +1,301 @@
+#include <cradle/service/warm_start.h>
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+
+// Boost.Crc triggers some warnings on MSVC.
+#if defined(_MSC_VER)
+#pragma warning(push)
+#pragma warning(disable : 4245)
+#pragma warning(disable : 4701)
+#include <boost/crc.hpp>
+#pragma warning(pop)
+#else
+#include <boost/crc.hpp>
+#endif
+
+#include <boost/numeric/conversion/cast.hpp>
+
+#include <spdlog/spdlog.h>
+
+#include <cradle/encodings/base64.h>
+#include <cradle/encodings/lz4.h>
+#include <cradle/fs/file_io.h>
+#include <cradle/service/internals.h>
+
+namespace cradle {
+
+namespace detail {
+
+warm_start_prefetch::~warm_start_prefetch()
+{
+    {
+        std::scoped_lock<std::mutex> lock(mutex);
+        stopping = true;
+        canceled = true;
+    }
+    expiry_wakeup.notify_all();
+    for (auto& worker : workers)
+        worker.join();
+    if (expiry.joinable())
+        expiry.join();
+}
+
+} // namespace detail
+
+namespace {
+
+std::size_t
+get_max_entries(warm_start_config const& config)
+{
+    return config.max_entries
+               ? boost::numeric_cast<std::size_t>(*config.max_entries)
+               : 1000;
+}
+
+std::size_t
+get_prefetch_concurrency(warm_start_config const& config)
+{
+    return config.prefetch_concurrency
+               ? std::max<std::size_t>(
+                   boost::numeric_cast<std::size_t>(
+                       *config.prefetch_concurrency),
+                   1)
+               : 2;
+}
+
+uint64_t
+get_prefetch_size_limit(warm_start_config const& config)
+{
+    return config.prefetch_size_limit
+               ? boost::numeric_cast<uint64_t>(*config.prefetch_size_limit)
+               : 0x10'00'00'00;
+}
+
+std::chrono::milliseconds
+get_prefetch_retention(warm_start_config const& config)
+{
+    return std::chrono::milliseconds(
+        config.prefetch_retention
+            ? std::max<integer>(*config.prefetch_retention, 0)
+            : 300'000);
+}
+
+// Read the data for the disk cache entry associated with :key.
+// This mirrors the reading half of disk_cached(), except that it's
+// synchronous and it stops short of decoding the data.
+optional<std::string>
+read_disk_cache_entry(disk_cache& cache, std::string const& key)
+{
+    auto entry = cache.find(key);
+    if (!entry)
+        return none;
+
+    if (entry->value)
+        return base64_decode(*entry->value, get_mime_base64_character_set());
+
+    auto data = read_file_contents(cache.get_path_for_id(entry->id));
+    std::string decompressed(
+        boost::numeric_cast<size_t>(entry->original_size), '\0');
+    lz4::decompress(
+        decompressed.data(), decompressed.size(), data.data(), data.size());
+    boost::crc_32_type crc;
+    crc.process_bytes(decompressed.data(), decompressed.size());
+    if (crc.checksum() != entry->crc32)
+        return none;
+    return decompressed;
+}
+
+void
+run_prefetch_worker(
+    detail::service_core_internals& core,
+    detail::warm_start_prefetch& prefetch,
+    uint64_t size_limit)
+{
+    while (!prefetch.canceled)
+    {
+        auto index = prefetch.next_key.fetch_add(1);
+        if (index >= prefetch.keys.size())
+            break;
+        auto const& key = prefetch.keys[index];
+        try
+        {
+            auto data = read_disk_cache_entry(core.disk_cache, key);
+            if (data)
+            {
+                std::scoped_lock<std::mutex> lock(prefetch.mutex);
+                if (prefetch.expired
+                    || prefetch.total_size + data->size() > size_limit)
+                {
+                    // Keys are listed hottest first, so once there's no
+                    // more room, there's no point in continuing.
+                    prefetch.canceled = true;
+                }
+                else
+                {
+                    prefetch.total_size += data->size();
+                    prefetch.entries.emplace(key, std::move(*data));
+                    ++prefetch.prefetched_count;
+                }
+            }
+        }
+        catch (...)
+        {
+            // Prefetching is purely an optimization, so just issue a warning
+            // and move on.
+            spdlog::get("cradle")->warn("error prefetching {}", key);
+        }
+        ++prefetch.finished_count;
+    }
+}
+
+// Wait until :deadline (or until :prefetch is stopping) and then drop
+// whatever entries haven't been used. This keeps a prefetch whose entries
+// are never requested from holding onto memory indefinitely.
+void
+run_prefetch_expiry(
+    detail::warm_start_prefetch& prefetch,
+    std::chrono::steady_clock::time_point deadline)
+{
+    std::unique_lock<std::mutex> lock(prefetch.mutex);
+    prefetch.expiry_wakeup.wait_until(
+        lock, deadline, [&] { return prefetch.stopping; });
+    if (prefetch.stopping)
+        return;
+    prefetch.expired = true;
+    prefetch.canceled = true;
+    auto const dropped = prefetch.entries.size();
+    prefetch.entries.clear();
+    prefetch.total_size = 0;
+    prefetch.expired_count = dropped;
+    if (dropped != 0)
+    {
+        spdlog::get("cradle")->info(
+            "dropping {} unused warm-start entries", dropped);
+    }
+}
+
+} // namespace
+
+void
+write_warm_start_manifest(service_core& core, warm_start_config const& config)
+{
+    auto keys = get_hottest_cache_keys(
+        core.internals().cache, get_max_entries(config));
+
+    // Write the manifest to a temporary file first so that an interrupted
+    // write can't leave behind a truncated manifest.
+    file_path path(config.manifest_path);
+    file_path temporary_path = path;
+    temporary_path += ".tmp";
+    {
+        std::ofstream output;
+        open_file(output, temporary_path, std::ios::out | std::ios::trunc);
+        for (auto const& key : keys)
+        {
+            // The manifest has one key per line, so any keys that span
+            // lines can't be recorded.
+            if (key.find('\n') == std::string::npos)
+                output << key << '\n';
+        }
+    }
+    std::filesystem::rename(temporary_path, path);
+}
+
+void
+start_warm_start_prefetch(service_core& core, warm_start_config const& config)
+{
+    auto& internals = core.internals();
+
+    // Any previous prefetch is stopped before the new one starts. (It's
+    // detached while holding the lock but destroyed outside of it, since
+    // destroying it waits for its threads.)
+    {
+        std::unique_ptr<detail::warm_start_prefetch> previous;
+        {
+            std::unique_lock<std::shared_mutex> lock(
+                internals.warm_start_mutex);
+            previous = std::move(internals.warm_start);
+        }
+    }
+
+    std::ifstream input(config.manifest_path);
+    if (!input)
+        return;
+    auto prefetch = std::make_unique<detail::warm_start_prefetch>();
+    auto const max_entries = get_max_entries(config);
+    std::string key;
+    while (prefetch->keys.size() < max_entries && std::getline(input, key))
+    {
+        if (!key.empty())
+            prefetch->keys.push_back(key);
+    }
+    spdlog::get("cradle")->info(
+        "prefetching {} warm-start entries", prefetch->keys.size());
+
+    auto const size_limit = get_prefetch_size_limit(config);
+    auto const worker_count = std::min(
+        get_prefetch_concurrency(config), prefetch->keys.size());
+    for (std::size_t i = 0; i != worker_count; ++i)
+    {
+        prefetch->workers.emplace_back(
+            [&internals, &state = *prefetch, size_limit] {
+                run_prefetch_worker(internals, state, size_limit);
+            });
+    }
+    prefetch->expiry = std::thread(
+        [&state = *prefetch,
+         deadline = std::chrono::steady_clock::now()
+                    + get_prefetch_retention(config)] {
+            run_prefetch_expiry(state, deadline);
+        });
+
+    std::unique_lock<std::shared_mutex> lock(internals.warm_start_mutex);
+    internals.warm_start = std::move(prefetch);
+}
+
+warm_start_progress
+get_warm_start_progress(service_core& core)
+{
+    warm_start_progress progress;
+    auto& internals = core.internals();
+    std::shared_lock<std::shared_mutex> lock(internals.warm_start_mutex);
+    auto const& prefetch = internals.warm_start;
+    if (prefetch)
+    {
+        progress.listed = prefetch->keys.size();
+        progress.finished = prefetch->finished_count;
+        progress.prefetched = prefetch->prefetched_count;
+        progress.used = prefetch->used_count;
+        progress.expired = prefetch->expired_count;
+    }
+    return progress;
+}
+
+namespace detail {
+
+optional<std::string>
+take_prefetched_disk_cache_entry(service_core& core, std::string const& key)
+{
+    auto& internals = core.internals();
+    std::shared_lock<std::shared_mutex> warm_start_lock(
+        internals.warm_start_mutex);
+    auto& prefetch = internals.warm_start;
+    if (!prefetch)
+        return none;
+    std::scoped_lock<std::mutex> lock(prefetch->mutex);
+    auto i = prefetch->entries.find(key);
+    if (i == prefetch->entries.end())
+        return none;
+    std::string data = std::move(i->second);
+    prefetch->entries.erase(i);
+    prefetch->total_size -= data.size();
+    ++prefetch->used_count;
+    return data;
+}
+
+} // namespace detail
+
+} // namespace cradle
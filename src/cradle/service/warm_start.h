@@ -0,0 +1,67 @@
+#ifndef CRADLE_SERVICE_WARM_START_H
+#define CRADLE_SERVICE_WARM_START_H
+
+#include <cradle/service/core.h>
+
+// This file provides warm starts for the service's memory cache.
+//
+// When a service shuts down, it can record the keys of the hottest entries
+// in its memory cache in a manifest file. When it starts back up, it can
+// prefetch the entries listed in the manifest from the disk cache in the
+// background. The memory cache itself holds typed values, and there's no way
+// to recover those types from a manifest, so prefetched entries are held in
+// their encoded form (already read, decompressed and checked) until they're
+// requested, at which point disk_cached() and friends use them instead of
+// going to disk.
+
+namespace cradle {
+
+// Write the warm-start manifest for :core.
+// Any existing manifest is replaced.
+void
+write_warm_start_manifest(service_core& core, warm_start_config const& config);
+
+// Start prefetching the entries listed in the warm-start manifest.
+//
+// This returns as soon as the manifest has been read. The prefetch itself
+// runs on its own threads and stops when the manifest is exhausted, when the
+// prefetch size limit is reached, or when :core is reset.
+//
+// If there's no manifest, this does nothing.
+//
+void
+start_warm_start_prefetch(
+    service_core& core, warm_start_config const& config);
+
+struct warm_start_progress
+{
+    // the number of keys listed in the manifest
+    std::size_t listed = 0;
+    // the number of keys that the prefetch has finished with (whether or
+    // not they were found)
+    std::size_t finished = 0;
+    // the number of entries that were successfully prefetched
+    std::size_t prefetched = 0;
+    // the number of prefetched entries that have been used
+    std::size_t used = 0;
+    // the number of prefetched entries that were dropped because they
+    // weren't used within the retention period
+    std::size_t expired = 0;
+};
+
+// Get the progress of :core's warm-start prefetch.
+warm_start_progress
+get_warm_start_progress(service_core& core);
+
+namespace detail {
+
+// If the disk cache entry for :key has been prefetched, remove it from the
+// prefetched entries and return its data.
+optional<std::string>
+take_prefetched_disk_cache_entry(service_core& core, std::string const& key);
+
+} // namespace detail
+
+} // namespace cradle
+
+#endif
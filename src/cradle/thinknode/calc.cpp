@@ -4,6 +4,7 @@
 
 #include <cradle/core/monitoring.h>
 #include <cradle/encodings/json.h>
+#include <cradle/encodings/native.h>
 #include <cradle/encodings/sha256_hash_id.h>
 #include <cradle/io/http_requests.hpp>
 #include <cradle/thinknode/iss.h>
@@ -83,6 +84,139 @@ sanitize_request(calculation_request const& request)
     }
 }
 
+// CALCULATION REQUEST DIGESTS
+
+namespace {
+
+// Digest the fields of :request, using :get_subrequest_digest to get the
+// digests of its subrequests (in the order in which they appear).
+sha256_digest
+digest_calculation_request_fields(
+    calculation_request const& request,
+    function_view<sha256_digest(calculation_request const&)> const&
+        get_subrequest_digest)
+{
+    sha256_hasher hasher;
+    sha256_hashing_buffer buffer(hasher);
+    raw_memory_writer<sha256_hashing_buffer> w(buffer);
+
+    auto write_subrequest = [&](calculation_request const& subrequest) {
+        auto digest = get_subrequest_digest(subrequest);
+        raw_write(w, digest.data(), digest.size());
+    };
+    auto write_subrequest_list
+        = [&](std::vector<calculation_request> const& subrequests) {
+              write_natively_encoded_value(w, subrequests.size());
+              for (auto const& subrequest : subrequests)
+                  write_subrequest(subrequest);
+          };
+    auto write_subrequest_map =
+        [&](std::map<string, calculation_request> const& subrequests) {
+            write_natively_encoded_value(w, subrequests.size());
+            for (auto const& [key, subrequest] : subrequests)
+            {
+                write_natively_encoded_value(w, key);
+                write_subrequest(subrequest);
+            }
+        };
+
+    write_natively_encoded_value(w, int(get_tag(request)));
+    switch (get_tag(request))
+    {
+        case calculation_request_tag::REFERENCE:
+            write_natively_encoded_value(w, as_reference(request));
+            break;
+        case calculation_request_tag::VALUE:
+            write_natively_encoded_value(w, as_value(request));
+            break;
+        case calculation_request_tag::FUNCTION: {
+            auto const& function = as_function(request);
+            write_natively_encoded_value(w, function.account);
+            write_natively_encoded_value(w, function.app);
+            write_natively_encoded_value(w, function.name);
+            write_natively_encoded_value(w, function.level);
+            write_subrequest_list(function.args);
+            break;
+        }
+        case calculation_request_tag::ARRAY:
+            write_subrequest_list(as_array(request).items);
+            write_natively_encoded_value(w, as_array(request).item_schema);
+            break;
+        case calculation_request_tag::ITEM:
+            write_subrequest(as_item(request).array);
+            write_subrequest(as_item(request).index);
+            write_natively_encoded_value(w, as_item(request).schema);
+            break;
+        case calculation_request_tag::OBJECT:
+            write_subrequest_map(as_object(request).properties);
+            write_natively_encoded_value(w, as_object(request).schema);
+            break;
+        case calculation_request_tag::PROPERTY:
+            write_subrequest(as_property(request).object);
+            write_subrequest(as_property(request).field);
+            write_natively_encoded_value(w, as_property(request).schema);
+            break;
+        case calculation_request_tag::LET:
+            write_subrequest_map(as_let(request).variables);
+            write_subrequest(as_let(request).in);
+            break;
+        case calculation_request_tag::VARIABLE:
+            write_natively_encoded_value(w, as_variable(request));
+            break;
+        case calculation_request_tag::META:
+            write_subrequest(as_meta(request).generator);
+            write_natively_encoded_value(w, as_meta(request).schema);
+            break;
+        case calculation_request_tag::CAST:
+            write_natively_encoded_value(w, as_cast(request).schema);
+            write_subrequest(as_cast(request).object);
+            break;
+        default:
+            CRADLE_THROW(
+                invalid_enum_value()
+                << enum_id_info("calculation_request_tag")
+                << enum_value_info(static_cast<int>(get_tag(request))));
+    }
+
+    return hasher.finish();
+}
+
+} // namespace
+
+sha256_digest
+get_calculation_request_digest(calculation_request const& request)
+{
+    return digest_calculation_request_fields(
+        request, [](calculation_request const& subrequest) {
+            return get_calculation_request_digest(subrequest);
+        });
+}
+
+sha256_digest
+get_calculation_request_digest(
+    calculation_request const& request,
+    std::span<sha256_digest const> subrequest_digests)
+{
+    std::size_t next = 0;
+    auto digest = digest_calculation_request_fields(
+        request, [&](calculation_request const&) {
+            if (next == subrequest_digests.size())
+            {
+                CRADLE_THROW(
+                    internal_check_failed() << internal_error_message_info(
+                        "too few calculation subrequest digests"));
+            }
+            return subrequest_digests[next++];
+        });
+    if (next != subrequest_digests.size())
+    {
+        CRADLE_THROW(
+            internal_check_failed() << internal_error_message_info(
+                "too many calculation subrequest digests"));
+    }
+    return digest;
+}
+
 namespace uncached {
 
 cppcoro::task<string>
@@ -115,6 +249,36 @@ post_calculation(
 
 } // namespace uncached
 
+namespace {
+
+// Before posted calculations were keyed by their request digests, they were
+// keyed by the requests themselves, and the disk cache still holds entries
+// under those keys. So before actually posting a request that the disk
+// cache doesn't have under its current key, this checks for it under the
+// old one. (That only costs anything on disk cache misses, which are about
+// to go to Thinknode anyway.)
+cppcoro::task<string>
+post_calculation_unless_cached_by_request(
+    service_core& service,
+    thinknode_session session,
+    string context_id,
+    calculation_request request)
+{
+    auto legacy = co_await look_up_disk_cached(
+        service,
+        make_sha256_hashed_id(
+            "post_calculation", session.api_url, context_id, request));
+    if (legacy)
+        co_return cast<string>(legacy->value);
+    co_return co_await uncached::post_calculation(
+        service,
+        std::move(session),
+        std::move(context_id),
+        std::move(request));
+}
+
+} // namespace
+
 cppcoro::shared_task<string>
 post_calculation(
     service_core& service,
@@ -122,11 +286,33 @@ post_calculation(
     string context_id,
     calculation_request request)
 {
+    auto request_digest = get_calculation_request_digest(request);
+    return post_calculation(
+        service,
+        std::move(session),
+        std::move(context_id),
+        std::move(request),
+        request_digest);
+}
+
+cppcoro::shared_task<string>
+post_calculation(
+    service_core& service,
+    thinknode_session session,
+    string context_id,
+    calculation_request request,
+    sha256_digest const& request_digest)
+{
+    // The request is identified by its digest, so the key doesn't have to
+    // hash (or compare) the full request.
     auto cache_key = make_sha256_hashed_id(
-        "post_calculation", session.api_url, context_id, request);
+        "post_calculation",
+        session.api_url,
+        context_id,
+        format_sha256_digest(request_digest));
 
     return fully_cached<string>(service, cache_key, [=, &service] {
-        return uncached::post_calculation(
+        return post_calculation_unless_cached_by_request(
             service, session, context_id, request);
     });
 }
@@ -1,9 +1,12 @@
 #ifndef CRADLE_THINKNODE_CALC_H
 #define CRADLE_THINKNODE_CALC_H
 
+#include <span>
+
 #include <cppcoro/async_generator.hpp>
 
 #include <cradle/core.h>
+#include <cradle/encodings/sha256.h>
 #include <cradle/service/core.h>
 #include <cradle/thinknode/types.hpp>
 
@@ -12,6 +15,24 @@ namespace cradle {
 struct http_connection_interface;
 struct check_in_interface;
 
+// Get the structural SHA-256 digest of a calculation request.
+//
+// This is a Merkle-style digest: each subrequest is digested exactly once,
+// and a request's digest covers only its own fields and the digests of its
+// immediate subrequests. It depends only on the contents of the request, so
+// it's stable across processes (and thus suitable for disk cache keys).
+//
+sha256_digest
+get_calculation_request_digest(calculation_request const& request);
+
+// Same, but when the digests of the request's immediate subrequests are
+// already known, they can be supplied in :subrequest_digests (in the order in
+// which they appear in the request, with map entries in key order).
+sha256_digest
+get_calculation_request_digest(
+    calculation_request const& request,
+    std::span<sha256_digest const> subrequest_digests);
+
 // Post a calculation to Thinknode.
 cppcoro::shared_task<string>
 post_calculation(
@@ -20,6 +41,16 @@ post_calculation(
     string context_id,
     calculation_request request);
 
+// Same, but where :request_digest is the (already computed) result of
+// get_calculation_request_digest(request).
+cppcoro::shared_task<string>
+post_calculation(
+    service_core& service,
+    thinknode_session session,
+    string context_id,
+    calculation_request request,
+    sha256_digest const& request_digest);
+
 // Given a calculation status, get the next status that would represent
 // meaningful progress. If the result is none, no further progress is possible.
 optional<calculation_status>
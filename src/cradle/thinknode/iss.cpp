@@ -4,6 +4,7 @@
 
 #include <cradle/core/monitoring.h>
 #include <cradle/encodings/msgpack.h>
+#include <cradle/encodings/sha256.h>
 #include <cradle/encodings/sha256_hash_id.h>
 #include <cradle/io/http_requests.hpp>
 #include <cradle/thinknode/calc.h>
@@ -506,9 +507,8 @@ post_iss_object(
     thinknode_type_info schema,
     blob msgpack_data)
 {
-    std::string data_hash;
-    picosha2::hash256_hex_string(
-        msgpack_data.data, msgpack_data.data + msgpack_data.size, data_hash);
+    auto data_hash = format_sha256_digest(
+        compute_sha256(msgpack_data.data, msgpack_data.size));
 
     auto cache_key = make_sha256_hashed_id(
         "post_iss_object",
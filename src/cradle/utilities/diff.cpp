@@ -279,8 +279,11 @@ compute_value_diff(
         else if (
             a.type() == value_type::ARRAY && b.type() == value_type::ARRAY)
         {
-            compute_array_diff(
-                diff, path, cast<dynamic_array>(a), cast<dynamic_array>(b));
+            visit_unpacked_array(a, [&](dynamic_array const& x) {
+                visit_unpacked_array(b, [&](dynamic_array const& y) {
+                    compute_array_diff(diff, path, x, y);
+                });
+            });
         }
         // Otherwise, there's no way to compress the change, so just add an
         // update to the new value.
@@ -344,12 +347,12 @@ apply_value_diff_item(
                 field->second = apply_value_diff_item(
                     field->second, path, path_index + 1, op, new_value);
             }
-            return dynamic(map);
+            return dynamic(std::move(map));
         }
         case value_type::INTEGER: {
             if (initial.type() != value_type::ARRAY)
                 throw invalid_diff_path();
-            dynamic_array array = cast<dynamic_array>(initial);
+            dynamic_array array = cast<dynamic_array>(dynamic(initial));
             size_t index;
             from_dynamic(&index, path_element);
             // If this is the last element, we need to actually act on it.
@@ -380,7 +383,7 @@ apply_value_diff_item(
                 array[index] = apply_value_diff_item(
                     array[index], path, path_index + 1, op, new_value);
             }
-            return dynamic(array);
+            return dynamic(std::move(array));
         }
         default:
             throw invalid_diff_path();
@@ -4,6 +4,7 @@
 #include <websocketpp/config/asio_no_tls_client.hpp>
 
 #include <cradle/encodings/msgpack.h>
+#include <cradle/encodings/msgpack_internals.h>
 #include <cradle/utilities/errors.h>
 #include <cradle/websocket/client.h>
 #include <cradle/websocket/messages.hpp>
@@ -57,15 +58,16 @@ websocket_client::set_message_handler(
     impl_->client.set_message_handler(
         [handler = std::move(handler)](
             websocketpp::connection_hdl hdl, message_ptr message) {
-            handler(from_dynamic<websocket_server_message>(
-                parse_msgpack_value(message->get_payload())));
+            websocket_server_message decoded;
+            parse_msgpack_value(&decoded, message->get_payload());
+            handler(decoded);
         });
 }
 
 void
 websocket_client::send(websocket_client_message const& message)
 {
-    auto msgpack = value_to_msgpack_string(to_dynamic(message));
+    auto msgpack = value_to_msgpack_string(message);
     websocketpp::lib::error_code ec;
     impl_->client.send(
         impl_->server_handle, msgpack, websocketpp::frame::opcode::binary, ec);
@@ -1,7 +1,5 @@
 #include <cradle/websocket/local_calcs.h>
 
-#include <picosha2.h>
-
 // Boost.Crc triggers some warnings on MSVC.
 #if defined(_MSC_VER)
 #pragma warning(push)
@@ -13,6 +11,7 @@
 #include <boost/crc.hpp>
 #endif
 
+#include <cradle/core/coercion.h>
 #include <cradle/core/dynamic.h>
 #include <cradle/encodings/msgpack.h>
 #include <cradle/encodings/sha256_hash_id.h>
@@ -43,6 +42,13 @@ resolve_named_type_reference(
     string context_id,
     api_named_type_reference ref);
 
+cppcoro::shared_task<coercion_plan>
+get_coercion_plan(
+    service_core& service,
+    thinknode_session session,
+    string context_id,
+    thinknode_type_info schema);
+
 cppcoro::task<thinknode_app_version_info>
 resolve_context_app(
     service_core& service,
@@ -121,15 +127,9 @@ coerce_local_calc_result(
     thinknode_type_info const& schema,
     dynamic value)
 {
-    std::function<cppcoro::task<api_type_info>(
-        api_named_type_reference const& ref)>
-        look_up_named_type = [&](api_named_type_reference const& ref)
-        -> cppcoro::task<api_type_info> {
-        co_return co_await resolve_named_type_reference(
-            service, session, context_id, ref);
-    };
-    co_return co_await coerce_value(
-        look_up_named_type, as_api_type(schema), std::move(value));
+    co_return apply_coercion_plan(
+        co_await get_coercion_plan(service, session, context_id, schema),
+        std::move(value));
 }
 
 cppcoro::task<dynamic>
@@ -175,25 +175,28 @@ perform_local_calc(
         case calculation_request_tag::ARRAY: {
             std::vector<dynamic> values;
             auto array = as_array(std::move(request));
+            // All the items share the same schema, so they share its plan.
+            auto const plan = co_await get_coercion_plan(
+                service, session, context_id, array.item_schema);
+            values.reserve(array.items.size());
             for (auto& item : array.items)
             {
-                spdlog::get("cradle")->info(
-                    "array.item_schema: {}",
-                    boost::lexical_cast<std::string>(array.item_schema));
-                values.push_back(co_await coercive_call(
-                    array.item_schema,
-                    co_await recursive_call(std::move(item))));
+                values.push_back(apply_coercion_plan(
+                    plan, co_await recursive_call(std::move(item))));
             }
             co_return dynamic(values);
         }
         case calculation_request_tag::ITEM: {
             auto item = as_item(std::move(request));
+            // The array is likely shared with the environment (or a cache),
+            // so it's only accessed through const references (and a packed
+            // array isn't unpacked just to get one element).
+            auto const array = co_await recursive_call(std::move(item.array));
+            auto const index = co_await recursive_call(std::move(item.index));
             co_return co_await coercive_call(
                 item.schema,
-                cast<dynamic_array>(
-                    co_await recursive_call(std::move(item.array)))
-                    .at(boost::numeric_cast<size_t>(cast<integer>(
-                        co_await recursive_call(std::move(item.index))))));
+                get_array_element(
+                    array, boost::numeric_cast<size_t>(cast<integer>(index))));
         }
         case calculation_request_tag::OBJECT: {
             auto object = as_object(std::move(request));
@@ -207,12 +210,13 @@ perform_local_calc(
         }
         case calculation_request_tag::PROPERTY: {
             auto property = as_property(std::move(request));
+            auto const object
+                = co_await recursive_call(std::move(property.object));
+            auto const field
+                = co_await recursive_call(std::move(property.field));
             co_return co_await coercive_call(
                 property.schema,
-                cast<dynamic_map>(
-                    co_await recursive_call(std::move(property.object)))
-                    .at(cast<string>(
-                        co_await recursive_call(std::move(property.field)))));
+                cast<dynamic_map>(object).at(cast<string>(field)));
         }
         case calculation_request_tag::LET: {
             auto let = as_let(std::move(request));
@@ -16,8 +16,6 @@
 #include <boost/crc.hpp>
 #endif
 
-#include <picosha2.h>
-
 #include <websocketpp/config/asio_no_tls.hpp>
 #include <websocketpp/server.hpp>
 
@@ -37,14 +35,18 @@
 #include <cppcoro/when_all.hpp>
 
 #include <cradle/caching/disk_cache.hpp>
+#include <cradle/core/coercion.h>
 #include <cradle/encodings/base64.h>
 #include <cradle/encodings/json.h>
 #include <cradle/encodings/msgpack.h>
+#include <cradle/encodings/msgpack_internals.h>
+#include <cradle/encodings/sha256.h>
 #include <cradle/encodings/sha256_hash_id.h>
 #include <cradle/encodings/yaml.h>
 #include <cradle/fs/app_dirs.h>
 #include <cradle/fs/file_io.h>
 #include <cradle/io/http_requests.hpp>
+#include <cradle/service/warm_start.h>
 #include <cradle/thinknode/apm.h>
 #include <cradle/thinknode/calc.h>
 #include <cradle/thinknode/iam.h>
@@ -190,8 +192,8 @@ send(
     connection_hdl hdl,
     websocket_server_message const& message)
 {
-    auto dynamic = to_dynamic(message);
-    auto msgpack = value_to_msgpack_string(dynamic);
+    // Messages are encoded directly, without building their dynamic forms.
+    auto const msgpack = value_to_msgpack_string(message);
     websocketpp::lib::error_code ec;
     server.ws.send(hdl, msgpack, websocketpp::frame::opcode::binary, ec);
     if (ec)
@@ -208,6 +210,8 @@ encode_object(output_data_encoding encoding, blob const& msgpack_data)
     if (encoding == output_data_encoding::MSGPACK)
         return msgpack_data;
 
+    dynamic_arena arena;
+    dynamic_memory_scope scope(arena.resource());
     auto object = parse_msgpack_value(
         reinterpret_cast<uint8_t const*>(msgpack_data.data),
         msgpack_data.size);
@@ -336,6 +340,44 @@ resolve_named_type_reference(
 
 namespace uncached {
 
+cppcoro::task<coercion_plan>
+get_coercion_plan(
+    service_core& service,
+    thinknode_session session,
+    string context_id,
+    thinknode_type_info schema)
+{
+    co_return co_await compile_coercion_plan(
+        [&](api_named_type_reference const& ref)
+            -> cppcoro::task<api_type_info> {
+            co_return co_await cradle::resolve_named_type_reference(
+                service, session, context_id, ref);
+        },
+        as_api_type(schema));
+}
+
+} // namespace uncached
+
+// Get the plan for coercing values to :schema. Plans are compiled once (per
+// context) and then shared by all the values that are coerced to :schema.
+cppcoro::shared_task<coercion_plan>
+get_coercion_plan(
+    service_core& service,
+    thinknode_session session,
+    string context_id,
+    thinknode_type_info schema)
+{
+    auto cache_key = make_sha256_hashed_id(
+        "coercion_plan", session.api_url, context_id, schema);
+
+    return cached<coercion_plan>(service, cache_key, [=, &service] {
+        return uncached::get_coercion_plan(
+            service, session, context_id, schema);
+    });
+}
+
+namespace uncached {
+
 // Decode an object from its encoded form, coerce it to the specified schema,
 // and encode it again as msgpack.
 static cppcoro::task<blob>
@@ -349,35 +391,37 @@ coerce_encoded_object(
 {
     // Decode the object.
     spdlog::get("cradle")->info("coerce_encoded_object: decoding");
+    // The decoded form is transient, so it's allocated in an arena. (The
+    // arena's scope can't extend past the decoding, since it's thread-local
+    // and coercion may resume on another thread.)
+    dynamic_arena arena;
     dynamic decoded_object;
-    switch (encoding)
     {
-        case input_data_encoding::JSON:
-            decoded_object = parse_json_value(
-                reinterpret_cast<char const*>(encoded_object.data),
-                encoded_object.size);
-            break;
-        case input_data_encoding::YAML:
-            decoded_object = parse_yaml_value(
-                reinterpret_cast<char const*>(encoded_object.data),
-                encoded_object.size);
-            break;
-        case input_data_encoding::MSGPACK:
-            decoded_object = parse_msgpack_value(
-                reinterpret_cast<uint8_t const*>(encoded_object.data),
-                encoded_object.size);
-            break;
+        dynamic_memory_scope scope(arena.resource());
+        switch (encoding)
+        {
+            case input_data_encoding::JSON:
+                decoded_object = parse_json_value(
+                    reinterpret_cast<char const*>(encoded_object.data),
+                    encoded_object.size);
+                break;
+            case input_data_encoding::YAML:
+                decoded_object = parse_yaml_value(
+                    reinterpret_cast<char const*>(encoded_object.data),
+                    encoded_object.size);
+                break;
+            case input_data_encoding::MSGPACK:
+                decoded_object = parse_msgpack_value(
+                    reinterpret_cast<uint8_t const*>(encoded_object.data),
+                    encoded_object.size);
+                break;
+        }
     }
 
     // Apply type coercion.
     spdlog::get("cradle")->info("coerce_encoded_object: coercing");
-    auto coerced_object = co_await coerce_value(
-        [&](api_named_type_reference const& ref)
-            -> cppcoro::task<api_type_info> {
-            co_return co_await cradle::resolve_named_type_reference(
-                core, session, context_id, ref);
-        },
-        as_api_type(schema),
+    auto coerced_object = apply_coercion_plan(
+        co_await get_coercion_plan(core, session, context_id, schema),
         std::move(decoded_object));
 
     // Encode it again as MessagePack.
@@ -396,11 +440,8 @@ coerce_encoded_object(
     input_data_encoding encoding,
     blob encoded_object)
 {
-    std::string data_hash;
-    picosha2::hash256_hex_string(
-        encoded_object.data,
-        encoded_object.data + encoded_object.size,
-        data_hash);
+    auto data_hash = format_sha256_digest(
+        compute_sha256(encoded_object.data, encoded_object.size));
 
     auto cache_key = make_sha256_hashed_id(
         "coerce_encoded_object",
@@ -579,13 +620,25 @@ visit_object_references(
 
     switch (get_tag(type))
     {
-        case api_type_info_tag::ARRAY_TYPE:
+        case api_type_info_tag::ARRAY_TYPE: {
+            // Packed arrays only hold numbers and booleans, so they can't
+            // contain references.
+            if (visit_packed_array(value, [](auto const&) {}))
+                break;
+            // Tables are expanded into rows just for the duration of the
+            // visit.
+            check_type(value_type::ARRAY, value.type());
+            dynamic_array rows;
+            auto const* table = get_record_table(value);
+            if (table)
+                rows = table->unpack();
             co_await cppcoro::when_all(map(
                 [&](auto const& item) {
                     return recurse(as_array_type(type).element_schema, item);
                 },
-                cast<dynamic_array>(value)));
+                table ? rows : *get_dynamic_array(value)));
             break;
+        }
         case api_type_info_tag::BLOB_TYPE:
             break;
         case api_type_info_tag::BOOLEAN_TYPE:
@@ -967,94 +1020,138 @@ deeply_copy_calculation(
 
 namespace detail {
 
-cppcoro::task<calculation_request>
+// a calculation request that's been posted piecewise, along with its digest
+// (so that the request it's part of doesn't have to recompute it)
+struct piecewise_calculation_request
+{
+    calculation_request request;
+    sha256_digest digest;
+};
+
+cppcoro::task<piecewise_calculation_request>
 post_calculation_piecewise(
     service_core& core,
     thinknode_session session,
     string context_id,
     calculation_request request)
 {
-    auto recurse
-        = [&](calculation_request calc) -> cppcoro::task<calculation_request> {
+    auto recurse = [&](calculation_request calc)
+        -> cppcoro::task<piecewise_calculation_request> {
         return post_calculation_piecewise(
             core, session, context_id, std::move(calc));
     };
 
+    // As the subrequests are posted, their digests are recorded here (in the
+    // order in which they appear in :shallow_calc).
+    std::vector<sha256_digest> subrequest_digests;
+    auto record_subrequest = [&](piecewise_calculation_request posted) {
+        subrequest_digests.push_back(posted.digest);
+        return std::move(posted.request);
+    };
+    auto record_subrequests
+        = [&](std::vector<piecewise_calculation_request> posted) {
+              std::vector<calculation_request> requests;
+              requests.reserve(posted.size());
+              for (auto& subrequest : posted)
+                  requests.push_back(record_subrequest(std::move(subrequest)));
+              return requests;
+          };
+    // Subrequests that aren't posted separately are digested in place.
+    auto record_unposted_subrequest = [&](calculation_request const& r) {
+        subrequest_digests.push_back(get_calculation_request_digest(r));
+    };
+
     calculation_request shallow_calc;
     switch (get_tag(request))
     {
         case calculation_request_tag::REFERENCE:
         case calculation_request_tag::VALUE:
-            co_return std::move(request);
+        case calculation_request_tag::VARIABLE: {
+            auto digest = get_calculation_request_digest(request);
+            co_return piecewise_calculation_request{
+                std::move(request), digest};
+        }
         case calculation_request_tag::FUNCTION: {
             auto subtasks = map(recurse, std::move(as_function(request).args));
+            auto args = record_subrequests(
+                co_await cppcoro::when_all(std::move(subtasks)));
             shallow_calc = make_calculation_request_with_function(
                 make_function_application(
                     as_function(request).account,
                     as_function(request).app,
                     as_function(request).name,
                     as_function(request).level,
-                    co_await cppcoro::when_all(std::move(subtasks))));
+                    std::move(args)));
             break;
         }
         case calculation_request_tag::ARRAY: {
             auto subtasks = map(recurse, std::move(as_array(request).items));
+            auto items = record_subrequests(
+                co_await cppcoro::when_all(std::move(subtasks)));
             shallow_calc = make_calculation_request_with_array(
                 make_calculation_array_request(
-                    co_await cppcoro::when_all(std::move(subtasks)),
-                    as_array(request).item_schema));
+                    std::move(items), as_array(request).item_schema));
             break;
         }
-        case calculation_request_tag::ITEM:
+        case calculation_request_tag::ITEM: {
+            auto array
+                = record_subrequest(co_await recurse(as_item(request).array));
+            record_unposted_subrequest(as_item(request).index);
             shallow_calc = make_calculation_request_with_item(
                 make_calculation_item_request(
-                    co_await recurse(as_item(request).array),
+                    std::move(array),
                     as_item(request).index,
                     as_item(request).schema));
             break;
+        }
         case calculation_request_tag::OBJECT: {
             std::map<string, calculation_request> properties;
             for (auto& property : as_object(request).properties)
             {
-                properties[property.first]
-                    = co_await recurse(std::move(property.second));
+                properties[property.first] = record_subrequest(
+                    co_await recurse(std::move(property.second)));
             }
             shallow_calc = make_calculation_request_with_object(
                 make_calculation_object_request(
                     properties, as_object(request).schema));
             break;
         }
-        case calculation_request_tag::PROPERTY:
+        case calculation_request_tag::PROPERTY: {
+            auto object = record_subrequest(
+                co_await recurse(as_property(request).object));
+            record_unposted_subrequest(as_property(request).field);
             shallow_calc = make_calculation_request_with_property(
                 make_calculation_property_request(
-                    co_await recurse(as_property(request).object),
+                    std::move(object),
                     as_property(request).field,
                     as_property(request).schema));
             break;
+        }
         case calculation_request_tag::LET: {
             std::map<string, calculation_request> variables;
             for (auto& property : as_let(request).variables)
             {
-                variables[property.first]
-                    = co_await recurse(std::move(property.second));
+                variables[property.first] = record_subrequest(
+                    co_await recurse(std::move(property.second)));
             }
+            record_unposted_subrequest(as_let(request).in);
             shallow_calc = make_calculation_request_with_let(
                 make_let_calculation_request(variables, as_let(request).in));
             break;
         }
-        case calculation_request_tag::VARIABLE:
-            co_return request;
         case calculation_request_tag::META:
             shallow_calc = make_calculation_request_with_meta(
                 make_meta_calculation_request(
-                    co_await recurse(as_meta(request).generator),
+                    record_subrequest(
+                        co_await recurse(as_meta(request).generator)),
                     as_meta(request).schema));
             break;
         case calculation_request_tag::CAST:
             shallow_calc = make_calculation_request_with_cast(
                 make_calculation_cast_request(
                     as_cast(request).schema,
-                    co_await recurse(as_cast(request).object)));
+                    record_subrequest(
+                        co_await recurse(as_cast(request).object))));
             break;
         default:
             CRADLE_THROW(
@@ -1063,9 +1160,17 @@ post_calculation_piecewise(
                 << enum_value_info(static_cast<int>(get_tag(request))));
     }
 
-    co_return make_calculation_request_with_reference(
+    auto shallow_digest
+        = get_calculation_request_digest(shallow_calc, subrequest_digests);
+    auto reference = make_calculation_request_with_reference(
         co_await post_calculation(
-            core, session, context_id, std::move(shallow_calc)));
+            core,
+            session,
+            context_id,
+            std::move(shallow_calc),
+            shallow_digest));
+    auto digest = get_calculation_request_digest(reference);
+    co_return piecewise_calculation_request{std::move(reference), digest};
 }
 
 } // namespace detail
@@ -1077,8 +1182,13 @@ post_calculation_piecewise(
     string context_id,
     calculation_request request)
 {
-    co_return as_reference(co_await detail::post_calculation_piecewise(
-        core, std::move(session), std::move(context_id), std::move(request)));
+    co_return as_reference(
+        (co_await detail::post_calculation_piecewise(
+             core,
+             std::move(session),
+             std::move(context_id),
+             std::move(request)))
+            .request);
 }
 
 static bool
@@ -1981,6 +2091,16 @@ on_close(websocket_server_impl& server, connection_hdl hdl)
     remove_client(server.clients, hdl);
 }
 
+// Get the request ID from the raw MessagePack form of a client message.
+static string
+get_message_request_id(string const& msgpack)
+{
+    dynamic_arena arena;
+    dynamic_memory_scope scope(arena.resource());
+    auto const message = parse_msgpack_value(msgpack);
+    return cast<string>(get_field(cast<dynamic_map>(message), "request_id"));
+}
+
 static void
 on_message(
     websocket_server_impl& server,
@@ -1990,11 +2110,21 @@ on_message(
     string request_id;
     try
     {
-        auto dynamic_message = parse_msgpack_value(raw_message->get_payload());
-        request_id = cast<string>(
-            get_field(cast<dynamic_map>(dynamic_message), "request_id"));
+        // Messages are decoded directly, without building their dynamic
+        // forms.
         websocket_client_message message;
-        from_dynamic(&message, dynamic_message);
+        try
+        {
+            parse_msgpack_value(&message, raw_message->get_payload());
+        }
+        catch (std::exception&)
+        {
+            // Recover the request ID (if there is one) so that the error can
+            // be reported against it.
+            request_id = get_message_request_id(raw_message->get_payload());
+            throw;
+        }
+        request_id = message.request_id;
         if (is_kill(message.content))
         {
             server.ws.stop_listening();
@@ -2062,6 +2192,10 @@ initialize(websocket_server_impl& server, server_config const& config)
             "cradle", begin(sinks), end(sinks));
         spdlog::register_logger(combined_logger);
     }
+
+    // The prefetch runs in the background, so it doesn't hold up listen().
+    if (config.warm_start)
+        start_warm_start_prefetch(server.core, *config.warm_start);
 }
 
 websocket_server::websocket_server(server_config const& config)
@@ -2075,6 +2209,19 @@ websocket_server::~websocket_server()
     if (impl_)
     {
         cppcoro::sync_wait(impl_->async_scope.join());
+        if (impl_->config.warm_start)
+        {
+            try
+            {
+                write_warm_start_manifest(
+                    impl_->core, *impl_->config.warm_start);
+            }
+            catch (std::exception& e)
+            {
+                spdlog::get("cradle")->warn(
+                    "error writing warm-start manifest: {}", e.what());
+            }
+        }
         delete impl_;
     }
 }
@@ -1,11 +1,17 @@
 #include <cradle/caching/immutable.h>
 
+#include <algorithm>
 #include <sstream>
 
+#include <cppcoro/async_manual_reset_event.hpp>
 #include <cppcoro/sync_wait.hpp>
+#include <cppcoro/when_all.hpp>
 
+#include <cradle/caching/immutable/eviction.h>
+#include <cradle/caching/immutable/internals.h>
 #include <cradle/core/immutable.h>
 #include <cradle/utilities/testing.h>
+#include <cradle/utilities/text.h>
 
 using namespace cradle;
 
@@ -49,11 +55,11 @@ TEST_CASE("basic immutable cache usage", "[immutable_cache]")
     {
         INFO("Cache reset() and is_initialized() work as expected.");
         REQUIRE(!cache.is_initialized());
-        cache.reset(immutable_cache_config(1024));
+        cache.reset(immutable_cache_config(1024, none, none, none, none));
         REQUIRE(cache.is_initialized());
         cache.reset();
         REQUIRE(!cache.is_initialized());
-        cache.reset(immutable_cache_config(1024));
+        cache.reset(immutable_cache_config(1024, none, none, none, none));
         REQUIRE(cache.is_initialized());
     }
 
@@ -252,7 +258,8 @@ TEST_CASE("basic immutable cache usage", "[immutable_cache]")
 TEST_CASE("immutable cache LRU eviction", "[immutable_cache]")
 {
     // Initialize the cache with 1.5kB of space for unused data.
-    immutable_cache cache(immutable_cache_config(1536));
+    immutable_cache cache(
+        immutable_cache_config(1536, none, none, none, none));
 
     auto one_kb_string_task = [](char content) -> cppcoro::task<std::string> {
         co_return std::string(1024, content);
@@ -301,3 +308,594 @@ TEST_CASE("immutable cache LRU eviction", "[immutable_cache]")
     REQUIRE(s.is_ready());
     REQUIRE(await_cache_value(s) == std::string(1024, 'b'));
 }
+
+TEST_CASE("sharded immutable cache eviction", "[immutable_cache]")
+{
+    auto one_kb_string_task = [](char content) -> cppcoro::task<std::string> {
+        co_return std::string(1024, content);
+    };
+
+    // The unused size limit is global across shards, and eviction should
+    // proceed in LRU order regardless of which shards the entries live in.
+    for (int shard_count : {1, 4, 16})
+    {
+        // Initialize the cache with 3.5kB of space for unused data.
+        immutable_cache cache(
+            immutable_cache_config(3584, shard_count, none, none, none));
+
+        // Fill the cache with eight values and release them in order.
+        std::vector<immutable_cache_ptr<std::string>> ptrs;
+        for (int i = 0; i != 8; ++i)
+        {
+            ptrs.emplace_back(cache, make_id(i), [&] {
+                return one_kb_string_task(char('a' + i));
+            });
+            REQUIRE(
+                await_cache_value(ptrs.back())
+                == std::string(1024, char('a' + i)));
+        }
+        REQUIRE(get_cache_snapshot(cache).in_use.size() == 8);
+        for (auto& ptr : ptrs)
+            ptr.reset();
+
+        // Only the last three released values should be retained.
+        auto snapshot = sort_cache_snapshot(get_cache_snapshot(cache));
+        auto const entry_size = sizeof(std::string) + 1024;
+        REQUIRE(snapshot.in_use.empty());
+        REQUIRE(
+            snapshot.pending_eviction
+            == (std::vector<immutable_cache_entry_snapshot>{
+                {"5", immutable_cache_entry_state::READY, entry_size},
+                {"6", immutable_cache_entry_state::READY, entry_size},
+                {"7", immutable_cache_entry_state::READY, entry_size}}));
+    }
+}
+
+TEST_CASE("immutable cache TinyLFU eviction", "[immutable_cache]")
+{
+    auto one_kb_string_task = [](char content) -> cppcoro::task<std::string> {
+        co_return std::string(1024, content);
+    };
+
+    // Request the value for :key and return whether or not it had to be
+    // created.
+    auto request = [&](immutable_cache& cache, int key) {
+        bool needed_creation = false;
+        immutable_cache_ptr<std::string> p(cache, make_id(key), [&] {
+            needed_creation = true;
+            return one_kb_string_task('a');
+        });
+        REQUIRE(await_cache_value(p) == std::string(1024, 'a'));
+        return needed_creation;
+    };
+
+    // Run a workload where two keys are used repeatedly and then a long
+    // sequence of keys is requested once each (i.e., a scan). Return whether
+    // or not the repeatedly used keys survived the scan.
+    auto hot_keys_survive_scan = [&](immutable_cache_eviction_policy policy) {
+        // There's room for four unused values.
+        immutable_cache cache(
+            immutable_cache_config(4300, none, policy, none, none));
+        for (int i = 0; i != 8; ++i)
+        {
+            request(cache, 0);
+            request(cache, 1);
+        }
+        for (int key = 100; key != 200; ++key)
+            REQUIRE(request(cache, key));
+        return !request(cache, 0) && !request(cache, 1);
+    };
+
+    REQUIRE(!hot_keys_survive_scan(immutable_cache_eviction_policy::LRU));
+    REQUIRE(hot_keys_survive_scan(immutable_cache_eviction_policy::TINY_LFU));
+}
+
+TEST_CASE("TinyLFU admission", "[immutable_cache]")
+{
+    // This exercises a single policy instance directly, so it doesn't
+    // depend on how keys are assigned to shards.
+    detail::frequency_sketch sketch(8);
+    // With no unused size limit, the window holds nothing, so every record
+    // in it is a candidate for admission.
+    auto policy = detail::create_eviction_policy(
+        immutable_cache_config(
+            0, 1, immutable_cache_eviction_policy::TINY_LFU, none, none),
+        1,
+        &sketch);
+
+    // Records 0 and 1 are used equally often, and record 2 is used once.
+    detail::immutable_cache_record records[3];
+    for (int i = 0; i != 3; ++i)
+    {
+        records[i].key_hash = std::hash<int>()(i * 1000);
+        records[i].size = 1;
+        records[i].release_time = uint64_t(i);
+    }
+    for (int n = 0; n != 4; ++n)
+    {
+        sketch.increment(records[0].key_hash);
+        sketch.increment(records[1].key_hash);
+    }
+    sketch.increment(records[2].key_hash);
+    REQUIRE(sketch.estimate(records[0].key_hash) == 4);
+    REQUIRE(sketch.estimate(records[1].key_hash) == 4);
+    REQUIRE(sketch.estimate(records[2].key_hash) == 1);
+
+    for (auto& record : records)
+        policy->add(&record);
+
+    // Record 0 is admitted to the main region, since it's empty. Record 1
+    // ties with it, and ties are admitted too, so the first candidate to
+    // lose is record 2.
+    auto const peeked = policy->peek_victim_rank();
+    REQUIRE(policy->select_victim() == &records[2]);
+    REQUIRE(peeked);
+    REQUIRE(peeked->frequency == 1);
+    REQUIRE(peeked->release_time == 2);
+
+    // Once it's gone, the oldest record in the main region is next.
+    policy->remove(&records[2]);
+    REQUIRE(policy->select_victim() == &records[0]);
+    policy->remove(&records[0]);
+    REQUIRE(policy->select_victim() == &records[1]);
+    policy->remove(&records[1]);
+    REQUIRE(policy->select_victim() == nullptr);
+}
+
+TEST_CASE("immutable cache total size limit", "[immutable_cache]")
+{
+    auto one_kb_string_task = [](char content) -> cppcoro::task<std::string> {
+        co_return std::string(1024, content);
+    };
+    auto const entry_size = sizeof(std::string) + 1024;
+
+    // Leave plenty of room for unused data, but only allow 2.5kB in total.
+    immutable_cache cache(
+        immutable_cache_config(0x10000, none, none, integer(2560), none));
+
+    auto acquire = [&](int key) {
+        immutable_cache_ptr<std::string> p(cache, make_id(key), [&] {
+            return one_kb_string_task(char('a' + key));
+        });
+        REQUIRE(await_cache_value(p) == std::string(1024, char('a' + key)));
+        return p;
+    };
+
+    // Load ID(1) and release it. Then load ID(2) and hold onto it.
+    acquire(1);
+    auto q = acquire(2);
+    REQUIRE(
+        get_cache_usage(cache)
+        == immutable_cache_usage(
+            integer(2 * entry_size), integer(entry_size), 0));
+
+    {
+        INFO("Loading a third value evicts the unused one.");
+        auto r = acquire(3);
+        REQUIRE(
+            sort_cache_snapshot(get_cache_snapshot(cache))
+            == (immutable_cache_snapshot{
+                {{"2", immutable_cache_entry_state::READY, entry_size},
+                 {"3", immutable_cache_entry_state::READY, entry_size}},
+                {}}));
+
+        INFO(
+            "Loading a fourth value while the others are still in use spills "
+            "it.");
+        auto s = acquire(4);
+        REQUIRE(s.is_ready());
+        REQUIRE(get_cache_usage(cache).spill_count == 1);
+        REQUIRE(
+            get_cache_usage(cache).total_size == integer(3 * entry_size));
+        s.reset();
+        REQUIRE(
+            sort_cache_snapshot(get_cache_snapshot(cache))
+            == (immutable_cache_snapshot{
+                {{"2", immutable_cache_entry_state::READY, entry_size},
+                 {"3", immutable_cache_entry_state::READY, entry_size}},
+                {}}));
+    }
+
+    {
+        INFO("Tasks can supply the sizes of their own values.");
+        auto sized_string_task = [](std::string value, std::size_t size)
+            -> cppcoro::task<sized_cache_value<std::string>> {
+            co_return sized_cache_value<std::string>{std::move(value), size};
+        };
+        immutable_cache_ptr<std::string> p(
+            cache, make_id(5), [&] { return sized_string_task("abc", 10); });
+        REQUIRE(await_cache_value(p) == "abc");
+        REQUIRE(
+            get_cache_usage(cache)
+            == immutable_cache_usage(
+                integer(2 * entry_size + 10), integer(entry_size), 1));
+    }
+}
+
+TEST_CASE("immutable cache total size overshoot", "[immutable_cache]")
+{
+    // Results only count against the total size limit once they finish
+    // loading, so concurrent loads can collectively overshoot it. Check that
+    // the overshoot is bounded by the results that are spilled and still in
+    // use, and that it goes away once they're released.
+    cppcoro::async_manual_reset_event loads_released;
+    auto one_kb_string_task
+        = [&](char content) -> cppcoro::task<std::string> {
+        co_await loads_released;
+        co_return std::string(1024, content);
+    };
+    auto const entry_size = sizeof(std::string) + 1024;
+    auto const limit = 2560;
+    immutable_cache cache(
+        immutable_cache_config(0x10000, none, none, integer(limit), none));
+
+    std::vector<immutable_cache_ptr<std::string>> ptrs;
+    for (int i = 0; i != 4; ++i)
+    {
+        ptrs.emplace_back(cache, make_id(i), [&, i] {
+            return one_kb_string_task(char('a' + i));
+        });
+    }
+
+    auto release_loads = [&]() -> cppcoro::task<> {
+        // Everything is still in flight, so nothing is counted yet.
+        REQUIRE(get_cache_usage(cache).total_size == 0);
+        loads_released.set();
+        co_return;
+    };
+    cppcoro::sync_wait(cppcoro::when_all(
+        ptrs[0].task(),
+        ptrs[1].task(),
+        ptrs[2].task(),
+        ptrs[3].task(),
+        release_loads()));
+
+    // Two of the results fit. The other two arrive over the limit and have
+    // to be spilled, but they're held until their users release them.
+    auto usage = get_cache_usage(cache);
+    REQUIRE(usage.spill_count == 2);
+    REQUIRE(usage.total_size == integer(4 * entry_size));
+    REQUIRE(usage.total_size - limit <= integer(2 * entry_size));
+
+    ptrs.clear();
+    usage = get_cache_usage(cache);
+    REQUIRE(usage.total_size == integer(2 * entry_size));
+    REQUIRE(usage.total_size <= limit);
+}
+
+TEST_CASE("immutable cache retry policy", "[immutable_cache]")
+{
+    int creation_count = 0;
+    auto failing_task = []() -> cppcoro::task<int> {
+        throw std::runtime_error("failed");
+        co_return 0;
+    };
+
+    // Request the value for :key (without waiting for it) and return the
+    // pointer.
+    auto request = [&](immutable_cache& cache, int key) {
+        return immutable_cache_ptr<int>(cache, make_id(key), [&] {
+            ++creation_count;
+            return failing_task();
+        });
+    };
+    auto request_and_fail = [&](immutable_cache& cache, int key) {
+        auto p = request(cache, key);
+        REQUIRE_THROWS(await_cache_value(p));
+        REQUIRE(p.is_failed());
+    };
+
+    auto make_cache = [](integer initial_backoff,
+                         omissible<integer> max_concurrent_retries) {
+        return std::make_unique<immutable_cache>(immutable_cache_config(
+            1024,
+            none,
+            none,
+            none,
+            immutable_cache_retry_policy(
+                initial_backoff, none, none, none, max_concurrent_retries)));
+    };
+
+    SECTION("failures are served from the cache during the backoff")
+    {
+        auto cache = make_cache(3'600'000, none);
+        request_and_fail(*cache, 0);
+        request_and_fail(*cache, 0);
+        REQUIRE(creation_count == 1);
+        REQUIRE(
+            get_cache_retry_stats(*cache)
+            == immutable_cache_retry_stats(1, 1, 0));
+    }
+
+    SECTION("failures are retried after the backoff")
+    {
+        auto cache = make_cache(0, none);
+        request_and_fail(*cache, 0);
+        request_and_fail(*cache, 0);
+        REQUIRE(creation_count == 2);
+        REQUIRE(
+            get_cache_retry_stats(*cache)
+            == immutable_cache_retry_stats(2, 0, 1));
+    }
+
+    SECTION("concurrent retries are capped")
+    {
+        auto cache = make_cache(0, integer(1));
+        request_and_fail(*cache, 0);
+        request_and_fail(*cache, 1);
+        REQUIRE(creation_count == 2);
+
+        // Retry ID(0), but don't wait for it yet.
+        auto p = request(*cache, 0);
+        REQUIRE(p.is_loading());
+        REQUIRE(creation_count == 3);
+
+        // Since ID(0) is retrying, ID(1) can't be retried.
+        auto q = request(*cache, 1);
+        REQUIRE(q.is_failed());
+        REQUIRE(creation_count == 3);
+
+        // Once ID(0)'s retry is done, ID(1) can be retried.
+        REQUIRE_THROWS(await_cache_value(p));
+        auto r = request(*cache, 1);
+        REQUIRE(r.is_loading());
+        REQUIRE(creation_count == 4);
+
+        REQUIRE(
+            get_cache_retry_stats(*cache)
+            == immutable_cache_retry_stats(3, 1, 2));
+    }
+
+    SECTION("retries whose tasks can't be created give back their slots")
+    {
+        auto cache = make_cache(0, integer(1));
+        request_and_fail(*cache, 0);
+        for (int i = 0; i != 3; ++i)
+        {
+            REQUIRE_THROWS_AS(
+                immutable_cache_ptr<int>(
+                    *cache,
+                    make_id(0),
+                    []() -> cppcoro::task<int> {
+                        throw std::runtime_error("can't create task");
+                    }),
+                std::runtime_error);
+        }
+        REQUIRE(
+            get_cache_retry_stats(*cache)
+            == immutable_cache_retry_stats(1, 0, 0));
+
+        // The record is still FAILED, and it can still be retried.
+        auto p = request(*cache, 0);
+        REQUIRE(p.is_loading());
+        REQUIRE(creation_count == 2);
+        REQUIRE_THROWS(await_cache_value(p));
+    }
+}
+
+TEST_CASE("immutable cache stats", "[immutable_cache]")
+{
+    auto one_kb_string_task = [](char content) -> cppcoro::task<std::string> {
+        co_return std::string(1024, content);
+    };
+    auto const entry_size = sizeof(std::string) + 1024;
+
+    // Initialize the cache with 1.5kB of space for unused data.
+    immutable_cache cache(
+        immutable_cache_config(1536, none, none, none, none));
+
+    auto request = [&](int key) {
+        immutable_cache_ptr<std::string> p(cache, make_id(key), [&] {
+            return one_kb_string_task('a');
+        });
+        await_cache_value(p);
+        return p;
+    };
+
+    auto p = request(0);
+    request(1);
+    request(1);
+    // This evicts ID(1).
+    request(2);
+
+    auto stats = get_cache_stats(cache);
+    REQUIRE(stats.entry_count == 2);
+    REQUIRE(stats.hits == 1);
+    REQUIRE(stats.misses == 3);
+    REQUIRE(stats.loads_in_progress == 0);
+    REQUIRE(stats.evictions == 1);
+    REQUIRE(stats.bytes_in_use == integer(entry_size));
+    REQUIRE(stats.bytes_pending_eviction == integer(entry_size));
+    integer load_count = 0;
+    for (auto count : stats.load_latency_histogram)
+        load_count += count;
+    REQUIRE(load_count == 3);
+}
+
+TEST_CASE("partial immutable cache snapshots", "[immutable_cache]")
+{
+    immutable_cache cache(
+        immutable_cache_config(1024, none, none, none, none));
+
+    std::vector<immutable_cache_ptr<int>> ptrs;
+    for (int i = 0; i != 10; ++i)
+    {
+        ptrs.emplace_back(cache, make_id(i), [&] { return test_task(i); });
+    }
+
+    auto keys_in = [](immutable_cache_snapshot const& snapshot) {
+        std::vector<string> keys;
+        for (auto const& entry : snapshot.in_use)
+            keys.push_back(entry.key);
+        return keys;
+    };
+
+    {
+        INFO("Consecutive pages cover every entry exactly once.");
+        std::vector<string> keys;
+        for (std::size_t offset = 0; offset < 12; offset += 4)
+        {
+            auto page = keys_in(get_cache_snapshot(cache, offset, 4));
+            REQUIRE(page.size() == (offset < 8 ? 4 : 2));
+            keys.insert(keys.end(), page.begin(), page.end());
+        }
+        std::sort(keys.begin(), keys.end());
+        REQUIRE(
+            keys
+            == (std::vector<string>{
+                "0", "1", "2", "3", "4", "5", "6", "7", "8", "9"}));
+    }
+
+    {
+        INFO("Strided snapshots sample the entries.");
+        auto sample = keys_in(get_cache_snapshot(cache, 1, 10, 3));
+        REQUIRE(sample.size() == 3);
+        std::sort(sample.begin(), sample.end());
+        REQUIRE(
+            std::adjacent_find(sample.begin(), sample.end()) == sample.end());
+    }
+}
+
+TEST_CASE("batch immutable cache acquisition", "[immutable_cache]")
+{
+    immutable_cache cache(
+        immutable_cache_config(1024, none, none, none, none));
+
+    // Load the first few keys individually.
+    std::vector<immutable_cache_ptr<int>> existing;
+    for (int i = 0; i != 4; ++i)
+    {
+        existing.emplace_back(cache, make_id(i), [&] { return test_task(i); });
+        await_cache_value(existing.back());
+    }
+
+    // Now acquire a batch that overlaps those and includes a duplicate.
+    std::vector<decltype(make_id(0))> keys;
+    for (int i = 0; i != 10; ++i)
+        keys.push_back(make_id(i));
+    keys.push_back(make_id(7));
+
+    std::vector<std::size_t> created;
+    auto ptrs = acquire_cache_ptrs<int>(cache, keys, [&](std::size_t i) {
+        created.push_back(i);
+        return test_task(int(i) * 10);
+    });
+
+    // Only the new keys should've needed tasks, and only the first instance
+    // of the duplicate key should've been used.
+    std::sort(created.begin(), created.end());
+    REQUIRE(created == (std::vector<std::size_t>{4, 5, 6, 7, 8, 9}));
+    REQUIRE(ptrs.size() == 11);
+    for (int i = 0; i != 4; ++i)
+        REQUIRE(await_cache_value(ptrs[i]) == i);
+    for (int i = 4; i != 10; ++i)
+        REQUIRE(await_cache_value(ptrs[i]) == i * 10);
+    REQUIRE(ptrs[10].untyped().record() == ptrs[7].untyped().record());
+
+    auto stats = get_cache_stats(cache);
+    REQUIRE(stats.entry_count == 10);
+    REQUIRE(stats.hits == 5);
+    REQUIRE(stats.misses == 10);
+}
+
+TEST_CASE("hottest immutable cache keys", "[immutable_cache]")
+{
+    immutable_cache cache(
+        immutable_cache_config(1024, 4, none, none, none));
+
+    auto access = [&](int key) {
+        immutable_cache_ptr<int> p(
+            cache, make_id(key), [&] { return test_task(key); });
+        return await_cache_value(p);
+    };
+
+    // Key 3 is accessed most, then 1. 0 and 2 are tied, but 2 was used
+    // more recently.
+    for (int key : {0, 1, 2, 3, 3, 1, 3, 3, 1, 0, 2})
+        REQUIRE(access(key) == key);
+    // A key whose task hasn't finished isn't listed.
+    immutable_cache_ptr<int> loading(
+        cache, make_id(4), [] { return test_task(4); });
+
+    REQUIRE(
+        get_hottest_cache_keys(cache, 10)
+        == (std::vector<std::string>{"3", "1", "2", "0"}));
+    REQUIRE(
+        get_hottest_cache_keys(cache, 2)
+        == (std::vector<std::string>{"3", "1"}));
+    REQUIRE(get_hottest_cache_keys(cache, 0).empty());
+}
+
+namespace {
+
+// a value type that spills on eviction
+struct spillable_value
+{
+    int x;
+};
+
+size_t
+deep_sizeof(spillable_value)
+{
+    return sizeof(spillable_value);
+}
+
+void
+to_dynamic(dynamic* v, spillable_value const& x)
+{
+    *v = dynamic(integer(x.x));
+}
+
+cppcoro::task<spillable_value>
+spillable_task(int x)
+{
+    co_return spillable_value{x};
+}
+
+} // namespace
+
+namespace cradle {
+
+template<>
+struct immutable_cache_spills_on_eviction<spillable_value> : std::true_type
+{
+};
+
+} // namespace cradle
+
+TEST_CASE("immutable cache eviction hook", "[immutable_cache]")
+{
+    immutable_cache cache(
+        immutable_cache_config(1024, none, none, none, none));
+
+    std::vector<std::pair<std::string, dynamic>> spilled;
+    set_eviction_hook(
+        cache,
+        [&](id_interface const& key, std::function<dynamic()> get_value) {
+            spilled.emplace_back(lexical_cast<string>(key), get_value());
+        });
+
+    {
+        immutable_cache_ptr<spillable_value> a(
+            cache, make_id(1), [] { return spillable_task(11); });
+        REQUIRE(await_cache_value(a).x == 11);
+        immutable_cache_ptr<spillable_value> b(
+            cache, make_id(2), [] { return spillable_task(12); });
+        REQUIRE(await_cache_value(b).x == 12);
+        // Values of other types are never offered to the hook.
+        immutable_cache_ptr<int> c(
+            cache, make_id(3), [] { return test_task(13); });
+        REQUIRE(await_cache_value(c) == 13);
+        // Neither are values that aren't ready yet.
+        immutable_cache_ptr<spillable_value> d(
+            cache, make_id(4), [] { return spillable_task(14); });
+    }
+    REQUIRE(spilled.empty());
+
+    clear_unused_entries(cache);
+    std::sort(spilled.begin(), spilled.end());
+    REQUIRE(
+        spilled
+        == (std::vector<std::pair<std::string, dynamic>>{
+            {"1", dynamic(integer(11))}, {"2", dynamic(integer(12))}}));
+}
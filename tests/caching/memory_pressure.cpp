@@ -0,0 +1,181 @@
+#include <cradle/caching/immutable/memory_pressure.hpp>
+
+#include <filesystem>
+#include <fstream>
+
+#include <cppcoro/sync_wait.hpp>
+
+#include <cradle/caching/immutable.h>
+#include <cradle/utilities/concurrency_testing.h>
+#include <cradle/utilities/testing.h>
+
+using namespace cradle;
+
+namespace {
+
+cppcoro::task<int>
+test_task(int the_answer)
+{
+    co_return the_answer;
+}
+
+// Fill :cache with :count unused entries.
+void
+fill_cache(immutable_cache& cache, int count)
+{
+    for (int i = 0; i != count; ++i)
+    {
+        immutable_cache_ptr<int> p(
+            cache, make_id(i), [i] { return test_task(i); });
+        cppcoro::sync_wait(p.task());
+    }
+}
+
+void
+write_file(std::filesystem::path const& path, std::string const& contents)
+{
+    std::ofstream output(path, std::ios::out | std::ios::trunc);
+    output << contents;
+}
+
+std::string
+psi_contents(double some_avg10)
+{
+    return "some avg10=" + std::to_string(some_avg10)
+           + " avg60=0.00 avg300=0.00 total=0\n"
+             "full avg10=0.00 avg60=0.00 avg300=0.00 total=0\n";
+}
+
+} // namespace
+
+TEST_CASE("memory pressure readings", "[immutable_cache][memory_pressure]")
+{
+    std::filesystem::path dir("memory_pressure_readings");
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+
+    memory_pressure_config config;
+    config.psi_path = (dir / "pressure").string();
+    config.cgroup_path = dir.string();
+
+    // Missing files are simply ignored.
+    {
+        auto reading = read_memory_pressure(config);
+        REQUIRE(!reading.psi_some_avg10);
+        REQUIRE(!reading.cgroup_current);
+        REQUIRE(!reading.cgroup_max);
+    }
+
+    write_file(dir / "pressure", psi_contents(12.5));
+    write_file(dir / "memory.current", "1234\n");
+    write_file(dir / "memory.max", "5678\n");
+    {
+        auto reading = read_memory_pressure(config);
+        REQUIRE(reading.psi_some_avg10 == 12.5);
+        REQUIRE(reading.cgroup_current == 1234);
+        REQUIRE(reading.cgroup_max == 5678);
+    }
+
+    // An unlimited cgroup reports "max".
+    write_file(dir / "memory.max", "max\n");
+    {
+        auto reading = read_memory_pressure(config);
+        REQUIRE(reading.cgroup_current == 1234);
+        REQUIRE(!reading.cgroup_max);
+    }
+}
+
+TEST_CASE("memory pressure monitoring", "[immutable_cache][memory_pressure]")
+{
+    std::filesystem::path dir("memory_pressure_monitoring");
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    write_file(dir / "pressure", psi_contents(0));
+    write_file(dir / "memory.current", "0\n");
+    write_file(dir / "memory.max", "max\n");
+
+    memory_pressure_config config;
+    config.psi_path = (dir / "pressure").string();
+    config.cgroup_path = dir.string();
+
+    immutable_cache cache(
+        immutable_cache_config(1024, none, none, none, none));
+    fill_cache(cache, 16);
+    auto const filled_size = get_cache_usage(cache).unused_size;
+    REQUIRE(filled_size > 0);
+
+    SECTION("PSI")
+    {
+        memory_pressure_monitor monitor(cache, config);
+
+        // No pressure leaves the budget alone.
+        monitor.poll();
+        REQUIRE(monitor.budget_fraction() == 1);
+        REQUIRE(get_unused_size_limit(cache) == 1024);
+
+        // Pressure halves it on every poll.
+        write_file(dir / "pressure", psi_contents(25));
+        monitor.poll();
+        REQUIRE(monitor.budget_fraction() == 0.5);
+        REQUIRE(get_unused_size_limit(cache) == 512);
+        monitor.poll();
+        REQUIRE(monitor.budget_fraction() == 0.25);
+        REQUIRE(get_unused_size_limit(cache) == 256);
+
+        // Once it subsides, the budget recovers gradually.
+        write_file(dir / "pressure", psi_contents(1));
+        monitor.poll();
+        REQUIRE(monitor.budget_fraction() == 0.375);
+        REQUIRE(get_unused_size_limit(cache) == 384);
+        for (int i = 0; i != 10; ++i)
+            monitor.poll();
+        REQUIRE(monitor.budget_fraction() == 1);
+        REQUIRE(get_unused_size_limit(cache) == 1024);
+    }
+    SECTION("minimum budget")
+    {
+        config.min_budget_fraction = 0.3;
+        memory_pressure_monitor monitor(cache, config);
+        write_file(dir / "pressure", psi_contents(25));
+        for (int i = 0; i != 4; ++i)
+            monitor.poll();
+        REQUIRE(monitor.budget_fraction() == 0.3);
+    }
+    SECTION("cgroup")
+    {
+        memory_pressure_monitor monitor(cache, config);
+
+        // Usage below the threshold isn't pressure.
+        write_file(dir / "memory.max", "10000\n");
+        write_file(dir / "memory.current", "8000\n");
+        monitor.poll();
+        REQUIRE(monitor.budget_fraction() == 1);
+        REQUIRE(get_cache_usage(cache).unused_size == filled_size);
+
+        // Usage above it shrinks the budget far enough that trimming the
+        // cache would free the excess, so in this case, everything goes.
+        write_file(dir / "memory.current", "9990\n");
+        monitor.poll();
+        REQUIRE(monitor.budget_fraction() == 0);
+        REQUIRE(get_cache_usage(cache).unused_size == 0);
+    }
+    SECTION("destruction")
+    {
+        {
+            memory_pressure_monitor monitor(cache, config);
+            write_file(dir / "pressure", psi_contents(25));
+            monitor.poll();
+            REQUIRE(get_unused_size_limit(cache) == 512);
+        }
+        // The full budget is restored once the monitor is gone.
+        REQUIRE(get_unused_size_limit(cache) == 1024);
+    }
+    SECTION("background polling")
+    {
+        config.poll_interval = 1;
+        write_file(dir / "pressure", psi_contents(25));
+        memory_pressure_monitor monitor(cache, config);
+        monitor.start();
+        REQUIRE(occurs_soon([&] { return monitor.budget_fraction() < 1; }));
+    }
+}
@@ -0,0 +1,301 @@
+#include <cradle/core/coercion.h>
+
+#include <cppcoro/sync_wait.hpp>
+
+#include <cradle/core.h>
+#include <cradle/utilities/testing.h>
+
+using namespace cradle;
+
+namespace {
+
+auto const float_type = make_api_type_info_with_float_type(api_float_type());
+auto const integer_type
+    = make_api_type_info_with_integer_type(api_integer_type());
+
+api_type_info
+make_array_type(api_type_info const& element_type)
+{
+    return make_api_type_info_with_array_type(
+        make_api_array_info(none, element_type));
+}
+
+api_type_info
+make_named_type(string const& name)
+{
+    return make_api_type_info_with_named_type(
+        make_api_named_type_reference("my_app", name));
+}
+
+// This is a dictionary of named types that records how often each one is
+// looked up.
+struct type_dictionary
+{
+    std::map<api_named_type_reference, api_type_info> types;
+    std::map<api_named_type_reference, int> lookups;
+
+    std::function<cppcoro::task<api_type_info>(
+        api_named_type_reference const& ref)>
+    look_up()
+    {
+        return [this](api_named_type_reference const& ref)
+                   -> cppcoro::task<api_type_info> {
+            ++lookups[ref];
+            co_return types.at(ref);
+        };
+    }
+
+    coercion_plan
+    compile(api_type_info const& type)
+    {
+        return cppcoro::sync_wait(compile_coercion_plan(look_up(), type));
+    }
+};
+
+} // namespace
+
+TEST_CASE("recursive coercion plans", "[core][coercion]")
+{
+    // A tree is a value and an array of subtrees.
+    type_dictionary dictionary;
+    auto const tree = make_api_named_type_reference("my_app", "tree");
+    dictionary.types[tree] = make_api_type_info_with_structure_type(
+        api_structure_info(
+            {{"value", make_api_structure_field_info("", float_type, none)},
+             {"children",
+              make_api_structure_field_info(
+                  "", make_array_type(make_named_type("tree")), true)}}));
+
+    auto const plan = dictionary.compile(make_named_type("tree"));
+    REQUIRE(dictionary.lookups[tree] == 1);
+    REQUIRE(deep_sizeof(plan) > sizeof(coercion_plan));
+
+    auto const value = dynamic(
+        {{"value", integer(1)},
+         {"children",
+          dynamic_array{
+              dynamic({{"value", 2.5}}),
+              dynamic(
+                  {{"value", 3.},
+                   {"children",
+                    dynamic_array{dynamic({{"value", integer(4)}})}}})}}});
+    REQUIRE(value_requires_coercion(plan, value));
+    auto const coerced = apply_coercion_plan(plan, value);
+    REQUIRE(
+        coerced
+        == dynamic(
+            {{"value", 1.},
+             {"children",
+              dynamic_array{
+                  dynamic({{"value", 2.5}}),
+                  dynamic(
+                      {{"value", 3.},
+                       {"children",
+                        dynamic_array{dynamic({{"value", 4.}})}}})}}}));
+    REQUIRE(!value_requires_coercion(plan, coerced));
+
+    // Applying the plan doesn't look anything else up.
+    REQUIRE(dictionary.lookups[tree] == 1);
+
+    // Errors deep within a value have the same paths that coerce_value()
+    // gives them.
+    auto const bad = dynamic(
+        {{"value", 1.},
+         {"children",
+          dynamic_array{
+              dynamic({{"value", 2.}}), dynamic({{"value", "x"}})}}});
+    try
+    {
+        apply_coercion_plan(plan, bad);
+        FAIL("no exception thrown");
+    }
+    catch (type_mismatch& e)
+    {
+        REQUIRE(
+            get_required_error_info<dynamic_value_path_info>(e)
+            == std::list<dynamic>({"children", integer(1), "value"}));
+    }
+    REQUIRE_THROWS_AS(
+        cppcoro::sync_wait(
+            coerce_value(dictionary.look_up(), make_named_type("tree"), bad)),
+        type_mismatch);
+    REQUIRE_THROWS_AS(
+        apply_coercion_plan(plan, dynamic({{"children", dynamic_array{}}})),
+        missing_field);
+}
+
+TEST_CASE("named type aliases in coercion plans", "[core][coercion]")
+{
+    type_dictionary dictionary;
+    dictionary.types[make_api_named_type_reference("my_app", "number")]
+        = make_named_type("float");
+    dictionary.types[make_api_named_type_reference("my_app", "float")]
+        = float_type;
+    auto const plan
+        = dictionary.compile(make_array_type(make_named_type("number")));
+    REQUIRE(
+        apply_coercion_plan(plan, dynamic(packed_array<integer>({1, 2})))
+        == dynamic({1., 2.}));
+    REQUIRE(
+        apply_coercion_plan(plan, dynamic({integer(1), 2.5}))
+        == dynamic({1., 2.5}));
+    REQUIRE_THROWS_AS(
+        apply_coercion_plan(plan, dynamic(dynamic_array{"x"})),
+        type_mismatch);
+}
+
+TEST_CASE("coercion plans leave conforming values alone", "[core][coercion]")
+{
+    type_dictionary dictionary;
+    auto const point_type = make_api_type_info_with_structure_type(
+        api_structure_info(
+            {{"x", make_api_structure_field_info("", float_type, none)},
+             {"label",
+              make_api_structure_field_info("", integer_type, true)}}));
+    auto const plan = dictionary.compile(make_array_type(point_type));
+
+    dynamic_array points;
+    for (int i = 0; i != 10; ++i)
+        points.push_back(dynamic({{"x", double(i)}, {"label", integer(i)}}));
+    auto const conforming = dynamic(points);
+
+    // A value that already conforms is returned as it is.
+    REQUIRE(!value_requires_coercion(plan, conforming));
+    auto const same = apply_coercion_plan(plan, conforming);
+    REQUIRE(get_dynamic_array(same) == get_dynamic_array(conforming));
+
+    // Otherwise, only the parts that require coercion are unshared.
+    points[7] = dynamic({{"x", integer(7)}});
+    auto const nonconforming = dynamic(points);
+    auto const coerced = apply_coercion_plan(plan, nonconforming);
+    REQUIRE(
+        coerced
+        == cppcoro::sync_wait(coerce_value(
+            dictionary.look_up(),
+            make_array_type(point_type),
+            nonconforming)));
+    REQUIRE(get_dynamic_array(coerced) != nullptr);
+    auto const& coerced_points = *get_dynamic_array(coerced);
+    REQUIRE(coerced_points[7] == dynamic({{"x", 7.}}));
+    REQUIRE(
+        &cast<dynamic_map>(coerced_points[6])
+        == &cast<dynamic_map>((*get_dynamic_array(nonconforming))[6]));
+}
+
+TEST_CASE("coerce_value only looks up the types it needs", "[core][coercion]")
+{
+    // :point refers to :label, but values that leave out the label don't
+    // need it, so coerce_value() doesn't look it up. (Compiling a plan
+    // resolves everything that the type can reach.)
+    type_dictionary dictionary;
+    auto const label = make_api_named_type_reference("my_app", "label");
+    dictionary.types[label] = integer_type;
+    auto const point_type = make_api_type_info_with_structure_type(
+        api_structure_info(
+            {{"x", make_api_structure_field_info("", float_type, none)},
+             {"label",
+              make_api_structure_field_info(
+                  "", make_named_type("label"), true)}}));
+
+    REQUIRE(
+        cppcoro::sync_wait(coerce_value(
+            dictionary.look_up(), point_type, dynamic({{"x", integer(1)}})))
+        == dynamic({{"x", 1.}}));
+    REQUIRE(dictionary.lookups[label] == 0);
+
+    // Once a value does reach it, it's looked up (once).
+    REQUIRE(
+        cppcoro::sync_wait(coerce_value(
+            dictionary.look_up(),
+            make_array_type(point_type),
+            dynamic(
+                {dynamic({{"x", 1.}, {"label", 2.}}),
+                 dynamic({{"x", 2.}, {"label", integer(3)}})})))
+        == dynamic(
+            {dynamic({{"x", 1.}, {"label", integer(2)}}),
+             dynamic({{"x", 2.}, {"label", integer(3)}})}));
+    REQUIRE(dictionary.lookups[label] == 1);
+
+    dictionary.compile(point_type);
+    REQUIRE(dictionary.lookups[label] == 2);
+}
+
+TEST_CASE("coercion leaves conforming arrays packed", "[core][coercion]")
+{
+    // Only :x requires coercion, so the arrays are left as they are (still
+    // packed and still shared with the original).
+    type_dictionary dictionary;
+    auto const type = make_api_type_info_with_structure_type(
+        api_structure_info(
+            {{"x", make_api_structure_field_info("", float_type, none)},
+             {"samples",
+              make_api_structure_field_info(
+                  "", make_array_type(float_type), none)},
+             {"ids",
+              make_api_structure_field_info(
+                  "", make_array_type(integer_type), none)}}));
+    auto const value = dynamic(
+        {{"x", integer(1)},
+         {"samples", packed_array<double>({0.5, 1.5})},
+         {"ids", packed_array<integer>({1, 2, 3})}});
+    auto const expected = dynamic(
+        {{"x", 1.},
+         {"samples", packed_array<double>({0.5, 1.5})},
+         {"ids", packed_array<integer>({1, 2, 3})}});
+
+    auto check = [&](dynamic const& coerced) {
+        REQUIRE(coerced == expected);
+        auto const& fields = cast<dynamic_map>(coerced);
+        auto const& original = cast<dynamic_map>(value);
+        REQUIRE(
+            get_packed_array<double>(get_field(fields, "samples"))
+            == get_packed_array<double>(get_field(original, "samples")));
+        REQUIRE(
+            get_packed_array<integer>(get_field(fields, "ids"))
+            == get_packed_array<integer>(get_field(original, "ids")));
+    };
+    check(cppcoro::sync_wait(coerce_value(dictionary.look_up(), type, value)));
+    check(apply_coercion_plan(dictionary.compile(type), value));
+}
+
+TEST_CASE("coercion plan serialization", "[core][coercion]")
+{
+    // Plans (including recursive ones) survive a trip through a dynamic
+    // value, so they can be stored in the disk cache.
+    type_dictionary dictionary;
+    auto const tree = make_api_named_type_reference("my_app", "tree");
+    dictionary.types[tree] = make_api_type_info_with_structure_type(
+        api_structure_info(
+            {{"value", make_api_structure_field_info("", float_type, none)},
+             {"children",
+              make_api_structure_field_info(
+                  "", make_array_type(make_named_type("tree")), true)}}));
+    auto const plan = dictionary.compile(make_named_type("tree"));
+
+    auto const decoded = from_dynamic<coercion_plan>(to_dynamic(plan));
+    REQUIRE(deep_sizeof(decoded) == deep_sizeof(plan));
+    REQUIRE(to_dynamic(decoded) == to_dynamic(plan));
+
+    auto const value = dynamic(
+        {{"value", integer(1)},
+         {"children",
+          dynamic_array{dynamic(
+              {{"value", integer(2)},
+               {"children", dynamic_array{dynamic({{"value", 3.}})}}})}}});
+    REQUIRE(
+        apply_coercion_plan(decoded, value)
+        == apply_coercion_plan(plan, value));
+    REQUIRE_THROWS_AS(
+        apply_coercion_plan(decoded, dynamic({{"children", dynamic_array{}}})),
+        missing_field);
+
+    // Node indices are checked when decoding.
+    auto encoded = to_dynamic(plan);
+    auto& root = cast<dynamic_map>(cast<dynamic_array>(encoded).front());
+    root[dynamic("element")] = integer(1000);
+    REQUIRE_THROWS_AS(
+        from_dynamic<coercion_plan>(encoded), invalid_coercion_plan);
+    REQUIRE_THROWS_AS(
+        from_dynamic<coercion_plan>(dynamic(dynamic_array{})),
+        invalid_coercion_plan);
+}
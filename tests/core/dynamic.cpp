@@ -1,5 +1,8 @@
 #include <cradle/core/dynamic.h>
 
+#include <algorithm>
+#include <thread>
+
 #include <cppcoro/sync_wait.hpp>
 
 #include <cradle/core.h>
@@ -8,6 +11,21 @@
 
 using namespace cradle;
 
+namespace {
+
+// Is it possible to cast a const dynamic to a T const&?
+template<class T>
+constexpr bool allows_const_cast
+    = requires(dynamic const& v) { cast<T>(v); };
+
+} // namespace
+
+// Arrays might be packed (or stored as tables), so there's no dynamic_array
+// for a const cast to refer to. Const casts to arrays are rejected at compile
+// time rather than failing when they encounter such an array.
+static_assert(!allows_const_cast<dynamic_array>);
+static_assert(allows_const_cast<dynamic_map>);
+
 TEST_CASE("value_type streaming", "[core][dynamic]")
 {
     REQUIRE(lexical_cast<string>(value_type::NIL) == "nil");
@@ -151,6 +169,30 @@ TEST_CASE("empty array/map equivalence", "[core][dynamic]")
     }
 }
 
+TEST_CASE("dynamic hashing", "[core][dynamic]")
+{
+    auto value = dynamic({{"a", integer(1)}, {"b", dynamic_array{2.5, "c"}}});
+    REQUIRE(invoke_hash(value) == invoke_hash(dynamic(value)));
+
+    // 0 and -0 are equal, so they should hash the same.
+    REQUIRE(invoke_hash(dynamic(0.)) == invoke_hash(dynamic(-0.)));
+
+    // Structurally similar values shouldn't collide.
+    REQUIRE(
+        invoke_hash(dynamic(dynamic_array()))
+        != invoke_hash(dynamic(dynamic_map())));
+    REQUIRE(invoke_hash(dynamic(integer(1))) != invoke_hash(dynamic(1.)));
+    REQUIRE(
+        invoke_hash(dynamic({integer(1), integer(2)}))
+        != invoke_hash(dynamic({integer(2), integer(1)})));
+    REQUIRE(
+        invoke_hash(dynamic({{"a", integer(1)}, {"b", integer(2)}}))
+        != invoke_hash(dynamic({{"a", integer(2)}, {"b", integer(1)}})));
+    REQUIRE(
+        invoke_hash(dynamic({{"a", "a"}}))
+        != invoke_hash(dynamic({{"b", "b"}})));
+}
+
 TEST_CASE("get_field", "[core][dynamic]")
 {
     auto map = dynamic_map({{"a", 12.}, {"b", false}});
@@ -171,6 +213,468 @@ TEST_CASE("get_field", "[core][dynamic]")
     }
 }
 
+TEST_CASE("dynamic maps", "[core][dynamic]")
+{
+    // Entries are sorted by key (and keys are ordered by type first), and if
+    // a key appears more than once, the last value wins.
+    auto map = dynamic_map(
+        {{"b", integer(1)},
+         {"a", integer(2)},
+         {integer(3), "c"},
+         {"b", integer(4)}});
+    REQUIRE(map.size() == 3);
+    REQUIRE(
+        dynamic_array(
+            {map.begin()->first,
+             std::next(map.begin())->first,
+             std::prev(map.end())->first})
+        == dynamic_array({dynamic(integer(3)), dynamic("a"), dynamic("b")}));
+    REQUIRE(get_field(map, "b") == integer(4));
+
+    // String keys can be looked up without constructing dynamics.
+    REQUIRE(map.find(std::string_view("a"))->second == integer(2));
+    REQUIRE(map.find(string("b"))->second == integer(4));
+    REQUIRE(map.find("c") == map.end());
+    REQUIRE(map.find(dynamic(integer(3)))->second == "c");
+    REQUIRE(map.count("a") == 1);
+    REQUIRE(map.count(dynamic(integer(4))) == 0);
+
+    // Insertions keep the entries sorted.
+    map["aa"] = integer(5);
+    map[dynamic(false)] = integer(6);
+    REQUIRE(!map.insert({dynamic("a"), dynamic(integer(7))}).second);
+    REQUIRE(map.insert({dynamic("c"), dynamic(integer(7))}).second);
+    REQUIRE(
+        map
+        == dynamic_map(
+            {{false, integer(6)},
+             {integer(3), "c"},
+             {"a", integer(2)},
+             {"aa", integer(5)},
+             {"b", integer(4)},
+             {"c", integer(7)}}));
+
+    REQUIRE(map.at("aa") == integer(5));
+    REQUIRE_THROWS_AS(map.at("d"), std::out_of_range);
+
+    REQUIRE(map.erase(dynamic("aa")) == 1);
+    REQUIRE(map.erase(dynamic("aa")) == 0);
+    REQUIRE(map.count("aa") == 0);
+    REQUIRE(map.size() == 5);
+
+    // Maps are ordered lexicographically by their entries.
+    REQUIRE(
+        dynamic_map({{"a", integer(1)}}) < dynamic_map({{"b", integer(0)}}));
+    REQUIRE(dynamic_map() < dynamic_map({{"a", integer(1)}}));
+}
+
+TEST_CASE("dynamic copy-on-write", "[core][dynamic]")
+{
+    auto const original = dynamic(
+        {{"items", dynamic_array{integer(1), integer(2)}},
+         {"text", string(dynamic::large_string_size, 'x')}});
+
+    // Copies share their storage with the original.
+    auto copy = original;
+    REQUIRE(
+        &cast<dynamic_map>(std::as_const(copy))
+        == &cast<dynamic_map>(original));
+    REQUIRE(copy == original);
+
+    // Modifying a copy unshares only the parts that are modified.
+    auto& copied_items = get_field(cast<dynamic_map>(copy), "items");
+    cast<dynamic_array>(copied_items).push_back(integer(3));
+    REQUIRE(copy != original);
+    REQUIRE(
+        get_field(cast<dynamic_map>(original), "items")
+        == dynamic_array{integer(1), integer(2)});
+    auto const& copied_map = cast<dynamic_map>(std::as_const(copy));
+    REQUIRE(
+        &cast<string>(get_field(copied_map, "text"))
+        == &cast<string>(get_field(cast<dynamic_map>(original), "text")));
+
+    // Large strings are also shared (and still look like strings).
+    auto text = get_field(cast<dynamic_map>(original), "text");
+    REQUIRE(text.type() == value_type::STRING);
+    cast<string>(text) += "y";
+    REQUIRE(cast<string>(text).size() == dynamic::large_string_size + 1);
+    REQUIRE(
+        cast<string>(get_field(cast<dynamic_map>(original), "text")).size()
+        == dynamic::large_string_size);
+
+    // Moving out of a copy leaves the original intact.
+    auto another_copy = original;
+    auto moved = cast<dynamic_map>(std::move(another_copy));
+    REQUIRE(dynamic(moved) == original);
+    REQUIRE(cast<dynamic_map>(original).size() == 2);
+}
+
+TEST_CASE("dynamic copy-on-write across threads", "[core][dynamic]")
+{
+    int const thread_count = 8;
+    for (int trial = 0; trial != 20; ++trial)
+    {
+        dynamic_array items;
+        for (int i = 0; i != 1000; ++i)
+            items.push_back(integer(i));
+        auto const expected_sum = integer(999 * 1000 / 2);
+
+        // Each thread gets its own copy of the same array, reads it, and then
+        // modifies it. The threads that get there first have to unshare
+        // their copies, but whichever one is last has the only reference
+        // left, so it modifies the array in place, after all the others
+        // have released it.
+        std::vector<dynamic> copies(thread_count, dynamic(items));
+        std::vector<integer> sums(thread_count, 0);
+        std::vector<std::thread> threads;
+        for (int t = 0; t != thread_count; ++t)
+        {
+            threads.emplace_back([&, t] {
+                for (auto const& item : *get_dynamic_array(copies[t]))
+                    sums[t] += cast<integer>(item);
+                for (auto& item : cast<dynamic_array>(copies[t]))
+                    item = integer(t);
+            });
+        }
+        for (auto& thread : threads)
+            thread.join();
+
+        for (int t = 0; t != thread_count; ++t)
+        {
+            REQUIRE(sums[t] == expected_sum);
+            auto const& modified_items = *get_dynamic_array(copies[t]);
+            REQUIRE(modified_items.size() == 1000);
+            REQUIRE(std::all_of(
+                modified_items.begin(),
+                modified_items.end(),
+                [&](dynamic const& item) {
+                    return item == dynamic(integer(t));
+                }));
+        }
+    }
+}
+
+TEST_CASE("packed arrays", "[core][dynamic]")
+{
+    auto const doubles = dynamic(packed_array<double>({1.5, -0., 3}));
+    auto const unpacked = dynamic_array{1.5, 0., 3.};
+
+    // Packed arrays look just like regular arrays.
+    REQUIRE(doubles.type() == value_type::ARRAY);
+    REQUIRE(doubles == dynamic(unpacked));
+    REQUIRE(dynamic(unpacked) == doubles);
+    REQUIRE(invoke_hash(doubles) == invoke_hash(dynamic(unpacked)));
+    REQUIRE(doubles < dynamic(packed_array<double>({2.})));
+    REQUIRE(doubles != dynamic(packed_array<integer>({1, 0, 3})));
+    REQUIRE(dynamic(unpacked) < dynamic(packed_array<double>({2.})));
+    REQUIRE(!(dynamic(unpacked) < doubles));
+    REQUIRE(dynamic(packed_array<integer>({1})) < doubles);
+    REQUIRE(visit_unpacked_array(doubles, [&](dynamic_array const& array) {
+        return array == unpacked;
+    }));
+    // Packed arrays are never unpacked in place, so there's no dynamic_array
+    // to refer to.
+    REQUIRE(get_dynamic_array(doubles) == nullptr);
+    REQUIRE(get_dynamic_array(dynamic(unpacked)) != nullptr);
+    REQUIRE(get_array_size(doubles) == 3);
+    REQUIRE(get_array_element(doubles, 2) == dynamic(3.));
+    REQUIRE_THROWS_AS(get_array_element(doubles, 3), std::out_of_range);
+    REQUIRE(
+        deep_sizeof(doubles)
+        == sizeof(dynamic) + deep_sizeof(packed_array<double>({1, 2, 3})));
+    REQUIRE(
+        deep_sizeof(packed_array<double>({1, 2, 3}))
+        == sizeof(packed_array<double>) + 3 * sizeof(double));
+
+    auto const booleans = dynamic(packed_array<bool>({1, 0}));
+    REQUIRE(booleans == dynamic({true, false}));
+    REQUIRE(invoke_hash(booleans) == invoke_hash(dynamic({true, false})));
+
+    // Accessing a packed array as a mutable dynamic_array unpacks it (without
+    // affecting its copies).
+    auto copy = doubles;
+    cast<dynamic_array>(copy).push_back(4.);
+    REQUIRE(get_packed_array<double>(copy) == nullptr);
+    REQUIRE(get_packed_array<double>(doubles) != nullptr);
+    REQUIRE(get_array_size(doubles) == 3);
+
+    // Conversions to and from std::vectors bypass the dynamic values.
+    auto const vector = std::vector<double>{1.5, 0, 3};
+    REQUIRE(get_packed_array<double>(to_dynamic(vector)) != nullptr);
+    REQUIRE(from_dynamic<std::vector<double>>(doubles) == vector);
+    REQUIRE(
+        from_dynamic<std::vector<double>>(
+            dynamic(packed_array<integer>({1, 2})))
+        == std::vector<double>{1, 2});
+    REQUIRE(
+        from_dynamic<std::vector<int>>(dynamic(packed_array<integer>({1, 2})))
+        == std::vector<int>{1, 2});
+    REQUIRE(
+        (from_dynamic<std::array<double, 3>>(doubles)
+         == std::array<double, 3>{1.5, 0, 3}));
+    REQUIRE_THROWS(from_dynamic<std::vector<string>>(doubles));
+    REQUIRE(to_dynamic(std::vector<double>()) == dynamic(dynamic_array()));
+
+    // Coercing packed integers to floats (and vice versa) keeps them packed.
+    std::function<cppcoro::task<api_type_info>(
+        api_named_type_reference const& ref)>
+        look_up_named_type = [&](api_named_type_reference const&)
+        -> cppcoro::task<api_type_info> {
+        co_return make_api_type_info_with_integer_type(api_integer_type());
+    };
+    auto coerce_value = [&](api_type_info const& element_type,
+                            dynamic const& value) {
+        return cppcoro::sync_wait(cradle::coerce_value(
+            look_up_named_type,
+            make_api_type_info_with_array_type(
+                make_api_array_info(none, element_type)),
+            value));
+    };
+    auto const float_type
+        = make_api_type_info_with_float_type(api_float_type());
+    auto const named_integer_type = make_api_type_info_with_named_type(
+        make_api_named_type_reference("my_app", "int"));
+    auto const floats
+        = coerce_value(float_type, dynamic(packed_array<integer>({1, 2})));
+    REQUIRE(floats == dynamic({1., 2.}));
+    REQUIRE(get_packed_array<double>(floats) != nullptr);
+    auto const integers = coerce_value(named_integer_type, floats);
+    REQUIRE(integers == dynamic({integer(1), integer(2)}));
+    REQUIRE(get_packed_array<integer>(integers) != nullptr);
+    REQUIRE_THROWS_AS(
+        coerce_value(
+            named_integer_type, dynamic(packed_array<double>({1, 2.5}))),
+        type_mismatch);
+    REQUIRE(coerce_value(float_type, doubles) == doubles);
+}
+
+TEST_CASE("interned strings", "[core][dynamic]")
+{
+    auto const& symbol = intern_string("meterset_weight");
+    REQUIRE(&intern_string("meterset_weight") == &symbol);
+    REQUIRE(symbol.text == "meterset_weight");
+
+    // Interned strings look just like regular strings.
+    auto const key = make_map_key("meterset_weight");
+    REQUIRE(get_string_symbol(key) == &symbol);
+    REQUIRE(key.type() == value_type::STRING);
+    REQUIRE(cast<string>(key) == "meterset_weight");
+    REQUIRE(key == dynamic(symbol));
+    REQUIRE(key == dynamic("meterset_weight"));
+    REQUIRE(dynamic("meterset_weight") == key);
+    REQUIRE(key != make_map_key("gantry_angle"));
+    REQUIRE(key < make_map_key("meterset_weight_2"));
+    REQUIRE(!(key < dynamic("meterset_weight")));
+    REQUIRE(make_map_key("gantry_angle") < key);
+    REQUIRE(invoke_hash(key) == invoke_hash(dynamic("meterset_weight")));
+    REQUIRE(deep_sizeof(key) == sizeof(dynamic));
+
+    // Long strings aren't interned.
+    auto const long_key = make_map_key(string(100, 'x'));
+    REQUIRE(get_string_symbol(long_key) == nullptr);
+    REQUIRE(long_key == dynamic(string(100, 'x')));
+
+    // Modifying an interned string replaces it with a regular string.
+    auto copy = key;
+    cast<string>(copy) += "_2";
+    REQUIRE(get_string_symbol(copy) == nullptr);
+    REQUIRE(copy == dynamic("meterset_weight_2"));
+    REQUIRE(cast<string>(key) == "meterset_weight");
+
+    // Maps can be queried with interned or regular keys, regardless of how
+    // their own keys are stored.
+    dynamic_map interned{{key, 1.}, {make_map_key("gantry_angle"), 2.}};
+    dynamic_map regular{{"meterset_weight", 1.}, {"gantry_angle", 2.}};
+    REQUIRE(interned == regular);
+    for (auto const* map : {&interned, &regular})
+    {
+        REQUIRE(map->at(key) == dynamic(1.));
+        REQUIRE(map->at("meterset_weight") == dynamic(1.));
+        REQUIRE(get_field(*map, symbol) == dynamic(1.));
+        REQUIRE(get_field(*map, intern_string("gantry_angle")) == dynamic(2.));
+        REQUIRE_THROWS_AS(
+            get_field(*map, intern_string("dose_rate")), missing_field);
+        dynamic const* v;
+        REQUIRE(!get_field(&v, *map, intern_string("dose_rate")));
+    }
+}
+
+TEST_CASE("record tables", "[core][dynamic]")
+{
+    dynamic_array records;
+    for (int i = 0; i != 3; ++i)
+    {
+        records.push_back(dynamic(
+            {{"gantry_angle", integer(i * 90)},
+             {"beam_id", "beam_" + std::to_string(i)}}));
+    }
+    auto const table = compact_array(records);
+    auto const* contents = get_record_table(table);
+    REQUIRE(contents != nullptr);
+    REQUIRE(contents->size() == 3);
+    REQUIRE(get_packed_array<integer>(*contents->find_column("gantry_angle")));
+    REQUIRE(contents->find_column("dose_rate") == nullptr);
+
+    // Tables look just like arrays of records.
+    REQUIRE(table.type() == value_type::ARRAY);
+    REQUIRE(table == dynamic(records));
+    REQUIRE(dynamic(records) == table);
+    REQUIRE(!(table < dynamic(records)));
+    REQUIRE(!(dynamic(records) < table));
+    REQUIRE(invoke_hash(table) == invoke_hash(dynamic(records)));
+    REQUIRE(visit_unpacked_array(table, [&](dynamic_array const& rows) {
+        return rows == records;
+    }));
+    // Tables are never expanded in place, so there's no dynamic_array to
+    // refer to.
+    REQUIRE(get_dynamic_array(table) == nullptr);
+    REQUIRE(get_array_size(table) == 3);
+    REQUIRE(get_array_element(table, 2) == records[2]);
+    REQUIRE_THROWS_AS(get_array_element(table, 3), std::out_of_range);
+    REQUIRE(deep_sizeof(table) < deep_sizeof(dynamic(records)));
+
+    auto changed = records;
+    cast<dynamic_map>(changed[1])["beam_id"] = "beam_9";
+    REQUIRE(table != compact_array(changed));
+    REQUIRE(table < compact_array(changed));
+    REQUIRE(table < dynamic(changed));
+
+    // Only arrays of (at least two) records with the same fields become
+    // tables.
+    REQUIRE(!get_record_table(compact_array({records[0]})));
+    auto mismatched = records;
+    mismatched.push_back(dynamic({{"gantry_angle", integer(0)}}));
+    REQUIRE(!get_record_table(compact_array(mismatched)));
+    REQUIRE(compact_array(mismatched) == dynamic(mismatched));
+
+    // Accessing a table as a mutable dynamic_array expands it (without
+    // affecting its copies).
+    auto copy = table;
+    cast<dynamic_array>(copy).push_back(dynamic(nil));
+    REQUIRE(get_record_table(copy) == nullptr);
+    REQUIRE(get_array_size(copy) == 4);
+    REQUIRE(get_record_table(table) != nullptr);
+
+    // Tables are coerced column by column.
+    std::function<cppcoro::task<api_type_info>(
+        api_named_type_reference const& ref)>
+        look_up_named_type = [&](api_named_type_reference const&)
+        -> cppcoro::task<api_type_info> {
+        co_return make_api_type_info_with_float_type(api_float_type());
+    };
+    auto coerce_value = [&](api_structure_info const& structure,
+                            dynamic const& value) {
+        return cppcoro::sync_wait(cradle::coerce_value(
+            look_up_named_type,
+            make_api_type_info_with_array_type(make_api_array_info(
+                none, make_api_type_info_with_structure_type(structure))),
+            value));
+    };
+    auto const string_type
+        = make_api_type_info_with_string_type(api_string_type());
+    auto const float_type = make_api_type_info_with_named_type(
+        make_api_named_type_reference("my_app", "float"));
+    auto const coerced = coerce_value(
+        api_structure_info(
+            {{"gantry_angle",
+              make_api_structure_field_info("", float_type, none)},
+             {"beam_id",
+              make_api_structure_field_info("", string_type, none)}}),
+        table);
+    REQUIRE(
+        coerced
+        == dynamic(
+            {dynamic({{"gantry_angle", 0.}, {"beam_id", "beam_0"}}),
+             dynamic({{"gantry_angle", 90.}, {"beam_id", "beam_1"}}),
+             dynamic({{"gantry_angle", 180.}, {"beam_id", "beam_2"}})}));
+    REQUIRE(get_record_table(coerced) != nullptr);
+    try
+    {
+        coerce_value(
+            api_structure_info(
+                {{"beam_id",
+                  make_api_structure_field_info("", float_type, none)}}),
+            table);
+        FAIL("no exception thrown");
+    }
+    catch (type_mismatch& e)
+    {
+        REQUIRE(
+            get_required_error_info<dynamic_value_path_info>(e)
+            == std::list<dynamic>({integer(0), "beam_id"}));
+    }
+    REQUIRE_THROWS_AS(
+        coerce_value(
+            api_structure_info(
+                {{"dose_rate",
+                  make_api_structure_field_info("", float_type, none)}}),
+            table),
+        missing_field);
+
+    // Conversions to std::vectors read the records straight from the
+    // columns.
+    auto const rows = from_dynamic<std::vector<dynamic>>(table);
+    REQUIRE(rows == records);
+}
+
+TEST_CASE("dynamic arenas", "[core][dynamic]")
+{
+    REQUIRE(!dynamic_memory_is_scoped());
+    REQUIRE(get_dynamic_memory_resource() == std::pmr::new_delete_resource());
+
+    dynamic_array records;
+    for (int i = 0; i != 3; ++i)
+    {
+        records.push_back(dynamic(
+            {{"gantry_angle", integer(i * 90)},
+             {"beam_id", "beam_" + std::to_string(i)}}));
+    }
+    auto const table = compact_array(records);
+    auto const expected = dynamic(
+        {{"description", string(100, 'x')},
+         {"isocenter", dynamic_array{12.5, -3.25, 40.}},
+         {"beams", dynamic(records)}});
+
+    dynamic escaped, copied;
+    {
+        dynamic_arena arena;
+        {
+            dynamic_memory_scope scope(arena.resource());
+            REQUIRE(dynamic_memory_is_scoped());
+            REQUIRE(get_dynamic_memory_resource() == arena.resource());
+
+            // Scopes nest (and restore the previous resource when they end).
+            {
+                dynamic_memory_scope heap(std::pmr::new_delete_resource());
+                REQUIRE(!dynamic_memory_is_scoped());
+            }
+            REQUIRE(get_dynamic_memory_resource() == arena.resource());
+
+            auto value = dynamic(
+                {{"description", string(100, 'x')},
+                 {"isocenter", dynamic_array{12.5, -3.25, 40.}},
+                 {"beams", compact_array(records)}});
+            REQUIRE(value == expected);
+
+            // Values can escape the arena via from_dynamic() or
+            // copy_to_heap().
+            from_dynamic(&escaped, value);
+            copied = copy_to_heap(value);
+
+            // Expanding a table within an arena doesn't tie the table to
+            // the arena, since the rows don't outlive the visit.
+            REQUIRE(visit_unpacked_array(
+                table,
+                [&](dynamic_array const& rows) { return rows == records; }));
+        }
+        REQUIRE(!dynamic_memory_is_scoped());
+    }
+    REQUIRE(escaped == expected);
+    REQUIRE(copied == expected);
+    REQUIRE(get_record_table(get_field(cast<dynamic_map>(copied), "beams")));
+    REQUIRE(table == dynamic(records));
+}
+
 TEST_CASE("get_union_tag", "[core][dynamic]")
 {
     // Try getting the type from a proper union dynamic.
@@ -0,0 +1,123 @@
+#include <cradle/core/field_dispatch.h>
+
+#include <cradle/core.h>
+#include <cradle/utilities/testing.h>
+
+using namespace cradle;
+
+namespace {
+
+constexpr field_name_table<0> no_names({});
+constexpr field_name_table<4> short_names({"a", "ab", "abc", "b"});
+constexpr field_name_table<12> long_names(
+    {"app",
+     "name",
+     "description",
+     "schema",
+     "omissible",
+     "fields",
+     "field_1",
+     "field_2",
+     "field_10",
+     "field_11",
+     "",
+     "field_12"});
+
+} // namespace
+
+TEST_CASE("field name tables", "[core][field_dispatch]")
+{
+    REQUIRE(no_names.find("") == -1);
+    REQUIRE(no_names.find("a") == -1);
+
+    REQUIRE(short_names.find("a") == 0);
+    REQUIRE(short_names.find("ab") == 1);
+    REQUIRE(short_names.find("abc") == 2);
+    REQUIRE(short_names.find("b") == 3);
+    REQUIRE(short_names.find("") == -1);
+    REQUIRE(short_names.find("abcd") == -1);
+    REQUIRE(short_names.find("c") == -1);
+
+    for (int i = 0; i != 12; ++i)
+        REQUIRE(long_names.find(long_names.names[i]) == i);
+    REQUIRE(long_names.find("field_3") == -1);
+    REQUIRE(long_names.find("field_") == -1);
+    REQUIRE(long_names.find("Name") == -1);
+}
+
+TEST_CASE("record field sets", "[core][field_dispatch]")
+{
+    record_field_set fields;
+    for (unsigned i : {0u, 63u, 64u, 127u, 128u, 200u, 1000u})
+    {
+        REQUIRE(!fields.contains(i));
+        fields.mark(i);
+        REQUIRE(fields.contains(i));
+    }
+    REQUIRE(!fields.contains(1));
+    REQUIRE(!fields.contains(129));
+    REQUIRE(!fields.contains(999));
+    REQUIRE(!fields.contains(100000));
+}
+
+TEST_CASE("single-pass structure decoding", "[core][field_dispatch]")
+{
+    auto const info = make_api_structure_field_info(
+        "the field",
+        make_api_type_info_with_integer_type(api_integer_type()),
+        true);
+    REQUIRE(from_dynamic<api_structure_field_info>(to_dynamic(info)) == info);
+
+    // Keys don't have to be interned, and fields that the structure doesn't
+    // know about are ignored (including ones with non-string keys).
+    REQUIRE(
+        from_dynamic<api_structure_field_info>(dynamic(dynamic_map(
+            {{dynamic(string("description")), "the field"},
+             {"schema", dynamic({{"integer_type", dynamic_map()}})},
+             {"omissible", true},
+             {"unknown", integer(1)},
+             {integer(2), "x"}})))
+        == info);
+
+    // Omissible fields can be left out.
+    REQUIRE(
+        from_dynamic<api_structure_field_info>(dynamic(
+            {{"description", "the field"},
+             {"schema", dynamic({{"integer_type", dynamic_map()}})}}))
+        == make_api_structure_field_info(
+            "the field",
+            make_api_type_info_with_integer_type(api_integer_type()),
+            none));
+
+    // Other fields can't.
+    try
+    {
+        from_dynamic<api_structure_field_info>(dynamic(
+            {{"description", "the field"}, {"omissible", false}}));
+        FAIL("no exception thrown");
+    }
+    catch (missing_field& e)
+    {
+        REQUIRE(get_required_error_info<field_name_info>(e) == "schema");
+    }
+
+    // Errors within fields identify the fields.
+    try
+    {
+        from_dynamic<api_structure_field_info>(dynamic(
+            {{"description", "the field"},
+             {"schema", dynamic({{"integer_type", dynamic_map()}})},
+             {"omissible", integer(1)}}));
+        FAIL("no exception thrown");
+    }
+    catch (type_mismatch& e)
+    {
+        REQUIRE(
+            get_required_error_info<dynamic_value_path_info>(e)
+            == std::list<dynamic>({"omissible"}));
+    }
+
+    REQUIRE_THROWS_AS(
+        from_dynamic<api_structure_field_info>(dynamic(integer(1))),
+        type_mismatch);
+}
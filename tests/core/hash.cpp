@@ -0,0 +1,51 @@
+#include <cradle/core/hash.h>
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include <cradle/utilities/testing.h>
+
+using namespace cradle;
+
+TEST_CASE("byte hashing", "[core][hash]")
+{
+    // Hash every prefix of a string (covering all the different code paths
+    // for short and long inputs) and check that there are no collisions.
+    std::string const text(200, 'x');
+    std::set<uint64_t> hashes;
+    for (size_t length = 0; length <= text.size(); ++length)
+    {
+        auto hash = hash_bytes(text.data(), length);
+        REQUIRE(hash == hash_bytes(text.data(), length));
+        hashes.insert(hash);
+    }
+    REQUIRE(hashes.size() == text.size() + 1);
+
+    // The seed should affect the hash.
+    REQUIRE(hash_bytes("abc", 3, 0) != hash_bytes("abc", 3, 1));
+
+    // Strings are hashed by their contents.
+    REQUIRE(invoke_hash(std::string("abc")) == hash_bytes("abc", 3));
+}
+
+TEST_CASE("integer hashing", "[core][hash]")
+{
+    // Consecutive integers should be spread out, even in the low bits (which
+    // are what hash tables typically use to select buckets).
+    std::set<uint64_t> low_bits;
+    for (uint64_t i = 0; i != 4096; ++i)
+        low_bits.insert(hash_integer(i) & 0xffff);
+    REQUIRE(low_bits.size() > 3900);
+
+    REQUIRE(invoke_hash(42) == invoke_hash(uint64_t(42)));
+}
+
+TEST_CASE("hash combining", "[core][hash]")
+{
+    auto a = invoke_hash(1), b = invoke_hash(2);
+    REQUIRE(combine_hashes(a, b) != combine_hashes(b, a));
+    REQUIRE(combine_hashes(a, a) != combine_hashes(b, b));
+    REQUIRE(combine_hashes(a) != combine_hashes(a, a));
+    REQUIRE(combine_hashes(a, b) == combine_hashes(a, b));
+}
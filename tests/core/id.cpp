@@ -2,6 +2,7 @@
 
 #include <algorithm>
 #include <cctype>
+#include <cstddef>
 #include <map>
 #include <unordered_map>
 #include <utility>
@@ -46,6 +47,19 @@ test_single_id(Id const& id)
     Id clone_copy;
     clone->deep_copy(&clone_copy);
     test_equal_ids(id, clone_copy);
+
+    // Copy the ID into a buffer and then move it into another one.
+    alignas(std::max_align_t) unsigned char buffer[sizeof(Id)];
+    REQUIRE(!id.copy_into(buffer, sizeof(Id) - 1));
+    id_interface* buffered = id.copy_into(buffer, sizeof(Id));
+    REQUIRE(buffered);
+    test_equal_ids(id, *buffered);
+    alignas(std::max_align_t) unsigned char other_buffer[sizeof(Id)];
+    id_interface* moved = buffered->move_into(other_buffer, sizeof(Id));
+    REQUIRE(moved);
+    test_equal_ids(id, *moved);
+    buffered->~id_interface();
+    moved->~id_interface();
 }
 
 // Test all the ID operations on a pair of different IDs.
@@ -172,6 +186,59 @@ TEST_CASE("captured_id move assignment", "[id]")
     REQUIRE(!f.is_initialized());
 }
 
+TEST_CASE("captured_id inline storage", "[id]")
+{
+    auto small = make_id(std::string("abc"));
+    captured_id c(small);
+    REQUIRE(c.is_inline());
+    captured_id d = c;
+    REQUIRE(d.is_inline());
+    REQUIRE(d.matches(small));
+    captured_id e = std::move(d);
+    REQUIRE(e.is_inline());
+    REQUIRE(e.matches(small));
+    REQUIRE(!d.is_initialized());
+
+    // IDs that are too big for the inline buffer go on the heap.
+    auto big = combine_ids(
+        make_id(std::string("a")),
+        make_id(std::string("b")),
+        make_id(std::string("c")),
+        make_id(std::string("d")));
+    REQUIRE(sizeof(big) > captured_id::inline_size);
+    captured_id f(big);
+    REQUIRE(!f.is_inline());
+    REQUIRE(f.matches(big));
+    captured_id g = std::move(f);
+    REQUIRE(!g.is_inline());
+    REQUIRE(g.matches(big));
+
+    // Switching between the two works in both directions.
+    swap(e, g);
+    REQUIRE(e.matches(big));
+    REQUIRE(!e.is_inline());
+    REQUIRE(g.matches(small));
+    REQUIRE(g.is_inline());
+    e = g;
+    REQUIRE(e.matches(small));
+    REQUIRE(e.is_inline());
+
+    // An inline reference still owns a copy of its referent.
+    captured_id r;
+    {
+        auto referent = make_id(std::string("xyz"));
+        r.capture(ref(referent));
+    }
+    REQUIRE(r.is_inline());
+    auto xyz = make_id(std::string("xyz"));
+    REQUIRE(r.matches(ref(xyz)));
+
+    // Typical cache keys are stored inline.
+    captured_id k(make_sha256_hashed_id(
+        "tag", std::string("api_url"), std::string("context_id")));
+    REQUIRE(k.is_inline());
+}
+
 TEST_CASE("combine_ids x1", "[id]")
 {
     auto a = combine_ids(make_id(0));
@@ -200,6 +267,20 @@ TEST_CASE("combine_ids x4", "[id]")
     test_different_ids(a, b);
 }
 
+TEST_CASE("combine_ids hashing", "[id]")
+{
+    // Swapped and repeated components shouldn't collide.
+    REQUIRE(
+        combine_ids(make_id(1), make_id(2)).hash()
+        != combine_ids(make_id(2), make_id(1)).hash());
+    REQUIRE(
+        combine_ids(make_id(1), make_id(1)).hash()
+        != combine_ids(make_id(2), make_id(2)).hash());
+    REQUIRE(
+        combine_ids(make_id(1), make_id(1)).hash()
+        != combine_ids(make_id(0), make_id(0)).hash());
+}
+
 TEST_CASE("clone_into/pointer", "[id]")
 {
     id_interface* storage = 0;
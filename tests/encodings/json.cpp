@@ -271,6 +271,33 @@ TEST_CASE("basic JSON encoding", "[encodings][json]")
         {{"type", integer(12)}, {"blob", "asdf"}});
 }
 
+TEST_CASE("packed JSON arrays", "[encodings][json]")
+{
+    // Homogeneous arrays of numbers (or booleans) are read as packed arrays.
+    test_json_encoding("[ true, false ]", dynamic({true, false}));
+    REQUIRE(get_packed_array<bool>(parse_json_value("[true]")) != nullptr);
+    test_json_encoding(
+        "[ -60, 4096 ]", dynamic({integer(-60), integer(4096)}));
+    REQUIRE(get_packed_array<integer>(parse_json_value("[1, 2]")) != nullptr);
+    test_json_encoding("[ -1.5, 12.5 ]", dynamic({-1.5, 12.5}));
+    REQUIRE(get_packed_array<double>(parse_json_value("[1.5]")) != nullptr);
+
+    // Mixed arrays aren't.
+    test_json_encoding("[ 1, 2.5 ]", dynamic({integer(1), 2.5}));
+    auto const mixed = parse_json_value("[1, 2.5]");
+    REQUIRE(get_packed_array<integer>(mixed) == nullptr);
+    REQUIRE(get_packed_array<double>(mixed) == nullptr);
+}
+
+TEST_CASE("interned JSON map keys", "[encodings][json]")
+{
+    auto const decoded = parse_json_value(R"({ "name": "linac" })");
+    REQUIRE(decoded == dynamic({{"name", "linac"}}));
+    auto const& [key, name] = *cast<dynamic_map>(decoded).begin();
+    REQUIRE(get_string_symbol(key) == &intern_string("name"));
+    REQUIRE(get_string_symbol(name) == nullptr);
+}
+
 TEST_CASE("malformed JSON blob", "[encodings][json]")
 {
     try
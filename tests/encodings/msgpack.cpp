@@ -3,7 +3,10 @@
 #include <cstdint>
 #include <cstring>
 
+#include <cradle/config.hpp>
 #include <cradle/encodings/json.h>
+#include <cradle/encodings/msgpack_internals.h>
+#include <cradle/thinknode/types.hpp>
 #include <cradle/utilities/testing.h>
 #include <cradle/utilities/text.h>
 
@@ -95,6 +98,173 @@ TEST_CASE("basic msgpack encoding", "[encodings][msgpack]")
         msgpack_data, sizeof(msgpack_data), parse_json_value(json_equivalent));
 }
 
+TEST_CASE("packed MessagePack arrays", "[encodings][msgpack]")
+{
+    // Homogeneous arrays of numbers (or booleans) are read as packed arrays.
+    uint8_t booleans[] = {0x92, 0xc3, 0xc2};
+    test_msgpack_encoding(booleans, sizeof(booleans), dynamic({true, false}));
+    REQUIRE(
+        get_packed_array<bool>(parse_msgpack_value(booleans, sizeof(booleans)))
+        != nullptr);
+    auto const integers = dynamic(packed_array<integer>({-60, 4096}));
+    REQUIRE(
+        get_packed_array<integer>(
+            parse_msgpack_value(value_to_msgpack_string(integers)))
+        != nullptr);
+    auto const doubles = dynamic(packed_array<double>({-1.5, 12.5}));
+    auto const msgpack = value_to_msgpack_string(doubles);
+    REQUIRE(
+        msgpack
+        == value_to_msgpack_string(dynamic(dynamic_array{-1.5, 12.5})));
+    REQUIRE(
+        get_packed_array<double>(parse_msgpack_value(msgpack)) != nullptr);
+    REQUIRE(parse_msgpack_value(msgpack) == doubles);
+
+    // Mixed arrays aren't.
+    auto const mixed = dynamic({integer(1), 2.5});
+    auto const parsed = parse_msgpack_value(value_to_msgpack_string(mixed));
+    REQUIRE(get_packed_array<integer>(parsed) == nullptr);
+    REQUIRE(parsed == mixed);
+}
+
+TEST_CASE("interned MessagePack map keys", "[encodings][msgpack]")
+{
+    auto const value = dynamic({{"name", "linac"}});
+    auto const decoded = parse_msgpack_value(value_to_msgpack_string(value));
+    REQUIRE(decoded == value);
+    auto const& [key, name] = *cast<dynamic_map>(decoded).begin();
+    REQUIRE(get_string_symbol(key) == &intern_string("name"));
+    REQUIRE(get_string_symbol(name) == nullptr);
+}
+
+TEST_CASE("MessagePack record tables", "[encodings][msgpack]")
+{
+    // Tables are encoded exactly like arrays of records, and arrays of
+    // records with the same fields are read as tables.
+    auto const records = dynamic_array{
+        dynamic({{"name", "linac_0"}, {"sad", 1000.}}),
+        dynamic({{"name", "linac_1"}, {"sad", 800.}})};
+    auto const msgpack = value_to_msgpack_string(compact_array(records));
+    REQUIRE(msgpack == value_to_msgpack_string(records));
+    auto const parsed = parse_msgpack_value(msgpack);
+    REQUIRE(get_record_table(parsed) != nullptr);
+    REQUIRE(parsed == dynamic(records));
+    REQUIRE(
+        get_packed_array<double>(*get_record_table(parsed)->find_column("sad"))
+        != nullptr);
+
+    // The decoded records are only ever expanded on request (or on
+    // modification), so they're read without a dynamic_array.
+    REQUIRE(get_dynamic_array(parsed) == nullptr);
+    REQUIRE(get_array_element(parsed, 1) == records[1]);
+    REQUIRE(visit_unpacked_array(parsed, [&](dynamic_array const& rows) {
+        return rows == records;
+    }));
+    auto expanded = parsed;
+    REQUIRE(cast<dynamic_array>(expanded) == records);
+    REQUIRE(get_record_table(parsed) != nullptr);
+
+    auto const mixed = dynamic({records[0], dynamic({{"name", "linac_2"}})});
+    auto const mixed_parsed
+        = parse_msgpack_value(value_to_msgpack_string(mixed));
+    REQUIRE(get_record_table(mixed_parsed) == nullptr);
+    REQUIRE(mixed_parsed == mixed);
+}
+
+namespace {
+
+// Test that :value is encoded directly (via its own overloads) exactly like
+// its dynamic form and that it's decoded directly back to itself.
+template<class Value>
+void
+test_direct_msgpack_encoding(Value const& value)
+{
+    INFO(to_dynamic(value));
+    auto const msgpack = value_to_msgpack_string(value);
+    REQUIRE(msgpack == value_to_msgpack_string(to_dynamic(value)));
+    Value decoded;
+    parse_msgpack_value(&decoded, msgpack);
+    REQUIRE(decoded == value);
+    auto const msgpack_blob = value_to_msgpack_blob(value);
+    REQUIRE(msgpack_blob.size == msgpack.size());
+    REQUIRE(
+        std::memcmp(msgpack_blob.data, msgpack.data(), msgpack.size()) == 0);
+}
+
+// Decode the MessagePack form of :v directly as a Value.
+template<class Value>
+Value
+decode_directly(dynamic const& v)
+{
+    Value x;
+    parse_msgpack_value(&x, value_to_msgpack_string(v));
+    return x;
+}
+
+} // namespace
+
+TEST_CASE("direct MessagePack encoding of API types", "[encodings][msgpack]")
+{
+    auto const float_type
+        = make_api_type_info_with_float_type(api_float_type());
+    auto const record_type = make_api_type_info_with_structure_type(
+        make_api_structure_info(
+            {{"count",
+              make_api_structure_field_info(
+                  "a count",
+                  make_api_type_info_with_integer_type(api_integer_type()),
+                  true)},
+             {"samples",
+              make_api_structure_field_info(
+                  "some samples",
+                  make_api_type_info_with_array_type(
+                      make_api_array_info(integer(3), float_type)),
+                  none)}}));
+    test_direct_msgpack_encoding(record_type);
+    test_direct_msgpack_encoding(
+        std::vector<api_type_info>{float_type, record_type});
+    test_direct_msgpack_encoding(thinknode_service_id::ISS);
+    test_direct_msgpack_encoding(
+        std::map<string, ptime>{{"t", ptime(date(2017, 4, 26))}});
+
+    // server_config's own fields don't all come after those of its
+    // supertype, so it's encoded via its dynamic form.
+    server_config config;
+    config.port = 41071;
+    config.request_concurrency = 2;
+    test_direct_msgpack_encoding(config);
+}
+
+TEST_CASE("direct MessagePack decoding of API types", "[encodings][msgpack]")
+{
+    // Fields that the structure doesn't know about are ignored.
+    REQUIRE(
+        decode_directly<api_named_type_reference>(
+            dynamic({{"app", "my_app"}, {"name", "t"}, {"x", integer(1)}}))
+        == make_api_named_type_reference("my_app", "t"));
+
+    // Errors are reported just as they are by from_dynamic().
+    try
+    {
+        decode_directly<std::vector<api_named_type_reference>>(
+            dynamic({dynamic({{"app", "my_app"}, {"name", integer(1)}})}));
+        FAIL("no exception thrown");
+    }
+    catch (type_mismatch& e)
+    {
+        REQUIRE(
+            get_required_error_info<dynamic_value_path_info>(e)
+            == std::list<dynamic>({integer(0), "name"}));
+    }
+    REQUIRE_THROWS_AS(
+        decode_directly<api_named_type_reference>(dynamic({{"app", "a"}})),
+        missing_field);
+    REQUIRE_THROWS_AS(
+        decode_directly<api_type_info>(
+            dynamic({{"float_type", dynamic_map()}, {"nil_type", nil}})),
+        multifield_union);
+}
+
 TEST_CASE("custom MessagePack blob ownership", "[encodings][msgpack]")
 {
     auto blob = parse_json_value(
@@ -2,7 +2,11 @@
 
 #include <cstring>
 
+#include <picosha2.h>
+
+#include <cradle/config.hpp>
 #include <cradle/encodings/json.h>
+#include <cradle/thinknode/types.hpp>
 #include <cradle/utilities/testing.h>
 #include <cradle/utilities/text.h>
 
@@ -60,6 +64,12 @@ TEST_CASE("basic native encoding", "[encodings][native]")
         = read_natively_encoded_value(native_data.data(), native_data.size());
 
     REQUIRE(decoded_data == original_data);
+
+    size_t deep_size = 0;
+    decoded_data = read_natively_encoded_value(
+        native_data.data(), native_data.size(), &deep_size);
+    REQUIRE(decoded_data == original_data);
+    REQUIRE(deep_size == deep_sizeof(original_data));
 }
 
 TEST_CASE("malformed natively encoded data", "[encodings][native]")
@@ -73,3 +83,256 @@ TEST_CASE("malformed natively encoded data", "[encodings][native]")
         REQUIRE_THROWS(read_natively_encoded_value(encoded_data, 1));
     }
 }
+
+namespace {
+
+template<class Value>
+byte_vector
+write_typed_value(Value const& value)
+{
+    byte_vector data;
+    byte_vector_buffer buffer(data);
+    raw_memory_writer<byte_vector_buffer> writer(buffer);
+    write_natively_encoded_value(writer, value);
+    return data;
+}
+
+template<class Value>
+void
+test_typed_native_encoding(Value const& value)
+{
+    INFO(to_dynamic(value));
+    REQUIRE(
+        write_typed_value(value)
+        == write_natively_encoded_value(to_dynamic(value)));
+}
+
+} // namespace
+
+TEST_CASE("typed native encoding", "[encodings][native]")
+{
+    test_typed_native_encoding(true);
+    test_typed_native_encoding(false);
+    test_typed_native_encoding(-60);
+    test_typed_native_encoding(uint16_t(4096));
+    test_typed_native_encoding(integer(1) << 40);
+    test_typed_native_encoding(12.5);
+    test_typed_native_encoding(-1.5f);
+    test_typed_native_encoding(string("foo"));
+    test_typed_native_encoding(
+        make_blob(string("Will anyone ever see this?")));
+    test_typed_native_encoding(std::vector<int>{1, 2, 3});
+    test_typed_native_encoding(
+        std::vector<std::vector<string>>{{"a", "b"}, {}, {"c"}});
+    test_typed_native_encoding(optional<double>(2.5));
+    test_typed_native_encoding(optional<string>());
+    test_typed_native_encoding(std::map<string, int>{{"a", 1}, {"b", 2}});
+    test_typed_native_encoding(dynamic({{"a", integer(1)}, {"b", "c"}}));
+}
+
+namespace {
+
+// Test that :value is encoded directly (via its own overloads) exactly like
+// its dynamic form and that it's decoded directly back to itself.
+template<class Value>
+void
+test_direct_native_encoding(Value const& value)
+{
+    INFO(to_dynamic(value));
+    auto const encoded = write_natively_encoded_value(value);
+    REQUIRE(encoded == write_natively_encoded_value(to_dynamic(value)));
+    Value decoded;
+    read_natively_encoded_value(&decoded, encoded.data(), encoded.size());
+    REQUIRE(decoded == value);
+}
+
+// Decode the native encoding of :v directly as a Value.
+template<class Value>
+Value
+decode_directly(dynamic const& v)
+{
+    auto const encoded = write_natively_encoded_value(v);
+    Value x;
+    read_natively_encoded_value(&x, encoded.data(), encoded.size());
+    return x;
+}
+
+} // namespace
+
+TEST_CASE("direct native encoding of API types", "[encodings][native]")
+{
+    auto const float_type
+        = make_api_type_info_with_float_type(api_float_type());
+    auto const record_type = make_api_type_info_with_structure_type(
+        make_api_structure_info(
+            {{"count",
+              make_api_structure_field_info(
+                  "a count",
+                  make_api_type_info_with_integer_type(api_integer_type()),
+                  true)},
+             {"samples",
+              make_api_structure_field_info(
+                  "some samples",
+                  make_api_type_info_with_array_type(
+                      make_api_array_info(integer(3), float_type)),
+                  none)}}));
+    test_direct_native_encoding(record_type);
+    test_direct_native_encoding(
+        std::vector<api_type_info>{float_type, record_type});
+    test_direct_native_encoding(
+        make_api_named_type_reference("my_app", "my_type"));
+    test_direct_native_encoding(thinknode_service_id::ISS);
+
+    // server_config's own fields don't all come after those of its
+    // supertype, so it's encoded via its dynamic form.
+    server_config config;
+    config.port = 41071;
+    config.request_concurrency = 2;
+    test_direct_native_encoding(config);
+}
+
+TEST_CASE("direct native decoding of API types", "[encodings][native]")
+{
+    // Fields that the structure doesn't know about are ignored.
+    REQUIRE(
+        decode_directly<api_named_type_reference>(
+            dynamic({{"app", "my_app"}, {"name", "t"}, {"x", integer(1)}}))
+        == make_api_named_type_reference("my_app", "t"));
+
+    // Errors are reported just as they are by from_dynamic().
+    try
+    {
+        decode_directly<std::vector<api_named_type_reference>>(
+            dynamic({dynamic({{"app", "my_app"}, {"name", integer(1)}})}));
+        FAIL("no exception thrown");
+    }
+    catch (type_mismatch& e)
+    {
+        REQUIRE(
+            get_required_error_info<dynamic_value_path_info>(e)
+            == std::list<dynamic>({integer(0), "name"}));
+    }
+    REQUIRE_THROWS_AS(
+        decode_directly<api_named_type_reference>(dynamic({{"app", "a"}})),
+        missing_field);
+    REQUIRE_THROWS_AS(
+        decode_directly<api_type_info>(
+            dynamic({{"float_type", dynamic_map()}, {"nil_type", nil}})),
+        multifield_union);
+
+    // Empty arrays are also accepted as empty maps.
+    REQUIRE(
+        decode_directly<api_structure_info>(
+            dynamic({{"fields", dynamic_array()}}))
+        == make_api_structure_info({}));
+
+    // Truncated data is reported as such.
+    auto const encoded = write_natively_encoded_value(
+        make_api_named_type_reference("my_app", "my_type"));
+    api_named_type_reference x;
+    REQUIRE_THROWS_AS(
+        read_natively_encoded_value(&x, encoded.data(), encoded.size() - 1),
+        corrupt_data);
+}
+
+TEST_CASE("packed native arrays", "[encodings][native]")
+{
+    // Packed arrays are encoded exactly like regular arrays, and homogeneous
+    // arrays of numbers (or booleans) are decoded as packed arrays.
+    auto test_packed_array = [](auto const& packed) {
+        typedef typename std::decay_t<decltype(packed)>::element_type T;
+        auto const native = write_natively_encoded_value(dynamic(packed));
+        REQUIRE(native == write_natively_encoded_value(packed.unpack()));
+        size_t deep_size = 0;
+        auto const decoded = read_natively_encoded_value(
+            native.data(), native.size(), &deep_size);
+        REQUIRE(get_packed_array<T>(decoded) != nullptr);
+        REQUIRE(decoded == dynamic(packed));
+        REQUIRE(deep_size == deep_sizeof(decoded));
+    };
+    test_packed_array(packed_array<bool>({1, 0, 1}));
+    test_packed_array(packed_array<integer>({-60, 4096}));
+    test_packed_array(packed_array<double>({-1.5, 12.5, 0}));
+    test_typed_native_encoding(std::vector<double>{-1.5, 12.5});
+
+    auto const mixed = dynamic({integer(1), 2.5});
+    auto const native = write_natively_encoded_value(mixed);
+    auto const decoded
+        = read_natively_encoded_value(native.data(), native.size());
+    REQUIRE(get_packed_array<integer>(decoded) == nullptr);
+    REQUIRE(decoded == mixed);
+}
+
+TEST_CASE("interned native map keys", "[encodings][native]")
+{
+    auto const value
+        = dynamic(dynamic_map{{"name", "linac"}, {integer(0), "zero"}});
+    auto const native = write_natively_encoded_value(value);
+    size_t deep_size = 0;
+    auto const decoded = read_natively_encoded_value(
+        native.data(), native.size(), &deep_size);
+    REQUIRE(decoded == value);
+    REQUIRE(deep_size == deep_sizeof(decoded));
+    auto const& map = cast<dynamic_map>(decoded);
+    REQUIRE(get_string_symbol(map.begin()->first) == nullptr);
+    REQUIRE(
+        get_string_symbol(std::next(map.begin())->first)
+        == &intern_string("name"));
+    // (Values aren't interned.)
+    REQUIRE(get_string_symbol(std::next(map.begin())->second) == nullptr);
+}
+
+TEST_CASE("native record tables", "[encodings][native]")
+{
+    // Tables are encoded exactly like arrays of records, and arrays of
+    // records with the same fields are decoded as tables.
+    auto const records = dynamic_array{
+        dynamic({{"name", "linac_0"}, {"sad", 1000.}}),
+        dynamic({{"name", "linac_1"}, {"sad", 800.}})};
+    auto const native = write_natively_encoded_value(compact_array(records));
+    REQUIRE(native == write_natively_encoded_value(records));
+    size_t deep_size = 0;
+    auto const decoded = read_natively_encoded_value(
+        native.data(), native.size(), &deep_size);
+    REQUIRE(get_record_table(decoded) != nullptr);
+    REQUIRE(decoded == dynamic(records));
+    REQUIRE(deep_size == deep_sizeof(decoded));
+
+    // Decoded arrays of structures are tables too. There's no dynamic_array
+    // behind them (and const casts to dynamic_array don't compile), but
+    // they're still readable through the const accessors and convertible to
+    // their typed forms.
+    auto const refs = std::vector<api_named_type_reference>{
+        make_api_named_type_reference("my_app", "a"),
+        make_api_named_type_reference("my_app", "b")};
+    auto const refs_native = write_natively_encoded_value(to_dynamic(refs));
+    auto const refs_decoded = read_natively_encoded_value(
+        refs_native.data(), refs_native.size());
+    REQUIRE(get_record_table(refs_decoded) != nullptr);
+    REQUIRE(get_dynamic_array(refs_decoded) == nullptr);
+    REQUIRE(get_array_element(refs_decoded, 1) == to_dynamic(refs[1]));
+    REQUIRE(
+        from_dynamic<std::vector<api_named_type_reference>>(refs_decoded)
+        == refs);
+    REQUIRE(get_record_table(refs_decoded) != nullptr);
+
+    auto const mixed = dynamic({records[0], dynamic({{"name", "linac_2"}})});
+    auto const mixed_native = write_natively_encoded_value(mixed);
+    auto const mixed_decoded = read_natively_encoded_value(
+        mixed_native.data(), mixed_native.size());
+    REQUIRE(get_record_table(mixed_decoded) == nullptr);
+    REQUIRE(mixed_decoded == mixed);
+}
+
+TEST_CASE("native SHA-256 hashing", "[encodings][native]")
+{
+    // Include a blob that's larger than the hashing buffer's staging area.
+    auto value = dynamic({
+        {"alpha", nil},
+        {"beta", make_blob(string(10000, 'x'))},
+        {"gamma", dynamic_array{integer(1), 2.5, "three"}},
+    });
+    REQUIRE(
+        natively_encoded_sha256(value)
+        == picosha2::hash256_hex_string(write_natively_encoded_value(value)));
+}
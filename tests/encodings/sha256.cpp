@@ -0,0 +1,156 @@
+#include <cradle/encodings/sha256.h>
+
+#include <random>
+
+#include <picosha2.h>
+
+#include <cradle/utilities/testing.h>
+
+using namespace cradle;
+
+namespace {
+
+std::vector<sha256_implementation> const all_implementations
+    = {sha256_implementation::PORTABLE,
+       sha256_implementation::SHA_NI,
+       sha256_implementation::AVX2};
+
+string
+picosha2_hex(string const& message)
+{
+    return picosha2::hash256_hex_string(message);
+}
+
+// Generate messages whose lengths cover all the interesting cases around
+// block boundaries (and padding that spills into a second block).
+std::vector<string>
+generate_test_messages()
+{
+    std::minstd_rand generator(1);
+    std::vector<string> messages;
+    auto add_message = [&](size_t length) {
+        string message(length, '\0');
+        for (auto& c : message)
+            c = char(generator());
+        messages.push_back(std::move(message));
+    };
+    for (size_t length = 0; length != 200; ++length)
+        add_message(length);
+    for (size_t length : {447, 448, 511, 512, 513, 4096, 10000, 100000})
+        add_message(length);
+    return messages;
+}
+
+std::vector<blob>
+make_blobs(std::vector<string> const& messages)
+{
+    std::vector<blob> blobs;
+    for (auto const& message : messages)
+    {
+        blob b;
+        b.data = message.data();
+        b.size = message.size();
+        blobs.push_back(b);
+    }
+    return blobs;
+}
+
+} // namespace
+
+TEST_CASE("SHA-256 implementation selection", "[encodings][sha256]")
+{
+    REQUIRE(is_sha256_implementation_supported(
+        sha256_implementation::PORTABLE));
+    REQUIRE(is_sha256_implementation_supported(get_sha256_implementation()));
+    REQUIRE(get_sha256_implementation() != sha256_implementation::AVX2);
+    REQUIRE(is_sha256_implementation_supported(
+        get_batch_sha256_implementation()));
+
+    REQUIRE_THROWS_AS(
+        sha256_hasher(sha256_implementation::AVX2),
+        unsupported_sha256_implementation);
+}
+
+TEST_CASE("SHA-256 digests", "[encodings][sha256]")
+{
+    REQUIRE(
+        format_sha256_digest(compute_sha256("abc", 3))
+        == "ba7816bf8f01cfea414140de5dae2223"
+           "b00361a396177a9cb410ff61f20015ad");
+    REQUIRE(
+        format_sha256_digest(compute_sha256("", 0))
+        == "e3b0c44298fc1c149afbf4c8996fb924"
+           "27ae41e4649b934ca495991b7852b855");
+
+    auto const messages = generate_test_messages();
+    for (auto implementation : all_implementations)
+    {
+        if (!is_sha256_implementation_supported(implementation)
+            || implementation == sha256_implementation::AVX2)
+        {
+            continue;
+        }
+        INFO(int(implementation));
+        for (auto const& message : messages)
+        {
+            INFO(message.size());
+
+            sha256_hasher hasher(implementation);
+            hasher.process(message.data(), message.size());
+            REQUIRE(
+                format_sha256_digest(hasher.finish())
+                == picosha2_hex(message));
+
+            // Also feed the message in irregular pieces.
+            sha256_hasher piecewise(implementation);
+            size_t offset = 0;
+            for (size_t piece = 1; offset != message.size(); piece += 7)
+            {
+                auto n = std::min(piece % 97, message.size() - offset);
+                piecewise.process(message.data() + offset, n);
+                offset += n;
+            }
+            REQUIRE(
+                format_sha256_digest(piecewise.finish())
+                == picosha2_hex(message));
+        }
+    }
+}
+
+TEST_CASE("batch SHA-256 digests", "[encodings][sha256]")
+{
+    auto const messages = generate_test_messages();
+    auto const blobs = make_blobs(messages);
+    for (auto implementation : all_implementations)
+    {
+        if (!is_sha256_implementation_supported(implementation))
+        {
+            REQUIRE_THROWS_AS(
+                compute_sha256_digests(blobs, implementation),
+                unsupported_sha256_implementation);
+            continue;
+        }
+        INFO(int(implementation));
+        auto digests = compute_sha256_digests(blobs, implementation);
+        REQUIRE(digests.size() == messages.size());
+        for (size_t i = 0; i != messages.size(); ++i)
+        {
+            INFO(messages[i].size());
+            REQUIRE(
+                format_sha256_digest(digests[i])
+                == picosha2_hex(messages[i]));
+        }
+
+        // Batches that don't fill all the lanes should also work.
+        REQUIRE(compute_sha256_digests({}, implementation).empty());
+        auto few = compute_sha256_digests(
+            std::span<blob const>(blobs).subspan(150, 3), implementation);
+        for (size_t i = 0; i != few.size(); ++i)
+        {
+            REQUIRE(
+                format_sha256_digest(few[i])
+                == picosha2_hex(messages[150 + i]));
+        }
+    }
+    REQUIRE(compute_sha256_digests(blobs).size() == messages.size());
+}
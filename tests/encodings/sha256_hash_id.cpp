@@ -0,0 +1,86 @@
+#include <cradle/encodings/sha256_hash_id.h>
+
+#include <cradle/utilities/testing.h>
+#include <cradle/utilities/text.h>
+
+using namespace cradle;
+
+namespace {
+
+// the number of times that a counted_value has been converted to a dynamic
+int conversion_count = 0;
+
+// a value type that counts how many times it's converted to a dynamic (and
+// thus how many times it's hashed)
+struct counted_value
+{
+    integer x;
+};
+
+bool
+operator==(counted_value const& a, counted_value const& b)
+{
+    return a.x == b.x;
+}
+
+bool
+operator<(counted_value const& a, counted_value const& b)
+{
+    return a.x < b.x;
+}
+
+size_t
+hash_value(counted_value const& v)
+{
+    return invoke_hash(v.x);
+}
+
+void
+to_dynamic(dynamic* v, counted_value const& x)
+{
+    ++conversion_count;
+    *v = dynamic(x.x);
+}
+
+} // namespace
+
+TEST_CASE("SHA-256 hashed IDs", "[encodings][sha256]")
+{
+    // Strings are hashed directly, so this is just the SHA-256 of "abc".
+    REQUIRE(
+        lexical_cast<string>(make_sha256_hashed_id(std::string("abc")))
+        == "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+    // Multiple arguments are hashed as if they were concatenated.
+    REQUIRE(
+        lexical_cast<string>(make_sha256_hashed_id("a", std::string("bc")))
+        == lexical_cast<string>(make_sha256_hashed_id(std::string("abc"))));
+}
+
+TEST_CASE("SHA-256 hashed ID memoization", "[encodings][sha256]")
+{
+    conversion_count = 0;
+    auto id = make_sha256_hashed_id("value", counted_value{12});
+    auto const digest = lexical_cast<string>(id);
+    REQUIRE(conversion_count == 1);
+
+    // Streaming the ID again reuses the digest.
+    REQUIRE(lexical_cast<string>(id) == digest);
+    REQUIRE(conversion_count == 1);
+
+    // So do copies of it.
+    captured_id captured(id);
+    REQUIRE(lexical_cast<string>(*captured) == digest);
+    std::unique_ptr<id_interface> cloned(id.clone());
+    REQUIRE(lexical_cast<string>(*cloned) == digest);
+    decltype(id) copy;
+    id.deep_copy(&copy);
+    REQUIRE(lexical_cast<string>(copy) == digest);
+    REQUIRE(conversion_count == 1);
+
+    // An equal ID that was constructed separately has to compute its own
+    // digest, but it's the same.
+    REQUIRE(
+        lexical_cast<string>(make_sha256_hashed_id("value", counted_value{12}))
+        == digest);
+    REQUIRE(conversion_count == 2);
+}
@@ -4,6 +4,7 @@
 
 #include <filesystem>
 
+#include <cradle/fs/utilities.h>
 #include <cradle/service/internals.h>
 #include <cradle/utilities/concurrency_testing.h>
 
@@ -184,3 +185,172 @@ TEST_CASE("lazily generated cached tasks", "[service][core]")
         REQUIRE(execution_count == 2);
     }
 }
+
+TEST_CASE("batch memory caching", "[service][core]")
+{
+    service_core core;
+    init_test_service(core);
+
+    int execution_count = 0;
+    auto counted_task = [&](int answer) -> cppcoro::task<int> {
+        ++execution_count;
+        co_return answer;
+    };
+
+    std::vector<decltype(make_id(0))> keys;
+    for (int i = 0; i != 100; ++i)
+        keys.push_back(make_id(i));
+
+    for (int pass = 0; pass != 2; ++pass)
+    {
+        auto tasks = cached_batch<int>(core, keys, [&](std::size_t i) {
+            return counted_task(int(i));
+        });
+        REQUIRE(tasks.size() == 100);
+        for (int i = 0; i != 100; ++i)
+            REQUIRE(cppcoro::sync_wait(tasks[i]) == i);
+        // The second pass should be served entirely from the cache.
+        REQUIRE(execution_count == 100);
+    }
+}
+
+namespace {
+
+// a value type that spills to disk when it's evicted from the memory cache
+struct spill_test_value
+{
+    integer x;
+};
+
+size_t
+deep_sizeof(spill_test_value)
+{
+    return sizeof(spill_test_value);
+}
+
+void
+to_dynamic(dynamic* v, spill_test_value const& x)
+{
+    *v = dynamic(x.x);
+}
+
+void
+from_dynamic(spill_test_value* x, dynamic const& v)
+{
+    x->x = cast<integer>(v);
+}
+
+} // namespace
+
+namespace cradle {
+
+template<>
+struct immutable_cache_spills_on_eviction<spill_test_value> : std::true_type
+{
+};
+
+} // namespace cradle
+
+TEST_CASE("spilling evicted values to disk", "[service][core]")
+{
+    auto cache_dir = file_path("spill_disk_cache");
+    reset_directory(cache_dir);
+    // The memory cache doesn't retain any unused values, so values are
+    // evicted as soon as they're no longer in use.
+    service_core core(service_config(
+        immutable_cache_config(0, none, none, none, none),
+        none,
+        disk_cache_config(some(cache_dir.string()), 0x40'00'00'00),
+        2,
+        2,
+        2,
+        none));
+
+    int execution_count = 0;
+    auto counted_task = [&](integer x) -> cppcoro::task<spill_test_value> {
+        ++execution_count;
+        co_return spill_test_value{x};
+    };
+
+    REQUIRE(
+        cppcoro::sync_wait(
+            cached<spill_test_value>(core, make_id(1), counted_task(1)))
+            .x
+        == 1);
+    REQUIRE(execution_count == 1);
+    REQUIRE(get_cache_stats(core.internals().cache).evictions == 1);
+
+    // The evicted value is written to the disk cache in the background.
+    REQUIRE(occurs_soon([&] {
+        return core.internals().disk_write_pool.get_tasks_total() == 0;
+    }));
+
+    // Requesting it again recovers it from disk rather than recomputing it.
+    REQUIRE(
+        cppcoro::sync_wait(
+            cached<spill_test_value>(core, make_id(1), counted_task(1)))
+            .x
+        == 1);
+    REQUIRE(execution_count == 1);
+}
+
+TEST_CASE("spilling evicted coercion plans to disk", "[service][core]")
+{
+    auto cache_dir = file_path("spill_plan_disk_cache");
+    reset_directory(cache_dir);
+    service_core core(service_config(
+        immutable_cache_config(0, none, none, none, none),
+        none,
+        disk_cache_config(some(cache_dir.string()), 0x40'00'00'00),
+        2,
+        2,
+        2,
+        none));
+
+    // A point is a structure with a named coordinate type, so compiling its
+    // plan requires a lookup.
+    auto const float_type
+        = make_api_type_info_with_float_type(api_float_type());
+    auto const coordinate_type = make_api_type_info_with_named_type(
+        make_api_named_type_reference("my_app", "coordinate"));
+    auto const point_type = make_api_type_info_with_structure_type(
+        api_structure_info(
+            {{"x", make_api_structure_field_info("", coordinate_type, none)},
+             {"y",
+              make_api_structure_field_info("", coordinate_type, none)}}));
+    int lookup_count = 0;
+    auto compile_plan = [&]() -> cppcoro::task<coercion_plan> {
+        co_return co_await compile_coercion_plan(
+            [&](api_named_type_reference const&)
+                -> cppcoro::task<api_type_info> {
+                ++lookup_count;
+                co_return float_type;
+            },
+            point_type);
+    };
+
+    auto const value = dynamic({{"x", integer(1)}, {"y", 2.5}});
+    auto const expected = dynamic({{"x", 1.}, {"y", 2.5}});
+
+    REQUIRE(
+        apply_coercion_plan(
+            cppcoro::sync_wait(
+                cached<coercion_plan>(core, make_id(1), compile_plan())),
+            value)
+        == expected);
+    REQUIRE(lookup_count == 1);
+    REQUIRE(get_cache_stats(core.internals().cache).evictions == 1);
+
+    REQUIRE(occurs_soon([&] {
+        return core.internals().disk_write_pool.get_tasks_total() == 0;
+    }));
+
+    // The recovered plan is read from disk rather than compiled again.
+    REQUIRE(
+        apply_coercion_plan(
+            cppcoro::sync_wait(
+                cached<coercion_plan>(core, make_id(1), compile_plan())),
+            value)
+        == expected);
+    REQUIRE(lookup_count == 1);
+}
@@ -0,0 +1,101 @@
+#include <cradle/service/warm_start.h>
+
+#include <cppcoro/sync_wait.hpp>
+
+#include <cradle/fs/utilities.h>
+#include <cradle/service/internals.h>
+#include <cradle/utilities/concurrency_testing.h>
+
+#include <cradle/utilities/testing.h>
+
+using namespace cradle;
+
+TEST_CASE("warm starts", "[service][warm_start]")
+{
+    auto cache_dir = file_path("warm_start_disk_cache");
+    reset_directory(cache_dir);
+    service_config config(
+        immutable_cache_config(0x40'00'00'00, none, none, none, none),
+        none,
+        disk_cache_config(some(cache_dir.string()), 0x40'00'00'00),
+        2,
+        2,
+        2,
+        none);
+    warm_start_config warm_start(
+        (cache_dir / "manifest").string(), 4, none, none, none);
+
+    service_core core(config);
+
+    int execution_count = 0;
+    auto counted_task = [&](int answer) -> cppcoro::task<integer> {
+        ++execution_count;
+        co_return integer(answer);
+    };
+    auto get_value = [&](int i) {
+        return cppcoro::sync_wait(fully_cached<integer>(
+            core, make_id(i), [&, i] { return counted_task(i); }));
+    };
+
+    // Compute ten values, but access 2, 3, 5 and 7 repeatedly to make them
+    // the hottest.
+    for (int i = 0; i != 10; ++i)
+        REQUIRE(get_value(i) == i);
+    for (int i : {2, 3, 5, 7, 2, 3, 5, 7, 2, 3, 5})
+        REQUIRE(get_value(i) == i);
+    REQUIRE(execution_count == 10);
+    REQUIRE(occurs_soon([&] {
+        return core.internals().disk_write_pool.get_tasks_total() == 0;
+    }));
+
+    write_warm_start_manifest(core, warm_start);
+
+    // Restart the service (with the same disk cache) and prefetch.
+    core.reset(config);
+    start_warm_start_prefetch(core, warm_start);
+    REQUIRE(occurs_soon([&] {
+        return get_warm_start_progress(core).finished == 4;
+    }));
+    auto progress = get_warm_start_progress(core);
+    REQUIRE(progress.listed == 4);
+    REQUIRE(progress.prefetched == 4);
+    REQUIRE(progress.used == 0);
+
+    // Prefetched entries are used without running their tasks.
+    REQUIRE(get_value(3) == 3);
+    REQUIRE(get_warm_start_progress(core).used == 1);
+    // Other entries still come from the disk cache as usual.
+    REQUIRE(get_value(4) == 4);
+    REQUIRE(get_warm_start_progress(core).used == 1);
+    REQUIRE(execution_count == 10);
+
+    // Prefetched entries that aren't used within the retention period are
+    // dropped, and requests for them go to the disk cache as usual.
+    warm_start.prefetch_retention = 0;
+    core.reset(config);
+    start_warm_start_prefetch(core, warm_start);
+    REQUIRE(occurs_soon([&] {
+        auto& prefetch = *core.internals().warm_start;
+        std::scoped_lock<std::mutex> lock(prefetch.mutex);
+        return prefetch.expired;
+    }));
+    progress = get_warm_start_progress(core);
+    REQUIRE(progress.expired == progress.prefetched);
+    REQUIRE(get_value(3) == 3);
+    REQUIRE(get_warm_start_progress(core).used == 0);
+    REQUIRE(execution_count == 10);
+}
+
+TEST_CASE("warm starts without a manifest", "[service][warm_start]")
+{
+    service_core core;
+    init_test_service(core);
+
+    start_warm_start_prefetch(
+        core,
+        warm_start_config(
+            "nonexistent_warm_start_manifest", none, none, none, none));
+    auto progress = get_warm_start_progress(core);
+    REQUIRE(progress.listed == 0);
+    REQUIRE(progress.prefetched == 0);
+}
@@ -10,7 +10,9 @@
 
 #include <cradle/core/monitoring.h>
 #include <cradle/encodings/json.h>
+#include <cradle/encodings/sha256_hash_id.h>
 #include <cradle/io/mock_http.h>
+#include <cradle/utilities/concurrency_testing.h>
 #include <cradle/utilities/testing.h>
 
 using namespace cradle;
@@ -308,6 +310,81 @@ TEST_CASE("calc variable substitution", "[thinknode][tn_calc]")
             make_meta_calculation_request(substituted_array, array_schema)));
 }
 
+TEST_CASE("calc request digests", "[thinknode][tn_calc]")
+{
+    auto item_schema
+        = make_thinknode_type_info_with_string_type(thinknode_string_type());
+    auto make_call = [](std::vector<calculation_request> args) {
+        return make_calculation_request_with_function(
+            make_function_application(
+                "my_account", "my_app", "my_function", none, std::move(args)));
+    };
+    auto a = make_calculation_request_with_reference("a");
+    auto b = make_calculation_request_with_value(dynamic("b"));
+    auto array = make_calculation_request_with_array(
+        make_calculation_array_request({a, b}, item_schema));
+    auto request = make_call({array, b});
+
+    // Digests are deterministic and depend on the request's contents.
+    REQUIRE(
+        get_calculation_request_digest(request)
+        == get_calculation_request_digest(make_call({array, b})));
+    REQUIRE(
+        get_calculation_request_digest(request)
+        != get_calculation_request_digest(make_call({b, array})));
+    REQUIRE(
+        get_calculation_request_digest(request)
+        != get_calculation_request_digest(make_call({array})));
+    // References and values with the same contents are different.
+    REQUIRE(
+        get_calculation_request_digest(
+            make_calculation_request_with_reference("b"))
+        != get_calculation_request_digest(b));
+
+    // Supplying the digests of the subrequests gives the same result.
+    std::vector<sha256_digest> subrequest_digests
+        = {get_calculation_request_digest(array),
+           get_calculation_request_digest(b)};
+    REQUIRE(
+        get_calculation_request_digest(request, subrequest_digests)
+        == get_calculation_request_digest(request));
+    REQUIRE_THROWS(get_calculation_request_digest(
+        request, std::span(subrequest_digests).first(1)));
+    subrequest_digests.push_back(get_calculation_request_digest(a));
+    REQUIRE_THROWS(
+        get_calculation_request_digest(request, subrequest_digests));
+}
+
+TEST_CASE("calcs posted under request keys", "[thinknode][tn_calc]")
+{
+    service_core service;
+    init_test_service(service);
+
+    thinknode_session session;
+    session.api_url = "https://mgh.thinknode.io/api/v1.0";
+    session.access_token = "xyz";
+
+    // Record a calculation ID in the disk cache under the key that
+    // post_calculation() used before it keyed requests by their digests.
+    auto request = make_calculation_request_with_value(dynamic("x"));
+    cppcoro::sync_wait(disk_cached<string>(
+        service,
+        make_sha256_hashed_id(
+            "post_calculation", session.api_url, "123", request),
+        []() -> cppcoro::task<string> { co_return "legacy-id"; }));
+    REQUIRE(occurs_soon([&] {
+        return service.internals().disk_write_pool.get_tasks_total() == 0;
+    }));
+
+    // Posting the same request finds it there (without any HTTP requests).
+    auto& mock_http = enable_http_mocking(service);
+    mock_http.set_script({});
+    REQUIRE(
+        cppcoro::sync_wait(post_calculation(service, session, "123", request))
+        == "legacy-id");
+    REQUIRE(mock_http.is_complete());
+}
+
 TEST_CASE("let calculation submission", "[thinknode][tn_calc]")
 {
     thinknode_session mock_session;